@@ -0,0 +1,101 @@
+#!/usr/bin/env python3
+"""Compress the management UI assets for embedding in the firmware.
+
+Each asset is gzipped into <out-dir>/<name>.gz, which the component embeds
+with target_add_binary_data(), and a C table describing the assets is
+written to --table. Output is deterministic, so the ETags only change when
+an asset's content does.
+
+HTML assets may reference other assets as %%name%%; the reference is
+replaced with "name?v=<etag>" so those assets can be cached forever and
+only the page itself needs revalidating.
+"""
+
+import argparse
+import gzip
+import hashlib
+import os
+import re
+
+CONTENT_TYPES = {
+    ".html": "text/html",
+    ".js": "application/javascript",
+    ".css": "text/css",
+    ".svg": "image/svg+xml",
+    ".json": "application/json",
+}
+
+
+def symbol_name(filename):
+    """Name of the symbol target_add_binary_data() creates for a file."""
+    return "_binary_" + re.sub(r"[^A-Za-z0-9]", "_", filename)
+
+
+def compress(data):
+    # mtime=0 keeps the output, and so the ETag, reproducible
+    return gzip.compress(data, compresslevel=9, mtime=0)
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__,
+                                     formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument("--out-dir", required=True)
+    parser.add_argument("--table", required=True, help="C header to write the asset table to")
+    parser.add_argument("assets", nargs="+")
+    args = parser.parse_args()
+
+    # Pages last, so the versions of everything they reference are known
+    assets = sorted(args.assets, key=lambda path: path.endswith(".html"))
+    versions = {}
+    entries = []
+
+    for path in assets:
+        name = os.path.basename(path)
+        ext = os.path.splitext(name)[1]
+        if ext not in CONTENT_TYPES:
+            raise SystemExit("error: no content type for %s" % name)
+
+        with open(path, "rb") as f:
+            data = f.read()
+
+        page = ext == ".html"
+        if page:
+            def versioned(match):
+                ref = match.group(1).decode()
+                if ref not in versions:
+                    raise SystemExit("error: %s references unknown asset %s" % (name, ref))
+                return ("%s?v=%s" % (ref, versions[ref])).encode()
+            data = re.sub(rb"%%([A-Za-z0-9_.-]+)%%", versioned, data)
+
+        packed = compress(data)
+        etag = hashlib.sha256(packed).hexdigest()[:16]
+        versions[name] = etag
+
+        with open(os.path.join(args.out_dir, name + ".gz"), "wb") as f:
+            f.write(packed)
+
+        entries.append((name, CONTENT_TYPES[ext], etag, symbol_name(name + ".gz"), not page,
+                        len(data), len(packed)))
+
+    lines = [
+        "// Generated by embed_assets.py from components/management_page_html/www, do not edit",
+        "",
+    ]
+    for name, _, _, symbol, _, _, _ in entries:
+        lines.append('extern const uint8_t %s_start[] asm("%s_start");' % (symbol, symbol))
+        lines.append('extern const uint8_t %s_end[] asm("%s_end");' % (symbol, symbol))
+    lines.append("")
+    lines.append("static const management_asset_t s_assets[] = {")
+    for name, content_type, etag, symbol, immutable, size, packed_size in entries:
+        lines.append('    { "%s", "%s", "\\"%s\\"", %s_start, %s_end, %s },  // %d -> %d bytes'
+                     % (name, content_type, etag, symbol, symbol,
+                        "true" if immutable else "false", size, packed_size))
+    lines.append("};")
+    lines.append("")
+
+    with open(args.table, "w") as f:
+        f.write("\n".join(lines))
+
+
+if __name__ == "__main__":
+    main()
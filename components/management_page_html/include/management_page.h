@@ -0,0 +1,32 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// One gzip-compressed management UI asset, embedded in flash
+typedef struct {
+    const char* name;           // File name, e.g. "app.js"
+    const char* content_type;
+    const char* etag;           // Strong ETag, quoted
+    const uint8_t* start;       // Compressed body
+    const uint8_t* end;
+    bool immutable;             // Referenced with a version, safe to cache forever
+} management_asset_t;
+
+// Get the number of embedded assets
+size_t management_page_asset_count(void);
+
+// Get an asset by index
+const management_asset_t* management_page_asset(size_t index);
+
+// Find an asset by file name, NULL if there is none
+const management_asset_t* management_page_find(const char* name);
+
+#ifdef __cplusplus
+}
+#endif
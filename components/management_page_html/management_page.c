@@ -0,0 +1,28 @@
+#include "management_page.h"
+#include <string.h>
+
+// Defines s_assets[] and the embedded data symbols
+#include "management_assets.h"
+
+size_t management_page_asset_count(void)
+{
+    return sizeof(s_assets) / sizeof(s_assets[0]);
+}
+
+const management_asset_t* management_page_asset(size_t index)
+{
+    if (index >= management_page_asset_count()) {
+        return NULL;
+    }
+    return &s_assets[index];
+}
+
+const management_asset_t* management_page_find(const char* name)
+{
+    for (size_t i = 0; i < management_page_asset_count(); i++) {
+        if (strcmp(s_assets[i].name, name) == 0) {
+            return &s_assets[i];
+        }
+    }
+    return NULL;
+}
@@ -0,0 +1,206 @@
+"use strict";
+
+const ALPACA = "/api/v1/switch/0/";
+const stateInputs = [];
+let transaction = 0;
+
+async function alpacaGet(method, params) {
+  const query = new URLSearchParams({ ClientID: 1, ClientTransactionID: ++transaction, ...params });
+  const response = await fetch(ALPACA + method + "?" + query);
+  const body = await response.json();
+  if (body.ErrorNumber) {
+    throw new Error(body.ErrorMessage);
+  }
+  return body.Value;
+}
+
+async function alpacaPut(method, params) {
+  const form = new URLSearchParams({ ClientID: 1, ClientTransactionID: ++transaction, ...params });
+  const response = await fetch(ALPACA + method, { method: "PUT", body: form });
+  const body = await response.json();
+  if (body.ErrorNumber) {
+    throw new Error(body.ErrorMessage);
+  }
+}
+
+async function post(path, form) {
+  const response = await fetch(path, { method: "POST", body: new URLSearchParams(form) });
+  if (!response.ok) {
+    throw new Error(await response.text());
+  }
+}
+
+function showStatus(id, message, error) {
+  const element = document.getElementById(id);
+  element.textContent = message;
+  element.classList.toggle("error", !!error);
+}
+
+async function loadSwitches() {
+  const tbody = document.querySelector("#switches tbody");
+  const count = await alpacaGet("maxswitch");
+  tbody.textContent = "";
+
+  for (let id = 0; id < count; id++) {
+    const [name, state, canWrite] = await Promise.all([
+      alpacaGet("getswitchname", { Id: id }),
+      alpacaGet("getswitch", { Id: id }),
+      alpacaGet("canwrite", { Id: id }),
+    ]);
+
+    const row = tbody.insertRow();
+    row.insertCell().textContent = id;
+
+    const nameInput = document.createElement("input");
+    nameInput.type = "text";
+    nameInput.value = name;
+    nameInput.addEventListener("change", () =>
+      alpacaPut("setswitchname", { Id: id, Name: nameInput.value }).catch(alert));
+    row.insertCell().appendChild(nameInput);
+
+    const stateInput = document.createElement("input");
+    stateInput.type = "checkbox";
+    stateInput.checked = state;
+    stateInput.disabled = !canWrite;
+    stateInput.addEventListener("change", () =>
+      alpacaPut("setswitch", { Id: id, State: stateInput.checked }).catch(alert));
+    row.insertCell().appendChild(stateInput);
+    stateInputs[id] = stateInput;
+  }
+}
+
+function watchSwitches() {
+  const scheme = location.protocol === "https:" ? "wss://" : "ws://";
+  const socket = new WebSocket(scheme + location.host + "/ws");
+  socket.addEventListener("message", (event) => {
+    for (const [id, state] of JSON.parse(event.data).sw) {
+      if (stateInputs[id]) {
+        stateInputs[id].checked = !!state;
+      }
+    }
+  });
+  // Reconnect after a reboot or dropped connection
+  socket.addEventListener("close", () => setTimeout(watchSwitches, 5000));
+}
+
+async function loadStatus() {
+  const response = await fetch("/ui/api/status");
+  const status = await response.json();
+  document.getElementById("firmware").textContent = "Firmware " + status.firmware;
+
+  const form = document.getElementById("auth-form");
+  form.enabled.checked = status.auth_enabled;
+  form.username.value = status.username;
+
+  const mqtt = document.getElementById("mqtt-form");
+  mqtt.uri.value = status.mqtt.uri;
+  mqtt.prefix.value = status.mqtt.prefix;
+  mqtt.username.value = status.mqtt.username;
+  showStatus("mqtt-status", status.mqtt.uri ? (status.mqtt.connected ? "Connected" : "Not connected") : "");
+}
+
+async function loadDew(fillForm) {
+  const response = await fetch("/ui/api/dew");
+  const dew = await response.json();
+  document.getElementById("dew").hidden = !dew.running;
+  if (!dew.running) {
+    return;
+  }
+
+  document.getElementById("dew-readings").textContent = dew.sensors_ok
+    ? `Air ${dew.ambient.toFixed(1)} °C at ${dew.humidity.toFixed(0)} %, dew point ${dew.dew_point.toFixed(1)} °C. ` +
+      `Optic ${dew.optic.toFixed(1)} °C, target ${dew.target.toFixed(1)} °C. Heater ${(dew.duty * 100).toFixed(0)} %.`
+    : `Sensors not responding. Heater ${(dew.duty * 100).toFixed(0)} %.`;
+  if (fillForm) {
+    const form = document.getElementById("dew-form");
+    form.auto.checked = dew.automatic;
+    form.margin.value = dew.margin;
+  }
+}
+
+async function loadRules() {
+  const response = await fetch("/ui/api/rules");
+  document.getElementById("rules-form").rules.value = await response.text();
+}
+
+function watchUpdates() {
+  const events = new EventSource("/ota/events");
+  events.addEventListener("progress", (event) => {
+    const progress = JSON.parse(event.data);
+    document.getElementById("ota-progress").value = progress.progress;
+    if (progress.phase === "idle") {
+      showStatus("ota-status", "");
+    } else if (progress.phase === "failed") {
+      showStatus("ota-status", "Update failed: " + progress.error, true);
+    } else {
+      showStatus("ota-status", progress.phase + " " + progress.progress + "%");
+    }
+  });
+}
+
+document.getElementById("ota-form").addEventListener("submit", (event) => {
+  event.preventDefault();
+  post("/ui/api/ota", { url: event.target.url.value })
+    .then(() => showStatus("ota-status", "Update started"))
+    .catch((error) => showStatus("ota-status", error.message, true));
+});
+
+document.getElementById("auth-form").addEventListener("submit", (event) => {
+  event.preventDefault();
+  const form = event.target;
+  post("/ui/api/auth", {
+    enabled: form.enabled.checked ? 1 : 0,
+    username: form.username.value,
+    password: form.password.value,
+  })
+    .then(() => {
+      form.password.value = "";
+      showStatus("auth-status", "Saved");
+    })
+    .catch((error) => showStatus("auth-status", error.message, true));
+});
+
+document.getElementById("mqtt-form").addEventListener("submit", (event) => {
+  event.preventDefault();
+  const form = event.target;
+  post("/ui/api/mqtt", {
+    uri: form.uri.value,
+    prefix: form.prefix.value,
+    username: form.username.value,
+    password: form.password.value,
+  })
+    .then(() => {
+      form.password.value = "";
+      showStatus("mqtt-status", "Saved");
+    })
+    .catch((error) => showStatus("mqtt-status", error.message, true));
+});
+
+document.getElementById("dew-form").addEventListener("submit", (event) => {
+  event.preventDefault();
+  const form = event.target;
+  post("/ui/api/dew", { auto: form.auto.checked ? 1 : 0, margin: form.margin.value })
+    .then(() => {
+      showStatus("dew-status", "Saved");
+      // The heater switch becomes read-only or writable again
+      return loadSwitches();
+    })
+    .catch((error) => showStatus("dew-status", error.message, true));
+});
+
+document.getElementById("rules-form").addEventListener("submit", (event) => {
+  event.preventDefault();
+  post("/ui/api/rules", { rules: event.target.rules.value })
+    .then(() => showStatus("rules-status", "Saved"))
+    .catch((error) => showStatus("rules-status", error.message, true));
+});
+
+loadStatus().catch((error) => showStatus("ota-status", error.message, true));
+loadRules().catch((error) => showStatus("rules-status", error.message, true));
+loadDew(true)
+  .then(() => setInterval(() => loadDew(false).catch(() => {}), 10000))
+  .catch((error) => showStatus("dew-status", error.message, true));
+loadSwitches()
+  .then(watchSwitches)
+  .catch((error) => showStatus("ota-status", error.message, true));
+watchUpdates();
@@ -17,6 +17,232 @@
 // HTTP Server Configuration
 #define HTTP_SERVER_PORT 80
 
+// Discovery Configuration
+#define MDNS_HOSTNAME "alpaca-switch"              // Advertised as alpaca-switch.local
+#define DISCOVERY_MAX_REPLIES_PER_SEC 20           // UDP discovery replies across all clients
+#define DISCOVERY_SOURCE_INTERVAL_MS 200           // Repeated requests from one client within this are ignored
+
+// MQTT Configuration (broker settings are stored in NVS)
+#define MQTT_DEFAULT_TOPIC_PREFIX "observatory/switch"
+#define MQTT_KEEPALIVE_S 30                        // Broker marks the device offline after 1.5x this
+#define MQTT_BATCH_WINDOW_MS 20                    // Changes within this window are published together
+
+// Modbus TCP Configuration (comment out to disable; Modbus has no authentication)
+#define USE_MODBUS_TCP
+#define MODBUS_TCP_PORT 502
+#define MODBUS_MAX_CLIENTS 2                       // The least recently active client is dropped for a new one
+#define MODBUS_IDLE_TIMEOUT_S 120                  // Clients silent for this long are disconnected
+
+// UDP Control Configuration (enabled once a key is stored)
+#define UDP_CONTROL_PORT 32230
+#define UDP_CONTROL_MAX_CLIENTS 8                  // Client ids, each with its own replay sequence
+
+// Task Layout Configuration
+// TASK_LAYOUT_ISOLATED keeps networking (Wi-Fi, lwIP, OTA download,
+// discovery) on core 0 and runs the HTTP server, which actuates the
+// switches, on core 1 above every other application task.
+// TASK_LAYOUT_SHARED leaves tasks unpinned at equal priority, as before,
+// for comparison with tools/latency_bench.py.
+#define TASK_LAYOUT_ISOLATED 0
+#define TASK_LAYOUT_SHARED 1
+#define TASK_LAYOUT TASK_LAYOUT_ISOLATED
+
+#if TASK_LAYOUT == TASK_LAYOUT_ISOLATED
+    #define NETWORK_CORE 0                         // Wi-Fi and lwIP are pinned here in sdkconfig
+    #define ACTUATION_CORE 1
+    #define HTTPD_TASK_CORE ACTUATION_CORE         // HTTP server, runs the switch handlers
+    #define HTTPD_TASK_PRIORITY 6
+    #define OTA_DOWNLOAD_TASK_CORE NETWORK_CORE    // HTTP download stage
+    #define OTA_DOWNLOAD_TASK_PRIORITY 3
+    #define OTA_FLASH_TASK_CORE ACTUATION_CORE     // Flash-write stage, yields to the HTTP server
+    #define OTA_FLASH_TASK_PRIORITY 2
+    #define STORAGE_FLUSH_TASK_CORE NETWORK_CORE   // Coalesced NVS writes of switch state
+    #define STORAGE_FLUSH_TASK_PRIORITY 1
+    #define DISCOVERY_TASK_CORE NETWORK_CORE       // Alpaca discovery responder
+    #define DISCOVERY_TASK_PRIORITY 2
+    #define MQTT_TASK_PRIORITY 3                   // esp-mqtt client task, on core 0 via sdkconfig
+    #define MQTT_PUBLISH_TASK_CORE NETWORK_CORE    // Publishes switch changes
+    #define MQTT_PUBLISH_TASK_PRIORITY 2
+    #define MODBUS_TASK_CORE ACTUATION_CORE        // Modbus TCP server, runs switch writes
+    #define MODBUS_TASK_PRIORITY 5
+    #define UDP_CONTROL_TASK_CORE ACTUATION_CORE   // Authenticated UDP switching
+    #define UDP_CONTROL_TASK_PRIORITY 6
+    #define DEW_TASK_CORE ACTUATION_CORE           // Dew heater control loop
+    #define DEW_TASK_PRIORITY 4
+    #define CURRENT_SENSE_TASK_CORE ACTUATION_CORE // ADC DMA draining and current filters
+    #define CURRENT_SENSE_TASK_PRIORITY 3
+    #define POWER_FAIL_TASK_CORE ACTUATION_CORE    // Writes switch states at once on a power-fail signal
+    #define POWER_FAIL_TASK_PRIORITY 7
+    #define GANG_TASK_CORE ACTUATION_CORE          // Steps ganged pins with a delay between them
+    #define GANG_TASK_PRIORITY 5
+#else
+    #define HTTPD_TASK_CORE tskNO_AFFINITY
+    #define HTTPD_TASK_PRIORITY 5
+    #define OTA_DOWNLOAD_TASK_CORE tskNO_AFFINITY
+    #define OTA_DOWNLOAD_TASK_PRIORITY 5
+    #define OTA_FLASH_TASK_CORE tskNO_AFFINITY
+    #define OTA_FLASH_TASK_PRIORITY 5
+    #define STORAGE_FLUSH_TASK_CORE tskNO_AFFINITY
+    #define STORAGE_FLUSH_TASK_PRIORITY 5
+    #define DISCOVERY_TASK_CORE tskNO_AFFINITY
+    #define DISCOVERY_TASK_PRIORITY 5
+    #define MQTT_TASK_PRIORITY 5
+    #define MQTT_PUBLISH_TASK_CORE tskNO_AFFINITY
+    #define MQTT_PUBLISH_TASK_PRIORITY 5
+    #define MODBUS_TASK_CORE tskNO_AFFINITY
+    #define MODBUS_TASK_PRIORITY 5
+    #define UDP_CONTROL_TASK_CORE tskNO_AFFINITY
+    #define UDP_CONTROL_TASK_PRIORITY 5
+    #define DEW_TASK_CORE tskNO_AFFINITY
+    #define DEW_TASK_PRIORITY 5
+    #define CURRENT_SENSE_TASK_CORE tskNO_AFFINITY
+    #define CURRENT_SENSE_TASK_PRIORITY 5
+    #define POWER_FAIL_TASK_CORE tskNO_AFFINITY
+    #define POWER_FAIL_TASK_PRIORITY 5
+    #define GANG_TASK_CORE tskNO_AFFINITY
+    #define GANG_TASK_PRIORITY 5
+#endif
+
+// Storage Configuration
+#define STORAGE_FLUSH_DELAY_MS 2000                // Switch changes are written once per this window
+
+// Rules Configuration
+#define SWITCH_RULES_MAX 32                        // Compiled rule entries; "excludes" takes two
+#define SWITCH_RULES_MAX_SWITCHES 32               // Switch ids rules can refer to
+#define SWITCH_RULES_MAX_DEPTH 4                   // Force rules setting off further force rules
+#define SWITCH_RULES_MAX_EVALUATIONS 64            // Rules looked at per switch write, at most
+#define SWITCH_RULES_MAX_TEXT 512                  // Longest rule text accepted
+
+// Relay Wear Configuration
+#define RELAY_RATED_CYCLES 100000                  // Switching cycles the relays are rated for
+#define RELAY_WEAR_WARN_PERCENT 80                 // Warn once a relay has used this much of its rating
+#define RELAY_COUNTER_FLUSH_CYCLES 50              // Unsaved cycles on any relay that cause a counter write
+#define RELAY_COUNTER_FLUSH_INTERVAL_S 3600        // Otherwise counters are written at most this often, if changed
+
+// Scene Configuration
+#define SWITCH_SCENES_MAX 8                        // Scenes stored
+#define SWITCH_SCENE_NAME_LEN 16                   // Longest scene name, plus its terminator
+#define SWITCH_SCENE_ENTRIES_MAX 128               // Switch settings across all scenes
+
+// Output Expander Configuration (uncomment one to drive switches through I/O expanders)
+// #define OUTPUT_EXPANDER_MCP23017                // 16 outputs per chip on I2C
+// #define OUTPUT_EXPANDER_74HC595                 // 8 outputs per chip, chained on SPI
+// #define OUTPUT_EXPANDER_SIMULATED               // Emulate the chips instead of using the bus, for bench testing
+#define OUTPUT_EXPANDER_CHIPS 2                    // MCP23017s at consecutive addresses, or 74HC595s in the chain
+#define OUTPUT_EXPANDER_PIN_BASE 64                // Switch pin of expander channel 0; channel n is pin 64 + n
+#define OUTPUT_EXPANDER_I2C_SDA_PIN 32
+#define OUTPUT_EXPANDER_I2C_SCL_PIN 33
+#define OUTPUT_EXPANDER_I2C_ADDRESS 0x20           // First MCP23017, with A2..A0 low
+#define OUTPUT_EXPANDER_I2C_SPEED_HZ 400000
+#define OUTPUT_EXPANDER_SPI_MOSI_PIN 23            // 74HC595 SER
+#define OUTPUT_EXPANDER_SPI_SCLK_PIN 18            // 74HC595 SRCLK
+#define OUTPUT_EXPANDER_SPI_LATCH_PIN 5            // 74HC595 RCLK, driven as chip select
+#define OUTPUT_EXPANDER_SPI_SPEED_HZ 4000000
+
+#if defined(OUTPUT_EXPANDER_MCP23017)
+    #define OUTPUT_EXPANDER_CHANNELS (16 * OUTPUT_EXPANDER_CHIPS)
+#elif defined(OUTPUT_EXPANDER_74HC595)
+    #define OUTPUT_EXPANDER_CHANNELS (8 * OUTPUT_EXPANDER_CHIPS)
+#else
+    #define OUTPUT_EXPANDER_CHANNELS 0
+#endif
+
+// Dew Heater Configuration (uncomment to run the dew heater loop)
+// #define USE_DEW_HEATER
+// #define DEW_SENSOR_SIMULATED                    // Thermal model instead of sensors, for bench testing
+#define DEW_HEATER_SWITCH 4                        // Switch driving the heater; set its range to 0-100, step 1
+#define DEW_PWM_FREQUENCY_HZ 1000                  // LEDC frequency on the heater switch's pin
+#define DEW_I2C_SDA_PIN 21                         // SHT3x air temperature and humidity sensor
+#define DEW_I2C_SCL_PIN 22
+#define DEW_SHT3X_ADDRESS 0x44
+#define DEW_ONEWIRE_PIN 4                          // DS18B20 probe on the optic
+#define DEW_CONTROL_PERIOD_MS 1000                 // Fixed control rate
+#define DEW_DEFAULT_MARGIN_C 3.0f                  // Optic is held this far above the dew point
+#define DEW_PID_KP 0.5f                            // Duty per degree below the target
+#define DEW_PID_KI 0.003f                          // Duty per degree-second
+#define DEW_PID_KD 2.0f                            // Duty per degree/second of cooling
+#define DEW_DERIVATIVE_FILTER_S 20.0f              // Low-pass on the derivative term
+#define DEW_SENSOR_MAX_FAILURES 10                 // Failed readings in a row before the fallback duty
+#define DEW_FALLBACK_DUTY 0.5f                     // Heater duty while the sensors are failing
+
+// Current Sensing Configuration (uncomment to measure load current on ADC1)
+// #define USE_CURRENT_SENSE
+#define CURRENT_SENSE_CHANNELS 2                   // Channels in the tables below, at most 4
+#define CURRENT_SENSE_SAMPLE_RATE_HZ 20000         // ADC conversions per second, shared by all channels
+#define CURRENT_SENSE_BLOCK_SAMPLES 50             // Samples per channel reduced at a time, at most 128
+#define CURRENT_SENSE_WINDOW_BLOCKS 20             // Sliding window length in blocks (100 ms at the defaults)
+#define CURRENT_SENSE_PUBLISH_MS 500               // How often the current switches are updated
+#define CURRENT_SENSE_DEADBAND_AMPS 0.02f          // Smaller changes are not published
+#define CURRENT_SENSE_SETTLE_MS 300                // Time after the relay switches before load faults are judged
+#define CURRENT_SENSE_FAULT_MS 1000                // A fault must last this long to be raised or cleared
+#define CURRENT_SENSE_CAPTURE_BYTES 8192           // Largest raw capture from /ui/api/current/capture
+
+// Relay switch whose load each current channel measures
+const int CURRENT_SENSE_SWITCH[CURRENT_SENSE_CHANNELS] = {0, 1};
+
+// ADC1 channel of each current channel (6 = GPIO34, 7 = GPIO35)
+const int CURRENT_SENSE_ADC_CHANNEL[CURRENT_SENSE_CHANNELS] = {6, 7};
+
+// AC loads are measured about the window mean and need no zero point
+const bool CURRENT_SENSE_AC[CURRENT_SENSE_CHANNELS] = {false, false};
+
+// Sensor gain at the pin: ACS712-05B (185 mV/A) behind a 2:3 divider
+const float CURRENT_SENSE_AMPS_PER_VOLT[CURRENT_SENSE_CHANNELS] = {8.1f, 8.1f};
+
+// Sensor output at the pin at zero current
+const float CURRENT_SENSE_ZERO_VOLTS[CURRENT_SENSE_CHANNELS] = {1.65f, 1.65f};
+
+// Less RMS current than this while switched on is an open load, and as
+// much while switched off means the relay is stuck on
+const float CURRENT_SENSE_MIN_AMPS[CURRENT_SENSE_CHANNELS] = {0.05f, 0.05f};
+
+// A higher peak current is an overcurrent
+const float CURRENT_SENSE_MAX_AMPS[CURRENT_SENSE_CHANNELS] = {4.0f, 4.0f};
+
+// Event Journal Configuration
+#define EVENT_JOURNAL_ENTRIES 256                  // Events kept through resets in RTC memory, 16 bytes each, split between the cores; a power of two
+#define EVENT_JOURNAL_AUTH_INTERVAL_MS 1000        // At most one authentication failure journaled per interval
+
+// Power-Fail Configuration
+#define POWER_FAIL_MAX_SWITCHES 32                 // Switches kept in the RTC memory snapshot
+#define POWER_FAIL_GPIO -1                         // Input pulled low by a supply supervisor on power failure; -1 for none
+
+// OTA Update Configuration
+#define OTA_CHUNK_SIZE 4096                        // Bytes per network read and per flash write
+#define OTA_RING_BUFFER_SIZE (8 * OTA_CHUNK_SIZE)  // Buffer between download and flash-write stages
+#define OTA_RESUME_CHECKPOINT_SIZE (64 * 1024)     // Bytes between persisted resume offsets
+#define OTA_MAX_RETRIES 8                          // Download attempts after the first one fails
+#define OTA_RETRY_BASE_DELAY_MS 1000               // First retry delay, doubled on each retry
+#define OTA_RETRY_MAX_DELAY_MS 30000               // Upper bound for the retry delay
+#define OTA_EVENTS_MAX_CLIENTS 3                   // Concurrent /ota/events listeners
+#define OTA_EVENTS_INTERVAL_MS 500                 // Minimum time between progress events
+#define OTA_EVENTS_KEEPALIVE_MS 15000              // Idle time before a keepalive comment is sent
+#define OTA_SIGNATURE_SUFFIX ".sig"                // Detached signature URL: image URL + suffix
+#define OTA_MANIFEST_SUFFIX ".sha256"              // Manifest URL: image URL + suffix
+
+// PEM public key for OTA image signatures. When set, only images with a
+// valid ECDSA signature are accepted; when empty, a published manifest
+// hash is checked instead if the server has one.
+#define OTA_SIGNING_PUBLIC_KEY ""
+
+// WebSocket Configuration
+#define SWITCH_EVENTS_MAX_CLIENTS 4                // Concurrent /ws clients
+#define SWITCH_EVENTS_QUEUE_LENGTH 16              // Changes queued per client before a full resync
+
+// Metrics Configuration
+#define METRICS_MAX_ROUTES 64                      // URI handlers; registering more fails
+#define METRICS_ROUTE_URI_LEN 64                   // Longest route label kept
+#define REQUEST_ARENA_SIZE 3072                    // Scratch memory per HTTP server task, reset after each request
+#define REQUEST_ARENA_WORKERS 2                    // HTTP server tasks that can hold an arena
+
+// HTTPS Configuration (started only when a certificate is stored)
+#define HTTPS_SERVER_PORT 443
+#define HTTPS_MAX_OPEN_SOCKETS 3                   // Each TLS session holds about 25 KB of buffers
+#define HTTPS_KEEPALIVE_IDLE_S 30                  // Idle time before TCP keep-alive probes start
+#define HTTPS_KEEPALIVE_INTERVAL_S 5               // Time between keep-alive probes
+#define HTTPS_KEEPALIVE_COUNT 3                    // Unanswered probes before the session is dropped
+#define HTTPS_MAX_PEM_SIZE 8192                    // Largest certificate and key bundle accepted
+
 // Switch Configuration
 #define DEFAULT_NUM_SWITCHES 5
 
@@ -38,6 +264,18 @@ const double DEFAULT_SWITCH_STEPS[DEFAULT_NUM_SWITCHES] = {1.0, 1.0, 1.0, 1.0, 1
 // Default writable state for each switch
 const bool DEFAULT_SWITCH_CAN_WRITE[DEFAULT_NUM_SWITCHES] = {true, true, true, true, true};
 
+// Most GPIO pins one switch can drive, its own pin included
+#define SWITCH_GANG_MAX_PINS 4
+
+// Further pins each switch drives together with its own, -1 for none.
+// Pins are switched on in this order and off in reverse.
+const int DEFAULT_SWITCH_GANG_PINS[DEFAULT_NUM_SWITCHES][SWITCH_GANG_MAX_PINS - 1] = {
+    {-1, -1, -1}, {-1, -1, -1}, {-1, -1, -1}, {-1, -1, -1}, {-1, -1, -1}
+};
+
+// Delay between the pins of a ganged switch in ms; 0 switches them all at once
+const int DEFAULT_SWITCH_GANG_DELAY_MS[DEFAULT_NUM_SWITCHES] = {0, 0, 0, 0, 0};
+
 // Device Information
 #define DEVICE_SERIAL "ESP32_SWITCH_SERIAL"
 #define DEVICE_NAME "ESP32 Alpaca Switch Server"
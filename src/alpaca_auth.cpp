@@ -1,8 +1,13 @@
 #include "alpaca_auth.h"
+#include "metrics.h"
+#include "request_arena.h"
+#include "event_journal.h"
 #include <nvs_flash.h>
 #include <nvs.h>
 #include <esp_log.h>
+#include <esp_timer.h>
 #include <mbedtls/base64.h>
+#include <lwip/sockets.h>
 #include <string.h>
 
 static const char* TAG = "alpaca_auth";
@@ -12,6 +17,23 @@ std::string AlpacaAuth::_username = "admin";
 std::string AlpacaAuth::_password = "admin";
 const char* AlpacaAuth::NVS_NAMESPACE = "alpaca_auth";
 
+// IPv4 address of the client in network order, 0 if it has none
+static uint32_t client_ipv4(httpd_req_t* req) {
+    struct sockaddr_storage addr;
+    socklen_t len = sizeof(addr);
+    uint32_t ip = 0;
+    if (getpeername(httpd_req_to_sockfd(req), (struct sockaddr*)&addr, &len) != 0) {
+        return 0;
+    }
+    if (addr.ss_family == AF_INET) {
+        ip = ((struct sockaddr_in*)&addr)->sin_addr.s_addr;
+    } else if (addr.ss_family == AF_INET6) {
+        // IPv4-mapped address on a dual-stack socket
+        memcpy(&ip, ((struct sockaddr_in6*)&addr)->sin6_addr.s6_addr + 12, sizeof(ip));
+    }
+    return ip;
+}
+
 esp_err_t AlpacaAuth::init() {
     return loadSettings();
 }
@@ -36,8 +58,9 @@ esp_err_t AlpacaAuth::setCredentials(const std::string& username, const std::str
     return saveSettings();
 }
 
-std::string AlpacaAuth::getUsername() {
-    return _username;
+const char* AlpacaAuth::getUsername() {
+    const char* username = RequestArena::strdup(_username.c_str());
+    return username != NULL ? username : "";
 }
 
 esp_err_t AlpacaAuth::loadSettings() {
@@ -141,7 +164,20 @@ bool AlpacaAuth::verifyRequest(httpd_req_t* req) {
     if (!_enabled) {
         return true;  // Authentication disabled
     }
-    
+
+    // The header buffers are not needed once the check is done
+    size_t mark = RequestArena::mark();
+    int64_t start = esp_timer_get_time();
+    bool result = checkCredentials(req);
+    Metrics::recordAuth(esp_timer_get_time() - start, result);
+    if (!result) {
+        EventJournal::record(JOURNAL_AUTH_FAILURE, JOURNAL_AUTH_HTTP, client_ipv4(req));
+    }
+    RequestArena::release(mark);
+    return result;
+}
+
+bool AlpacaAuth::checkCredentials(httpd_req_t* req) {
     // Get Authorization header
     size_t auth_header_len = httpd_req_get_hdr_value_len(req, "Authorization");
     if (auth_header_len == 0) {
@@ -149,7 +185,7 @@ bool AlpacaAuth::verifyRequest(httpd_req_t* req) {
         return false;
     }
     
-    char* auth_header = new char[auth_header_len + 1];
+    char* auth_header = (char*)RequestArena::alloc(auth_header_len + 1);
     if (auth_header == NULL) {
         ESP_LOGE(TAG, "Failed to allocate memory for auth header");
         return false;
@@ -158,33 +194,28 @@ bool AlpacaAuth::verifyRequest(httpd_req_t* req) {
     esp_err_t err = httpd_req_get_hdr_value_str(req, "Authorization", auth_header, auth_header_len + 1);
     if (err != ESP_OK) {
         ESP_LOGE(TAG, "Failed to get Authorization header: %s", esp_err_to_name(err));
-        delete[] auth_header;
         return false;
     }
     
     // Check if it's a Basic auth header
     if (strncmp(auth_header, "Basic ", 6) != 0) {
         ESP_LOGW(TAG, "Not a Basic auth header");
-        delete[] auth_header;
         return false;
     }
     
     // Decode base64
     size_t out_len = 0;
-    unsigned char* decoded = new unsigned char[auth_header_len];
+    unsigned char* decoded = (unsigned char*)RequestArena::alloc(auth_header_len);
     if (decoded == NULL) {
         ESP_LOGE(TAG, "Failed to allocate memory for decoded auth");
-        delete[] auth_header;
         return false;
     }
     
     mbedtls_base64_decode(decoded, auth_header_len, &out_len, 
                           (const unsigned char*)auth_header + 6, auth_header_len - 6);
-    delete[] auth_header;
     
     if (out_len == 0) {
         ESP_LOGW(TAG, "Failed to decode base64 auth");
-        delete[] decoded;
         return false;
     }
     
@@ -195,7 +226,6 @@ bool AlpacaAuth::verifyRequest(httpd_req_t* req) {
     char* colon = strchr((char*)decoded, ':');
     if (colon == NULL) {
         ESP_LOGW(TAG, "Invalid auth format, no colon separator");
-        delete[] decoded;
         return false;
     }
     
@@ -210,7 +240,6 @@ bool AlpacaAuth::verifyRequest(httpd_req_t* req) {
         ESP_LOGW(TAG, "Authentication failed for user: %s", auth_username);
     }
     
-    delete[] decoded;
     return result;
 }
 
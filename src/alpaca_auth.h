@@ -19,8 +19,9 @@ public:
     // Set username and password
     static esp_err_t setCredentials(const std::string& username, const std::string& password);
     
-    // Get username
-    static std::string getUsername();
+    // Get username. The copy lives in the request arena and is only valid
+    // until the current request ends.
+    static const char* getUsername();
     
     // Verify request authentication
     static bool verifyRequest(httpd_req_t* req);
@@ -39,6 +40,9 @@ private:
     
     // Save authentication settings to NVS
     static esp_err_t saveSettings();
+
+    // Check the request's Basic credentials
+    static bool checkCredentials(httpd_req_t* req);
 };
 
 #endif // ALPACA_AUTH_H
\ No newline at end of file
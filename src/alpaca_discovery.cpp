@@ -0,0 +1,178 @@
+#include "alpaca_discovery.h"
+#include "config.h"
+#include <esp_log.h>
+#include <esp_timer.h>
+#include <mdns.h>
+#include <lwip/sockets.h>
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
+
+static const char* TAG = "alpaca_discovery";
+
+// Port and request prefix defined by the Alpaca discovery protocol; the
+// character after the prefix is the protocol version
+#define DISCOVERY_PORT 32227
+#define DISCOVERY_REQUEST "alpacadiscovery"
+
+// Clients remembered for the per-client limit
+#define DISCOVERY_SOURCE_SLOTS 8
+
+typedef struct {
+    uint32_t addr;
+    uint16_t port;
+    int64_t last_reply_us;
+} discovery_source_t;
+
+static char s_response[32];
+static int s_response_len = 0;
+
+static discovery_source_t s_sources[DISCOVERY_SOURCE_SLOTS];
+static int64_t s_tokens_refilled_us = 0;
+static int s_tokens = DISCOVERY_MAX_REPLIES_PER_SEC;
+
+static uint32_t s_replies = 0;
+static uint32_t s_dropped = 0;
+
+// Whether a reply may go to this client now. Only the responder task
+// calls this, so the state needs no locking.
+static bool allow_reply(const struct sockaddr_in* source) {
+    int64_t now = esp_timer_get_time();
+
+    // Ignore a client repeating itself within the interval, e.g. one
+    // request per interface or a burst of retries
+    discovery_source_t* slot = &s_sources[0];
+    for (int i = 0; i < DISCOVERY_SOURCE_SLOTS; i++) {
+        discovery_source_t* entry = &s_sources[i];
+        if (entry->addr == source->sin_addr.s_addr && entry->port == source->sin_port) {
+            if (now - entry->last_reply_us < (int64_t)DISCOVERY_SOURCE_INTERVAL_MS * 1000) {
+                return false;
+            }
+            slot = entry;
+            break;
+        }
+        if (entry->last_reply_us < slot->last_reply_us) {
+            slot = entry;
+        }
+    }
+
+    // Token bucket across all clients
+    int64_t refill = (now - s_tokens_refilled_us) * DISCOVERY_MAX_REPLIES_PER_SEC / 1000000;
+    if (refill > 0) {
+        s_tokens = s_tokens + refill > DISCOVERY_MAX_REPLIES_PER_SEC
+                 ? DISCOVERY_MAX_REPLIES_PER_SEC : s_tokens + (int)refill;
+        s_tokens_refilled_us += refill * 1000000 / DISCOVERY_MAX_REPLIES_PER_SEC;
+        if (s_tokens == DISCOVERY_MAX_REPLIES_PER_SEC) {
+            s_tokens_refilled_us = now;
+        }
+    }
+    if (s_tokens == 0) {
+        return false;
+    }
+    s_tokens--;
+
+    slot->addr = source->sin_addr.s_addr;
+    slot->port = source->sin_port;
+    slot->last_reply_us = now;
+    return true;
+}
+
+esp_err_t AlpacaDiscovery::start(uint16_t http_port) {
+    s_response_len = snprintf(s_response, sizeof(s_response), "{\"AlpacaPort\":%u}", http_port);
+
+    esp_err_t err = startMdns(http_port);
+    if (err != ESP_OK) {
+        // Broadcast discovery still works without mDNS
+        ESP_LOGW(TAG, "mDNS advertisement failed: %s", esp_err_to_name(err));
+    }
+
+    if (xTaskCreatePinnedToCore(responderTask, "alpaca_discovery", 3072, NULL, DISCOVERY_TASK_PRIORITY,
+                                NULL, DISCOVERY_TASK_CORE) != pdPASS) {
+        ESP_LOGE(TAG, "Failed to create responder task");
+        return ESP_ERR_NO_MEM;
+    }
+    return ESP_OK;
+}
+
+esp_err_t AlpacaDiscovery::startMdns(uint16_t http_port) {
+    esp_err_t err = mdns_init();
+    if (err != ESP_OK) {
+        return err;
+    }
+
+    mdns_hostname_set(MDNS_HOSTNAME);
+    mdns_instance_name_set(DEVICE_NAME);
+
+    char port[8];
+    snprintf(port, sizeof(port), "%u", http_port);
+    mdns_txt_item_t txt[] = {
+        { "name", DEVICE_NAME },
+        { "serial", DEVICE_SERIAL },
+        { "devicetype", "Switch" },
+        { "alpacaport", port },
+    };
+
+    err = mdns_service_add(DEVICE_NAME, "_alpaca", "_tcp", http_port, txt, sizeof(txt) / sizeof(txt[0]));
+    if (err == ESP_OK) {
+        ESP_LOGI(TAG, "Advertising _alpaca._tcp on %s.local:%u", MDNS_HOSTNAME, http_port);
+    }
+    return err;
+}
+
+void AlpacaDiscovery::onIpChanged(void* ctx, const esp_netif_ip_info_t* ip_info) {
+    esp_netif_t* netif = static_cast<esp_netif_t*>(ctx);
+
+    // Resend the announcement so cached records are replaced at once
+    // instead of when they expire
+    ESP_LOGI(TAG, "Address changed to " IPSTR ", announcing", IP2STR(&ip_info->ip));
+    mdns_netif_action(netif, (mdns_event_actions_t)(MDNS_EVENT_ANNOUNCE_IP4 | MDNS_EVENT_IP4_REVERSE_LOOKUP));
+}
+
+void AlpacaDiscovery::responderTask(void* pvParameter) {
+    int sock = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+    if (sock < 0) {
+        ESP_LOGE(TAG, "Failed to create socket: errno %d", errno);
+        vTaskDelete(NULL);
+        return;
+    }
+
+    struct sockaddr_in addr = {};
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(DISCOVERY_PORT);
+    addr.sin_addr.s_addr = htonl(INADDR_ANY);
+    if (bind(sock, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
+        ESP_LOGE(TAG, "Failed to bind port %d: errno %d", DISCOVERY_PORT, errno);
+        close(sock);
+        vTaskDelete(NULL);
+        return;
+    }
+
+    ESP_LOGI(TAG, "Answering discovery on UDP port %d", DISCOVERY_PORT);
+
+    char request[64];
+    while (true) {
+        struct sockaddr_in source;
+        socklen_t source_len = sizeof(source);
+        int len = recvfrom(sock, request, sizeof(request), 0, (struct sockaddr*)&source, &source_len);
+        if (len < (int)sizeof(DISCOVERY_REQUEST) ||
+            memcmp(request, DISCOVERY_REQUEST, sizeof(DISCOVERY_REQUEST) - 1) != 0) {
+            continue;
+        }
+
+        if (!allow_reply(&source)) {
+            s_dropped++;
+            continue;
+        }
+
+        if (sendto(sock, s_response, s_response_len, 0, (struct sockaddr*)&source, source_len) < 0) {
+            ESP_LOGW(TAG, "Failed to send discovery reply: errno %d", errno);
+            continue;
+        }
+
+        s_replies++;
+        ESP_LOGD(TAG, "Discovery reply %lu to " IPSTR " (%lu dropped)", (unsigned long)s_replies,
+                 IP2STR((esp_ip4_addr_t*)&source.sin_addr), (unsigned long)s_dropped);
+    }
+}
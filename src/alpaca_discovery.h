@@ -0,0 +1,31 @@
+#ifndef ALPACA_DISCOVERY_H
+#define ALPACA_DISCOVERY_H
+
+#include <esp_err.h>
+#include <esp_netif.h>
+#include <stdint.h>
+
+// Alpaca device discovery, in place of the library's responder.
+//
+// The device is advertised over mDNS/DNS-SD as _alpaca._tcp, which
+// crosses VLANs through an mDNS reflector where UDP broadcasts do not.
+// The UDP discovery protocol on port 32227 is still answered for
+// clients that only broadcast: the reply never changes, so it is built
+// once at start and sent from that buffer, rate limited overall and per
+// client so a client rescanning in a tight loop costs little.
+class AlpacaDiscovery {
+public:
+    // Start the mDNS advertisement and the UDP responder for the
+    // Alpaca API on http_port
+    static esp_err_t start(uint16_t http_port);
+
+    // Announce the new address; set as the WiFiManager IP callback with
+    // the station interface as ctx
+    static void onIpChanged(void* ctx, const esp_netif_ip_info_t* ip_info);
+
+private:
+    static esp_err_t startMdns(uint16_t http_port);
+    static void responderTask(void* pvParameter);
+};
+
+#endif // ALPACA_DISCOVERY_H
@@ -1,14 +1,29 @@
 #include "alpaca_switch.h"
+#include "metrics.h"
+#include "switch_storage.h"
+#include <math.h>
+#include <stdlib.h>
 #include <string.h>
+#include <strings.h>
 #include <esp_log.h>
+#include <esp_timer.h>
+#include <freertos/task.h>
 
 static const char* TAG = "alpaca_switch";
 
+static_assert(OUTPUT_EXPANDER_PIN_BASE >= GPIO_NUM_MAX, "Expander pins must not overlap GPIOs");
+static_assert(OUTPUT_EXPANDER_PIN_BASE + OUTPUT_EXPANDER_CHANNELS <= 128, "Ganged pins are stored as int8_t");
+
 // Constructor with configurable switches
-AlpacaSwitch::AlpacaSwitch(const switch_config_t* configs, int num_switches) : Switch()
+AlpacaSwitch::AlpacaSwitch(const switch_config_t* configs, int num_switches, OutputBackend* expander)
+    : Switch(), _expander(expander), _expander_failing(false), _gang_task(NULL)
 {
     _connected = true; // Start as connected regardless of WiFi
     _num_switches = num_switches;
+    _num_listeners = 0;
+    _batch_depth = 0;
+    _rules_evaluated = 0;
+    _rules_forced = 0;
     
     // Allocate memory for switch properties
     _switch_states = new bool[num_switches];
@@ -16,16 +31,41 @@ AlpacaSwitch::AlpacaSwitch(const switch_config_t* configs, int num_switches) : S
     _switch_descriptions = new char*[num_switches];
     _switch_values = new double[num_switches];
     _switch_can_write = new bool[num_switches];
+    _switch_automatic = new bool[num_switches]();
     _min_switch_values = new double[num_switches];
     _max_switch_values = new double[num_switches];
     _switch_steps = new double[num_switches];
     _switch_pins = new int[num_switches];
+    _switch_gangs = new switch_gang_t[num_switches]();
+    _gang_sequences = new GangSequence[num_switches]();
+    _gpio_masks = new uint64_t[num_switches]();
+    _expander_masks = new uint64_t[num_switches]();
+    _batch_pending = new bool[num_switches]();
+    _scene_ids = new int32_t[num_switches];
+    _scene_values = new double[num_switches];
+    _next_states = new bool[num_switches];
+    _next_changed = new bool[num_switches];
+    _relay_cycles = new uint32_t[num_switches]();
+    _relay_on_ticks = new uint64_t[num_switches]();
+    _relay_on_since = new TickType_t[num_switches]();
+    _lock = xSemaphoreCreateRecursiveMutex();
+    _scene_lock = xSemaphoreCreateMutex();
+    
+    // Gang sequences started below run once the switches are set up
+    xSemaphoreTakeRecursive(_lock, portMAX_DELAY);
     
     // Initialize the switches with values from config
     for (int i = 0; i < num_switches; i++) {
         _switch_states[i] = configs[i].normally_on;
         _switch_values[i] = configs[i].normally_on ? 1.0 : 0.0;
         
+        // A saved value outside the configured range is from an older
+        // configuration; the switch starts at its default then
+        if (configs[i].restored && configs[i].value >= configs[i].min_value && configs[i].value <= configs[i].max_value) {
+            _switch_states[i] = configs[i].state;
+            _switch_values[i] = configs[i].value;
+        }
+        
         // Allocate and copy strings
         _switch_names[i] = new char[32];
         snprintf(_switch_names[i], 32, "%s", configs[i].name ? configs[i].name : "Switch");
@@ -39,22 +79,76 @@ AlpacaSwitch::AlpacaSwitch(const switch_config_t* configs, int num_switches) : S
         _switch_steps[i] = configs[i].step;
         _switch_pins[i] = configs[i].gpio_pin;
         
-        // Configure GPIO pins
+        // Configure output pins, all off until the switch is set below.
+        // A pin that cannot drive an output leaves the switch without one.
+        if (_switch_pins[i] >= 0 && !claimPin(i, _switch_pins[i])) {
+            ESP_LOGW(TAG, "Switch %d: pin %d is not a free output", i, _switch_pins[i]);
+            _switch_pins[i] = -1;
+        }
         if (_switch_pins[i] >= 0) {
-            gpio_reset_pin((gpio_num_t)_switch_pins[i]);
-            gpio_set_direction((gpio_num_t)_switch_pins[i], GPIO_MODE_OUTPUT);
-            gpio_set_level((gpio_num_t)_switch_pins[i], _switch_states[i] ? 1 : 0);
-            ESP_LOGI(TAG, "Initialized switch %d on GPIO %d, initial state: %s", 
-                    i, _switch_pins[i], _switch_states[i] ? "ON" : "OFF");
+            // Ganged pins another switch already drives are dropped
+            const switch_gang_t* gang = &configs[i].gang;
+            switch_gang_t* kept = &_switch_gangs[i];
+            kept->delay_ms = gang->delay_ms;
+            for (int j = 0; j < gang->count && j < SWITCH_GANG_MAX_PINS - 1; j++) {
+                if (!claimPin(i, gang->pins[j])) {
+                    ESP_LOGW(TAG, "Switch %d: pin %d is not a free output, left out of the gang", i, gang->pins[j]);
+                    continue;
+                }
+                kept->pins[kept->count++] = gang->pins[j];
+            }
+            _gang_sequences[i].device = this;
+            _gang_sequences[i].id = i;
+            if (kept->count > 0 && kept->delay_ms > 0 && _gang_task == NULL &&
+                xTaskCreatePinnedToCore(gangTask, "gang", 3072, this, GANG_TASK_PRIORITY, &_gang_task,
+                                        GANG_TASK_CORE) != pdPASS) {
+                ESP_LOGW(TAG, "No task for gang delays, ganged pins switch at once");
+                _gang_task = NULL;
+            }
+            if (kept->count > 0 && kept->delay_ms > 0 && _gang_task != NULL) {
+                esp_timer_create_args_t timer_args = {};
+                timer_args.callback = gangTimer;
+                timer_args.arg = &_gang_sequences[i];
+                timer_args.name = "gang";
+                if (esp_timer_create(&timer_args, &_gang_sequences[i].timer) != ESP_OK) {
+                    ESP_LOGW(TAG, "Switch %d: no timer for the gang delay, its pins switch at once", i);
+                    _gang_sequences[i].timer = NULL;
+                }
+            }
+            writePins(i, _switch_states[i], _switch_states[i]);
+            
+            // Energizing the relay at boot wears it like any other cycle
+            if (_switch_states[i]) {
+                _relay_cycles[i] = 1;
+                _relay_on_since[i] = xTaskGetTickCount();
+            }
+            ESP_LOGI(TAG, "Initialized switch %d on pin %d%s, initial state: %s", 
+                    i, _switch_pins[i], kept->count > 0 ? " and ganged pins" : "",
+                    _switch_states[i] ? "ON" : "OFF");
         } else {
             ESP_LOGI(TAG, "Initialized virtual switch %d, initial state: %s", 
                     i, _switch_states[i] ? "ON" : "OFF");
         }
     }
+    flushOutputs(true);
+    xSemaphoreGiveRecursive(_lock);
 }
 
 AlpacaSwitch::~AlpacaSwitch()
 {
+    for (int i = 0; i < _num_switches; i++) {
+        if (_gang_sequences[i].timer != NULL) {
+            esp_timer_stop(_gang_sequences[i].timer);
+            esp_timer_delete(_gang_sequences[i].timer);
+        }
+    }
+    if (_gang_task != NULL) {
+        // Not while it holds the lock
+        xSemaphoreTakeRecursive(_lock, portMAX_DELAY);
+        vTaskDelete(_gang_task);
+        xSemaphoreGiveRecursive(_lock);
+    }
+    
     // Free allocated memory
     for (int i = 0; i < _num_switches; i++) {
         delete[] _switch_names[i];
@@ -66,18 +160,96 @@ AlpacaSwitch::~AlpacaSwitch()
     delete[] _switch_descriptions;
     delete[] _switch_values;
     delete[] _switch_can_write;
+    delete[] _switch_automatic;
     delete[] _min_switch_values;
     delete[] _max_switch_values;
     delete[] _switch_steps;
     delete[] _switch_pins;
+    delete[] _switch_gangs;
+    delete[] _gang_sequences;
+    delete[] _gpio_masks;
+    delete[] _expander_masks;
+    delete[] _batch_pending;
+    delete[] _scene_ids;
+    delete[] _scene_values;
+    delete[] _next_states;
+    delete[] _next_changed;
+    delete[] _relay_cycles;
+    delete[] _relay_on_ticks;
+    delete[] _relay_on_since;
+    vSemaphoreDelete(_lock);
+    vSemaphoreDelete(_scene_lock);
 }
 
 // Common device interface methods
 
 esp_err_t AlpacaSwitch::action(const char *action, const char *parameters, char *buf, size_t len)
 {
-    // No custom actions implemented
-    return ALPACA_ERR_ACTION_NOT_IMPLEMENTED;
+    if (len > 0) {
+        buf[0] = '\0';
+    }
+    
+    // Scenes: apply, save and delete take the scene name as parameter
+    if (strcasecmp(action, "scene:list") == 0) {
+        xSemaphoreTakeRecursive(_lock, portMAX_DELAY);
+        size_t pos = snprintf(buf, len, "[");
+        for (int i = 0; i < _scenes.count() && pos < len; i++) {
+            const uint8_t* ids;
+            const float* values;
+            int count = _scenes.entries(i, &ids, &values);
+            pos += snprintf(buf + pos, len - pos, "%s{\"name\":\"%s\",\"switches\":{", i > 0 ? "," : "",
+                            _scenes.name(i));
+            for (int j = 0; j < count && pos < len; j++) {
+                pos += snprintf(buf + pos, len - pos, "%s\"%u\":%g", j > 0 ? "," : "", ids[j], values[j]);
+            }
+            if (pos < len) {
+                pos += snprintf(buf + pos, len - pos, "}}");
+            }
+        }
+        if (pos < len) {
+            pos += snprintf(buf + pos, len - pos, "]");
+        }
+        xSemaphoreGiveRecursive(_lock);
+        
+        // Truncated JSON would read as a shorter list; refuse it instead
+        if (pos >= len) {
+            if (len > 0) {
+                buf[0] = '\0';
+            }
+            ESP_LOGW(TAG, "Scene list does not fit in %u bytes", (unsigned)len);
+            return ALPACA_ERR_INVALID_OPERATION;
+        }
+        return ALPACA_OK;
+    }
+    
+    bool apply = strcasecmp(action, "scene:apply") == 0;
+    bool save = strcasecmp(action, "scene:save") == 0;
+    bool remove = strcasecmp(action, "scene:delete") == 0;
+    if (!apply && !save && !remove) {
+        return ALPACA_ERR_ACTION_NOT_IMPLEMENTED;
+    }
+    
+    char name[SWITCH_SCENE_NAME_LEN];
+    int* ids = new int[_num_switches];
+    int count = 0;
+    esp_err_t err = parseSceneParameters(parameters, name, ids, _num_switches, &count);
+    if (err == ALPACA_OK && !save && count > 0) {
+        err = ALPACA_ERR_INVALID_VALUE;
+    }
+    if (err == ALPACA_OK) {
+        if (apply) {
+            err = applyScene(name);
+        } else if (save) {
+            err = saveScene(name, ids, count);
+        } else {
+            err = deleteScene(name);
+        }
+    }
+    delete[] ids;
+    if (err == ALPACA_OK) {
+        snprintf(buf, len, "%s", name);
+    }
+    return err;
 }
 
 esp_err_t AlpacaSwitch::commandblind(const char *command, bool raw)
@@ -144,6 +316,10 @@ esp_err_t AlpacaSwitch::get_name(char *buf, size_t len)
 esp_err_t AlpacaSwitch::get_supportedactions(std::vector<std::string> &actions)
 {
     actions.clear();
+    actions.push_back("scene:apply");
+    actions.push_back("scene:save");
+    actions.push_back("scene:delete");
+    actions.push_back("scene:list");
     return ALPACA_OK;
 }
 
@@ -162,7 +338,7 @@ esp_err_t AlpacaSwitch::get_canwrite(int32_t id, bool *canwrite)
         return ALPACA_ERR_INVALID_VALUE;
     }
     
-    *canwrite = _switch_can_write[id];
+    *canwrite = _switch_can_write[id] && !_switch_automatic[id];
     return ALPACA_OK;
 }
 
@@ -173,7 +349,9 @@ esp_err_t AlpacaSwitch::get_getswitch(int32_t id, bool *getswitch)
         return ALPACA_ERR_INVALID_VALUE;
     }
     
+    xSemaphoreTakeRecursive(_lock, portMAX_DELAY);
     *getswitch = _switch_states[id];
+    xSemaphoreGiveRecursive(_lock);
     ESP_LOGD(TAG, "Get switch %ld state: %s", id, _switch_states[id] ? "ON" : "OFF");
     return ALPACA_OK;
 }
@@ -196,7 +374,9 @@ esp_err_t AlpacaSwitch::get_getswitchname(int32_t id, char *buf, size_t len)
         return ALPACA_ERR_INVALID_VALUE;
     }
     
+    xSemaphoreTakeRecursive(_lock, portMAX_DELAY);
     strncpy(buf, _switch_names[id], len);
+    xSemaphoreGiveRecursive(_lock);
     return ALPACA_OK;
 }
 
@@ -207,7 +387,9 @@ esp_err_t AlpacaSwitch::get_getswitchvalue(int32_t id, double *value)
         return ALPACA_ERR_INVALID_VALUE;
     }
     
+    xSemaphoreTakeRecursive(_lock, portMAX_DELAY);
     *value = _switch_values[id];
+    xSemaphoreGiveRecursive(_lock);
     ESP_LOGD(TAG, "Get switch %ld value: %f", id, _switch_values[id]);
     return ALPACA_OK;
 }
@@ -246,23 +428,39 @@ esp_err_t AlpacaSwitch::put_setswitch(int32_t id, bool value)
         return ALPACA_ERR_NOT_CONNECTED;
     }
     
-    if (!_switch_can_write[id]) {
+    if (!_switch_can_write[id] || _switch_automatic[id]) {
         ESP_LOGW(TAG, "Cannot set switch %ld - switch is read-only", id);
         return ALPACA_ERR_INVALID_OPERATION;
     }
     
-    // Set the switch state
-    _switch_states[id] = value;
+    xSemaphoreTakeRecursive(_lock, portMAX_DELAY);
+    int64_t start_us = esp_timer_get_time();
+    _rules_evaluated = 0;
+    _rules_forced = 0;
+    bool state_changed = _switch_states[id] != value;
+    if (state_changed && !rulesAllow(id, value)) {
+        recordRules(start_us, true);
+        xSemaphoreGiveRecursive(_lock);
+        return ALPACA_ERR_INVALID_OPERATION;
+    }
+    bool changed = state_changed || _switch_values[id] != (value ? 1.0 : 0.0);
+
+    // Set the switch state and its output
+    setOutput(id, value);
     
     // Update the switch value
     _switch_values[id] = value ? 1.0 : 0.0;
     
-    // Set the physical GPIO pin if valid
-    if (_switch_pins[id] >= 0) {
-        gpio_set_level((gpio_num_t)_switch_pins[id], value ? 1 : 0);
-    }
-    
     ESP_LOGI(TAG, "Switch %ld set to %s", id, value ? "ON" : "OFF");
+    if (changed) {
+        notifyChange(id);
+    }
+    if (state_changed) {
+        applyRules(id, 1);
+    }
+    recordRules(start_us, false);
+    flushOutputs(false);
+    xSemaphoreGiveRecursive(_lock);
     return ALPACA_OK;
 }
 
@@ -273,8 +471,10 @@ esp_err_t AlpacaSwitch::put_setswitchname(int32_t id, const char *name)
         return ALPACA_ERR_INVALID_VALUE;
     }
     
+    xSemaphoreTakeRecursive(_lock, portMAX_DELAY);
     strncpy(_switch_names[id], name, 31);
     _switch_names[id][31] = '\0'; // Ensure null termination
+    xSemaphoreGiveRecursive(_lock);
     
     ESP_LOGI(TAG, "Switch %ld name set to: %s", id, name);
     return ALPACA_OK;
@@ -292,31 +492,58 @@ esp_err_t AlpacaSwitch::put_setswitchvalue(int32_t id, double value)
         return ALPACA_ERR_NOT_CONNECTED;
     }
     
-    if (!_switch_can_write[id]) {
+    if (!_switch_can_write[id] || _switch_automatic[id]) {
         ESP_LOGW(TAG, "Cannot set switch %ld value - switch is read-only", id);
         return ALPACA_ERR_INVALID_OPERATION;
     }
     
-    // Check if the value is within range
-    if (value < _min_switch_values[id] || value > _max_switch_values[id]) {
+    // Check if the value is within range; NaN compares false with both
+    // bounds, so it is refused on its own
+    if (!isfinite(value) || value < _min_switch_values[id] || value > _max_switch_values[id]) {
         ESP_LOGW(TAG, "Invalid switch %ld value: %f (range: %f to %f)", 
                  id, value, _min_switch_values[id], _max_switch_values[id]);
         return ALPACA_ERR_INVALID_VALUE;
     }
     
+    return writeValue(id, value);
+}
+
+esp_err_t AlpacaSwitch::writeValue(int32_t id, double value)
+{
+    xSemaphoreTakeRecursive(_lock, portMAX_DELAY);
+    int64_t start_us = esp_timer_get_time();
+    _rules_evaluated = 0;
+    _rules_forced = 0;
+    bool new_state = value > 0;
+    bool state_changed = _switch_states[id] != new_state;
+    if (state_changed && !rulesAllow(id, new_state)) {
+        recordRules(start_us, true);
+        xSemaphoreGiveRecursive(_lock);
+        return ALPACA_ERR_INVALID_OPERATION;
+    }
+    bool changed = _switch_values[id] != value;
+
     // Set the switch value
     _switch_values[id] = value;
     
-    // Update the switch state (on if value > 0)
-    bool new_state = value > 0;
-    _switch_states[id] = new_state;
+    // Update the switch state (on if value > 0) and its output
+    setOutput(id, new_state);
     
-    // Set the physical GPIO pin if valid
-    if (_switch_pins[id] >= 0) {
-        gpio_set_level((gpio_num_t)_switch_pins[id], new_state ? 1 : 0);
+    // Control loops set their switches every few seconds
+    if (_switch_automatic[id]) {
+        ESP_LOGD(TAG, "Switch %ld value set to %f by its control loop", id, value);
+    } else {
+        ESP_LOGI(TAG, "Switch %ld value set to %f (state: %s)", id, value, new_state ? "ON" : "OFF");
     }
-    
-    ESP_LOGI(TAG, "Switch %ld value set to %f (state: %s)", id, value, new_state ? "ON" : "OFF");
+    if (changed) {
+        notifyChange(id);
+    }
+    if (state_changed) {
+        applyRules(id, 1);
+    }
+    recordRules(start_us, false);
+    flushOutputs(false);
+    xSemaphoreGiveRecursive(_lock);
     return ALPACA_OK;
 }
 
@@ -329,4 +556,608 @@ esp_err_t AlpacaSwitch::get_switchstep(int32_t id, double *switchstep)
     
     *switchstep = _switch_steps[id];
     return ALPACA_OK;
-}
\ No newline at end of file
+}
+
+// Outputs and relay wear
+
+void AlpacaSwitch::setOutput(int32_t id, bool state)
+{
+    if (_switch_pins[id] >= 0) {
+        // Only a transition costs anything: a tick read and an add
+        if (state != _switch_states[id]) {
+            TickType_t now = xTaskGetTickCount();
+            if (state) {
+                _relay_cycles[id]++;
+                _relay_on_since[id] = now;
+            } else {
+                _relay_on_ticks[id] += now - _relay_on_since[id];
+            }
+        }
+        writePins(id, state, state != _switch_states[id]);
+    }
+    _switch_states[id] = state;
+}
+
+void AlpacaSwitch::writePins(int32_t id, bool state, bool sequence)
+{
+    GangSequence* gang = &_gang_sequences[id];
+    if (gang->timer == NULL || !sequence) {
+        // A sequence under way already ends at this state
+        if (gang->running) {
+            return;
+        }
+        
+        // Every pin of the switch in one masked write per backend, so a
+        // gang never shows a mix of states. Expander writes wait for
+        // flushOutputs().
+        if (_gpio_masks[id] != 0) {
+            _gpio.write(_gpio_masks[id], state);
+        }
+        if (_expander_masks[id] != 0) {
+            _expander->write(_expander_masks[id], state);
+        }
+        gang->on = state ? _switch_gangs[id].count + 1 : 0;
+        return;
+    }
+    
+    // The first pin changes now and the rest from the timer. A sequence
+    // already running turns toward the new state from where it is.
+    if (!gang->running && stepGang(id, state)) {
+        gang->running = true;
+        esp_timer_start_once(gang->timer, _switch_gangs[id].delay_ms * 1000ULL);
+    }
+}
+
+// Switch the next pin of a gang toward state: on in the configured order
+// and off in reverse, so a supply pin listed first is the first on and
+// the last off. Returns whether more pins remain.
+bool AlpacaSwitch::stepGang(int32_t id, bool state)
+{
+    GangSequence* gang = &_gang_sequences[id];
+    int total = _switch_gangs[id].count + 1;
+    if (state ? gang->on >= total : gang->on == 0) {
+        return false;
+    }
+    int index = state ? gang->on : gang->on - 1;
+    int pin = index == 0 ? _switch_pins[id] : _switch_gangs[id].pins[index - 1];
+    if (pin >= OUTPUT_EXPANDER_PIN_BASE) {
+        _expander->write(1ULL << (pin - OUTPUT_EXPANDER_PIN_BASE), state);
+        flushOutputs(true);
+    } else {
+        _gpio.write(1ULL << pin, state);
+    }
+    gang->on = state ? gang->on + 1 : gang->on - 1;
+    return state ? gang->on < total : gang->on > 0;
+}
+
+// Runs in the esp_timer task that every timer shares, so it must not wait
+// for the lock or the expander there; the gang task takes the step
+void AlpacaSwitch::gangTimer(void* arg)
+{
+    GangSequence* gang = (GangSequence*)arg;
+    gang->due = true;
+    xTaskNotifyGive(gang->device->_gang_task);
+}
+
+void AlpacaSwitch::gangTask(void* arg)
+{
+    AlpacaSwitch* device = (AlpacaSwitch*)arg;
+    while (true) {
+        ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+        
+        xSemaphoreTakeRecursive(device->_lock, portMAX_DELAY);
+        for (int32_t id = 0; id < device->_num_switches; id++) {
+            GangSequence* gang = &device->_gang_sequences[id];
+            if (!gang->due.exchange(false)) {
+                continue;
+            }
+            if (gang->running && device->stepGang(id, device->_switch_states[id])) {
+                esp_timer_start_once(gang->timer, device->_switch_gangs[id].delay_ms * 1000ULL);
+            } else {
+                gang->running = false;
+            }
+        }
+        xSemaphoreGiveRecursive(device->_lock);
+    }
+}
+
+bool AlpacaSwitch::claimPin(int32_t id, int pin)
+{
+    if (pin >= OUTPUT_EXPANDER_PIN_BASE) {
+        int channel = pin - OUTPUT_EXPANDER_PIN_BASE;
+        if (_expander == NULL || !_expander->claim(channel)) {
+            return false;
+        }
+        _expander_masks[id] |= 1ULL << channel;
+        return true;
+    }
+    if (!_gpio.claim(pin)) {
+        return false;
+    }
+    _gpio_masks[id] |= 1ULL << pin;
+    return true;
+}
+
+// Send held expander writes once the write, its rules and any batch
+// around it are done; with now, whatever is open
+void AlpacaSwitch::flushOutputs(bool now)
+{
+    if (_expander == NULL || (_batch_depth > 0 && !now)) {
+        return;
+    }
+    
+    // A failed flush keeps its writes for the next one; log the change only
+    bool ok = _expander->flush();
+    if (!ok && !_expander_failing) {
+        ESP_LOGE(TAG, "Output expander did not take the switch outputs, retrying with the next write");
+    } else if (ok && _expander_failing) {
+        ESP_LOGI(TAG, "Output expander is taking writes again");
+    }
+    _expander_failing = !ok;
+}
+
+esp_err_t AlpacaSwitch::getGang(int32_t id, switch_gang_t* gang)
+{
+    if (id < 0 || id >= _num_switches) {
+        return ESP_ERR_NOT_FOUND;
+    }
+    *gang = _switch_gangs[id];
+    return ESP_OK;
+}
+
+esp_err_t AlpacaSwitch::getRelayCounter(int32_t id, relay_counter_t* counter)
+{
+    if (id < 0 || id >= _num_switches || _switch_pins[id] < 0) {
+        return ESP_ERR_NOT_FOUND;
+    }
+    
+    xSemaphoreTakeRecursive(_lock, portMAX_DELAY);
+    uint64_t on_ticks = _relay_on_ticks[id];
+    if (_switch_states[id]) {
+        on_ticks += xTaskGetTickCount() - _relay_on_since[id];
+    }
+    counter->cycles = _relay_cycles[id];
+    counter->on_seconds = (uint32_t)(on_ticks / configTICK_RATE_HZ);
+    xSemaphoreGiveRecursive(_lock);
+    return ESP_OK;
+}
+
+void AlpacaSwitch::addRelayCounters(const relay_counter_t* counters, int count)
+{
+    xSemaphoreTakeRecursive(_lock, portMAX_DELAY);
+    for (int i = 0; i < count && i < _num_switches; i++) {
+        _relay_cycles[i] += counters[i].cycles;
+        _relay_on_ticks[i] += (uint64_t)counters[i].on_seconds * configTICK_RATE_HZ;
+    }
+    xSemaphoreGiveRecursive(_lock);
+}
+
+// Change notification
+
+esp_err_t AlpacaSwitch::addChangeListener(switch_listener_fn_t listener, void* ctx)
+{
+    if (_num_listeners >= SWITCH_MAX_LISTENERS) {
+        ESP_LOGE(TAG, "Too many change listeners");
+        return ESP_ERR_NO_MEM;
+    }
+    
+    _listeners[_num_listeners] = listener;
+    _listener_ctx[_num_listeners] = ctx;
+    _num_listeners++;
+    return ESP_OK;
+}
+
+void AlpacaSwitch::beginBatch()
+{
+    xSemaphoreTakeRecursive(_lock, portMAX_DELAY);
+    _batch_depth++;
+}
+
+void AlpacaSwitch::endBatch()
+{
+    if (_batch_depth == 0) {
+        return;
+    }
+    if (--_batch_depth > 0) {
+        xSemaphoreGiveRecursive(_lock);
+        return;
+    }
+    flushOutputs(false);
+    
+    // Deliver everything that changed during the batch, with current values
+    switch_change_t changes[SWITCH_MAX_BATCH];
+    int count = 0;
+    for (int i = 0; i < _num_switches; i++) {
+        if (!_batch_pending[i]) {
+            continue;
+        }
+        _batch_pending[i] = false;
+        changes[count].id = i;
+        changes[count].state = _switch_states[i];
+        changes[count].value = _switch_values[i];
+        if (++count == SWITCH_MAX_BATCH) {
+            deliver(changes, count);
+            count = 0;
+        }
+    }
+    if (count > 0) {
+        deliver(changes, count);
+    }
+    xSemaphoreGiveRecursive(_lock);
+}
+
+void AlpacaSwitch::notifyChange(int32_t id)
+{
+    if (_batch_depth > 0) {
+        _batch_pending[id] = true;
+        return;
+    }
+    
+    switch_change_t change;
+    change.id = id;
+    change.state = _switch_states[id];
+    change.value = _switch_values[id];
+    deliver(&change, 1);
+}
+
+void AlpacaSwitch::deliver(const switch_change_t* changes, int count)
+{
+    for (int i = 0; i < _num_listeners; i++) {
+        _listeners[i](_listener_ctx[i], changes, count);
+    }
+}
+
+// Interlock and automation rules
+
+void AlpacaSwitch::setRules(const SwitchRules& rules)
+{
+    xSemaphoreTakeRecursive(_lock, portMAX_DELAY);
+    _rules = rules;
+    xSemaphoreGiveRecursive(_lock);
+    Metrics::setRuleCount(rules.count());
+    ESP_LOGI(TAG, "Loaded %d rule entries", rules.count());
+}
+
+esp_err_t AlpacaSwitch::checkWrite(int32_t id, bool state)
+{
+    if (id < 0 || id >= _num_switches) {
+        return ALPACA_ERR_INVALID_VALUE;
+    }
+    if (!_connected) {
+        return ALPACA_ERR_NOT_CONNECTED;
+    }
+    if (!_switch_can_write[id] || _switch_automatic[id]) {
+        return ALPACA_ERR_INVALID_OPERATION;
+    }
+    
+    xSemaphoreTakeRecursive(_lock, portMAX_DELAY);
+    int evaluated = 0;
+    bool allowed = _switch_states[id] == state ||
+                   _rules.check(id, state, _switch_states, &evaluated) == NULL;
+    xSemaphoreGiveRecursive(_lock);
+    return allowed ? ALPACA_OK : ALPACA_ERR_INVALID_OPERATION;
+}
+
+bool AlpacaSwitch::rulesAllow(int32_t id, bool state)
+{
+    const switch_rule_t* rule = _rules.check(id, state, _switch_states, &_rules_evaluated);
+    if (rule != NULL) {
+        ESP_LOGW(TAG, "Switch %ld may not turn %s while switch %d is %s", id, state ? "on" : "off",
+                 rule->trigger, (rule->flags & SWITCH_RULE_TRIGGER_ON) ? "on" : "off");
+        return false;
+    }
+    return true;
+}
+
+void AlpacaSwitch::applyRules(int32_t id, int depth)
+{
+    int count;
+    const switch_rule_t* rules = _rules.forces(id, &count);
+    if (count > 0 && depth > SWITCH_RULES_MAX_DEPTH) {
+        ESP_LOGW(TAG, "Rules stopped at switch %ld, cascade deeper than %d", id, SWITCH_RULES_MAX_DEPTH);
+        return;
+    }
+    
+    for (int i = 0; i < count; i++) {
+        // Bound the work one write can cause, whatever the rules are
+        if (_rules_evaluated >= SWITCH_RULES_MAX_EVALUATIONS) {
+            ESP_LOGW(TAG, "Rules stopped after %d evaluations", _rules_evaluated);
+            return;
+        }
+        _rules_evaluated++;
+        
+        const switch_rule_t* rule = &rules[i];
+        bool target_on = (rule->flags & SWITCH_RULE_TARGET_ON) != 0;
+        if (_switch_states[id] != ((rule->flags & SWITCH_RULE_TRIGGER_ON) != 0) ||
+            _switch_states[rule->target] == target_on || !rulesAllow(rule->target, target_on)) {
+            continue;
+        }
+        
+        // Rules act for the device, so read-only switches are set too
+        int32_t target = rule->target;
+        setOutput(target, target_on);
+        _switch_values[target] = target_on ? 1.0 : 0.0;
+        _rules_forced++;
+        ESP_LOGI(TAG, "Switch %ld set %s by rule on switch %ld", target, target_on ? "ON" : "OFF", id);
+        notifyChange(target);
+        applyRules(target, depth + 1);
+    }
+}
+
+void AlpacaSwitch::recordRules(int64_t start_us, bool refused)
+{
+    if (_rules.count() > 0) {
+        Metrics::recordRules(esp_timer_get_time() - start_us, _rules_evaluated, _rules_forced, refused);
+    }
+}
+
+// Automatic control
+
+void AlpacaSwitch::setAutomatic(int32_t id, bool automatic)
+{
+    if (id < 0 || id >= _num_switches) {
+        return;
+    }
+    
+    xSemaphoreTakeRecursive(_lock, portMAX_DELAY);
+    _switch_automatic[id] = automatic;
+    xSemaphoreGiveRecursive(_lock);
+    ESP_LOGI(TAG, "Switch %ld %s", id, automatic ? "under automatic control" : "back under manual control");
+}
+
+bool AlpacaSwitch::isAutomatic(int32_t id)
+{
+    return id >= 0 && id < _num_switches && _switch_automatic[id];
+}
+
+esp_err_t AlpacaSwitch::setAutomaticValue(int32_t id, double value)
+{
+    if (!isAutomatic(id)) {
+        return ALPACA_ERR_INVALID_OPERATION;
+    }
+    if (!isfinite(value)) {
+        return ALPACA_ERR_INVALID_VALUE;
+    }
+    
+    if (value < _min_switch_values[id]) {
+        value = _min_switch_values[id];
+    } else if (value > _max_switch_values[id]) {
+        value = _max_switch_values[id];
+    }
+    return writeValue(id, value);
+}
+
+// Scenes
+
+void AlpacaSwitch::setScenes(const SwitchScenes& scenes)
+{
+    xSemaphoreTakeRecursive(_lock, portMAX_DELAY);
+    _scenes = scenes;
+    xSemaphoreGiveRecursive(_lock);
+    ESP_LOGI(TAG, "Loaded %d scenes", scenes.count());
+}
+
+esp_err_t AlpacaSwitch::applyScene(const char* name)
+{
+    if (!_connected) {
+        return ALPACA_ERR_NOT_CONNECTED;
+    }
+    
+    xSemaphoreTakeRecursive(_lock, portMAX_DELAY);
+    int64_t start_us = esp_timer_get_time();
+    int index = _scenes.find(name);
+    if (index < 0) {
+        xSemaphoreGiveRecursive(_lock);
+        ESP_LOGW(TAG, "No scene named %s", name);
+        return ALPACA_ERR_INVALID_VALUE;
+    }
+    
+    const uint8_t* ids;
+    const float* values;
+    int count = _scenes.entries(index, &ids, &values);
+    for (int i = 0; i < count; i++) {
+        int32_t id = ids[i];
+        double value = values[i];
+        if (_switch_steps[id] > 0) {
+            // Floats hold stepped values only approximately; put them back on a step
+            value = _min_switch_values[id] +
+                    round((value - _min_switch_values[id]) / _switch_steps[id]) * _switch_steps[id];
+        }
+        _scene_ids[i] = id;
+        _scene_values[i] = value;
+    }
+    
+    int changed = 0;
+    esp_err_t err = transition(_scene_ids, _scene_values, count, start_us, &changed);
+    int64_t elapsed_us = esp_timer_get_time() - start_us;
+    Metrics::recordScene(elapsed_us, changed, err != ALPACA_OK);
+    xSemaphoreGiveRecursive(_lock);
+    if (err != ALPACA_OK) {
+        ESP_LOGW(TAG, "Scene %s refused", name);
+        return err;
+    }
+    ESP_LOGI(TAG, "Scene %s applied, %d of %d switches changed in %lld us", name, changed, count, elapsed_us);
+    return ALPACA_OK;
+}
+
+esp_err_t AlpacaSwitch::setValues(const int32_t* ids, const double* values, int count)
+{
+    if (!_connected) {
+        return ALPACA_ERR_NOT_CONNECTED;
+    }
+    for (int i = 0; i < count; i++) {
+        if (ids[i] < 0 || ids[i] >= _num_switches) {
+            return ALPACA_ERR_INVALID_VALUE;
+        }
+    }
+    
+    xSemaphoreTakeRecursive(_lock, portMAX_DELAY);
+    int changed = 0;
+    esp_err_t err = transition(ids, values, count, esp_timer_get_time(), &changed);
+    xSemaphoreGiveRecursive(_lock);
+    return err;
+}
+
+esp_err_t AlpacaSwitch::transition(const int32_t* ids, const double* values, int count, int64_t start_us,
+                                   int* changed)
+{
+    // Work out the states the settings leave and check every one against
+    // them before making any
+    memcpy(_next_states, _switch_states, _num_switches * sizeof(bool));
+    for (int i = 0; i < count; i++) {
+        int32_t id = ids[i];
+        if (!_switch_can_write[id] || _switch_automatic[id]) {
+            ESP_LOGW(TAG, "Cannot set switch %ld - switch is read-only", id);
+            return ALPACA_ERR_INVALID_OPERATION;
+        }
+        if (!isfinite(values[i]) || values[i] < _min_switch_values[id] || values[i] > _max_switch_values[id]) {
+            ESP_LOGW(TAG, "Invalid switch %ld value: %f (range: %f to %f)",
+                     id, values[i], _min_switch_values[id], _max_switch_values[id]);
+            return ALPACA_ERR_INVALID_VALUE;
+        }
+        _next_states[id] = values[i] > 0;
+    }
+    
+    _rules_evaluated = 0;
+    _rules_forced = 0;
+    int32_t refused;
+    const switch_rule_t* rule = _rules.checkTransition(ids, count, _switch_states, _next_states,
+                                                       &_rules_evaluated, &refused);
+    if (rule != NULL) {
+        ESP_LOGW(TAG, "Switch %ld may not turn %s while switch %d is %s", refused,
+                 _next_states[refused] ? "on" : "off", rule->trigger,
+                 (rule->flags & SWITCH_RULE_TRIGGER_ON) ? "on" : "off");
+        recordRules(start_us, true);
+        return ALPACA_ERR_INVALID_OPERATION;
+    }
+    
+    // Make the settings, then run the force rules of those that changed state
+    beginBatch();
+    for (int i = 0; i < count; i++) {
+        int32_t id = ids[i];
+        _next_changed[i] = _switch_states[id] != _next_states[id];
+        if (_switch_values[id] == values[i]) {
+            continue;
+        }
+        _switch_values[id] = values[i];
+        setOutput(id, _next_states[id]);
+        notifyChange(id);
+        (*changed)++;
+    }
+    for (int i = 0; i < count; i++) {
+        if (_next_changed[i]) {
+            applyRules(ids[i], 1);
+        }
+    }
+    endBatch();
+    
+    recordRules(start_us, false);
+    return ALPACA_OK;
+}
+
+esp_err_t AlpacaSwitch::saveScene(const char* name, const int* ids, int count)
+{
+    int* scene_ids = new int[_num_switches];
+    double* scene_values = new double[_num_switches];
+    
+    xSemaphoreTakeRecursive(_lock, portMAX_DELAY);
+    int scene_count = 0;
+    esp_err_t err = ALPACA_OK;
+    if (count == 0) {
+        // Every switch a client could set
+        for (int id = 0; id < _num_switches; id++) {
+            if (_switch_can_write[id] && !_switch_automatic[id]) {
+                scene_ids[scene_count] = id;
+                scene_values[scene_count] = _switch_values[id];
+                scene_count++;
+            }
+        }
+    } else {
+        for (int i = 0; i < count && err == ALPACA_OK; i++) {
+            int id = ids[i];
+            if (!_switch_can_write[id] || _switch_automatic[id]) {
+                err = ALPACA_ERR_INVALID_OPERATION;
+            }
+            scene_ids[i] = id;
+            scene_values[i] = _switch_values[id];
+        }
+        scene_count = count;
+    }
+    xSemaphoreGiveRecursive(_lock);
+    
+    if (err == ALPACA_OK) {
+        err = editScenes(name, scene_ids, scene_values, scene_count, false);
+    }
+    delete[] scene_ids;
+    delete[] scene_values;
+    return err;
+}
+
+esp_err_t AlpacaSwitch::deleteScene(const char* name)
+{
+    return editScenes(name, NULL, NULL, 0, true);
+}
+
+esp_err_t AlpacaSwitch::editScenes(const char* name, const int* ids, const double* values, int count, bool remove)
+{
+    // Edits are made to a copy and saved before they take effect, so the
+    // switches are not held up by the NVS write
+    xSemaphoreTake(_scene_lock, portMAX_DELAY);
+    SwitchScenes* updated = new SwitchScenes();
+    xSemaphoreTakeRecursive(_lock, portMAX_DELAY);
+    *updated = _scenes;
+    xSemaphoreGiveRecursive(_lock);
+    
+    esp_err_t err = remove ? updated->remove(name) : updated->set(name, ids, values, count, _num_switches);
+    if (err == ESP_OK) {
+        err = SwitchStorage::saveScenes(updated);
+        if (err == ESP_OK) {
+            xSemaphoreTakeRecursive(_lock, portMAX_DELAY);
+            _scenes = *updated;
+            xSemaphoreGiveRecursive(_lock);
+            ESP_LOGI(TAG, "Scene %s %s", name, remove ? "deleted" : "saved");
+        } else {
+            err = ALPACA_ERR_INVALID_OPERATION;
+        }
+    } else if (err == ESP_ERR_NO_MEM) {
+        ESP_LOGW(TAG, "No room for scene %s", name);
+        err = ALPACA_ERR_INVALID_OPERATION;
+    } else {
+        err = ALPACA_ERR_INVALID_VALUE;
+    }
+    delete updated;
+    xSemaphoreGive(_scene_lock);
+    return err;
+}
+
+esp_err_t AlpacaSwitch::parseSceneParameters(const char* parameters, char* name, int* ids, int max_ids, int* count)
+{
+    *count = 0;
+    if (parameters == NULL) {
+        return ALPACA_ERR_INVALID_VALUE;
+    }
+    
+    const char* colon = strchr(parameters, ':');
+    size_t name_len = colon != NULL ? (size_t)(colon - parameters) : strlen(parameters);
+    if (name_len == 0 || name_len >= SWITCH_SCENE_NAME_LEN) {
+        return ALPACA_ERR_INVALID_VALUE;
+    }
+    memcpy(name, parameters, name_len);
+    name[name_len] = '\0';
+    if (colon == NULL) {
+        return ALPACA_OK;
+    }
+    
+    // Switch ids, comma separated
+    const char* p = colon + 1;
+    while (*p != '\0') {
+        char* end;
+        long id = strtol(p, &end, 10);
+        if (end == p || id < 0 || id >= max_ids || *count >= max_ids || (*end != ',' && *end != '\0')) {
+            return ALPACA_ERR_INVALID_VALUE;
+        }
+        ids[(*count)++] = (int)id;
+        p = *end == ',' ? end + 1 : end;
+    }
+    return *count > 0 ? ALPACA_OK : ALPACA_ERR_INVALID_VALUE;
+}
@@ -4,6 +4,22 @@
 
 #include <alpaca_server/api.h>
 #include <driver/gpio.h>
+#include <esp_timer.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/semphr.h>
+#include <freertos/task.h>
+#include <atomic>
+#include "switch_rules.h"
+#include "switch_scenes.h"
+#include "output_drivers.h"
+#include "config.h"
+
+// Further pins one switch drives together with its own, as stored in NVS
+typedef struct {
+    uint8_t count;                          // Pins used below
+    int8_t pins[SWITCH_GANG_MAX_PINS - 1];  // In switch-on order, after gpio_pin
+    uint16_t delay_ms;                      // Between pins; 0 switches them at once
+} switch_gang_t;
 
 // Switch configuration struct
 typedef struct {
@@ -15,12 +31,41 @@ typedef struct {
     double max_value;       // Maximum value
     double step;            // Step value
     bool can_write;         // Whether the switch can be modified
+    switch_gang_t gang;     // Further pins, when one switch drives several
+    bool restored;          // Start at state and value below instead of normally_on
+    bool state;             // State saved before the last reset
+    double value;           // Value saved before the last reset
 } switch_config_t;
 
+// One switch change, as delivered to change listeners
+typedef struct {
+    int32_t id;
+    bool state;
+    double value;
+} switch_change_t;
+
+// Wear of one switch's relay, as stored in NVS
+typedef struct {
+    uint32_t cycles;            // Times switched on
+    uint32_t on_seconds;        // Time spent on
+} relay_counter_t;
+
+// Receives switch changes on the task that made them. Runs inside the
+// switch update path, so it must not block.
+typedef void (*switch_listener_fn_t)(void* ctx, const switch_change_t* changes, int count);
+
+// Maximum number of change listeners
+#define SWITCH_MAX_LISTENERS 6
+
+// Changes delivered per listener call when a batch is flushed
+#define SWITCH_MAX_BATCH 16
+
 class AlpacaSwitch : public AlpacaServer::Switch
 {
 public:
-    AlpacaSwitch(const switch_config_t* configs, int num_switches);
+    // Switch pins below OUTPUT_EXPANDER_PIN_BASE are GPIOs; those from it
+    // on are channels of expander, which may be NULL when there is none
+    AlpacaSwitch(const switch_config_t* configs, int num_switches, OutputBackend* expander = NULL);
     ~AlpacaSwitch();
 
 public:
@@ -52,7 +97,99 @@ public:
     virtual esp_err_t put_setswitchvalue(int32_t id, double value) override;
     virtual esp_err_t get_switchstep(int32_t id, double *switchstep) override;
 
+    // Register a listener for switch state and value changes
+    esp_err_t addChangeListener(switch_listener_fn_t listener, void* ctx);
+
+    // Group the changes made until endBatch() into one notification. The
+    // device stays locked to the calling task until endBatch(), so other
+    // tasks' changes never land in the batch.
+    void beginBatch();
+    void endBatch();
+
+    // Replace the interlock and automation rules. Setters refuse a change
+    // an inhibit rule forbids; a change that triggers force rules sets
+    // their targets, cascading up to SWITCH_RULES_MAX_DEPTH deep.
+    void setRules(const SwitchRules& rules);
+
+    // Check, without setting it, whether switch id may enter state now:
+    // the same checks put_setswitch makes
+    esp_err_t checkWrite(int32_t id, bool state);
+
+    // Hand switch id to a control loop, or give it back. While automatic
+    // the switch reports CanWrite false and refuses writes from clients;
+    // the loop sets it with setAutomaticValue().
+    void setAutomatic(int32_t id, bool automatic);
+    bool isAutomatic(int32_t id);
+
+    // Set an automatic switch's value, clamped to its range. Rules still apply.
+    esp_err_t setAutomaticValue(int32_t id, double value);
+
+    // Cycles and on-time of the relay on switch id, counted since the
+    // counters from NVS were added; ESP_ERR_NOT_FOUND for a switch
+    // without an output
+    esp_err_t getRelayCounter(int32_t id, relay_counter_t* counter);
+
+    // Add the counters saved by earlier boots, one per switch
+    void addRelayCounters(const relay_counter_t* counters, int count);
+
+    // Further pins switch id drives; count is 0 for a single pin
+    esp_err_t getGang(int32_t id, switch_gang_t* gang);
+
+    // Replace the scenes
+    void setScenes(const SwitchScenes& scenes);
+
+    // Set every switch in the named scene in one transition. All its
+    // settings are checked first, the rules against the states the scene
+    // leaves, and either all are made or none; listeners get one batch.
+    esp_err_t applyScene(const char* name);
+
+    // Set switches ids to values in one transition, as a scene does. Each
+    // value is checked like put_setswitchvalue() checks it, the rules
+    // against the states all of them leave, and either all are made or
+    // none; listeners get one batch.
+    esp_err_t setValues(const int32_t* ids, const double* values, int count);
+
+    // Store the current values of switches ids as a scene, or of every
+    // writable switch when count is 0, and save the scenes to NVS
+    esp_err_t saveScene(const char* name, const int* ids, int count);
+    esp_err_t deleteScene(const char* name);
+
 private:
+    // Drive switch id's output to state, counting relay cycles and on-time
+    void setOutput(int32_t id, bool state);
+    void writePins(int32_t id, bool state, bool sequence);
+    bool stepGang(int32_t id, bool state);
+    static void gangTimer(void* arg);
+    static void gangTask(void* arg);
+    bool claimPin(int32_t id, int pin);
+    void flushOutputs(bool now);
+
+    // Set a validated value and the state that follows from it
+    esp_err_t writeValue(int32_t id, double value);
+
+    // Check and make settings together, with the device locked; *changed
+    // counts the switches whose value changed
+    esp_err_t transition(const int32_t* ids, const double* values, int count, int64_t start_us, int* changed);
+
+    // Report a change to the listeners, or hold it for the open batch
+    void notifyChange(int32_t id);
+    void deliver(const switch_change_t* changes, int count);
+
+    // Whether the rules let switch id enter state, counting the work
+    bool rulesAllow(int32_t id, bool state);
+
+    // Run the force rules for a switch that just changed state
+    void applyRules(int32_t id, int depth);
+
+    // Report the rule work of one write to the metrics
+    void recordRules(int64_t start_us, bool refused);
+
+    // Apply a change to the scenes and save them, outside the switch lock
+    esp_err_t editScenes(const char* name, const int* ids, const double* values, int count, bool remove);
+
+    // Scene parameter "name" or "name:id,id,...", split into name and ids
+    static esp_err_t parseSceneParameters(const char* parameters, char* name, int* ids, int max_ids, int* count);
+
     bool _connected;
     int _num_switches;
     
@@ -61,12 +198,65 @@ private:
     char **_switch_descriptions;
     double *_switch_values;
     bool *_switch_can_write;
+    bool *_switch_automatic;
     double *_min_switch_values;
     double *_max_switch_values;
     double *_switch_steps;
     
     // GPIO pins for the switches
     int *_switch_pins;
+    switch_gang_t *_switch_gangs;
+    uint64_t *_gpio_masks;          // Every pin of each switch, for masked writes
+    uint64_t *_expander_masks;
+    GpioOutput _gpio;
+    OutputBackend *_expander;
+    bool _expander_failing;
+
+    // A gang with a delay steps through its pins from a timer, taking the
+    // lock for one pin at a time rather than for the whole sequence. The
+    // timer only wakes the gang task, which takes the steps.
+    struct GangSequence {
+        AlpacaSwitch *device;
+        int32_t id;
+        uint8_t on;                 // Pins on, always the first in switch-on order
+        bool running;               // The timer takes the next step
+        std::atomic<bool> due;      // The timer has fired, the step is not taken yet
+        esp_timer_handle_t timer;   // NULL unless the gang has a delay
+    };
+    GangSequence *_gang_sequences;
+    TaskHandle_t _gang_task;        // NULL until a gang has a delay
+
+    // Relay wear: times switched on, ticks on before the current period,
+    // and when the current period began
+    uint32_t *_relay_cycles;
+    uint64_t *_relay_on_ticks;
+    TickType_t *_relay_on_since;
+
+    // Change listeners and the batch being collected for them
+    switch_listener_fn_t _listeners[SWITCH_MAX_LISTENERS];
+    void *_listener_ctx[SWITCH_MAX_LISTENERS];
+    int _num_listeners;
+    int _batch_depth;
+    bool *_batch_pending;
+
+    // Interlock and automation rules, and the work done for the current write
+    SwitchRules _rules;
+    int _rules_evaluated;
+    int _rules_forced;
+
+    // Scenes, with room for the settings of one
+    SwitchScenes _scenes;
+    int32_t *_scene_ids;
+    double *_scene_values;
+    SemaphoreHandle_t _scene_lock;
+
+    // Room to work out the states a transition leaves
+    bool *_next_states;
+    bool *_next_changed;
+
+    // Guards switch state, the rules and the open batch; switches are set
+    // from the HTTP server and other tasks such as the MQTT client
+    SemaphoreHandle_t _lock;
 };
 
 #endif // ALPACA_SWITCH_H
\ No newline at end of file
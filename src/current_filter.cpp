@@ -0,0 +1,168 @@
+#include "current_filter.h"
+#include <math.h>
+#include <string.h>
+
+void current_block_stats(const int16_t* samples, int n, current_block_t* block) {
+    int32_t sum = 0;
+    int32_t sum_squares = 0;
+    int16_t min = INT16_MAX;
+    int16_t max = INT16_MIN;
+    for (int i = 0; i < n; i++) {
+        int32_t sample = samples[i];
+        sum += sample;
+        sum_squares += sample * sample;
+        min = samples[i] < min ? samples[i] : min;
+        max = samples[i] > max ? samples[i] : max;
+    }
+    block->sum = sum;
+    block->sum_squares = sum_squares;
+    block->min = min;
+    block->max = max;
+}
+
+CurrentPipeline::CurrentPipeline() : _count(0), _samples(0) {
+    memset(_index, -1, sizeof(_index));
+}
+
+bool CurrentPipeline::configure(const current_channel_config_t* channels, int count) {
+    if (count < 0 || count > CURRENT_MAX_CHANNELS) {
+        return false;
+    }
+
+    int8_t index[16];
+    memset(index, -1, sizeof(index));
+    for (int i = 0; i < count; i++) {
+        uint8_t adc_channel = channels[i].adc_channel;
+        if (adc_channel >= 16 || index[adc_channel] >= 0) {
+            return false;
+        }
+        index[adc_channel] = (int8_t)i;
+    }
+
+    memcpy(_index, index, sizeof(_index));
+    memset(_channels, 0, sizeof(_channels));
+    for (int i = 0; i < count; i++) {
+        _channels[i].config = channels[i];
+    }
+    _count = count;
+    _samples = 0;
+    return true;
+}
+
+void CurrentPipeline::ingest(const uint8_t* data, size_t len) {
+    for (size_t offset = 0; offset + CURRENT_SAMPLE_BYTES <= len; offset += CURRENT_SAMPLE_BYTES) {
+        uint16_t word = (uint16_t)(data[offset] | (data[offset + 1] << 8));
+        int index = _index[word >> 12];
+        if (index < 0) {
+            continue;
+        }
+
+        // Samples collect per channel until a block is full; the block is
+        // then reduced in one pass and replaces the oldest in the window
+        Channel& channel = _channels[index];
+        channel.staging[channel.staged++] = (int16_t)(word & 0x0FFF);
+        if (channel.staged < CURRENT_SENSE_BLOCK_SAMPLES) {
+            continue;
+        }
+        channel.staged = 0;
+        _samples += CURRENT_SENSE_BLOCK_SAMPLES;
+
+        current_block_t block;
+        current_block_stats(channel.staging, CURRENT_SENSE_BLOCK_SAMPLES, &block);
+        if (channel.filled == CURRENT_SENSE_WINDOW_BLOCKS) {
+            const current_block_t& oldest = channel.blocks[channel.next];
+            channel.sum -= oldest.sum;
+            channel.sum_squares -= oldest.sum_squares;
+        } else {
+            channel.filled++;
+        }
+        channel.blocks[channel.next] = block;
+        channel.sum += block.sum;
+        channel.sum_squares += block.sum_squares;
+        channel.next = (channel.next + 1) % CURRENT_SENSE_WINDOW_BLOCKS;
+    }
+}
+
+void CurrentPipeline::reading(int index, current_reading_t* reading) const {
+    reading->rms = 0.0f;
+    reading->peak = 0.0f;
+    reading->valid = false;
+    if (index < 0 || index >= _count || _channels[index].filled == 0) {
+        return;
+    }
+
+    const Channel& channel = _channels[index];
+    const current_channel_config_t& config = channel.config;
+    int16_t min = INT16_MAX;
+    int16_t max = INT16_MIN;
+    for (int i = 0; i < channel.filled; i++) {
+        min = channel.blocks[i].min < min ? channel.blocks[i].min : min;
+        max = channel.blocks[i].max > max ? channel.blocks[i].max : max;
+    }
+
+    // Worked in codes and scaled once: the calibration is linear, so
+    // amps are codes times volts_per_code times amps_per_volt about the
+    // code for zero current, or about the mean for AC loads
+    double n = (double)channel.filled * CURRENT_SENSE_BLOCK_SAMPLES;
+    double mean = channel.sum / n;
+    double mean_square = channel.sum_squares / n;
+    double zero = config.ac ? mean : (config.zero_volts - config.volts_offset) / config.volts_per_code;
+    double variance = mean_square - 2.0 * zero * mean + zero * zero;
+    double excursion = fmax(fabs(max - zero), fabs(zero - min));
+    double scale = fabs((double)config.volts_per_code * config.amps_per_volt);
+
+    reading->rms = (float)(sqrt(variance > 0.0 ? variance : 0.0) * scale);
+    reading->peak = (float)(excursion * scale);
+    reading->valid = channel.filled == CURRENT_SENSE_WINDOW_BLOCKS;
+}
+
+CurrentFaultDetector::CurrentFaultDetector()
+    : _min_amps(0.0f), _max_amps(0.0f), _switched_on(false), _switched_ms(0), _conditions(0), _faults(0) {
+    memset(_changed_ms, 0, sizeof(_changed_ms));
+}
+
+void CurrentFaultDetector::configure(float min_amps, float max_amps) {
+    _min_amps = min_amps;
+    _max_amps = max_amps;
+}
+
+uint8_t CurrentFaultDetector::update(uint32_t now_ms, bool switched_on, const current_reading_t& reading) {
+    if (switched_on != _switched_on) {
+        _switched_on = switched_on;
+        _switched_ms = now_ms;
+    }
+    if (!reading.valid) {
+        return _faults;
+    }
+
+    // Open load and stuck on are judged only once the relay and the
+    // window have settled; until then they keep their last state
+    uint8_t conditions = _conditions & (CURRENT_FAULT_OPEN_LOAD | CURRENT_FAULT_STUCK_ON);
+    if (now_ms - _switched_ms >= CURRENT_SENSE_SETTLE_MS) {
+        conditions = 0;
+        if (switched_on && reading.rms < _min_amps) {
+            conditions |= CURRENT_FAULT_OPEN_LOAD;
+        }
+        if (!switched_on && reading.rms >= _min_amps) {
+            conditions |= CURRENT_FAULT_STUCK_ON;
+        }
+    }
+    if (_max_amps > 0.0f && reading.peak > _max_amps) {
+        conditions |= CURRENT_FAULT_OVERCURRENT;
+    }
+
+    for (int bit = 0; bit < 3; bit++) {
+        uint8_t flag = 1 << bit;
+        if ((conditions ^ _conditions) & flag) {
+            _changed_ms[bit] = now_ms;
+        }
+        bool held = now_ms - _changed_ms[bit] >= CURRENT_SENSE_FAULT_MS;
+        if ((conditions & flag) && (held || flag == CURRENT_FAULT_OVERCURRENT)) {
+            _faults |= flag;
+        } else if (!(conditions & flag) && held) {
+            _faults &= ~flag;
+        }
+    }
+    _conditions = conditions;
+    return _faults;
+}
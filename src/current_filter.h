@@ -0,0 +1,133 @@
+#ifndef CURRENT_FILTER_H
+#define CURRENT_FILTER_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include "config.h"
+
+// Current sensing pipeline: ADC DMA frames in, RMS and peak current per
+// channel out. Kept free of ESP-IDF so recorded captures can be replayed
+// through it on the host (tools/current_replay.cpp).
+
+// Most channels one pipeline takes
+#define CURRENT_MAX_CHANNELS 4
+
+// Sample words are 16 bits, ESP32 "type 1" DMA format: 12 data bits,
+// then the 4-bit ADC channel, little-endian
+#define CURRENT_SAMPLE_BYTES 2
+
+// Block sums of squares are 32-bit: 12-bit codes allow 128 samples
+#if CURRENT_SENSE_BLOCK_SAMPLES > 128
+#error "CURRENT_SENSE_BLOCK_SAMPLES must be at most 128"
+#endif
+
+// Fault flags
+#define CURRENT_FAULT_OPEN_LOAD 0x01     // Switched on, but no current flows
+#define CURRENT_FAULT_STUCK_ON 0x02      // Switched off, but current still flows
+#define CURRENT_FAULT_OVERCURRENT 0x04   // Peak above the channel's limit
+
+// Aggregates of one block of samples, in ADC codes
+typedef struct {
+    int32_t sum;
+    int32_t sum_squares;
+    int16_t min;
+    int16_t max;
+} current_block_t;
+
+// Sum, sum of squares, minimum and maximum of n samples. Straight loops
+// over a contiguous array without branches, so the compiler can
+// vectorise them where the target has SIMD.
+void current_block_stats(const int16_t* samples, int n, current_block_t* block);
+
+// How one channel's codes become amps
+typedef struct {
+    uint8_t adc_channel;        // ADC1 channel in the sample words
+    bool ac;                    // AC load: measure about the window mean
+    float volts_per_code;       // ADC calibration, linear
+    float volts_offset;
+    float amps_per_volt;        // Current sensor gain
+    float zero_volts;           // Sensor output at zero current (DC loads)
+} current_channel_config_t;
+
+// Header in front of a raw capture: the channels as the device had
+// them configured, so a replay converts codes to amps the same way. The
+// raw DMA bytes follow it. Little-endian, laid out alike on the ESP32
+// and on 32 and 64-bit hosts.
+#define CURRENT_CAPTURE_MAGIC 0x31534343   // "CCS1"
+
+typedef struct {
+    uint32_t magic;
+    uint32_t sample_rate_hz;    // ADC conversions per second, all channels
+    uint32_t channels;
+    current_channel_config_t channel[CURRENT_MAX_CHANNELS];
+} current_capture_header_t;
+
+// One channel's result over the sliding window
+typedef struct {
+    float rms;                  // A
+    float peak;                 // A, largest excursion from zero (or the mean, AC)
+    bool valid;                 // A full window has been seen
+} current_reading_t;
+
+// Demultiplexes DMA frames into per-channel blocks and keeps a sliding
+// window of CURRENT_SENSE_WINDOW_BLOCKS blocks per channel. Window sums
+// are exact integers, added and removed a block at a time, so the
+// window never drifts however long it runs.
+class CurrentPipeline {
+public:
+    CurrentPipeline();
+
+    // Set up the channels and empty the windows; false for more than
+    // CURRENT_MAX_CHANNELS channels or one ADC channel used twice
+    bool configure(const current_channel_config_t* channels, int count);
+
+    // Feed raw DMA bytes; words for unknown channels are skipped
+    void ingest(const uint8_t* data, size_t len);
+
+    void reading(int channel, current_reading_t* reading) const;
+
+    int channelCount() const { return _count; }
+    uint32_t samples() const { return _samples; }
+
+private:
+    struct Channel {
+        current_channel_config_t config;
+        int16_t staging[CURRENT_SENSE_BLOCK_SAMPLES];
+        int staged;
+        current_block_t blocks[CURRENT_SENSE_WINDOW_BLOCKS];
+        int next;
+        int filled;
+        int64_t sum;
+        int64_t sum_squares;
+    };
+
+    Channel _channels[CURRENT_MAX_CHANNELS];
+    int _count;
+    int8_t _index[16];          // Pipeline channel for each ADC channel, or -1
+    uint32_t _samples;
+};
+
+// Debounced fault detection for one channel. Open load and stuck on are
+// only judged CURRENT_SENSE_SETTLE_MS after the relay last switched,
+// and must hold for CURRENT_SENSE_FAULT_MS; overcurrent is flagged at
+// once. Every flag clears after CURRENT_SENSE_FAULT_MS without it.
+class CurrentFaultDetector {
+public:
+    CurrentFaultDetector();
+
+    void configure(float min_amps, float max_amps);
+
+    // Evaluate one reading; returns the current fault flags
+    uint8_t update(uint32_t now_ms, bool switched_on, const current_reading_t& reading);
+
+private:
+    float _min_amps;
+    float _max_amps;
+    bool _switched_on;
+    uint32_t _switched_ms;
+    uint32_t _changed_ms[3];    // When each condition last changed
+    uint8_t _conditions;
+    uint8_t _faults;
+};
+
+#endif // CURRENT_FILTER_H
@@ -0,0 +1,386 @@
+#include "current_sense.h"
+#include "config.h"
+#include <esp_adc/adc_cali.h>
+#include <esp_adc/adc_cali_scheme.h>
+#include <esp_adc/adc_continuous.h>
+#include <esp_attr.h>
+#include <esp_log.h>
+#include <esp_timer.h>
+#include <math.h>
+#include <stdio.h>
+#include <string.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/semphr.h>
+#include <freertos/task.h>
+
+static const char* TAG = "current_sense";
+
+static_assert(CURRENT_SENSE_CHANNELS <= CURRENT_MAX_CHANNELS, "Too many current sense channels");
+
+// DMA frames of 128 conversions, 6.4 ms at the default rate; the pool
+// holds four, so the task can fall behind by 25 ms before data is lost
+#define CURRENT_FRAME_BYTES 256
+#define CURRENT_POOL_BYTES (4 * CURRENT_FRAME_BYTES)
+
+// ADC1 at 12 dB attenuation reads up to about 3.1 V
+#define CURRENT_NOMINAL_FULL_SCALE_V 3.1f
+#define CURRENT_MAX_CODE 4095
+
+// Current switches read in 10 mA steps, up to twice the overcurrent
+// limit; the fault switch holds the CURRENT_FAULT_* flags
+#define CURRENT_SWITCH_STEP 0.01
+#define CURRENT_FAULT_FLAGS_MAX 7
+
+static AlpacaSwitch* s_device = NULL;
+static int32_t s_first_switch = 0;
+static adc_continuous_handle_t s_adc = NULL;
+
+// Used by the sample task only
+static CurrentPipeline s_pipeline;
+static CurrentFaultDetector s_detectors[CURRENT_SENSE_CHANNELS];
+static double s_published[CURRENT_SENSE_SWITCHES];
+
+// Shared with the HTTP server and metrics
+static SemaphoreHandle_t s_lock = NULL;
+static current_channel_config_t s_channels[CURRENT_SENSE_CHANNELS];
+static current_channel_status_t s_status[CURRENT_SENSE_CHANNELS];
+static uint32_t s_samples = 0;
+static uint64_t s_process_us = 0;
+static volatile uint32_t s_overruns = 0;
+static bool s_running = false;
+
+// Capture in progress: the sample task copies DMA data here and gives
+// s_capture_done when it is full
+static uint8_t* s_capture_buf = NULL;
+static size_t s_capture_len = 0;
+static size_t s_capture_pos = 0;
+static SemaphoreHandle_t s_capture_done = NULL;
+
+// Names and descriptions outlive the configs handed to the device
+static char s_names[CURRENT_SENSE_SWITCHES][32];
+static char s_descriptions[CURRENT_SENSE_SWITCHES][96];
+
+// The DMA pool was full and conversions were dropped
+static bool IRAM_ATTR on_pool_overflow(adc_continuous_handle_t handle, const adc_continuous_evt_data_t* edata,
+                                       void* user_data) {
+    s_overruns++;
+    return false;
+}
+
+// Linear code to volts conversion from the eFuse calibration, or the
+// nominal full scale if the chip has none
+static void calibrate(float* volts_per_code, float* volts_offset) {
+    *volts_per_code = CURRENT_NOMINAL_FULL_SCALE_V / CURRENT_MAX_CODE;
+    *volts_offset = 0.0f;
+
+#if ADC_CALI_SCHEME_LINE_FITTING_SUPPORTED
+    adc_cali_line_fitting_config_t config = {};
+    config.unit_id = ADC_UNIT_1;
+    config.atten = ADC_ATTEN_DB_12;
+    config.bitwidth = ADC_BITWIDTH_12;
+    adc_cali_handle_t cali;
+    if (adc_cali_create_scheme_line_fitting(&config, &cali) != ESP_OK) {
+        ESP_LOGW(TAG, "No ADC calibration, using nominal full scale");
+        return;
+    }
+    int low_mv;
+    int high_mv;
+    if (adc_cali_raw_to_voltage(cali, 0, &low_mv) == ESP_OK &&
+        adc_cali_raw_to_voltage(cali, CURRENT_MAX_CODE, &high_mv) == ESP_OK) {
+        *volts_per_code = (high_mv - low_mv) / 1000.0f / CURRENT_MAX_CODE;
+        *volts_offset = low_mv / 1000.0f;
+    }
+    adc_cali_delete_scheme_line_fitting(cali);
+#endif
+}
+
+void CurrentSense::getSwitchConfig(int index, switch_config_t* config) {
+    int channel = index / CURRENT_SENSE_SWITCHES_PER_CHANNEL;
+    int relay = CURRENT_SENSE_SWITCH[channel];
+
+    config->gpio_pin = -1;
+    config->normally_on = false;
+    config->min_value = 0.0;
+    config->can_write = false;
+    switch (index % CURRENT_SENSE_SWITCHES_PER_CHANNEL) {
+    case 0:
+        snprintf(s_names[index], sizeof(s_names[index]), "Load %d current", relay);
+        snprintf(s_descriptions[index], sizeof(s_descriptions[index]), "RMS current of switch %d, A", relay);
+        config->max_value = 2.0 * CURRENT_SENSE_MAX_AMPS[channel];
+        config->step = CURRENT_SWITCH_STEP;
+        break;
+    case 1:
+        snprintf(s_names[index], sizeof(s_names[index]), "Load %d peak", relay);
+        snprintf(s_descriptions[index], sizeof(s_descriptions[index]), "Peak current of switch %d, A", relay);
+        config->max_value = 2.0 * CURRENT_SENSE_MAX_AMPS[channel];
+        config->step = CURRENT_SWITCH_STEP;
+        break;
+    default:
+        snprintf(s_names[index], sizeof(s_names[index]), "Load %d faults", relay);
+        snprintf(s_descriptions[index], sizeof(s_descriptions[index]),
+                 "Faults on switch %d: 1 open load, 2 stuck on, 4 overcurrent", relay);
+        config->max_value = CURRENT_FAULT_FLAGS_MAX;
+        config->step = 1.0;
+        break;
+    }
+    config->name = s_names[index];
+    config->description = s_descriptions[index];
+}
+
+esp_err_t CurrentSense::start(AlpacaSwitch* device, int32_t first_switch) {
+    int32_t num_switches;
+    device->get_maxswitch(&num_switches);
+    if (first_switch + CURRENT_SENSE_SWITCHES > num_switches) {
+        ESP_LOGE(TAG, "Current switches %d to %d do not exist", (int)first_switch,
+                 (int)(first_switch + CURRENT_SENSE_SWITCHES - 1));
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    float volts_per_code;
+    float volts_offset;
+    calibrate(&volts_per_code, &volts_offset);
+    for (int i = 0; i < CURRENT_SENSE_CHANNELS; i++) {
+        if (CURRENT_SENSE_SWITCH[i] < 0 || CURRENT_SENSE_SWITCH[i] >= first_switch) {
+            ESP_LOGE(TAG, "Channel %d measures switch %d, which is not a relay", i, CURRENT_SENSE_SWITCH[i]);
+            return ESP_ERR_INVALID_ARG;
+        }
+        s_channels[i].adc_channel = (uint8_t)CURRENT_SENSE_ADC_CHANNEL[i];
+        s_channels[i].ac = CURRENT_SENSE_AC[i];
+        s_channels[i].volts_per_code = volts_per_code;
+        s_channels[i].volts_offset = volts_offset;
+        s_channels[i].amps_per_volt = CURRENT_SENSE_AMPS_PER_VOLT[i];
+        s_channels[i].zero_volts = CURRENT_SENSE_ZERO_VOLTS[i];
+        s_detectors[i].configure(CURRENT_SENSE_MIN_AMPS[i], CURRENT_SENSE_MAX_AMPS[i]);
+        s_status[i].monitored_switch = CURRENT_SENSE_SWITCH[i];
+    }
+    if (!s_pipeline.configure(s_channels, CURRENT_SENSE_CHANNELS)) {
+        ESP_LOGE(TAG, "Invalid ADC channel table");
+        return ESP_ERR_INVALID_ARG;
+    }
+    s_device = device;
+    s_first_switch = first_switch;
+
+    s_lock = xSemaphoreCreateMutex();
+    s_capture_done = xSemaphoreCreateBinary();
+    if (s_lock == NULL || s_capture_done == NULL) {
+        return ESP_ERR_NO_MEM;
+    }
+
+    adc_continuous_handle_cfg_t handle_config = {};
+    handle_config.max_store_buf_size = CURRENT_POOL_BYTES;
+    handle_config.conv_frame_size = CURRENT_FRAME_BYTES;
+    esp_err_t err = adc_continuous_new_handle(&handle_config, &s_adc);
+    if (err != ESP_OK) {
+        return err;
+    }
+
+    // One conversion per channel in turn, 12-bit, 0 to about 3.1 V
+    adc_digi_pattern_config_t pattern[CURRENT_SENSE_CHANNELS] = {};
+    for (int i = 0; i < CURRENT_SENSE_CHANNELS; i++) {
+        pattern[i].atten = ADC_ATTEN_DB_12;
+        pattern[i].channel = CURRENT_SENSE_ADC_CHANNEL[i];
+        pattern[i].unit = ADC_UNIT_1;
+        pattern[i].bit_width = ADC_BITWIDTH_12;
+    }
+    adc_continuous_config_t config = {};
+    config.pattern_num = CURRENT_SENSE_CHANNELS;
+    config.adc_pattern = pattern;
+    config.sample_freq_hz = CURRENT_SENSE_SAMPLE_RATE_HZ;
+    config.conv_mode = ADC_CONV_SINGLE_UNIT_1;
+    config.format = ADC_DIGI_OUTPUT_FORMAT_TYPE1;
+    err = adc_continuous_config(s_adc, &config);
+    if (err != ESP_OK) {
+        return err;
+    }
+
+    adc_continuous_evt_cbs_t callbacks = {};
+    callbacks.on_pool_ovf = on_pool_overflow;
+    err = adc_continuous_register_event_callbacks(s_adc, &callbacks, NULL);
+    if (err != ESP_OK) {
+        return err;
+    }
+
+    for (int i = 0; i < CURRENT_SENSE_SWITCHES; i++) {
+        device->setAutomatic(first_switch + i, true);
+        s_published[i] = 0.0;
+    }
+
+    err = adc_continuous_start(s_adc);
+    if (err != ESP_OK) {
+        return err;
+    }
+    if (xTaskCreatePinnedToCore(sampleTask, "current_sense", 4096, NULL, CURRENT_SENSE_TASK_PRIORITY, NULL,
+                                CURRENT_SENSE_TASK_CORE) != pdPASS) {
+        ESP_LOGE(TAG, "Failed to create sample task");
+        adc_continuous_stop(s_adc);
+        return ESP_ERR_NO_MEM;
+    }
+    s_running = true;
+
+    ESP_LOGI(TAG, "%d current channels at %d Hz, switches %d to %d", CURRENT_SENSE_CHANNELS,
+             CURRENT_SENSE_SAMPLE_RATE_HZ / CURRENT_SENSE_CHANNELS, (int)first_switch,
+             (int)(first_switch + CURRENT_SENSE_SWITCHES - 1));
+    return ESP_OK;
+}
+
+bool CurrentSense::running() {
+    return s_running;
+}
+
+void CurrentSense::getStatus(int channel, current_channel_status_t* status) {
+    if (s_lock == NULL || channel < 0 || channel >= CURRENT_SENSE_CHANNELS) {
+        memset(status, 0, sizeof(*status));
+        return;
+    }
+
+    xSemaphoreTake(s_lock, portMAX_DELAY);
+    *status = s_status[channel];
+    xSemaphoreGive(s_lock);
+}
+
+uint32_t CurrentSense::samples() {
+    if (s_lock == NULL) {
+        return 0;
+    }
+    xSemaphoreTake(s_lock, portMAX_DELAY);
+    uint32_t samples = s_samples;
+    xSemaphoreGive(s_lock);
+    return samples;
+}
+
+uint32_t CurrentSense::overruns() {
+    return s_overruns;
+}
+
+uint64_t CurrentSense::processUs() {
+    if (s_lock == NULL) {
+        return 0;
+    }
+    xSemaphoreTake(s_lock, portMAX_DELAY);
+    uint64_t process_us = s_process_us;
+    xSemaphoreGive(s_lock);
+    return process_us;
+}
+
+esp_err_t CurrentSense::capture(uint8_t* buf, size_t len, size_t* captured) {
+    if (s_lock == NULL) {
+        return ESP_ERR_INVALID_STATE;
+    }
+    if (len <= sizeof(current_capture_header_t)) {
+        return ESP_ERR_INVALID_SIZE;
+    }
+
+    current_capture_header_t header = {};
+    header.magic = CURRENT_CAPTURE_MAGIC;
+    header.sample_rate_hz = CURRENT_SENSE_SAMPLE_RATE_HZ;
+    header.channels = CURRENT_SENSE_CHANNELS;
+    memcpy(header.channel, s_channels, sizeof(s_channels));
+    memcpy(buf, &header, sizeof(header));
+
+    xSemaphoreTake(s_lock, portMAX_DELAY);
+    if (s_capture_buf != NULL) {
+        xSemaphoreGive(s_lock);
+        return ESP_ERR_INVALID_STATE;
+    }
+    xSemaphoreTake(s_capture_done, 0);  // Left over from a capture that timed out
+    s_capture_buf = buf + sizeof(header);
+    s_capture_len = len - sizeof(header);
+    s_capture_pos = 0;
+    xSemaphoreGive(s_lock);
+
+    // Twice as long as the data takes to arrive, plus a second
+    uint32_t timeout_ms = (uint32_t)((uint64_t)s_capture_len * 2000 /
+                                     (CURRENT_SAMPLE_BYTES * CURRENT_SENSE_SAMPLE_RATE_HZ)) + 1000;
+    bool done = xSemaphoreTake(s_capture_done, pdMS_TO_TICKS(timeout_ms)) == pdTRUE;
+
+    xSemaphoreTake(s_lock, portMAX_DELAY);
+    *captured = sizeof(header) + s_capture_pos;
+    s_capture_buf = NULL;
+    xSemaphoreGive(s_lock);
+    return done ? ESP_OK : ESP_ERR_TIMEOUT;
+}
+
+// Write a value to a current switch if it moved by at least deadband,
+// or reached zero
+static void publish_value(int index, double value, double deadband) {
+    value = round(value / CURRENT_SWITCH_STEP) * CURRENT_SWITCH_STEP;
+    double last = s_published[index];
+    if (fabs(value - last) >= deadband || (value == 0.0 && last != 0.0)) {
+        s_published[index] = value;
+        s_device->setAutomaticValue(s_first_switch + index, value);
+    }
+}
+
+void CurrentSense::publish(uint32_t now_ms) {
+    // All channels in one change notification
+    s_device->beginBatch();
+    for (int i = 0; i < CURRENT_SENSE_CHANNELS; i++) {
+        current_reading_t reading;
+        s_pipeline.reading(i, &reading);
+        bool switched_on = false;
+        s_device->get_getswitch(CURRENT_SENSE_SWITCH[i], &switched_on);
+        uint8_t faults = s_detectors[i].update(now_ms, switched_on, reading);
+
+        xSemaphoreTake(s_lock, portMAX_DELAY);
+        uint8_t previous = s_status[i].faults;
+        s_status[i].reading = reading;
+        s_status[i].faults = faults;
+        xSemaphoreGive(s_lock);
+
+        if (faults & ~previous) {
+            ESP_LOGW(TAG, "Switch %d load fault:%s%s%s (%.2f A RMS, %.2f A peak)", CURRENT_SENSE_SWITCH[i],
+                     (faults & CURRENT_FAULT_OPEN_LOAD) ? " open load" : "",
+                     (faults & CURRENT_FAULT_STUCK_ON) ? " stuck on" : "",
+                     (faults & CURRENT_FAULT_OVERCURRENT) ? " overcurrent" : "", reading.rms, reading.peak);
+        } else if (previous && !faults) {
+            ESP_LOGI(TAG, "Switch %d load faults cleared", CURRENT_SENSE_SWITCH[i]);
+        }
+
+        if (!reading.valid) {
+            continue;
+        }
+        int index = i * CURRENT_SENSE_SWITCHES_PER_CHANNEL;
+        publish_value(index, reading.rms, CURRENT_SENSE_DEADBAND_AMPS);
+        publish_value(index + 1, reading.peak, CURRENT_SENSE_DEADBAND_AMPS);
+        publish_value(index + 2, faults, 0.5);
+    }
+    s_device->endBatch();
+}
+
+void CurrentSense::sampleTask(void* pvParameter) {
+    uint8_t frame[CURRENT_FRAME_BYTES];
+    int64_t last_publish_us = esp_timer_get_time();
+
+    while (true) {
+        uint32_t len = 0;
+        esp_err_t err = adc_continuous_read(s_adc, frame, sizeof(frame), &len, CURRENT_SENSE_PUBLISH_MS);
+        int64_t start_us = esp_timer_get_time();
+
+        if (err == ESP_OK) {
+            s_pipeline.ingest(frame, len);
+            uint32_t samples = s_pipeline.samples();
+            uint32_t duration_us = (uint32_t)(esp_timer_get_time() - start_us);
+
+            xSemaphoreTake(s_lock, portMAX_DELAY);
+            s_samples = samples;
+            s_process_us += duration_us;
+            if (s_capture_buf != NULL && s_capture_pos < s_capture_len) {
+                size_t count = s_capture_len - s_capture_pos < len ? s_capture_len - s_capture_pos : len;
+                memcpy(s_capture_buf + s_capture_pos, frame, count);
+                s_capture_pos += count;
+                if (s_capture_pos == s_capture_len) {
+                    xSemaphoreGive(s_capture_done);
+                }
+            }
+            xSemaphoreGive(s_lock);
+        } else if (err != ESP_ERR_TIMEOUT) {
+            ESP_LOGW(TAG, "ADC read failed: %s", esp_err_to_name(err));
+            vTaskDelay(pdMS_TO_TICKS(CURRENT_SENSE_PUBLISH_MS));
+        }
+
+        if (start_us - last_publish_us >= CURRENT_SENSE_PUBLISH_MS * 1000LL) {
+            last_publish_us = start_us;
+            publish((uint32_t)(start_us / 1000));
+        }
+    }
+}
@@ -0,0 +1,57 @@
+#ifndef CURRENT_SENSE_H
+#define CURRENT_SENSE_H
+
+#include <esp_err.h>
+#include <stddef.h>
+#include <stdint.h>
+#include "alpaca_switch.h"
+#include "current_filter.h"
+
+// Read-only switches added per current channel: RMS amps, peak amps and
+// the fault flags
+#define CURRENT_SENSE_SWITCHES_PER_CHANNEL 3
+#define CURRENT_SENSE_SWITCHES (CURRENT_SENSE_SWITCHES_PER_CHANNEL * CURRENT_SENSE_CHANNELS)
+
+// One channel's state, for the metrics
+typedef struct {
+    int32_t monitored_switch;   // Relay whose load is measured
+    current_reading_t reading;
+    uint8_t faults;             // CURRENT_FAULT_* flags
+} current_channel_status_t;
+
+// Load current sensing on ADC1. The channels are sampled continuously
+// by the ADC's DMA at CURRENT_SENSE_SAMPLE_RATE_HZ; a task drains the
+// DMA pool, runs the frames through a CurrentPipeline and every
+// CURRENT_SENSE_PUBLISH_MS writes the RMS current, peak current and
+// fault flags of each channel to its read-only switches, so clients
+// read them with GetSwitchValue and rules can act on faults.
+class CurrentSense {
+public:
+    // Switch config for the index-th current switch, to be appended to
+    // the relays before the device is created
+    static void getSwitchConfig(int index, switch_config_t* config);
+
+    // Start sampling; the current switches begin at first_switch
+    static esp_err_t start(AlpacaSwitch* device, int32_t first_switch);
+
+    // Sampling has started
+    static bool running();
+
+    static void getStatus(int channel, current_channel_status_t* status);
+
+    // Counters for the metrics
+    static uint32_t samples();
+    static uint32_t overruns();
+    static uint64_t processUs();
+
+    // Record the next raw DMA data, up to len bytes, behind a header
+    // describing the channels, for replay with tools/current_replay.cpp.
+    // Blocks for as long as the capture takes.
+    static esp_err_t capture(uint8_t* buf, size_t len, size_t* captured);
+
+private:
+    static void sampleTask(void* pvParameter);
+    static void publish(uint32_t now_ms);
+};
+
+#endif // CURRENT_SENSE_H
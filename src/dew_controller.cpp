@@ -0,0 +1,319 @@
+#include "dew_controller.h"
+#include "dew_model.h"
+#include "dew_sensor.h"
+#include "config.h"
+#include <driver/ledc.h>
+#include <esp_log.h>
+#include <esp_timer.h>
+#include <nvs.h>
+#include <math.h>
+#include <string.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/semphr.h>
+#include <freertos/task.h>
+
+static const char* TAG = "dew_controller";
+const char* DewController::NVS_NAMESPACE = "dew";
+
+// PWM on the heater pin
+#define DEW_LEDC_MODE LEDC_LOW_SPEED_MODE
+#define DEW_LEDC_TIMER LEDC_TIMER_0
+#define DEW_LEDC_CHANNEL LEDC_CHANNEL_0
+#define DEW_LEDC_RESOLUTION LEDC_TIMER_10_BIT
+#define DEW_LEDC_MAX_DUTY ((1 << 10) - 1)
+
+// Accepted margins above the dew point
+#define DEW_MIN_MARGIN_C 0.5f
+#define DEW_MAX_MARGIN_C 15.0f
+
+static AlpacaSwitch* s_device = NULL;
+static double s_min_value = 0.0;
+static double s_max_value = 1.0;
+static double s_step = 0.0;
+static bool s_pwm = false;
+
+#ifdef DEW_SENSOR_SIMULATED
+static DewThermalModel s_model;
+static SimulatedDewSensor s_air(&s_model, false);
+static SimulatedDewSensor s_probe(&s_model, true);
+#else
+static Sht3xSensor s_air(DEW_I2C_SDA_PIN, DEW_I2C_SCL_PIN, DEW_SHT3X_ADDRESS);
+static Ds18b20Sensor s_probe(DEW_ONEWIRE_PIN);
+#endif
+
+// The status and mode are shared between the control task and the HTTP
+// server
+static SemaphoreHandle_t s_lock = NULL;
+static dew_status_t s_status;
+static bool s_mode_changed = false;
+
+// Heater duty for a switch value
+static float value_to_duty(double value) {
+    float duty = (float)((value - s_min_value) / (s_max_value - s_min_value));
+    return duty < 0.0f ? 0.0f : (duty > 1.0f ? 1.0f : duty);
+}
+
+// Switch value for a heater duty, on the switch's step grid
+static double duty_to_value(float duty) {
+    double span = s_max_value - s_min_value;
+    if (s_step <= 0.0) {
+        return s_min_value + duty * span;
+    }
+    return s_min_value + round(duty * span / s_step) * s_step;
+}
+
+esp_err_t DewController::start(AlpacaSwitch* device, int gpio_pin) {
+    int32_t num_switches;
+    device->get_maxswitch(&num_switches);
+    if (DEW_HEATER_SWITCH < 0 || DEW_HEATER_SWITCH >= num_switches) {
+        ESP_LOGE(TAG, "Heater switch %d does not exist", DEW_HEATER_SWITCH);
+        return ESP_ERR_INVALID_ARG;
+    }
+    device->get_minswitchvalue(DEW_HEATER_SWITCH, &s_min_value);
+    device->get_maxswitchvalue(DEW_HEATER_SWITCH, &s_max_value);
+    device->get_switchstep(DEW_HEATER_SWITCH, &s_step);
+    if (s_max_value <= s_min_value) {
+        ESP_LOGE(TAG, "Heater switch %d has no value range", DEW_HEATER_SWITCH);
+        return ESP_ERR_INVALID_ARG;
+    }
+    s_device = device;
+
+    s_lock = xSemaphoreCreateMutex();
+    if (s_lock == NULL) {
+        return ESP_ERR_NO_MEM;
+    }
+
+    memset(&s_status, 0, sizeof(s_status));
+    s_status.automatic = true;
+    s_status.margin = DEW_DEFAULT_MARGIN_C;
+    nvs_handle_t handle;
+    if (nvs_open(NVS_NAMESPACE, NVS_READONLY, &handle) == ESP_OK) {
+        uint8_t automatic;
+        if (nvs_get_u8(handle, "auto", &automatic) == ESP_OK) {
+            s_status.automatic = automatic != 0;
+        }
+        float margin;
+        size_t size = sizeof(margin);
+        if (nvs_get_blob(handle, "margin", &margin, &size) == ESP_OK && size == sizeof(margin)) {
+            s_status.margin = margin;
+        }
+        nvs_close(handle);
+    }
+
+    // A missing sensor is not fatal: the loop falls back to a fixed duty
+    // and picks the sensor up if it starts answering
+    if (s_air.begin() != ESP_OK) {
+        ESP_LOGW(TAG, "Air sensor not found");
+    }
+    if (s_probe.begin() != ESP_OK) {
+        ESP_LOGW(TAG, "Optic temperature probe not found");
+    }
+
+    // LEDC takes the pin over from the switch's plain GPIO output
+    if (gpio_pin >= 0) {
+        ledc_timer_config_t timer = {};
+        timer.speed_mode = DEW_LEDC_MODE;
+        timer.duty_resolution = DEW_LEDC_RESOLUTION;
+        timer.timer_num = DEW_LEDC_TIMER;
+        timer.freq_hz = DEW_PWM_FREQUENCY_HZ;
+        timer.clk_cfg = LEDC_AUTO_CLK;
+        esp_err_t err = ledc_timer_config(&timer);
+        if (err != ESP_OK) {
+            return err;
+        }
+
+        double value;
+        device->get_getswitchvalue(DEW_HEATER_SWITCH, &value);
+        ledc_channel_config_t channel = {};
+        channel.gpio_num = gpio_pin;
+        channel.speed_mode = DEW_LEDC_MODE;
+        channel.channel = DEW_LEDC_CHANNEL;
+        channel.timer_sel = DEW_LEDC_TIMER;
+        channel.duty = (uint32_t)(value_to_duty(value) * DEW_LEDC_MAX_DUTY);
+        err = ledc_channel_config(&channel);
+        if (err != ESP_OK) {
+            return err;
+        }
+        s_pwm = true;
+    }
+
+    esp_err_t err = device->addChangeListener(onSwitchChange, NULL);
+    if (err != ESP_OK) {
+        return err;
+    }
+    device->setAutomatic(DEW_HEATER_SWITCH, s_status.automatic);
+
+    s_status.running = true;
+    if (xTaskCreatePinnedToCore(controlTask, "dew_control", 4096, NULL, DEW_TASK_PRIORITY, NULL,
+                                DEW_TASK_CORE) != pdPASS) {
+        ESP_LOGE(TAG, "Failed to create control task");
+        return ESP_ERR_NO_MEM;
+    }
+
+    ESP_LOGI(TAG, "Dew heater on switch %d, %s mode, %.1f C above the dew point", DEW_HEATER_SWITCH,
+             s_status.automatic ? "automatic" : "manual", s_status.margin);
+    return ESP_OK;
+}
+
+esp_err_t DewController::setAutomatic(bool automatic) {
+    if (s_lock == NULL) {
+        return ESP_ERR_INVALID_STATE;
+    }
+
+    nvs_handle_t handle;
+    esp_err_t err = nvs_open(NVS_NAMESPACE, NVS_READWRITE, &handle);
+    if (err != ESP_OK) {
+        return err;
+    }
+    err = nvs_set_u8(handle, "auto", automatic ? 1 : 0);
+    if (err == ESP_OK) {
+        err = nvs_commit(handle);
+    }
+    nvs_close(handle);
+    if (err != ESP_OK) {
+        return err;
+    }
+
+    // The loop picks up from whatever duty the heater is at, so taking
+    // over from a manual setting does not jump
+    xSemaphoreTake(s_lock, portMAX_DELAY);
+    s_mode_changed = s_status.automatic != automatic;
+    s_status.automatic = automatic;
+    xSemaphoreGive(s_lock);
+
+    s_device->setAutomatic(DEW_HEATER_SWITCH, automatic);
+    return ESP_OK;
+}
+
+esp_err_t DewController::setMargin(float margin) {
+    if (s_lock == NULL) {
+        return ESP_ERR_INVALID_STATE;
+    }
+    if (!(margin >= DEW_MIN_MARGIN_C && margin <= DEW_MAX_MARGIN_C)) {
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    nvs_handle_t handle;
+    esp_err_t err = nvs_open(NVS_NAMESPACE, NVS_READWRITE, &handle);
+    if (err != ESP_OK) {
+        return err;
+    }
+    err = nvs_set_blob(handle, "margin", &margin, sizeof(margin));
+    if (err == ESP_OK) {
+        err = nvs_commit(handle);
+    }
+    nvs_close(handle);
+    if (err != ESP_OK) {
+        return err;
+    }
+
+    xSemaphoreTake(s_lock, portMAX_DELAY);
+    s_status.margin = margin;
+    xSemaphoreGive(s_lock);
+    return ESP_OK;
+}
+
+void DewController::getStatus(dew_status_t* status) {
+    if (s_lock == NULL) {
+        memset(status, 0, sizeof(*status));
+        return;
+    }
+
+    xSemaphoreTake(s_lock, portMAX_DELAY);
+    *status = s_status;
+    xSemaphoreGive(s_lock);
+}
+
+void DewController::onSwitchChange(void* ctx, const switch_change_t* changes, int count) {
+    if (!s_pwm) {
+        return;
+    }
+
+    // Called on the switch path; updating the LEDC duty does not block
+    for (int i = 0; i < count; i++) {
+        if (changes[i].id == DEW_HEATER_SWITCH) {
+            float duty = changes[i].state ? value_to_duty(changes[i].value) : 0.0f;
+            ledc_set_duty(DEW_LEDC_MODE, DEW_LEDC_CHANNEL, (uint32_t)(duty * DEW_LEDC_MAX_DUTY));
+            ledc_update_duty(DEW_LEDC_MODE, DEW_LEDC_CHANNEL);
+        }
+    }
+}
+
+void DewController::controlTask(void* pvParameter) {
+    dew_pid_config_t config = { DEW_PID_KP, DEW_PID_KI, DEW_PID_KD, DEW_CONTROL_PERIOD_MS / 1000.0f,
+                                DEW_DERIVATIVE_FILTER_S };
+    DewPid pid(config);
+    int failures = 0;
+    bool primed = false;
+
+    TickType_t wake = xTaskGetTickCount();
+    while (true) {
+        vTaskDelayUntil(&wake, pdMS_TO_TICKS(DEW_CONTROL_PERIOD_MS));
+        int64_t start_us = esp_timer_get_time();
+
+        double value;
+        s_device->get_getswitchvalue(DEW_HEATER_SWITCH, &value);
+        float duty = value_to_duty(value);
+
+#ifdef DEW_SENSOR_SIMULATED
+        s_model.step(DEW_CONTROL_PERIOD_MS / 1000.0f, duty);
+#endif
+
+        dew_reading_t air;
+        dew_reading_t probe;
+        esp_err_t air_err = s_air.read(&air);
+        esp_err_t probe_err = s_probe.read(&probe);
+        bool ok = air_err == ESP_OK && probe_err == ESP_OK;
+
+        xSemaphoreTake(s_lock, portMAX_DELAY);
+        bool automatic = s_status.automatic;
+        if (s_mode_changed || !primed) {
+            pid.reset(duty);
+            s_mode_changed = false;
+            primed = true;
+        }
+
+        if (ok) {
+            if (failures >= DEW_SENSOR_MAX_FAILURES) {
+                ESP_LOGI(TAG, "Sensors are back");
+                pid.reset(duty);
+            }
+            failures = 0;
+            s_status.ambient = air.temperature;
+            s_status.humidity = air.humidity;
+            s_status.dew_point = dew_point(air.temperature, air.humidity);
+            s_status.optic = probe.temperature;
+            s_status.target = s_status.dew_point + s_status.margin;
+            if (automatic) {
+                duty = pid.update(s_status.target, probe.temperature);
+            }
+        } else {
+            s_status.sensor_errors++;
+            if (++failures == DEW_SENSOR_MAX_FAILURES) {
+                ESP_LOGW(TAG, "Sensors failing (air %s, probe %s), heating at %.0f %%", esp_err_to_name(air_err),
+                         esp_err_to_name(probe_err), DEW_FALLBACK_DUTY * 100.0f);
+            }
+            if (failures >= DEW_SENSOR_MAX_FAILURES && automatic) {
+                duty = DEW_FALLBACK_DUTY;
+            }
+        }
+        s_status.sensors_ok = ok;
+        s_status.duty = duty;
+        s_status.loops++;
+        xSemaphoreGive(s_lock);
+
+        if (automatic) {
+            double new_value = duty_to_value(duty);
+            if (new_value != value) {
+                s_device->setAutomaticValue(DEW_HEATER_SWITCH, new_value);
+            }
+        }
+
+        uint32_t duration_us = (uint32_t)(esp_timer_get_time() - start_us);
+        xSemaphoreTake(s_lock, portMAX_DELAY);
+        if (duration_us > s_status.loop_max_us) {
+            s_status.loop_max_us = duration_us;
+        }
+        xSemaphoreGive(s_lock);
+    }
+}
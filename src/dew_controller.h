@@ -0,0 +1,58 @@
+#ifndef DEW_CONTROLLER_H
+#define DEW_CONTROLLER_H
+
+#include <esp_err.h>
+#include <stdint.h>
+#include "alpaca_switch.h"
+
+// Dew heater loop state, for the UI and metrics
+typedef struct {
+    bool running;               // Loop started
+    bool automatic;             // Loop drives the heater switch
+    bool sensors_ok;            // Last readings were good
+    float ambient;              // Air temperature, °C
+    float humidity;             // Relative humidity, %
+    float dew_point;            // °C
+    float optic;                // Probe on the optic, °C
+    float target;               // Dew point plus margin, °C
+    float margin;               // °C
+    float duty;                 // Heater duty, 0 to 1
+    uint32_t loops;             // Control steps run
+    uint32_t sensor_errors;     // Failed readings
+    uint32_t loop_max_us;       // Longest control step, sensor reads included
+} dew_status_t;
+
+// Closed-loop dew heater control. Reads air temperature and humidity
+// and the temperature of the optic, and runs a PID loop at a fixed rate
+// on its own task that holds the optic DEW_DEFAULT_MARGIN_C (or the
+// stored margin) above the dew point by driving the value of the
+// heater switch. While in automatic mode the heater switch reads as
+// CanWrite false and refuses client writes; in manual mode it is an
+// ordinary switch whose value sets the duty.
+//
+// The heater switch's pin is driven with LEDC PWM at the duty given by
+// its value within its range, in either mode. If the sensors keep
+// failing, the heater runs at DEW_FALLBACK_DUTY rather than stopping.
+class DewController {
+public:
+    // Start the loop on DEW_HEATER_SWITCH, whose GPIO is gpio_pin
+    static esp_err_t start(AlpacaSwitch* device, int gpio_pin);
+
+    // Switch between automatic and manual mode; stored in NVS
+    static esp_err_t setAutomatic(bool automatic);
+
+    // Set how far above the dew point the optic is held; stored in NVS
+    static esp_err_t setMargin(float margin);
+
+    static void getStatus(dew_status_t* status);
+
+private:
+    static const char* NVS_NAMESPACE;
+
+    static void controlTask(void* pvParameter);
+
+    // Follow heater value changes with the PWM duty
+    static void onSwitchChange(void* ctx, const switch_change_t* changes, int count);
+};
+
+#endif // DEW_CONTROLLER_H
@@ -0,0 +1,98 @@
+#include "dew_model.h"
+#include <math.h>
+
+// Magnus coefficients over water
+#define MAGNUS_B 17.62f
+#define MAGNUS_C 243.12f
+
+float dew_point(float temperature, float humidity) {
+    if (humidity < 1.0f) {
+        humidity = 1.0f;
+    } else if (humidity > 100.0f) {
+        humidity = 100.0f;
+    }
+    float gamma = logf(humidity / 100.0f) + MAGNUS_B * temperature / (MAGNUS_C + temperature);
+    return MAGNUS_C * gamma / (MAGNUS_B - gamma);
+}
+
+float relative_humidity(float temperature, float dew_point) {
+    float humidity = 100.0f * expf(MAGNUS_B * dew_point / (MAGNUS_C + dew_point) -
+                                   MAGNUS_B * temperature / (MAGNUS_C + temperature));
+    return humidity > 100.0f ? 100.0f : humidity;
+}
+
+DewPid::DewPid(const dew_pid_config_t& config) : _config(config) {
+    reset(0.0f);
+}
+
+void DewPid::reset(float duty) {
+    _integral = duty;
+    _derivative = 0.0f;
+    _last_measurement = 0.0f;
+    _primed = false;
+}
+
+float DewPid::update(float target, float measurement) {
+    float error = target - measurement;
+
+    if (_primed) {
+        // Cooling counts as positive, like a growing error
+        float rate = (_last_measurement - measurement) / _config.period_s;
+        float alpha = _config.period_s / (_config.derivative_filter_s + _config.period_s);
+        _derivative += alpha * (rate - _derivative);
+    }
+    _last_measurement = measurement;
+    _primed = true;
+
+    float proportional = _config.kp * error;
+    float derivative = _config.kd * _derivative;
+    float step = _config.ki * error * _config.period_s;
+    float output = proportional + _integral + step + derivative;
+
+    // Only integrate while that moves the output back into range
+    if (!((output > 1.0f && step > 0.0f) || (output < 0.0f && step < 0.0f))) {
+        _integral += step;
+    }
+    if (_integral > 1.0f) {
+        _integral = 1.0f;
+    } else if (_integral < 0.0f) {
+        _integral = 0.0f;
+    }
+
+    output = proportional + _integral + derivative;
+    if (output > 1.0f) {
+        return 1.0f;
+    }
+    if (output < 0.0f) {
+        return 0.0f;
+    }
+    return output;
+}
+
+const dew_plant_t DEW_DEFAULT_PLANT = {
+    10.0f,      // heater_w
+    400.0f,     // capacity_j_per_k
+    0.6f,       // loss_w_per_k
+    1.5f,       // sky_w
+    12.0f,      // ambient_start
+    4.0f,       // ambient_end
+    10800.0f,   // cooling_s
+    5.0f,       // air_dew_point
+    60.0f,      // probe_lag_s
+};
+
+DewThermalModel::DewThermalModel(const dew_plant_t& plant) : _plant(plant), _elapsed(0.0f), _wind(1.0f) {
+    _ambient = plant.ambient_start;
+    _optic = plant.ambient_start - plant.sky_w / plant.loss_w_per_k;
+    _probe = _optic;
+}
+
+void DewThermalModel::step(float dt_s, float duty) {
+    _elapsed += dt_s;
+    _ambient = _plant.ambient_end +
+               (_plant.ambient_start - _plant.ambient_end) * expf(-_elapsed / _plant.cooling_s);
+
+    float power = _plant.heater_w * duty - _plant.loss_w_per_k * _wind * (_optic - _ambient) - _plant.sky_w;
+    _optic += power * dt_s / _plant.capacity_j_per_k;
+    _probe += (_optic - _probe) * dt_s / (_plant.probe_lag_s + dt_s);
+}
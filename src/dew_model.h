@@ -0,0 +1,95 @@
+#ifndef DEW_MODEL_H
+#define DEW_MODEL_H
+
+// Dew heater control math. Kept free of ESP-IDF so it also builds on the
+// host, where tools/dew_sim.cpp runs the loop against the thermal model.
+
+// Dew point in °C from air temperature (°C) and relative humidity (%).
+// Magnus formula with Sonntag's constants, good to about 0.35 °C
+// between -45 and 60 °C.
+float dew_point(float temperature, float humidity);
+
+// Relative humidity (%) of air at temperature with the given dew point
+float relative_humidity(float temperature, float dew_point);
+
+// PID gains and timing
+typedef struct {
+    float kp;                   // Duty per °C below the target
+    float ki;                   // Duty per °C·s
+    float kd;                   // Duty per °C/s of cooling
+    float period_s;             // Fixed time between updates
+    float derivative_filter_s;  // Low-pass time constant on the derivative
+} dew_pid_config_t;
+
+// PID loop producing a heater duty from 0 to 1.
+//
+// The derivative acts on the measurement rather than the error, so the
+// target moving with the dew point does not kick the output, and is
+// low-pass filtered against sensor quantisation. The integral is held
+// while the output is saturated in the direction it would grow
+// (conditional integration), so it does not wind up during a long
+// stretch at 0 or 100 %.
+class DewPid {
+public:
+    explicit DewPid(const dew_pid_config_t& config);
+
+    // Forget the history and continue from duty, for a bumpless start
+    void reset(float duty);
+
+    // One control step; returns the new duty
+    float update(float target, float measurement);
+
+private:
+    dew_pid_config_t _config;
+    float _integral;
+    float _derivative;
+    float _last_measurement;
+    bool _primed;
+};
+
+// Plant parameters of the thermal model
+typedef struct {
+    float heater_w;             // Heater power at full duty
+    float capacity_j_per_k;     // Heat capacity of the optic and strap
+    float loss_w_per_k;         // Loss to the surrounding air
+    float sky_w;                // Radiation to a clear sky
+    float ambient_start;        // Air temperature at dusk, °C
+    float ambient_end;          // Air temperature the night cools towards, °C
+    float cooling_s;            // Time constant of the night's cooling
+    float air_dew_point;        // Dew point of the air, °C
+    float probe_lag_s;          // Time constant of the probe taped to the optic
+} dew_plant_t;
+
+// Default plant: a 200 mm optic with a 10 W strap, cooling from 12 °C
+// towards 4 °C in air with a 5 °C dew point. Unheated, the optic sits
+// about 2.5 °C below the air and dews over within the first hour.
+extern const dew_plant_t DEW_DEFAULT_PLANT;
+
+// Lumped thermal model of a heated optic through a night, for the
+// simulated sensor backend and host testing
+class DewThermalModel {
+public:
+    explicit DewThermalModel(const dew_plant_t& plant = DEW_DEFAULT_PLANT);
+
+    // Advance by dt_s seconds with the heater at duty
+    void step(float dt_s, float duty);
+
+    // Scale the loss to the air, as wind does
+    void setWind(float factor) { _wind = factor; }
+
+    float ambient() const { return _ambient; }
+    float humidity() const { return relative_humidity(_ambient, _plant.air_dew_point); }
+    float optic() const { return _optic; }
+    float probe() const { return _probe; }
+    float elapsed() const { return _elapsed; }
+
+private:
+    dew_plant_t _plant;
+    float _elapsed;
+    float _wind;
+    float _ambient;
+    float _optic;
+    float _probe;
+};
+
+#endif // DEW_MODEL_H
@@ -0,0 +1,215 @@
+#include "dew_sensor.h"
+#include <driver/gpio.h>
+#include <esp_rom_sys.h>
+#include <freertos/FreeRTOS.h>
+#include <math.h>
+
+// SHT3x single shot, high repeatability, no clock stretching; the result
+// is ready 15 ms later
+#define SHT3X_MEASURE_HIGH 0x2400
+#define SHT3X_I2C_SPEED_HZ 100000
+#define SHT3X_TIMEOUT_MS 20
+
+// DS18B20 commands
+#define DS18B20_SKIP_ROM 0xCC
+#define DS18B20_CONVERT_T 0x44
+#define DS18B20_READ_SCRATCHPAD 0xBE
+#define DS18B20_POWER_ON_VALUE 0x0550    // 85 °C, read when no conversion has run
+
+// CRC-8 over data, polynomial 0x31, as the SHT3x uses (MSB first)
+static uint8_t crc8_sensirion(const uint8_t* data, int len) {
+    uint8_t crc = 0xFF;
+    for (int i = 0; i < len; i++) {
+        crc ^= data[i];
+        for (int bit = 0; bit < 8; bit++) {
+            crc = (crc & 0x80) ? (crc << 1) ^ 0x31 : crc << 1;
+        }
+    }
+    return crc;
+}
+
+// CRC-8 over data, polynomial 0x31 reflected, as 1-Wire uses (LSB first)
+static uint8_t crc8_maxim(const uint8_t* data, int len) {
+    uint8_t crc = 0;
+    for (int i = 0; i < len; i++) {
+        crc ^= data[i];
+        for (int bit = 0; bit < 8; bit++) {
+            crc = (crc & 0x01) ? (crc >> 1) ^ 0x8C : crc >> 1;
+        }
+    }
+    return crc;
+}
+
+Sht3xSensor::Sht3xSensor(int sda_pin, int scl_pin, uint8_t address)
+    : _sda_pin(sda_pin), _scl_pin(scl_pin), _address(address), _bus(NULL), _dev(NULL), _measuring(false) {
+}
+
+esp_err_t Sht3xSensor::begin() {
+    i2c_master_bus_config_t bus_config = {};
+    bus_config.i2c_port = -1;   // Any free controller
+    bus_config.sda_io_num = (gpio_num_t)_sda_pin;
+    bus_config.scl_io_num = (gpio_num_t)_scl_pin;
+    bus_config.clk_source = I2C_CLK_SRC_DEFAULT;
+    bus_config.glitch_ignore_cnt = 7;
+    bus_config.flags.enable_internal_pullup = true;
+    esp_err_t err = i2c_new_master_bus(&bus_config, &_bus);
+    if (err != ESP_OK) {
+        return err;
+    }
+
+    i2c_device_config_t dev_config = {};
+    dev_config.dev_addr_length = I2C_ADDR_BIT_LEN_7;
+    dev_config.device_address = _address;
+    dev_config.scl_speed_hz = SHT3X_I2C_SPEED_HZ;
+    return i2c_master_bus_add_device(_bus, &dev_config, &_dev);
+}
+
+esp_err_t Sht3xSensor::read(dew_reading_t* reading) {
+    esp_err_t result = ESP_ERR_INVALID_STATE;
+
+    if (_measuring) {
+        // Temperature and humidity words, each followed by its CRC
+        uint8_t data[6];
+        result = i2c_master_receive(_dev, data, sizeof(data), SHT3X_TIMEOUT_MS);
+        if (result == ESP_OK && (crc8_sensirion(data, 2) != data[2] || crc8_sensirion(data + 3, 2) != data[5])) {
+            result = ESP_ERR_INVALID_CRC;
+        }
+        if (result == ESP_OK) {
+            reading->temperature = -45.0f + 175.0f * ((data[0] << 8) | data[1]) / 65535.0f;
+            reading->humidity = 100.0f * ((data[3] << 8) | data[4]) / 65535.0f;
+        }
+    }
+
+    uint8_t command[2] = { SHT3X_MEASURE_HIGH >> 8, SHT3X_MEASURE_HIGH & 0xFF };
+    esp_err_t err = i2c_master_transmit(_dev, command, sizeof(command), SHT3X_TIMEOUT_MS);
+    _measuring = err == ESP_OK;
+    return _measuring ? result : err;
+}
+
+// 1-Wire timing, standard speed, in microseconds. Each slot is timed
+// with interrupts off on this core; the recovery between slots is not
+// critical and runs with them on.
+static portMUX_TYPE s_onewire_lock = portMUX_INITIALIZER_UNLOCKED;
+
+Ds18b20Sensor::Ds18b20Sensor(int pin) : _pin(pin), _converting(false) {
+}
+
+esp_err_t Ds18b20Sensor::begin() {
+    gpio_config_t config = {};
+    config.pin_bit_mask = 1ULL << _pin;
+    config.mode = GPIO_MODE_INPUT_OUTPUT_OD;
+    config.pull_up_en = GPIO_PULLUP_ENABLE;
+    esp_err_t err = gpio_config(&config);
+    if (err != ESP_OK) {
+        return err;
+    }
+    gpio_set_level((gpio_num_t)_pin, 1);
+    return reset() ? ESP_OK : ESP_ERR_NOT_FOUND;
+}
+
+bool Ds18b20Sensor::reset() {
+    gpio_num_t pin = (gpio_num_t)_pin;
+
+    gpio_set_level(pin, 0);
+    esp_rom_delay_us(480);
+    portENTER_CRITICAL(&s_onewire_lock);
+    gpio_set_level(pin, 1);
+    esp_rom_delay_us(70);
+    bool present = gpio_get_level(pin) == 0;
+    portEXIT_CRITICAL(&s_onewire_lock);
+    esp_rom_delay_us(410);
+    return present;
+}
+
+void Ds18b20Sensor::writeByte(uint8_t byte) {
+    gpio_num_t pin = (gpio_num_t)_pin;
+
+    for (int bit = 0; bit < 8; bit++) {
+        bool one = (byte >> bit) & 0x01;
+        portENTER_CRITICAL(&s_onewire_lock);
+        gpio_set_level(pin, 0);
+        esp_rom_delay_us(one ? 6 : 60);
+        gpio_set_level(pin, 1);
+        portEXIT_CRITICAL(&s_onewire_lock);
+        esp_rom_delay_us(one ? 64 : 10);
+    }
+}
+
+uint8_t Ds18b20Sensor::readByte() {
+    gpio_num_t pin = (gpio_num_t)_pin;
+    uint8_t byte = 0;
+
+    for (int bit = 0; bit < 8; bit++) {
+        portENTER_CRITICAL(&s_onewire_lock);
+        gpio_set_level(pin, 0);
+        esp_rom_delay_us(6);
+        gpio_set_level(pin, 1);
+        esp_rom_delay_us(9);
+        if (gpio_get_level(pin)) {
+            byte |= 1 << bit;
+        }
+        portEXIT_CRITICAL(&s_onewire_lock);
+        esp_rom_delay_us(55);
+    }
+    return byte;
+}
+
+esp_err_t Ds18b20Sensor::read(dew_reading_t* reading) {
+    esp_err_t result = ESP_ERR_INVALID_STATE;
+
+    if (_converting) {
+        uint8_t scratchpad[9];
+        if (!reset()) {
+            result = ESP_ERR_NOT_FOUND;
+        } else {
+            writeByte(DS18B20_SKIP_ROM);
+            writeByte(DS18B20_READ_SCRATCHPAD);
+            for (int i = 0; i < 9; i++) {
+                scratchpad[i] = readByte();
+            }
+            int16_t raw = (int16_t)((scratchpad[1] << 8) | scratchpad[0]);
+            // A data line held low answers every reset and reads as zeros,
+            // whose CRC is zero too; the configuration byte of a real
+            // scratchpad always has its low bits set
+            uint8_t any = 0;
+            for (int i = 0; i < 9; i++) {
+                any |= scratchpad[i];
+            }
+            if (any == 0) {
+                result = ESP_ERR_NOT_FOUND;
+            } else if (crc8_maxim(scratchpad, 8) != scratchpad[8]) {
+                result = ESP_ERR_INVALID_CRC;
+            } else if (raw == DS18B20_POWER_ON_VALUE) {
+                result = ESP_ERR_INVALID_STATE;
+            } else {
+                reading->temperature = raw / 16.0f;
+                reading->humidity = NAN;
+                result = ESP_OK;
+            }
+        }
+    }
+
+    // 12-bit conversion, done within 750 ms
+    _converting = reset();
+    if (!_converting) {
+        return ESP_ERR_NOT_FOUND;
+    }
+    writeByte(DS18B20_SKIP_ROM);
+    writeByte(DS18B20_CONVERT_T);
+    return result;
+}
+
+SimulatedDewSensor::SimulatedDewSensor(const DewThermalModel* model, bool probe)
+    : _model(model), _probe(probe) {
+}
+
+esp_err_t SimulatedDewSensor::read(dew_reading_t* reading) {
+    if (_probe) {
+        reading->temperature = roundf(_model->probe() * 16.0f) / 16.0f;
+        reading->humidity = NAN;
+    } else {
+        reading->temperature = _model->ambient();
+        reading->humidity = _model->humidity();
+    }
+    return ESP_OK;
+}
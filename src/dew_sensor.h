@@ -0,0 +1,81 @@
+#ifndef DEW_SENSOR_H
+#define DEW_SENSOR_H
+
+#include <esp_err.h>
+#include <stdint.h>
+#include <driver/i2c_master.h>
+#include "dew_model.h"
+
+// One sensor reading; humidity is NAN for sensors without it
+typedef struct {
+    float temperature;          // °C
+    float humidity;             // % relative
+} dew_reading_t;
+
+// A temperature (and maybe humidity) sensor for the dew heater loop.
+// Conversions run between calls, so read() never waits for one: it
+// returns the result of the conversion started by the previous call and
+// starts the next.
+class DewSensor {
+public:
+    virtual ~DewSensor() {}
+
+    // Set up the bus and the sensor
+    virtual esp_err_t begin() = 0;
+
+    // Latest reading. ESP_ERR_INVALID_STATE until the first conversion
+    // has finished; ESP_ERR_INVALID_CRC for a corrupted transfer;
+    // ESP_ERR_NOT_FOUND if no sensor answers.
+    virtual esp_err_t read(dew_reading_t* reading) = 0;
+};
+
+// Sensirion SHT3x air temperature and humidity sensor on I2C
+class Sht3xSensor : public DewSensor {
+public:
+    Sht3xSensor(int sda_pin, int scl_pin, uint8_t address);
+
+    virtual esp_err_t begin() override;
+    virtual esp_err_t read(dew_reading_t* reading) override;
+
+private:
+    int _sda_pin;
+    int _scl_pin;
+    uint8_t _address;
+    i2c_master_bus_handle_t _bus;
+    i2c_master_dev_handle_t _dev;
+    bool _measuring;
+};
+
+// Maxim DS18B20 temperature probe, alone on a 1-Wire bus. The bus is
+// bit-banged on an open-drain GPIO and needs a 4.7 kΩ pull-up.
+class Ds18b20Sensor : public DewSensor {
+public:
+    explicit Ds18b20Sensor(int pin);
+
+    virtual esp_err_t begin() override;
+    virtual esp_err_t read(dew_reading_t* reading) override;
+
+private:
+    bool reset();
+    void writeByte(uint8_t byte);
+    uint8_t readByte();
+
+    int _pin;
+    bool _converting;
+};
+
+// Reads the thermal model instead of hardware: the air, or the probe on
+// the optic quantised like a DS18B20
+class SimulatedDewSensor : public DewSensor {
+public:
+    SimulatedDewSensor(const DewThermalModel* model, bool probe);
+
+    virtual esp_err_t begin() override { return ESP_OK; }
+    virtual esp_err_t read(dew_reading_t* reading) override;
+
+private:
+    const DewThermalModel* _model;
+    bool _probe;
+};
+
+#endif // DEW_SENSOR_H
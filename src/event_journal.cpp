@@ -0,0 +1,347 @@
+#include "event_journal.h"
+#include "ota_updater.h"
+#include "config.h"
+#include "sdkconfig.h"
+#include <esp_attr.h>
+#include <esp_cpu.h>
+#include <esp_freertos_hooks.h>
+#include <esp_log.h>
+#include <esp_system.h>
+#include <atomic>
+#include <stdio.h>
+#include <string.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
+
+static const char* TAG = "event_journal";
+
+// Each core records into its own part of the ring
+#define JOURNAL_CORES portNUM_PROCESSORS
+#define JOURNAL_CORE_ENTRIES (EVENT_JOURNAL_ENTRIES / JOURNAL_CORES)
+
+static_assert((EVENT_JOURNAL_ENTRIES & (EVENT_JOURNAL_ENTRIES - 1)) == 0,
+              "EVENT_JOURNAL_ENTRIES must be a power of two");
+static_assert(JOURNAL_CORE_ENTRIES >= 2, "EVENT_JOURNAL_ENTRIES is too small for the number of cores");
+static_assert(sizeof(journal_entry_t) == 16, "Journal entries are 16 bytes");
+
+// Changes whenever the entry layout does, so an old journal is discarded
+#define JOURNAL_MAGIC 0x4A524E32   // "JRN2"
+
+// Power management is off, so the CPU clock is fixed
+#define CYCLES_PER_MS (CONFIG_ESP_DEFAULT_CPU_FREQ_MHZ * 1000)
+
+typedef struct {
+    uint32_t magic;
+    uint32_t boots;
+    journal_entry_t entries[EVENT_JOURNAL_ENTRIES];
+} journal_t;
+
+// Not cleared at reset; holds garbage after power-on until init()
+static RTC_NOINIT_ATTR journal_t s_journal;
+
+// What each core keeps to itself, in ordinary RAM. Only its own core
+// writes it, with interrupts masked, so no lock or atomic increment is
+// needed; round is read by the other cores to keep sequence numbers in
+// order across them.
+typedef struct {
+    uint32_t cycles;                // Cycle count at the last tick
+    uint32_t ms;                    // Milliseconds since boot at the last tick
+    uint32_t next;                  // Position of the next entry in this core's part
+    uint32_t boot_next;             // Position when this boot started
+    uint32_t torn;                  // Position of an entry torn by the last reset
+    std::atomic<uint32_t> round;    // Round of the last sequence number handed out
+} journal_core_t;
+
+static DRAM_ATTR journal_core_t s_cores[JOURNAL_CORES];
+static uint32_t s_boots = 0;
+static std::atomic<uint32_t> s_last_auth_ms(0);
+
+// CRC-8, polynomial 0x07. The table is in RAM so a record never waits
+// on the flash cache.
+static DRAM_ATTR uint8_t s_crc_table[256];
+
+static void build_crc_table() {
+    for (int i = 0; i < 256; i++) {
+        uint8_t crc = (uint8_t)i;
+        for (int bit = 0; bit < 8; bit++) {
+            crc = (crc & 0x80) ? (crc << 1) ^ 0x07 : crc << 1;
+        }
+        s_crc_table[i] = crc;
+    }
+}
+
+// CRC of every field but the CRC itself
+static inline uint8_t entry_crc(uint32_t seq, uint32_t time_ms, uint8_t type, uint16_t id, uint32_t value) {
+    uint8_t crc = 0xFF;
+    for (int shift = 0; shift < 32; shift += 8) {
+        crc = s_crc_table[crc ^ (uint8_t)(seq >> shift)];
+        crc = s_crc_table[crc ^ (uint8_t)(time_ms >> shift)];
+        crc = s_crc_table[crc ^ (uint8_t)(value >> shift)];
+    }
+    crc = s_crc_table[crc ^ type];
+    crc = s_crc_table[crc ^ (uint8_t)id];
+    crc = s_crc_table[crc ^ (uint8_t)(id >> 8)];
+    return crc;
+}
+
+// A sequence number carries the core that recorded it in its low part
+static bool entry_valid(const journal_entry_t& entry, int core) {
+    return entry.seq % JOURNAL_CORES == (uint32_t)core && entry.type != 0 &&
+           entry.crc == entry_crc(entry.seq, entry.time_ms, entry.type, entry.id, entry.value);
+}
+
+static inline journal_entry_t& core_entry(int core, uint32_t position) {
+    return s_journal.entries[core * JOURNAL_CORE_ENTRIES + (position & (JOURNAL_CORE_ENTRIES - 1))];
+}
+
+// Runs in each core's tick interrupt, so a record only has to turn the
+// cycles since the last tick into milliseconds
+static void IRAM_ATTR sync_clock() {
+    journal_core_t& core = s_cores[xPortGetCoreID()];
+    core.cycles = esp_cpu_get_cycle_count();
+    core.ms = xTaskGetTickCountFromISR() * portTICK_PERIOD_MS;
+}
+
+static const char* reset_reason_name(uint32_t reason) {
+    switch (reason) {
+        case ESP_RST_POWERON:   return "power-on";
+        case ESP_RST_EXT:       return "external";
+        case ESP_RST_SW:        return "restart";
+        case ESP_RST_PANIC:     return "panic";
+        case ESP_RST_INT_WDT:   return "interrupt watchdog";
+        case ESP_RST_TASK_WDT:  return "task watchdog";
+        case ESP_RST_WDT:       return "watchdog";
+        case ESP_RST_DEEPSLEEP: return "deep sleep";
+        case ESP_RST_BROWNOUT:  return "brown-out";
+        case ESP_RST_SDIO:      return "SDIO";
+    }
+    return "unknown";
+}
+
+void EventJournal::init() {
+    build_crc_table();
+
+    // Each core carries on after the newest entry of its part that
+    // survived; torn entries and any left from an old layout are skipped.
+    // Every core starts past the newest round, so this boot's entries
+    // sort after all earlier ones.
+    uint32_t round = 0;
+    int kept = 0;
+    if (s_journal.magic != JOURNAL_MAGIC) {
+        memset(&s_journal, 0, sizeof(s_journal));
+        s_journal.magic = JOURNAL_MAGIC;
+    }
+    for (int c = 0; c < JOURNAL_CORES; c++) {
+        journal_core_t& core = s_cores[c];
+        bool found = false;
+        uint32_t newest_seq = 0;
+        core.next = 0;
+        for (uint32_t i = 0; i < JOURNAL_CORE_ENTRIES; i++) {
+            const journal_entry_t& entry = core_entry(c, i);
+            if (entry_valid(entry, c)) {
+                kept++;
+                if (!found || entry.seq > newest_seq) {
+                    newest_seq = entry.seq;
+                    core.next = i + 1;
+                    found = true;
+                }
+            }
+        }
+        if (found && newest_seq / JOURNAL_CORES > round) {
+            round = newest_seq / JOURNAL_CORES;
+        }
+
+        // An entry torn by the reset most likely sits just after the
+        // newest one; step over it so it can still be read
+        // (with none, torn is a position already overwritten)
+        const journal_entry_t& after = core_entry(c, core.next);
+        core.torn = core.next - JOURNAL_CORE_ENTRIES - 1;
+        if (found && !entry_valid(after, c) && after.type != 0) {
+            core.torn = core.next++;
+        }
+        core.boot_next = core.next;
+        core.cycles = 0;
+        core.ms = 0;
+    }
+    for (int c = 0; c < JOURNAL_CORES; c++) {
+        s_cores[c].round.store(round, std::memory_order_relaxed);
+    }
+
+    // Until their first tick, times on the other cores count from boot
+    s_cores[xPortGetCoreID()].cycles = esp_cpu_get_cycle_count();
+    s_cores[xPortGetCoreID()].ms = xTaskGetTickCount() * portTICK_PERIOD_MS;
+    for (int c = 0; c < JOURNAL_CORES; c++) {
+        if (esp_register_freertos_tick_hook_for_cpu(sync_clock, c) != ESP_OK) {
+            ESP_LOGW(TAG, "No tick hook on core %d; its times will drift", c);
+        }
+    }
+    s_boots = ++s_journal.boots;
+
+    esp_reset_reason_t reason = esp_reset_reason();
+    ESP_LOGI(TAG, "Boot %lu after %s reset, %d entries from earlier boots", (unsigned long)s_boots,
+             reset_reason_name(reason), kept);
+    record(JOURNAL_BOOT, (uint16_t)s_boots, (uint32_t)reason);
+}
+
+void EventJournal::record(journal_event_t type, uint16_t id, uint32_t value) {
+    if (s_journal.magic != JOURNAL_MAGIC) {
+        return;
+    }
+
+    // With interrupts masked on this core nothing else on it can record,
+    // the tick cannot move the clock, and the task cannot move to another
+    // core, so this core's state needs no lock
+    UBaseType_t mask = portSET_INTERRUPT_MASK_FROM_ISR();
+    int c = xPortGetCoreID();
+    journal_core_t& core = s_cores[c];
+    uint32_t time_ms = core.ms + (esp_cpu_get_cycle_count() - core.cycles) / CYCLES_PER_MS;
+
+    // A flood of bad requests would otherwise push everything else out
+    if (type == JOURNAL_AUTH_FAILURE) {
+        uint32_t last_ms = s_last_auth_ms.load(std::memory_order_relaxed);
+        if (time_ms - last_ms < EVENT_JOURNAL_AUTH_INTERVAL_MS && last_ms != 0) {
+            portCLEAR_INTERRUPT_MASK_FROM_ISR(mask);
+            return;
+        }
+        s_last_auth_ms.store(time_ms, std::memory_order_relaxed);
+    }
+
+    // One round past the newest any core has handed out, so entries sort
+    // in the order they were recorded; the core in the low part keeps two
+    // cores recording at the same moment apart
+    uint32_t round = core.round.load(std::memory_order_relaxed);
+    for (int other = 0; other < JOURNAL_CORES; other++) {
+        uint32_t other_round = s_cores[other].round.load(std::memory_order_relaxed);
+        round = other_round > round ? other_round : round;
+    }
+    round++;
+    core.round.store(round, std::memory_order_relaxed);
+    uint32_t seq = round * JOURNAL_CORES + c;
+
+    journal_entry_t& entry = core_entry(c, core.next++);
+    entry.seq = seq;
+    entry.time_ms = time_ms;
+    entry.type = (uint8_t)type;
+    entry.id = id;
+    entry.value = value;
+    entry.crc = entry_crc(seq, time_ms, (uint8_t)type, id, value);
+    portCLEAR_INTERRUPT_MASK_FROM_ISR(mask);
+}
+
+int EventJournal::list(journal_entry_t* entries) {
+    int count = 0;
+    for (int c = 0; c < JOURNAL_CORES; c++) {
+        // Oldest first within the core's part. Entries being written while
+        // this runs read as torn and are left out; only the one the reset
+        // tore is reported, where it was written.
+        const journal_core_t& core = s_cores[c];
+        uint32_t next = core.next;
+        uint32_t after_seq = 0;
+        for (uint32_t position = next; position != next + JOURNAL_CORE_ENTRIES; position++) {
+            journal_entry_t entry = core_entry(c, position);
+            if (entry_valid(entry, c)) {
+                after_seq = entry.seq;
+            } else if (((position - core.torn) & (JOURNAL_CORE_ENTRIES - 1)) == 0 &&
+                       core.next - core.torn <= JOURNAL_CORE_ENTRIES) {
+                memset(&entry, 0, sizeof(entry));
+                entry.seq = after_seq;
+            } else {
+                continue;
+            }
+
+            // Merge with the other cores' entries by sequence number; a
+            // torn entry keeps its place after the one before it
+            int i = count++;
+            while (i > 0 && entries[i - 1].seq > entry.seq) {
+                entries[i] = entries[i - 1];
+                i--;
+            }
+            entries[i] = entry;
+        }
+    }
+    return count;
+}
+
+uint32_t EventJournal::next() {
+    uint32_t round = 0;
+    for (int c = 0; c < JOURNAL_CORES; c++) {
+        uint32_t core_round = s_cores[c].round.load(std::memory_order_relaxed);
+        round = core_round > round ? core_round : round;
+    }
+    return (round + 1) * JOURNAL_CORES;
+}
+
+uint32_t EventJournal::recorded() {
+    uint32_t count = 0;
+    for (int c = 0; c < JOURNAL_CORES; c++) {
+        count += s_cores[c].next - s_cores[c].boot_next;
+    }
+    return count;
+}
+
+const char* EventJournal::typeName(uint8_t type) {
+    switch (type) {
+        case JOURNAL_BOOT:          return "boot";
+        case JOURNAL_SWITCH:        return "switch";
+        case JOURNAL_AUTH_FAILURE:  return "auth_failure";
+        case JOURNAL_WIFI:          return "wifi";
+        case JOURNAL_OTA:           return "ota";
+    }
+    return "unknown";
+}
+
+void EventJournal::describe(const journal_entry_t* entry, char* buf, size_t len) {
+    uint32_t value = entry->value;
+    const uint8_t* ip = (const uint8_t*)&value;   // Network order, as lwIP keeps it
+
+    switch (entry->type) {
+        case JOURNAL_BOOT:
+            snprintf(buf, len, "Boot %u after %s reset", entry->id, reset_reason_name(value));
+            break;
+        case JOURNAL_SWITCH: {
+            float switch_value;
+            memcpy(&switch_value, &value, sizeof(switch_value));
+            snprintf(buf, len, "Switch %u set to %g", entry->id, switch_value);
+            break;
+        }
+        case JOURNAL_AUTH_FAILURE:
+            snprintf(buf, len, "%s authentication failed from %u.%u.%u.%u",
+                     entry->id == JOURNAL_AUTH_UDP ? "UDP" : "HTTP", ip[0], ip[1], ip[2], ip[3]);
+            break;
+        case JOURNAL_WIFI:
+            if (entry->id == JOURNAL_WIFI_STARTED) {
+                snprintf(buf, len, "Wi-Fi started");
+            } else if (entry->id == JOURNAL_WIFI_CONNECTED) {
+                snprintf(buf, len, "Wi-Fi connected");
+            } else if (entry->id == JOURNAL_WIFI_DISCONNECTED) {
+                snprintf(buf, len, "Wi-Fi disconnected, reason %lu", (unsigned long)value);
+            } else {
+                snprintf(buf, len, "Got IP address %u.%u.%u.%u", ip[0], ip[1], ip[2], ip[3]);
+            }
+            break;
+        case JOURNAL_OTA:
+            if (entry->id == OTA_PHASE_FAILED) {
+                snprintf(buf, len, "OTA failed: %s", esp_err_to_name((esp_err_t)value));
+            } else {
+                snprintf(buf, len, "OTA %s, %lu bytes written", OtaUpdater::getPhaseName((ota_phase_t)entry->id),
+                         (unsigned long)value);
+            }
+            break;
+        default:
+            snprintf(buf, len, "Unknown event");
+            break;
+    }
+}
+
+uint32_t EventJournal::boots() {
+    return s_boots;
+}
+
+void EventJournal::onSwitchChange(void* ctx, const switch_change_t* changes, int count) {
+    for (int i = 0; i < count; i++) {
+        float value = (float)changes[i].value;
+        uint32_t bits;
+        memcpy(&bits, &value, sizeof(bits));
+        record(JOURNAL_SWITCH, (uint16_t)changes[i].id, bits);
+    }
+}
@@ -0,0 +1,77 @@
+#ifndef EVENT_JOURNAL_H
+#define EVENT_JOURNAL_H
+
+#include <esp_err.h>
+#include <stddef.h>
+#include <stdint.h>
+#include "alpaca_switch.h"
+
+// Kinds of journal entry, and what their id and value hold
+typedef enum {
+    JOURNAL_BOOT = 1,           // id: boot count, value: esp_reset_reason_t
+    JOURNAL_SWITCH,             // id: switch, value: new value, float bits
+    JOURNAL_AUTH_FAILURE,       // id: JOURNAL_AUTH_*, value: client IPv4 address
+    JOURNAL_WIFI,               // id: JOURNAL_WIFI_*, value: disconnect reason or IPv4 address
+    JOURNAL_OTA,                // id: ota_phase_t, value: bytes written, or esp_err_t when failed
+} journal_event_t;
+
+// Where an authentication failure came from
+#define JOURNAL_AUTH_HTTP 0
+#define JOURNAL_AUTH_UDP 1
+
+// Wi-Fi transitions
+#define JOURNAL_WIFI_STARTED 0
+#define JOURNAL_WIFI_CONNECTED 1
+#define JOURNAL_WIFI_DISCONNECTED 2
+#define JOURNAL_WIFI_GOT_IP 3
+
+// One entry, 16 bytes. seq orders entries across cores and resets, and
+// carries the core that recorded it; crc covers the other fields, so an
+// entry cut short by a reset is detected.
+typedef struct {
+    uint32_t seq;
+    uint32_t time_ms;           // Since the boot it was recorded in
+    uint8_t type;               // journal_event_t
+    uint8_t crc;
+    uint16_t id;
+    uint32_t value;
+} journal_entry_t;
+
+// Ring of the last EVENT_JOURNAL_ENTRIES events in RTC slow memory,
+// which keeps its contents through panics, watchdog and brown-out
+// resets, so the events leading up to a crash can be read after it.
+// Each core records into its own part of the ring, with interrupts
+// masked on that core for the few instructions it takes: no lock, no
+// atomic increment shared between cores, and the time comes from the
+// cycle counter rather than a call. Cheap enough for the switch path,
+// and safe from any task or interrupt.
+class EventJournal {
+public:
+    // Check the journal left by earlier boots, start a new one if there
+    // is none, and record this boot
+    static void init();
+
+    static void record(journal_event_t type, uint16_t id, uint32_t value);
+
+    // Copy the entries held into entries, which has room for
+    // EVENT_JOURNAL_ENTRIES, oldest first; returns how many. An entry
+    // torn by a reset has type 0 and follows the one before it.
+    static int list(journal_entry_t* entries);
+
+    // Above every sequence number handed out so far
+    static uint32_t next();
+
+    // Entries recorded since this boot
+    static uint32_t recorded();
+
+    // Human-readable description of an entry
+    static void describe(const journal_entry_t* entry, char* buf, size_t len);
+    static const char* typeName(uint8_t type);
+
+    static uint32_t boots();
+
+    // Records switch changes; add with AlpacaSwitch::addChangeListener()
+    static void onSwitchChange(void* ctx, const switch_change_t* changes, int count);
+};
+
+#endif // EVENT_JOURNAL_H
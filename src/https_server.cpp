@@ -0,0 +1,192 @@
+#include "https_server.h"
+#include "metrics.h"
+#include "config.h"
+#include <esp_https_server.h>
+#include <esp_log.h>
+#include <nvs.h>
+#include <lwip/sockets.h>
+#include <stdlib.h>
+#include <string.h>
+
+static const char* TAG = "https_server";
+const char* HttpsServer::NVS_NAMESPACE = "https";
+
+esp_err_t HttpsServer::start(const httpd_config_t& base, httpd_handle_t* handle) {
+    uint8_t* cert = NULL;
+    uint8_t* key = NULL;
+    size_t cert_len = 0;
+    size_t key_len = 0;
+
+    if (loadPem("cert", &cert, &cert_len) != ESP_OK || loadPem("key", &key, &key_len) != ESP_OK) {
+        free(cert);
+        ESP_LOGI(TAG, "No certificate stored, HTTPS disabled");
+        return ESP_ERR_NOT_FOUND;
+    }
+
+    httpd_ssl_config_t config = HTTPD_SSL_CONFIG_DEFAULT();
+    size_t stack_size = config.httpd.stack_size;
+    config.httpd = base;
+    config.httpd.stack_size = stack_size;               // The handshake needs the larger default
+    config.httpd.ctrl_port = base.ctrl_port + 1;        // Each server needs its own control socket
+    config.httpd.max_open_sockets = HTTPS_MAX_OPEN_SOCKETS;
+    config.httpd.open_fn = onSocketOpen;
+
+    // Keep idle connections open so polling clients skip the handshake;
+    // TCP keep-alive frees the TLS session of a client that went away
+    config.httpd.keep_alive_enable = true;
+    config.httpd.keep_alive_idle = HTTPS_KEEPALIVE_IDLE_S;
+    config.httpd.keep_alive_interval = HTTPS_KEEPALIVE_INTERVAL_S;
+    config.httpd.keep_alive_count = HTTPS_KEEPALIVE_COUNT;
+
+    config.port_secure = HTTPS_SERVER_PORT;
+    config.transport_mode = HTTPD_SSL_TRANSPORT_SECURE;
+    config.servercert = cert;
+    config.servercert_len = cert_len;
+    config.prvtkey_pem = key;
+    config.prvtkey_len = key_len;
+    config.session_tickets = true;
+
+    esp_err_t err = httpd_ssl_start(handle, &config);
+    if (err != ESP_OK) {
+        ESP_LOGE(TAG, "Failed to start HTTPS server: %s", esp_err_to_name(err));
+        free(cert);
+        free(key);
+        return err;
+    }
+
+    ESP_LOGI(TAG, "HTTPS server started on port %d", HTTPS_SERVER_PORT);
+    return ESP_OK;
+}
+
+esp_err_t HttpsServer::onSocketOpen(httpd_handle_t hd, int sockfd) {
+    // A response goes out as separate header and body records; with Nagle
+    // the second waits for the client's delayed ACK
+    int nodelay = 1;
+    setsockopt(sockfd, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof(nodelay));
+    return Metrics::onSocketOpen(hd, sockfd);
+}
+
+esp_err_t HttpsServer::loadPem(const char* key, uint8_t** data, size_t* len) {
+    nvs_handle_t handle;
+    esp_err_t err = nvs_open(NVS_NAMESPACE, NVS_READONLY, &handle);
+    if (err != ESP_OK) {
+        return err;
+    }
+
+    size_t size = 0;
+    err = nvs_get_blob(handle, key, NULL, &size);
+    if (err == ESP_OK) {
+        *data = (uint8_t*)malloc(size);
+        err = (*data != NULL) ? nvs_get_blob(handle, key, *data, &size) : ESP_ERR_NO_MEM;
+        if (err != ESP_OK) {
+            free(*data);
+            *data = NULL;
+        }
+    }
+    nvs_close(handle);
+
+    *len = size;
+    return err;
+}
+
+// Find the private key block in a PEM bundle; returns false if there is none
+static bool find_key_block(const char* bundle, size_t len, size_t* start, size_t* end) {
+    const char* pos = bundle;
+    const char* limit = bundle + len;
+
+    while ((pos = strstr(pos, "-----BEGIN ")) != NULL && pos < limit) {
+        const char* line_end = strchr(pos, '\n');
+        if (line_end == NULL) {
+            return false;
+        }
+        // BEGIN PRIVATE KEY, BEGIN EC PRIVATE KEY, BEGIN RSA PRIVATE KEY
+        const char* label = strstr(pos, "PRIVATE KEY-----");
+        if (label != NULL && label < line_end) {
+            const char* footer = strstr(line_end, "PRIVATE KEY-----");
+            if (footer == NULL) {
+                return false;
+            }
+            footer += strlen("PRIVATE KEY-----");
+            if (*footer == '\r') {
+                footer++;
+            }
+            if (*footer == '\n') {
+                footer++;
+            }
+            *start = pos - bundle;
+            *end = footer - bundle;
+            return true;
+        }
+        pos = line_end;
+    }
+    return false;
+}
+
+esp_err_t HttpsServer::storeCredentials(const char* bundle, size_t len) {
+    size_t key_start;
+    size_t key_end;
+    if (!find_key_block(bundle, len, &key_start, &key_end)) {
+        ESP_LOGW(TAG, "No private key in PEM bundle");
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    // The certificates are what is left around the key; both are stored
+    // with the terminating NUL the PEM parser expects
+    size_t cert_len = len - (key_end - key_start);
+    char* cert = (char*)malloc(cert_len + 1);
+    char* key = (char*)malloc(key_end - key_start + 1);
+    if (cert == NULL || key == NULL) {
+        free(cert);
+        free(key);
+        return ESP_ERR_NO_MEM;
+    }
+    memcpy(cert, bundle, key_start);
+    memcpy(cert + key_start, bundle + key_end, len - key_end);
+    cert[cert_len] = '\0';
+    memcpy(key, bundle + key_start, key_end - key_start);
+    key[key_end - key_start] = '\0';
+
+    esp_err_t err = ESP_ERR_INVALID_ARG;
+    if (strstr(cert, "-----BEGIN CERTIFICATE-----") == NULL) {
+        ESP_LOGW(TAG, "No certificate in PEM bundle");
+    } else {
+        nvs_handle_t handle;
+        err = nvs_open(NVS_NAMESPACE, NVS_READWRITE, &handle);
+        if (err == ESP_OK) {
+            err = nvs_set_blob(handle, "cert", cert, cert_len + 1);
+            if (err == ESP_OK) {
+                err = nvs_set_blob(handle, "key", key, key_end - key_start + 1);
+            }
+            if (err == ESP_OK) {
+                err = nvs_commit(handle);
+            }
+            nvs_close(handle);
+        }
+        if (err == ESP_OK) {
+            ESP_LOGI(TAG, "Stored HTTPS certificate, used from next restart");
+        } else {
+            ESP_LOGE(TAG, "Failed to store HTTPS credentials: %s", esp_err_to_name(err));
+        }
+    }
+
+    // Wipe the key copy before it goes back to the heap
+    memset(key, 0, key_end - key_start);
+    free(cert);
+    free(key);
+    return err;
+}
+
+esp_err_t HttpsServer::clearCredentials() {
+    nvs_handle_t handle;
+    esp_err_t err = nvs_open(NVS_NAMESPACE, NVS_READWRITE, &handle);
+    if (err != ESP_OK) {
+        return err;
+    }
+
+    err = nvs_erase_all(handle);
+    if (err == ESP_OK) {
+        err = nvs_commit(handle);
+    }
+    nvs_close(handle);
+    return err;
+}
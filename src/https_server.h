@@ -0,0 +1,38 @@
+#ifndef HTTPS_SERVER_H
+#define HTTPS_SERVER_H
+
+#include <esp_err.h>
+#include <esp_http_server.h>
+#include <stddef.h>
+
+// Optional HTTPS listener serving the same routes as the plain server.
+// It starts only when a certificate and private key are stored in NVS
+// (see storeCredentials). TLS session tickets are enabled, so clients
+// that reconnect resume their session instead of repeating the full
+// handshake, and connections are kept open between requests so a polling
+// client pays for the handshake once.
+class HttpsServer {
+public:
+    // Start the listener with the plain server's settings as a base.
+    // Returns ESP_ERR_NOT_FOUND when no credentials are stored.
+    static esp_err_t start(const httpd_config_t& base, httpd_handle_t* handle);
+
+    // Store a PEM bundle holding the certificate chain and the private
+    // key, in either order, NUL-terminated. Takes effect on the next start.
+    static esp_err_t storeCredentials(const char* bundle, size_t len);
+
+    // Remove the stored credentials, disabling HTTPS from the next start
+    static esp_err_t clearCredentials();
+
+private:
+    static const char* NVS_NAMESPACE;
+
+    // Load a NUL-terminated PEM blob into a buffer that lives as long as
+    // the server
+    static esp_err_t loadPem(const char* key, uint8_t** data, size_t* len);
+
+    // Socket open hook: disable Nagle so small TLS records go out at once
+    static esp_err_t onSocketOpen(httpd_handle_t hd, int sockfd);
+};
+
+#endif // HTTPS_SERVER_H
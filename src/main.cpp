@@ -2,7 +2,6 @@
 
 #include <alpaca_server/api.h>
 #include <alpaca_server/device.h>
-#include <alpaca_server/discovery.h>
 
 #include <esp_app_desc.h>
 #include <esp_http_server.h>
@@ -13,14 +12,35 @@
 #include <esp_wifi.h>
 
 #include "alpaca_switch.h"
+#include "output_drivers.h"
 #include "wifi_manager.h"
+#include "alpaca_discovery.h"
 #include "switch_storage.h"
 #include "ota_updater.h"
+#include "ota_events.h"
+#include "management_server.h"
+#include "metrics.h"
+#include "switch_events.h"
+#include "https_server.h"
+#include "mqtt_bridge.h"
+#include "modbus_server.h"
+#include "udp_control.h"
+#include "dew_controller.h"
+#include "current_sense.h"
+#include "event_journal.h"
+#include "power_fail.h"
 #include "alpaca_auth.h"
 #include "config.h"
 
 static const char *TAG = "main";
 
+// Relays, then the read-only current switches
+#ifdef USE_CURRENT_SENSE
+    #define NUM_SWITCHES (DEFAULT_NUM_SWITCHES + CURRENT_SENSE_SWITCHES)
+#else
+    #define NUM_SWITCHES DEFAULT_NUM_SWITCHES
+#endif
+
 // HTTP Server Configuration
 #define HTTP_SERVER_MAX_URI_HANDLERS 64
 #define HTTP_SERVER_STACK_SIZE 8192
@@ -29,8 +49,56 @@ static const char *TAG = "main";
 #define WIFI_SSID "your_wifi_ssid"
 #define WIFI_PASS "your_wifi_password"
 
-// HTTP server handle
+// Switch outputs on I/O expanders, beyond the ESP32's spare GPIOs
+#if OUTPUT_EXPANDER_CHANNELS > 0
+    #ifdef OUTPUT_EXPANDER_MCP23017
+        #define OUTPUT_EXPANDER_TYPE EXPANDER_MCP23017
+    #else
+        #define OUTPUT_EXPANDER_TYPE EXPANDER_74HC595
+    #endif
+    #if defined(OUTPUT_EXPANDER_SIMULATED)
+        static SimulatedExpanderBus s_expander_bus(OUTPUT_EXPANDER_TYPE, OUTPUT_EXPANDER_CHIPS);
+    #elif defined(OUTPUT_EXPANDER_MCP23017)
+        static I2cExpanderBus s_expander_bus(OUTPUT_EXPANDER_I2C_SDA_PIN, OUTPUT_EXPANDER_I2C_SCL_PIN,
+                                             OUTPUT_EXPANDER_I2C_ADDRESS, OUTPUT_EXPANDER_CHIPS);
+    #else
+        static SpiExpanderBus s_expander_bus(OUTPUT_EXPANDER_SPI_MOSI_PIN, OUTPUT_EXPANDER_SPI_SCLK_PIN,
+                                             OUTPUT_EXPANDER_SPI_LATCH_PIN);
+    #endif
+    static ExpanderOutput s_expander(&s_expander_bus, OUTPUT_EXPANDER_TYPE, OUTPUT_EXPANDER_CHIPS);
+#endif
+
+// HTTP server handles; the HTTPS one stays NULL without a certificate
 static httpd_handle_t server = NULL;
+static httpd_handle_t https_server = NULL;
+
+// Register every route with one server
+static void register_routes(httpd_handle_t handle, AlpacaServer::Api& api, AlpacaSwitch* switchDevice)
+{
+    // Register the API routes with the HTTP server
+    api.register_routes(handle);
+    ESP_LOGI(TAG, "Alpaca API routes registered");
+
+    // OTA progress event stream
+    if (OtaEvents::registerHandlers(handle) != ESP_OK) {
+        ESP_LOGW(TAG, "Failed to register OTA event stream");
+    }
+
+    // Management UI
+    if (ManagementServer::registerHandlers(handle, switchDevice) != ESP_OK) {
+        ESP_LOGW(TAG, "Failed to register management UI");
+    }
+
+    // Switch change push over WebSocket
+    if (SwitchEvents::registerHandlers(handle, switchDevice) != ESP_OK) {
+        ESP_LOGW(TAG, "Failed to register switch event WebSocket");
+    }
+
+    // Prometheus metrics
+    if (Metrics::registerHandlers(handle) != ESP_OK) {
+        ESP_LOGW(TAG, "Failed to register metrics endpoint");
+    }
+}
 
 extern "C" void app_main(void)
 {
@@ -45,6 +113,9 @@ extern "C" void app_main(void)
     ESP_ERROR_CHECK(ret);
 
     ESP_LOGI(TAG, "ESP32 ASCOM Alpaca Switch Controller");
+
+    // Events before the last reset are still in RTC memory
+    EventJournal::init();
     
     // Initialize storage
     SwitchStorage::init();
@@ -86,12 +157,22 @@ extern "C" void app_main(void)
     config.max_uri_handlers = HTTP_SERVER_MAX_URI_HANDLERS;
     config.stack_size = HTTP_SERVER_STACK_SIZE;
     config.lru_purge_enable = true;
+    config.core_id = HTTPD_TASK_CORE;
+    config.task_priority = HTTPD_TASK_PRIORITY;
+    config.open_fn = Metrics::onSocketOpen;
+    config.close_fn = SwitchEvents::onSocketClose;
+    Metrics::setSocketLimit(config.max_open_sockets);
 
     ESP_ERROR_CHECK(httpd_start(&server, &config));
     ESP_LOGI(TAG, "HTTP server started");
+
+    // HTTPS alongside, when a certificate has been stored
+    if (HttpsServer::start(config, &https_server) == ESP_OK) {
+        Metrics::setSocketLimit(config.max_open_sockets + HTTPS_MAX_OPEN_SOCKETS);
+    }
     
     // Create switch configurations
-    switch_config_t switch_configs[DEFAULT_NUM_SWITCHES]; 
+    switch_config_t switch_configs[NUM_SWITCHES] = {};
     
     // Initialize with default values
     for (int i = 0; i < DEFAULT_NUM_SWITCHES; i++) {
@@ -125,10 +206,87 @@ extern "C" void app_main(void)
             switch_configs[i].step = DEFAULT_SWITCH_STEPS[i];
             switch_configs[i].can_write = DEFAULT_SWITCH_CAN_WRITE[i];
         }
+        
+        // Ganged pins set through the management API replace the defaults
+        switch_gang_t* gang = &switch_configs[i].gang;
+        if (SwitchStorage::loadGang(i, gang) != ESP_OK) {
+            for (int j = 0; j < SWITCH_GANG_MAX_PINS - 1; j++) {
+                if (DEFAULT_SWITCH_GANG_PINS[i][j] >= 0) {
+                    gang->pins[gang->count++] = (int8_t)DEFAULT_SWITCH_GANG_PINS[i][j];
+                }
+            }
+            gang->delay_ms = (uint16_t)DEFAULT_SWITCH_GANG_DELAY_MS[i];
+        }
+    }
+
+    #ifdef USE_CURRENT_SENSE
+        for (int i = 0; i < CURRENT_SENSE_SWITCHES; i++) {
+            CurrentSense::getSwitchConfig(i, &switch_configs[DEFAULT_NUM_SWITCHES + i]);
+        }
+    #endif
+
+    // Switches start as they were last set rather than at their defaults,
+    // including changes a brown-out kept from NVS. Read-only and automatic
+    // switches are left to whatever sets them.
+    bool saved_states[NUM_SWITCHES];
+    double saved_values[NUM_SWITCHES];
+    if (PowerFail::recover(saved_states, saved_values, NUM_SWITCHES) == ESP_OK) {
+        for (int i = 0; i < DEFAULT_NUM_SWITCHES; i++) {
+            #ifdef USE_DEW_HEATER
+                if (i == DEW_HEATER_SWITCH) {
+                    continue;
+                }
+            #endif
+            if (switch_configs[i].can_write) {
+                switch_configs[i].restored = true;
+                switch_configs[i].state = saved_states[i];
+                switch_configs[i].value = saved_values[i];
+            }
+        }
     }
     
+    // Switches whose pins are expander channels still start if the bus
+    // does not: their writes fail and are retried with each change
+    OutputBackend* expander = NULL;
+    #if OUTPUT_EXPANDER_CHANNELS > 0
+        #ifndef OUTPUT_EXPANDER_SIMULATED
+            if (s_expander_bus.begin() != ESP_OK) {
+                ESP_LOGE(TAG, "Failed to start the output expander bus");
+            }
+        #endif
+        expander = &s_expander;
+        Metrics::setOutputExpander(&s_expander);
+    #endif
+    
     // Create ASCOM Switch device instance
-    AlpacaSwitch* switchDevice = new AlpacaSwitch(switch_configs, DEFAULT_NUM_SWITCHES);
+    AlpacaSwitch* switchDevice = new AlpacaSwitch(switch_configs, NUM_SWITCHES, expander);
+
+    // Interlock and automation rules, stored precompiled. A table from an
+    // older firmware is compiled again from the stored text.
+    SwitchRules rules;
+    if (SwitchStorage::loadRules(&rules, NUM_SWITCHES) == ESP_OK) {
+        switchDevice->setRules(rules);
+    } else {
+        char* text = new char[SWITCH_RULES_MAX_TEXT];
+        char error[96];
+        if (SwitchStorage::loadRulesText(text, SWITCH_RULES_MAX_TEXT) == ESP_OK && text[0] != '\0') {
+            if (rules.compile(text, NUM_SWITCHES, error, sizeof(error)) == ESP_OK) {
+                SwitchStorage::saveRules(text, &rules);
+                switchDevice->setRules(rules);
+                ESP_LOGI(TAG, "Rules compiled again from their text");
+            } else {
+                ESP_LOGW(TAG, "Stored rules no longer compile: %s", error);
+            }
+        }
+        delete[] text;
+    }
+
+    // Scene presets, applied with the scene:apply action
+    SwitchScenes* scenes = new SwitchScenes();
+    if (SwitchStorage::loadScenes(scenes, NUM_SWITCHES) == ESP_OK) {
+        switchDevice->setScenes(*scenes);
+    }
+    delete scenes;
     
     // Create vector of devices
     std::vector<AlpacaServer::Device *> devices;
@@ -144,14 +302,66 @@ extern "C" void app_main(void)
         DEVICE_LOCATION
     );
     
-    // Register the API routes with the HTTP server
-    api.register_routes(server);
-    ESP_LOGI(TAG, "Alpaca API routes registered");
+    register_routes(server, api, switchDevice);
+    if (https_server != NULL) {
+        register_routes(https_server, api, switchDevice);
+    }
+
+    // Keep switch states safe from the next brown-out
+    if (PowerFail::start(switchDevice) != ESP_OK) {
+        ESP_LOGW(TAG, "Failed to start power-fail snapshots");
+    }
+
+    // Journal switch changes, for reading after a crash
+    if (switchDevice->addChangeListener(EventJournal::onSwitchChange, NULL) != ESP_OK) {
+        ESP_LOGW(TAG, "Failed to journal switch changes");
+    }
+
+    // Persist switch changes and relay wear in the background
+    if (SwitchStorage::startFlushTask(switchDevice) != ESP_OK) {
+        ESP_LOGW(TAG, "Failed to start switch state flush task");
+    }
+    Metrics::setSwitchDevice(switchDevice);
+
+    // MQTT bridge, connects once a broker is configured
+    if (MqttBridge::start(switchDevice) != ESP_OK) {
+        ESP_LOGW(TAG, "Failed to start MQTT bridge");
+    }
+
+    // Modbus TCP for PLCs
+    #ifdef USE_MODBUS_TCP
+        if (ModbusServer::start(switchDevice) != ESP_OK) {
+            ESP_LOGW(TAG, "Failed to start Modbus TCP server");
+        }
+    #endif
+
+    // Closed-loop dew heater on one of the switches
+    #ifdef USE_DEW_HEATER
+        int heater_pin = DEW_HEATER_SWITCH < DEFAULT_NUM_SWITCHES ? switch_configs[DEW_HEATER_SWITCH].gpio_pin : -1;
+        if (DewController::start(switchDevice, heater_pin) != ESP_OK) {
+            ESP_LOGW(TAG, "Failed to start dew heater control");
+        }
+    #endif
+
+    // Load current sensing on the relays
+    #ifdef USE_CURRENT_SENSE
+        if (CurrentSense::start(switchDevice, DEFAULT_NUM_SWITCHES) != ESP_OK) {
+            ESP_LOGW(TAG, "Failed to start current sensing");
+        }
+    #endif
+
+    // Authenticated UDP switching, answers once a key is stored
+    if (UdpControl::start(switchDevice) != ESP_OK) {
+        ESP_LOGW(TAG, "Failed to start UDP control");
+    }
 
     // Start the Alpaca Discovery service - will work on local networks
     // even without internet connection
     ESP_LOGI(TAG, "Starting Alpaca Discovery server");
-    alpaca_server_discovery_start(HTTP_SERVER_PORT);
+    if (AlpacaDiscovery::start(HTTP_SERVER_PORT) != ESP_OK) {
+        ESP_LOGW(TAG, "Failed to start Alpaca discovery");
+    }
+    wifiManager.setIpCallback(AlpacaDiscovery::onIpChanged, wifiManager.getNetif());
     
     // Main loop
     ESP_LOGI(TAG, "System startup complete, entering main loop");
@@ -0,0 +1,727 @@
+#include "management_server.h"
+#include "management_page.h"
+#include "ota_updater.h"
+#include "alpaca_auth.h"
+#include "https_server.h"
+#include "mqtt_bridge.h"
+#include "udp_control.h"
+#include "switch_storage.h"
+#include "request_arena.h"
+#include "dew_controller.h"
+#include "current_sense.h"
+#include "event_journal.h"
+#include "config.h"
+#include <esp_log.h>
+#include <stdlib.h>
+#include <string.h>
+
+static const char* TAG = "management";
+
+// Cache policy: versioned assets never change under the same URL, the page
+// itself is always revalidated against its ETag
+#define CACHE_IMMUTABLE "public, max-age=31536000, immutable"
+#define CACHE_REVALIDATE "no-cache"
+
+// Largest accepted form body
+#define FORM_MAX_SIZE 512
+
+// Decode a form value in place ('+' and %XX escapes)
+static void url_decode(char* value) {
+    char* out = value;
+    for (char* in = value; *in != '\0'; in++) {
+        if (*in == '+') {
+            *out++ = ' ';
+        } else if (in[0] == '%' && in[1] != '\0' && in[2] != '\0') {
+            char hex[3] = { in[1], in[2], '\0' };
+            *out++ = (char)strtol(hex, NULL, 16);
+            in += 2;
+        } else {
+            *out++ = *in;
+        }
+    }
+    *out = '\0';
+}
+
+// Get a decoded value from a form body
+static bool form_value(const char* form, const char* key, char* value, size_t len) {
+    if (httpd_query_key_value(form, key, value, len) != ESP_OK) {
+        return false;
+    }
+    url_decode(value);
+    return true;
+}
+
+// Copy a string into a JSON string body, escaping as needed
+static void json_escape(const char* in, char* out, size_t len) {
+    size_t pos = 0;
+    for (; *in != '\0' && pos + 7 < len; in++) {
+        unsigned char c = (unsigned char)*in;
+        if (c == '"' || c == '\\') {
+            out[pos++] = '\\';
+            out[pos++] = c;
+        } else if (c < 0x20) {
+            pos += snprintf(&out[pos], len - pos, "\\u%04x", c);
+        } else {
+            out[pos++] = c;
+        }
+    }
+    out[pos] = '\0';
+}
+
+esp_err_t ManagementServer::registerHandlers(httpd_handle_t server, AlpacaSwitch* device) {
+    esp_err_t err;
+    char uri[64];
+
+    // One handler per asset, with the asset as context; "/ui/" is the page
+    for (size_t i = 0; i < management_page_asset_count(); i++) {
+        const management_asset_t* asset = management_page_asset(i);
+        snprintf(uri, sizeof(uri), "/ui/%s", asset->name);
+
+        httpd_uri_t asset_uri = {};
+        asset_uri.uri = uri;
+        asset_uri.method = HTTP_GET;
+        asset_uri.handler = assetHandler;
+        asset_uri.user_ctx = (void*)asset;
+        err = httpd_register_uri_handler(server, &asset_uri);
+        if (err != ESP_OK) {
+            return err;
+        }
+
+        if (strcmp(asset->name, "index.html") == 0) {
+            asset_uri.uri = "/ui/";
+            err = httpd_register_uri_handler(server, &asset_uri);
+            if (err != ESP_OK) {
+                return err;
+            }
+        }
+    }
+
+    httpd_uri_t status_uri = {};
+    status_uri.uri = "/ui/api/status";
+    status_uri.method = HTTP_GET;
+    status_uri.handler = statusHandler;
+    err = httpd_register_uri_handler(server, &status_uri);
+    if (err != ESP_OK) {
+        return err;
+    }
+
+    httpd_uri_t ota_uri = {};
+    ota_uri.uri = "/ui/api/ota";
+    ota_uri.method = HTTP_POST;
+    ota_uri.handler = otaHandler;
+    err = httpd_register_uri_handler(server, &ota_uri);
+    if (err != ESP_OK) {
+        return err;
+    }
+
+    httpd_uri_t auth_uri = {};
+    auth_uri.uri = "/ui/api/auth";
+    auth_uri.method = HTTP_POST;
+    auth_uri.handler = authHandler;
+    err = httpd_register_uri_handler(server, &auth_uri);
+    if (err != ESP_OK) {
+        return err;
+    }
+
+    httpd_uri_t mqtt_uri = {};
+    mqtt_uri.uri = "/ui/api/mqtt";
+    mqtt_uri.method = HTTP_POST;
+    mqtt_uri.handler = mqttHandler;
+    err = httpd_register_uri_handler(server, &mqtt_uri);
+    if (err != ESP_OK) {
+        return err;
+    }
+
+    // POST sets the UDP control key, DELETE disables the protocol
+    httpd_uri_t udp_uri = {};
+    udp_uri.uri = "/ui/api/udp";
+    udp_uri.method = HTTP_POST;
+    udp_uri.handler = udpKeyHandler;
+    err = httpd_register_uri_handler(server, &udp_uri);
+    if (err != ESP_OK) {
+        return err;
+    }
+    udp_uri.method = HTTP_DELETE;
+    err = httpd_register_uri_handler(server, &udp_uri);
+    if (err != ESP_OK) {
+        return err;
+    }
+
+    // GET returns the rule text, POST replaces the rules
+    httpd_uri_t rules_uri = {};
+    rules_uri.uri = "/ui/api/rules";
+    rules_uri.method = HTTP_GET;
+    rules_uri.handler = rulesHandler;
+    rules_uri.user_ctx = device;
+    err = httpd_register_uri_handler(server, &rules_uri);
+    if (err != ESP_OK) {
+        return err;
+    }
+    rules_uri.method = HTTP_POST;
+    err = httpd_register_uri_handler(server, &rules_uri);
+    if (err != ESP_OK) {
+        return err;
+    }
+
+    // GET returns the ganged pins in use, POST saves a switch's gang
+    httpd_uri_t gang_uri = {};
+    gang_uri.uri = "/ui/api/gangs";
+    gang_uri.method = HTTP_GET;
+    gang_uri.handler = gangHandler;
+    gang_uri.user_ctx = device;
+    err = httpd_register_uri_handler(server, &gang_uri);
+    if (err != ESP_OK) {
+        return err;
+    }
+    gang_uri.method = HTTP_POST;
+    err = httpd_register_uri_handler(server, &gang_uri);
+    if (err != ESP_OK) {
+        return err;
+    }
+
+    // GET returns the dew heater readings, POST sets its mode and margin
+    httpd_uri_t dew_uri = {};
+    dew_uri.uri = "/ui/api/dew";
+    dew_uri.method = HTTP_GET;
+    dew_uri.handler = dewHandler;
+    err = httpd_register_uri_handler(server, &dew_uri);
+    if (err != ESP_OK) {
+        return err;
+    }
+    dew_uri.method = HTTP_POST;
+    err = httpd_register_uri_handler(server, &dew_uri);
+    if (err != ESP_OK) {
+        return err;
+    }
+
+    // GET records raw current sense samples for replay on a host
+    httpd_uri_t capture_uri = {};
+    capture_uri.uri = "/ui/api/current/capture";
+    capture_uri.method = HTTP_GET;
+    capture_uri.handler = currentCaptureHandler;
+    err = httpd_register_uri_handler(server, &capture_uri);
+    if (err != ESP_OK) {
+        return err;
+    }
+
+    // GET returns the event journal, including events before the last reset
+    httpd_uri_t journal_uri = {};
+    journal_uri.uri = "/ui/api/journal";
+    journal_uri.method = HTTP_GET;
+    journal_uri.handler = journalHandler;
+    err = httpd_register_uri_handler(server, &journal_uri);
+    if (err != ESP_OK) {
+        return err;
+    }
+
+    // POST stores a PEM bundle, DELETE removes it
+    httpd_uri_t tls_uri = {};
+    tls_uri.uri = "/ui/api/tls";
+    tls_uri.method = HTTP_POST;
+    tls_uri.handler = tlsHandler;
+    err = httpd_register_uri_handler(server, &tls_uri);
+    if (err != ESP_OK) {
+        return err;
+    }
+    tls_uri.method = HTTP_DELETE;
+    return httpd_register_uri_handler(server, &tls_uri);
+}
+
+bool ManagementServer::authorize(httpd_req_t* req) {
+    if (AlpacaAuth::verifyRequest(req)) {
+        return true;
+    }
+    AlpacaAuth::addAuthHeaders(req);
+    httpd_resp_send_err(req, HTTPD_401_UNAUTHORIZED, "Authentication required");
+    return false;
+}
+
+esp_err_t ManagementServer::readForm(httpd_req_t* req, char* buf, size_t len) {
+    if (req->content_len >= len) {
+        return ESP_ERR_INVALID_SIZE;
+    }
+
+    size_t received = 0;
+    while (received < req->content_len) {
+        int ret = httpd_req_recv(req, buf + received, req->content_len - received);
+        if (ret == HTTPD_SOCK_ERR_TIMEOUT) {
+            continue;
+        }
+        if (ret <= 0) {
+            return ESP_FAIL;
+        }
+        received += ret;
+    }
+    buf[received] = '\0';
+    return ESP_OK;
+}
+
+esp_err_t ManagementServer::assetHandler(httpd_req_t* req) {
+    const management_asset_t* asset = static_cast<const management_asset_t*>(req->user_ctx);
+
+    if (!authorize(req)) {
+        return ESP_OK;
+    }
+
+    httpd_resp_set_hdr(req, "ETag", asset->etag);
+    httpd_resp_set_hdr(req, "Cache-Control", asset->immutable ? CACHE_IMMUTABLE : CACHE_REVALIDATE);
+
+    // A matching ETag means the browser's copy is current
+    char if_none_match[40];
+    if (httpd_req_get_hdr_value_str(req, "If-None-Match", if_none_match,
+                                    sizeof(if_none_match)) == ESP_OK &&
+        strcmp(if_none_match, asset->etag) == 0) {
+        httpd_resp_set_status(req, "304 Not Modified");
+        return httpd_resp_send(req, NULL, 0);
+    }
+
+    // Sent directly from the flash mapping, no copy into RAM
+    httpd_resp_set_type(req, asset->content_type);
+    httpd_resp_set_hdr(req, "Content-Encoding", "gzip");
+    return httpd_resp_send(req, (const char*)asset->start, asset->end - asset->start);
+}
+
+esp_err_t ManagementServer::statusHandler(httpd_req_t* req) {
+    char username[96];
+    char mqtt_uri[192];
+    char mqtt_prefix[96];
+    char mqtt_username[96];
+    char json[640];
+
+    if (!authorize(req)) {
+        return ESP_OK;
+    }
+
+    mqtt_bridge_config_t mqtt;
+    MqttBridge::getConfig(&mqtt);
+    json_escape(mqtt.uri, mqtt_uri, sizeof(mqtt_uri));
+    json_escape(mqtt.prefix, mqtt_prefix, sizeof(mqtt_prefix));
+    json_escape(mqtt.username, mqtt_username, sizeof(mqtt_username));
+
+    json_escape(AlpacaAuth::getUsername(), username, sizeof(username));
+    snprintf(json, sizeof(json),
+             "{\"firmware\":\"%s\",\"auth_enabled\":%s,\"username\":\"%s\","
+             "\"mqtt\":{\"uri\":\"%s\",\"prefix\":\"%s\",\"username\":\"%s\",\"connected\":%s}}",
+             OtaUpdater::getFirmwareVersion(),
+             AlpacaAuth::isEnabled() ? "true" : "false", username,
+             mqtt_uri, mqtt_prefix, mqtt_username, MqttBridge::isConnected() ? "true" : "false");
+
+    httpd_resp_set_type(req, "application/json");
+    httpd_resp_set_hdr(req, "Cache-Control", "no-store");
+    return httpd_resp_sendstr(req, json);
+}
+
+esp_err_t ManagementServer::otaHandler(httpd_req_t* req) {
+    char form[FORM_MAX_SIZE];
+    char url[256];
+
+    if (!authorize(req)) {
+        return ESP_OK;
+    }
+
+    if (readForm(req, form, sizeof(form)) != ESP_OK || !form_value(form, "url", url, sizeof(url))) {
+        return httpd_resp_send_err(req, HTTPD_400_BAD_REQUEST, "Missing firmware URL");
+    }
+
+    esp_err_t err = OtaUpdater::startUpdate(url);
+    if (err == ESP_ERR_INVALID_STATE) {
+        httpd_resp_set_status(req, "409 Conflict");
+        return httpd_resp_sendstr(req, "An update is already in progress");
+    }
+    if (err != ESP_OK) {
+        return httpd_resp_send_err(req, HTTPD_500_INTERNAL_SERVER_ERROR, esp_err_to_name(err));
+    }
+
+    ESP_LOGI(TAG, "Firmware update requested from %s", url);
+    httpd_resp_set_status(req, "202 Accepted");
+    return httpd_resp_sendstr(req, "Update started");
+}
+
+esp_err_t ManagementServer::authHandler(httpd_req_t* req) {
+    char form[FORM_MAX_SIZE];
+    char enabled[4];
+    char username[64];
+    char password[64];
+
+    if (!authorize(req)) {
+        return ESP_OK;
+    }
+
+    if (readForm(req, form, sizeof(form)) != ESP_OK || !form_value(form, "enabled", enabled, sizeof(enabled))) {
+        return httpd_resp_send_err(req, HTTPD_400_BAD_REQUEST, "Invalid request");
+    }
+
+    // Credentials only change when a new password is given
+    if (form_value(form, "password", password, sizeof(password)) && password[0] != '\0') {
+        if (!form_value(form, "username", username, sizeof(username)) ||
+            AlpacaAuth::setCredentials(username, password) != ESP_OK) {
+            return httpd_resp_send_err(req, HTTPD_400_BAD_REQUEST, "Invalid username or password");
+        }
+    }
+
+    if (AlpacaAuth::setEnabled(strcmp(enabled, "1") == 0) != ESP_OK) {
+        return httpd_resp_send_err(req, HTTPD_500_INTERNAL_SERVER_ERROR, "Failed to save settings");
+    }
+
+    return httpd_resp_sendstr(req, "Saved");
+}
+
+esp_err_t ManagementServer::tlsHandler(httpd_req_t* req) {
+    if (!authorize(req)) {
+        return ESP_OK;
+    }
+
+    if (req->method == HTTP_DELETE) {
+        if (HttpsServer::clearCredentials() != ESP_OK) {
+            return httpd_resp_send_err(req, HTTPD_500_INTERNAL_SERVER_ERROR, "Failed to remove certificate");
+        }
+        return httpd_resp_sendstr(req, "Removed, HTTPS is disabled after a restart");
+    }
+
+    // Certificates are only uploaded when provisioning, so the buffer
+    // comes from the heap rather than the request arena
+    char* bundle = (char*)malloc(HTTPS_MAX_PEM_SIZE);
+    if (bundle == NULL) {
+        return httpd_resp_send_err(req, HTTPD_500_INTERNAL_SERVER_ERROR, "Out of memory");
+    }
+
+    esp_err_t err = readForm(req, bundle, HTTPS_MAX_PEM_SIZE);
+    if (err == ESP_OK) {
+        err = HttpsServer::storeCredentials(bundle, req->content_len);
+    }
+    memset(bundle, 0, HTTPS_MAX_PEM_SIZE);
+    free(bundle);
+
+    if (err != ESP_OK) {
+        return httpd_resp_send_err(req, HTTPD_400_BAD_REQUEST,
+                                   "Expected a PEM certificate and private key");
+    }
+    return httpd_resp_sendstr(req, "Saved, HTTPS starts after a restart");
+}
+
+esp_err_t ManagementServer::mqttHandler(httpd_req_t* req) {
+    char form[FORM_MAX_SIZE];
+    mqtt_bridge_config_t config;
+
+    if (!authorize(req)) {
+        return ESP_OK;
+    }
+
+    if (readForm(req, form, sizeof(form)) != ESP_OK) {
+        return httpd_resp_send_err(req, HTTPD_400_BAD_REQUEST, "Invalid request");
+    }
+
+    // Fields left out keep their current value; an empty URI disables the bridge
+    MqttBridge::getConfig(&config);
+    form_value(form, "uri", config.uri, sizeof(config.uri));
+    form_value(form, "prefix", config.prefix, sizeof(config.prefix));
+    form_value(form, "username", config.username, sizeof(config.username));
+
+    // The password only changes when a new one is given
+    char password[sizeof(config.password)];
+    if (form_value(form, "password", password, sizeof(password)) && password[0] != '\0') {
+        strlcpy(config.password, password, sizeof(config.password));
+    }
+
+    if (MqttBridge::setConfig(&config) != ESP_OK) {
+        return httpd_resp_send_err(req, HTTPD_400_BAD_REQUEST, "Invalid MQTT settings");
+    }
+    return httpd_resp_sendstr(req, "Saved");
+}
+
+esp_err_t ManagementServer::udpKeyHandler(httpd_req_t* req) {
+    char form[FORM_MAX_SIZE];
+    char hex[2 * UDP_CONTROL_KEY_SIZE + 1];
+    uint8_t key[UDP_CONTROL_KEY_SIZE];
+
+    if (!authorize(req)) {
+        return ESP_OK;
+    }
+
+    if (req->method == HTTP_DELETE) {
+        if (UdpControl::setKey(NULL) != ESP_OK) {
+            return httpd_resp_send_err(req, HTTPD_500_INTERNAL_SERVER_ERROR, "Failed to remove key");
+        }
+        return httpd_resp_sendstr(req, "Removed, UDP control is disabled");
+    }
+
+    // The key is 32 bytes as 64 hex digits
+    if (readForm(req, form, sizeof(form)) != ESP_OK || !form_value(form, "key", hex, sizeof(hex)) ||
+        strlen(hex) != 2 * UDP_CONTROL_KEY_SIZE) {
+        return httpd_resp_send_err(req, HTTPD_400_BAD_REQUEST, "Expected a 64 digit hex key");
+    }
+    for (int i = 0; i < UDP_CONTROL_KEY_SIZE; i++) {
+        char byte[3] = { hex[2 * i], hex[2 * i + 1], '\0' };
+        char* end;
+        key[i] = (uint8_t)strtol(byte, &end, 16);
+        if (*end != '\0') {
+            return httpd_resp_send_err(req, HTTPD_400_BAD_REQUEST, "Expected a 64 digit hex key");
+        }
+    }
+
+    esp_err_t err = UdpControl::setKey(key);
+    memset(key, 0, sizeof(key));
+    memset(hex, 0, sizeof(hex));
+    memset(form, 0, sizeof(form));
+    if (err != ESP_OK) {
+        return httpd_resp_send_err(req, HTTPD_500_INTERNAL_SERVER_ERROR, "Failed to save key");
+    }
+    return httpd_resp_sendstr(req, "Saved");
+}
+
+esp_err_t ManagementServer::rulesHandler(httpd_req_t* req) {
+    AlpacaSwitch* device = static_cast<AlpacaSwitch*>(req->user_ctx);
+    char error[160];
+
+    if (!authorize(req)) {
+        return ESP_OK;
+    }
+
+    char* text = (char*)RequestArena::alloc(SWITCH_RULES_MAX_TEXT);
+    if (text == NULL) {
+        return httpd_resp_send_err(req, HTTPD_500_INTERNAL_SERVER_ERROR, "Out of memory");
+    }
+
+    if (req->method == HTTP_GET) {
+        SwitchStorage::loadRulesText(text, SWITCH_RULES_MAX_TEXT);
+        httpd_resp_set_type(req, "text/plain");
+        return httpd_resp_sendstr(req, text);
+    }
+
+    // Rule text is percent-encoded in the form, so allow for some growth
+    char* form = (char*)RequestArena::alloc(2 * SWITCH_RULES_MAX_TEXT);
+    if (form == NULL) {
+        return httpd_resp_send_err(req, HTTPD_500_INTERNAL_SERVER_ERROR, "Out of memory");
+    }
+    if (readForm(req, form, 2 * SWITCH_RULES_MAX_TEXT) != ESP_OK ||
+        !form_value(form, "rules", text, SWITCH_RULES_MAX_TEXT)) {
+        return httpd_resp_send_err(req, HTTPD_400_BAD_REQUEST, "Missing or too long rules");
+    }
+
+    int32_t num_switches;
+    device->get_maxswitch(&num_switches);
+    SwitchRules rules;
+    if (rules.compile(text, num_switches, error, sizeof(error)) != ESP_OK) {
+        return httpd_resp_send_err(req, HTTPD_400_BAD_REQUEST, error);
+    }
+
+    device->setRules(rules);
+    if (SwitchStorage::saveRules(text, &rules) != ESP_OK) {
+        return httpd_resp_send_err(req, HTTPD_500_INTERNAL_SERVER_ERROR, "Rules are active but could not be saved");
+    }
+
+    snprintf(error, sizeof(error), "Saved %d rule entries", rules.count());
+    return httpd_resp_sendstr(req, error);
+}
+
+esp_err_t ManagementServer::gangHandler(httpd_req_t* req) {
+    AlpacaSwitch* device = static_cast<AlpacaSwitch*>(req->user_ctx);
+    char form[FORM_MAX_SIZE];
+    char value[48];
+    char json[96];
+
+    if (!authorize(req)) {
+        return ESP_OK;
+    }
+
+    if (req->method == HTTP_GET) {
+        httpd_resp_set_type(req, "application/json");
+        httpd_resp_sendstr_chunk(req, "[");
+        for (int i = 0; i < DEFAULT_NUM_SWITCHES; i++) {
+            switch_gang_t gang;
+            device->getGang(i, &gang);
+            size_t pos = snprintf(json, sizeof(json), "%s{\"id\":%d,\"pins\":[", i > 0 ? "," : "", i);
+            for (int j = 0; j < gang.count; j++) {
+                pos += snprintf(json + pos, sizeof(json) - pos, "%s%d", j > 0 ? "," : "", gang.pins[j]);
+            }
+            snprintf(json + pos, sizeof(json) - pos, "],\"delay_ms\":%u}", gang.delay_ms);
+            httpd_resp_sendstr_chunk(req, json);
+        }
+        httpd_resp_sendstr_chunk(req, "]");
+        return httpd_resp_sendstr_chunk(req, NULL);
+    }
+
+    // Pins are a comma-separated list, empty to drive the switch's own pin only
+    if (readForm(req, form, sizeof(form)) != ESP_OK || !form_value(form, "id", value, sizeof(value))) {
+        return httpd_resp_send_err(req, HTTPD_400_BAD_REQUEST, "Missing switch id");
+    }
+    int id = atoi(value);
+    if (id < 0 || id >= DEFAULT_NUM_SWITCHES) {
+        return httpd_resp_send_err(req, HTTPD_400_BAD_REQUEST, "Only output switches can be ganged");
+    }
+
+    switch_gang_t gang = {};
+    if (form_value(form, "delay_ms", value, sizeof(value))) {
+        long delay = strtol(value, NULL, 10);
+        if (delay < 0 || delay > 10000) {
+            return httpd_resp_send_err(req, HTTPD_400_BAD_REQUEST, "Delay must be 0 to 10000 ms");
+        }
+        gang.delay_ms = (uint16_t)delay;
+    }
+    if (form_value(form, "pins", value, sizeof(value))) {
+        char* pos = value;
+        while (*pos != '\0') {
+            char* end;
+            long pin = strtol(pos, &end, 10);
+            bool expander = pin >= OUTPUT_EXPANDER_PIN_BASE && pin < OUTPUT_EXPANDER_PIN_BASE + OUTPUT_EXPANDER_CHANNELS;
+            if (end == pos || !(GPIO_IS_VALID_OUTPUT_GPIO(pin) || expander) || gang.count >= SWITCH_GANG_MAX_PINS - 1) {
+                return httpd_resp_send_err(req, HTTPD_400_BAD_REQUEST, "Expected up to 3 output pins");
+            }
+            for (int j = 0; j < gang.count; j++) {
+                if (gang.pins[j] == pin) {
+                    return httpd_resp_send_err(req, HTTPD_400_BAD_REQUEST, "Pins must be distinct");
+                }
+            }
+            gang.pins[gang.count++] = (int8_t)pin;
+            pos = *end == ',' ? end + 1 : end;
+            if (*end != ',' && *end != '\0') {
+                return httpd_resp_send_err(req, HTTPD_400_BAD_REQUEST, "Expected up to 3 output pins");
+            }
+        }
+    }
+
+    // Pins are configured as the device starts
+    if (SwitchStorage::saveGang(id, &gang) != ESP_OK) {
+        return httpd_resp_send_err(req, HTTPD_500_INTERNAL_SERVER_ERROR, "Failed to save gang");
+    }
+    return httpd_resp_sendstr(req, "Saved, the gang applies after a restart");
+}
+
+esp_err_t ManagementServer::dewHandler(httpd_req_t* req) {
+    char form[FORM_MAX_SIZE];
+    char value[16];
+    char json[384];
+
+    if (!authorize(req)) {
+        return ESP_OK;
+    }
+
+    if (req->method == HTTP_POST) {
+        if (readForm(req, form, sizeof(form)) != ESP_OK) {
+            return httpd_resp_send_err(req, HTTPD_400_BAD_REQUEST, "Invalid request");
+        }
+
+        // Fields left out keep their current value
+        esp_err_t err = ESP_OK;
+        if (form_value(form, "margin", value, sizeof(value))) {
+            err = DewController::setMargin(strtof(value, NULL));
+        }
+        if (err == ESP_OK && form_value(form, "auto", value, sizeof(value))) {
+            err = DewController::setAutomatic(strcmp(value, "1") == 0);
+        }
+        if (err == ESP_ERR_INVALID_STATE) {
+            return httpd_resp_send_err(req, HTTPD_404_NOT_FOUND, "Dew heater control is not enabled");
+        }
+        if (err != ESP_OK) {
+            return httpd_resp_send_err(req, HTTPD_400_BAD_REQUEST, "Invalid dew heater settings");
+        }
+        return httpd_resp_sendstr(req, "Saved");
+    }
+
+    dew_status_t dew;
+    DewController::getStatus(&dew);
+    snprintf(json, sizeof(json),
+             "{\"running\":%s,\"automatic\":%s,\"sensors_ok\":%s,\"ambient\":%.2f,\"humidity\":%.1f,"
+             "\"dew_point\":%.2f,\"optic\":%.2f,\"target\":%.2f,\"margin\":%.1f,\"duty\":%.3f}",
+             dew.running ? "true" : "false", dew.automatic ? "true" : "false",
+             dew.sensors_ok ? "true" : "false", dew.ambient, dew.humidity, dew.dew_point, dew.optic,
+             dew.target, dew.margin, dew.duty);
+
+    httpd_resp_set_type(req, "application/json");
+    httpd_resp_set_hdr(req, "Cache-Control", "no-store");
+    return httpd_resp_sendstr(req, json);
+}
+
+esp_err_t ManagementServer::currentCaptureHandler(httpd_req_t* req) {
+    if (!authorize(req)) {
+        return ESP_OK;
+    }
+    if (!CurrentSense::running()) {
+        return httpd_resp_send_err(req, HTTPD_404_NOT_FOUND, "Current sensing is not enabled");
+    }
+
+    // Captures are taken while diagnosing a load, so the buffer comes
+    // from the heap rather than the request arena
+    uint8_t* capture = (uint8_t*)malloc(CURRENT_SENSE_CAPTURE_BYTES);
+    if (capture == NULL) {
+        return httpd_resp_send_err(req, HTTPD_500_INTERNAL_SERVER_ERROR, "Out of memory");
+    }
+
+    size_t captured = 0;
+    esp_err_t err = CurrentSense::capture(capture, CURRENT_SENSE_CAPTURE_BYTES, &captured);
+    if (err == ESP_ERR_INVALID_STATE) {
+        free(capture);
+        return httpd_resp_send_err(req, HTTPD_500_INTERNAL_SERVER_ERROR, "A capture is already running");
+    }
+    if (err != ESP_OK && err != ESP_ERR_TIMEOUT) {
+        free(capture);
+        return httpd_resp_send_err(req, HTTPD_500_INTERNAL_SERVER_ERROR, "Capture failed");
+    }
+
+    // A timed-out capture is sent as far as it got
+    httpd_resp_set_type(req, "application/octet-stream");
+    httpd_resp_set_hdr(req, "Content-Disposition", "attachment; filename=\"current.bin\"");
+    httpd_resp_set_hdr(req, "Cache-Control", "no-store");
+    err = httpd_resp_send(req, (const char*)capture, captured);
+    free(capture);
+    return err;
+}
+
+esp_err_t ManagementServer::journalHandler(httpd_req_t* req) {
+    char chunk[1024];
+    char text[80];
+    size_t len;
+
+    if (!authorize(req)) {
+        return ESP_OK;
+    }
+
+    httpd_resp_set_type(req, "application/json");
+    httpd_resp_set_hdr(req, "Cache-Control", "no-store");
+
+    // Copied out first, so the listing does not hold up recording
+    journal_entry_t* entries = (journal_entry_t*)malloc(EVENT_JOURNAL_ENTRIES * sizeof(journal_entry_t));
+    if (entries == NULL) {
+        return httpd_resp_send_err(req, HTTPD_500_INTERNAL_SERVER_ERROR, "Out of memory");
+    }
+    int count = EventJournal::list(entries);
+    len = snprintf(chunk, sizeof(chunk), "{\"boots\":%lu,\"next\":%lu,\"entries\":[",
+                   (unsigned long)EventJournal::boots(), (unsigned long)EventJournal::next());
+
+    esp_err_t err = ESP_OK;
+    for (int i = 0; i < count && err == ESP_OK; i++) {
+        const journal_entry_t& entry = entries[i];
+        const char* separator = i > 0 ? "," : "";
+        char line[192];
+        int line_len;
+        if (entry.type == 0) {
+            line_len = snprintf(line, sizeof(line), "%s{\"torn\":true}", separator);
+        } else {
+            EventJournal::describe(&entry, text, sizeof(text));
+            line_len = snprintf(line, sizeof(line),
+                                "%s{\"seq\":%lu,\"time_ms\":%lu,\"type\":\"%s\",\"id\":%u,"
+                                "\"value\":%lu,\"text\":\"%s\"}",
+                                separator, (unsigned long)entry.seq, (unsigned long)entry.time_ms,
+                                EventJournal::typeName(entry.type), entry.id, (unsigned long)entry.value, text);
+        }
+
+        if (len + line_len >= sizeof(chunk)) {
+            err = httpd_resp_send_chunk(req, chunk, len);
+            len = 0;
+        }
+        memcpy(chunk + len, line, line_len);
+        len += line_len;
+    }
+    free(entries);
+
+    if (err == ESP_OK) {
+        err = httpd_resp_send_chunk(req, chunk, len);
+    }
+    if (err == ESP_OK) {
+        err = httpd_resp_sendstr_chunk(req, "]}");
+    }
+    if (err == ESP_OK) {
+        err = httpd_resp_send_chunk(req, NULL, 0);
+    }
+    return err;
+}
@@ -0,0 +1,38 @@
+#ifndef MANAGEMENT_SERVER_H
+#define MANAGEMENT_SERVER_H
+
+#include <esp_err.h>
+#include <esp_http_server.h>
+#include "alpaca_switch.h"
+
+// Management UI at /ui/. The page assets come pre-gzipped from the
+// management_page_html component and are sent straight from flash with
+// strong ETags, so a repeat visit costs one 304 for the page itself. The
+// small JSON API behind the page lives here as well.
+class ManagementServer {
+public:
+    // Register the UI and its API with the HTTP server
+    static esp_err_t registerHandlers(httpd_handle_t server, AlpacaSwitch* device);
+
+private:
+    static esp_err_t assetHandler(httpd_req_t* req);
+    static esp_err_t statusHandler(httpd_req_t* req);
+    static esp_err_t otaHandler(httpd_req_t* req);
+    static esp_err_t authHandler(httpd_req_t* req);
+    static esp_err_t tlsHandler(httpd_req_t* req);
+    static esp_err_t mqttHandler(httpd_req_t* req);
+    static esp_err_t udpKeyHandler(httpd_req_t* req);
+    static esp_err_t rulesHandler(httpd_req_t* req);
+    static esp_err_t gangHandler(httpd_req_t* req);
+    static esp_err_t dewHandler(httpd_req_t* req);
+    static esp_err_t currentCaptureHandler(httpd_req_t* req);
+    static esp_err_t journalHandler(httpd_req_t* req);
+
+    // Check credentials, sending the 401 response if they are missing
+    static bool authorize(httpd_req_t* req);
+
+    // Read a form-encoded request body into buf, NUL-terminated
+    static esp_err_t readForm(httpd_req_t* req, char* buf, size_t len);
+};
+
+#endif // MANAGEMENT_SERVER_H
@@ -0,0 +1,631 @@
+#include "metrics.h"
+#include "alpaca_switch.h"
+#include "alpaca_auth.h"
+#include "request_arena.h"
+#include "dew_controller.h"
+#include "current_sense.h"
+#include "event_journal.h"
+#include "power_fail.h"
+#include "output_backend.h"
+#include "config.h"
+#include "sdkconfig.h"
+#include <esp_heap_caps.h>
+#include <esp_log.h>
+#include <esp_timer.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
+
+static const char* TAG = "metrics";
+
+static const int64_t s_bucket_bounds[METRICS_LATENCY_BUCKET_COUNT] = METRICS_LATENCY_BUCKETS;
+
+// One instrumented URI handler. The slot stands in as the handler's
+// user_ctx; the trampoline restores the original before calling it.
+typedef struct {
+    char uri[METRICS_ROUTE_URI_LEN];
+    httpd_method_t method;
+    esp_err_t (*handler)(httpd_req_t* req);
+    void* user_ctx;
+    std::atomic<uint32_t> errors;       // Handler returned an error
+    metrics_histogram_t latency;
+} metrics_route_t;
+
+static metrics_route_t s_routes[METRICS_MAX_ROUTES];
+static std::atomic<int> s_route_count(0);
+
+static metrics_histogram_t s_auth_latency;
+static std::atomic<uint32_t> s_auth_failures(0);
+
+static std::atomic<int32_t> s_open_sockets(0);
+static std::atomic<uint32_t> s_accepted_sockets(0);
+static int s_max_sockets = 0;
+
+// Rule evaluation; only written with the switch device locked
+static int s_rule_count = 0;
+static std::atomic<uint32_t> s_rule_writes(0);
+static std::atomic<uint32_t> s_rules_evaluated(0);
+static std::atomic<uint32_t> s_rules_forced(0);
+static std::atomic<uint32_t> s_rules_refused(0);
+static std::atomic<uint64_t> s_rule_time_us(0);
+static std::atomic<uint32_t> s_rule_max_time_us(0);
+static std::atomic<uint32_t> s_rule_max_evaluated(0);
+
+// Scenes applied; also only written with the switch device locked
+static std::atomic<uint32_t> s_scene_applies(0);
+static std::atomic<uint32_t> s_scene_refused(0);
+static std::atomic<uint32_t> s_scene_switches(0);
+static std::atomic<uint64_t> s_scene_time_us(0);
+static std::atomic<uint32_t> s_scene_max_time_us(0);
+
+// Switch device whose relay counters are reported
+static AlpacaSwitch* s_device = NULL;
+
+// Output expander, when switches drive one
+static const ExpanderOutput* s_expander = NULL;
+
+// Size of the buffer each group of metric lines is formatted into
+#define METRICS_CHUNK_SIZE 768
+
+extern "C" esp_err_t __real_httpd_register_uri_handler(httpd_handle_t handle, const httpd_uri_t* uri_handler);
+
+static esp_err_t route_trampoline(httpd_req_t* req) {
+    metrics_route_t* route = static_cast<metrics_route_t*>(req->user_ctx);
+    req->user_ctx = route->user_ctx;
+
+    int64_t start = esp_timer_get_time();
+    esp_err_t err = route->handler(req);
+    Metrics::observe(&route->latency, esp_timer_get_time() - start);
+    RequestArena::reset();
+
+    if (err != ESP_OK) {
+        route->errors.fetch_add(1, std::memory_order_relaxed);
+    }
+    return err;
+}
+
+// Linked in place of httpd_register_uri_handler for every caller
+extern "C" esp_err_t __wrap_httpd_register_uri_handler(httpd_handle_t handle, const httpd_uri_t* uri_handler) {
+    // Handlers are registered from one task at startup
+    int index = s_route_count.load(std::memory_order_relaxed);
+
+    // A route served by more than one server shares its slot
+    for (int i = 0; i < index; i++) {
+        metrics_route_t* route = &s_routes[i];
+        if (route->method == uri_handler->method && route->handler == uri_handler->handler &&
+            route->user_ctx == uri_handler->user_ctx && strcmp(route->uri, uri_handler->uri) == 0) {
+            httpd_uri_t wrapped = *uri_handler;
+            wrapped.handler = route_trampoline;
+            wrapped.user_ctx = route;
+            return __real_httpd_register_uri_handler(handle, &wrapped);
+        }
+    }
+
+    // The trampoline is also what resets the request arena, so a route
+    // without a slot would leak arena memory with every request
+    if (index >= METRICS_MAX_ROUTES) {
+        ESP_LOGE(TAG, "No metrics slot for %s, raise METRICS_MAX_ROUTES", uri_handler->uri);
+        return ESP_ERR_NO_MEM;
+    }
+
+    metrics_route_t* route = &s_routes[index];
+    strlcpy(route->uri, uri_handler->uri, sizeof(route->uri));
+    route->method = uri_handler->method;
+    route->handler = uri_handler->handler;
+    route->user_ctx = uri_handler->user_ctx;
+
+    httpd_uri_t wrapped = *uri_handler;
+    wrapped.handler = route_trampoline;
+    wrapped.user_ctx = route;
+
+    esp_err_t err = __real_httpd_register_uri_handler(handle, &wrapped);
+    if (err == ESP_OK) {
+        s_route_count.store(index + 1, std::memory_order_release);
+    }
+    return err;
+}
+
+void Metrics::observe(metrics_histogram_t* histogram, int64_t duration_us) {
+    int bucket = 0;
+    while (bucket < METRICS_LATENCY_BUCKET_COUNT && duration_us > s_bucket_bounds[bucket]) {
+        bucket++;
+    }
+
+    histogram->buckets[bucket].fetch_add(1, std::memory_order_relaxed);
+    histogram->sum_us.fetch_add((uint64_t)duration_us, std::memory_order_relaxed);
+    histogram->count.fetch_add(1, std::memory_order_relaxed);
+}
+
+void Metrics::recordAuth(int64_t duration_us, bool ok) {
+    observe(&s_auth_latency, duration_us);
+    if (!ok) {
+        s_auth_failures.fetch_add(1, std::memory_order_relaxed);
+    }
+}
+
+esp_err_t Metrics::onSocketOpen(httpd_handle_t hd, int sockfd) {
+    s_open_sockets.fetch_add(1, std::memory_order_relaxed);
+    s_accepted_sockets.fetch_add(1, std::memory_order_relaxed);
+    return ESP_OK;
+}
+
+void Metrics::onSocketClose(httpd_handle_t hd, int sockfd) {
+    s_open_sockets.fetch_sub(1, std::memory_order_relaxed);
+    // With close_fn set, closing the socket is up to us
+    close(sockfd);
+}
+
+void Metrics::setSocketLimit(int max_sockets) {
+    s_max_sockets = max_sockets;
+}
+
+void Metrics::recordRules(int64_t duration_us, int evaluated, int forced, bool refused) {
+    s_rule_writes.fetch_add(1, std::memory_order_relaxed);
+    s_rules_evaluated.fetch_add(evaluated, std::memory_order_relaxed);
+    s_rules_forced.fetch_add(forced, std::memory_order_relaxed);
+    if (refused) {
+        s_rules_refused.fetch_add(1, std::memory_order_relaxed);
+    }
+    s_rule_time_us.fetch_add(duration_us, std::memory_order_relaxed);
+    if ((uint32_t)duration_us > s_rule_max_time_us.load(std::memory_order_relaxed)) {
+        s_rule_max_time_us.store((uint32_t)duration_us, std::memory_order_relaxed);
+    }
+    if ((uint32_t)evaluated > s_rule_max_evaluated.load(std::memory_order_relaxed)) {
+        s_rule_max_evaluated.store(evaluated, std::memory_order_relaxed);
+    }
+}
+
+void Metrics::recordScene(int64_t duration_us, int changed, bool refused) {
+    if (refused) {
+        s_scene_refused.fetch_add(1, std::memory_order_relaxed);
+        return;
+    }
+    s_scene_applies.fetch_add(1, std::memory_order_relaxed);
+    s_scene_switches.fetch_add(changed, std::memory_order_relaxed);
+    s_scene_time_us.fetch_add(duration_us, std::memory_order_relaxed);
+    if ((uint32_t)duration_us > s_scene_max_time_us.load(std::memory_order_relaxed)) {
+        s_scene_max_time_us.store((uint32_t)duration_us, std::memory_order_relaxed);
+    }
+}
+
+void Metrics::setSwitchDevice(AlpacaSwitch* device) {
+    s_device = device;
+}
+
+void Metrics::setOutputExpander(const ExpanderOutput* expander) {
+    s_expander = expander;
+}
+
+void Metrics::setRuleCount(int count) {
+    s_rule_count = count;
+}
+
+esp_err_t Metrics::registerHandlers(httpd_handle_t server) {
+    httpd_uri_t metrics_uri = {};
+    metrics_uri.uri = "/metrics";
+    metrics_uri.method = HTTP_GET;
+    metrics_uri.handler = metricsHandler;
+    return httpd_register_uri_handler(server, &metrics_uri);
+}
+
+// Append formatted text to a chunk buffer, sending it first if full
+static esp_err_t emit(httpd_req_t* req, char* buf, size_t* len, const char* fmt, ...)
+    __attribute__((format(printf, 4, 5)));
+
+static esp_err_t emit(httpd_req_t* req, char* buf, size_t* len, const char* fmt, ...) {
+    for (int attempt = 0; attempt < 2; attempt++) {
+        va_list args;
+        va_start(args, fmt);
+        int n = vsnprintf(buf + *len, METRICS_CHUNK_SIZE - *len, fmt, args);
+        va_end(args);
+
+        if (n >= 0 && *len + n < METRICS_CHUNK_SIZE) {
+            *len += n;
+            return ESP_OK;
+        }
+        if (*len == 0) {
+            return ESP_ERR_INVALID_SIZE;    // A single line longer than the buffer
+        }
+        esp_err_t err = httpd_resp_send_chunk(req, buf, *len);
+        *len = 0;
+        if (err != ESP_OK) {
+            return err;
+        }
+    }
+    return ESP_ERR_INVALID_SIZE;
+}
+
+// Write one histogram; labels is a label list without braces, or empty
+static esp_err_t emit_histogram(httpd_req_t* req, char* buf, size_t* len, const char* name,
+                                const char* labels, const metrics_histogram_t* histogram) {
+    const char* sep = labels[0] != '\0' ? "," : "";
+    esp_err_t err = ESP_OK;
+    uint32_t cumulative = 0;
+
+    for (int i = 0; i <= METRICS_LATENCY_BUCKET_COUNT && err == ESP_OK; i++) {
+        cumulative += histogram->buckets[i].load(std::memory_order_relaxed);
+        if (i < METRICS_LATENCY_BUCKET_COUNT) {
+            err = emit(req, buf, len, "%s_bucket{%s%sle=\"%g\"} %lu\n", name, labels, sep,
+                       s_bucket_bounds[i] / 1e6, (unsigned long)cumulative);
+        } else {
+            err = emit(req, buf, len, "%s_bucket{%s%sle=\"+Inf\"} %lu\n", name, labels, sep,
+                       (unsigned long)cumulative);
+        }
+    }
+    if (err != ESP_OK) {
+        return err;
+    }
+
+    err = emit(req, buf, len, "%s_sum{%s} %.6f\n", name, labels,
+               histogram->sum_us.load(std::memory_order_relaxed) / 1e6);
+    if (err != ESP_OK) {
+        return err;
+    }
+    return emit(req, buf, len, "%s_count{%s} %lu\n", name, labels,
+                (unsigned long)histogram->count.load(std::memory_order_relaxed));
+}
+
+esp_err_t Metrics::metricsHandler(httpd_req_t* req) {
+    char* buf;
+    size_t len = 0;
+    esp_err_t err;
+    char labels[METRICS_ROUTE_URI_LEN + 32];
+
+    if (!AlpacaAuth::verifyRequest(req)) {
+        AlpacaAuth::addAuthHeaders(req);
+        return httpd_resp_send_err(req, HTTPD_401_UNAUTHORIZED, "Authentication required");
+    }
+
+    buf = (char*)RequestArena::alloc(METRICS_CHUNK_SIZE);
+    if (buf == NULL) {
+        return httpd_resp_send_err(req, HTTPD_500_INTERNAL_SERVER_ERROR, "Out of memory");
+    }
+
+    httpd_resp_set_type(req, "text/plain; version=0.0.4");
+
+    int route_count = s_route_count.load(std::memory_order_acquire);
+
+    err = emit(req, buf, &len, "# TYPE alpaca_http_requests_total counter\n");
+    for (int i = 0; i < route_count && err == ESP_OK; i++) {
+        err = emit(req, buf, &len, "alpaca_http_requests_total{method=\"%s\",route=\"%s\"} %lu\n",
+                   http_method_str((enum http_method)s_routes[i].method), s_routes[i].uri,
+                   (unsigned long)s_routes[i].latency.count.load(std::memory_order_relaxed));
+    }
+
+    if (err == ESP_OK) {
+        err = emit(req, buf, &len, "# TYPE alpaca_http_request_errors_total counter\n");
+    }
+    for (int i = 0; i < route_count && err == ESP_OK; i++) {
+        err = emit(req, buf, &len, "alpaca_http_request_errors_total{method=\"%s\",route=\"%s\"} %lu\n",
+                   http_method_str((enum http_method)s_routes[i].method), s_routes[i].uri,
+                   (unsigned long)s_routes[i].errors.load(std::memory_order_relaxed));
+    }
+
+    if (err == ESP_OK) {
+        err = emit(req, buf, &len, "# TYPE alpaca_http_request_duration_seconds histogram\n");
+    }
+    for (int i = 0; i < route_count && err == ESP_OK; i++) {
+        snprintf(labels, sizeof(labels), "method=\"%s\",route=\"%s\"",
+                 http_method_str((enum http_method)s_routes[i].method), s_routes[i].uri);
+        err = emit_histogram(req, buf, &len, "alpaca_http_request_duration_seconds", labels,
+                             &s_routes[i].latency);
+    }
+
+    if (err == ESP_OK) {
+        err = emit(req, buf, &len, "# TYPE alpaca_auth_duration_seconds histogram\n");
+    }
+    if (err == ESP_OK) {
+        err = emit_histogram(req, buf, &len, "alpaca_auth_duration_seconds", "", &s_auth_latency);
+    }
+    if (err == ESP_OK) {
+        err = emit(req, buf, &len,
+                   "# TYPE alpaca_auth_failures_total counter\n"
+                   "alpaca_auth_failures_total %lu\n"
+                   "# TYPE alpaca_httpd_open_sockets gauge\n"
+                   "alpaca_httpd_open_sockets %ld\n"
+                   "# TYPE alpaca_httpd_max_sockets gauge\n"
+                   "alpaca_httpd_max_sockets %d\n"
+                   "# TYPE alpaca_httpd_sockets_accepted_total counter\n"
+                   "alpaca_httpd_sockets_accepted_total %lu\n",
+                   (unsigned long)s_auth_failures.load(std::memory_order_relaxed),
+                   (long)s_open_sockets.load(std::memory_order_relaxed), s_max_sockets,
+                   (unsigned long)s_accepted_sockets.load(std::memory_order_relaxed));
+    }
+    if (err == ESP_OK) {
+        err = emit(req, buf, &len,
+                   "# TYPE alpaca_heap_free_bytes gauge\n"
+                   "alpaca_heap_free_bytes %u\n"
+                   "# TYPE alpaca_heap_min_free_bytes gauge\n"
+                   "alpaca_heap_min_free_bytes %u\n"
+                   "# TYPE alpaca_heap_largest_free_block_bytes gauge\n"
+                   "alpaca_heap_largest_free_block_bytes %u\n"
+                   "# TYPE alpaca_uptime_seconds counter\n"
+                   "alpaca_uptime_seconds %lld\n",
+                   (unsigned int)heap_caps_get_free_size(MALLOC_CAP_8BIT),
+                   (unsigned int)heap_caps_get_minimum_free_size(MALLOC_CAP_8BIT),
+                   (unsigned int)heap_caps_get_largest_free_block(MALLOC_CAP_8BIT),
+                   esp_timer_get_time() / 1000000);
+    }
+
+    // Resets survived by the event journal, and events recorded this boot
+    if (err == ESP_OK) {
+        err = emit(req, buf, &len,
+                   "# TYPE alpaca_boots_total counter\n"
+                   "alpaca_boots_total %lu\n"
+                   "# TYPE alpaca_journal_entries_total counter\n"
+                   "alpaca_journal_entries_total %lu\n",
+                   (unsigned long)EventJournal::boots(), (unsigned long)EventJournal::recorded());
+    }
+
+    // Switch states recovered from a power failure, and the snapshots kept against one
+    power_fail_status_t power;
+    PowerFail::getStatus(&power);
+    if (err == ESP_OK) {
+        err = emit(req, buf, &len,
+                   "# TYPE alpaca_power_fail_recovered gauge\n"
+                   "alpaca_power_fail_recovered %d\n"
+                   "# TYPE alpaca_power_fail_snapshots_total counter\n"
+                   "alpaca_power_fail_snapshots_total %lu\n"
+                   "# TYPE alpaca_power_fail_signals_total counter\n"
+                   "alpaca_power_fail_signals_total %lu\n"
+                   "# TYPE alpaca_power_fail_snapshot_max_seconds gauge\n"
+                   "alpaca_power_fail_snapshot_max_seconds %.6f\n",
+                   power.recovered ? 1 : 0, (unsigned long)power.captures, (unsigned long)power.signals,
+                   power.capture_max_us / 1e6);
+    }
+
+    // Fragmentation: many free blocks, or a largest block much smaller
+    // than the free total, means the heap is breaking up
+    multi_heap_info_t heap;
+    heap_caps_get_info(&heap, MALLOC_CAP_8BIT);
+    if (err == ESP_OK) {
+        err = emit(req, buf, &len,
+                   "# TYPE alpaca_heap_free_blocks gauge\n"
+                   "alpaca_heap_free_blocks %u\n"
+                   "# TYPE alpaca_heap_allocated_blocks gauge\n"
+                   "alpaca_heap_allocated_blocks %u\n"
+                   "# TYPE alpaca_heap_fragmentation_ratio gauge\n"
+                   "alpaca_heap_fragmentation_ratio %.4f\n",
+                   (unsigned int)heap.free_blocks, (unsigned int)heap.allocated_blocks,
+                   heap.total_free_bytes > 0
+                       ? 1.0 - (double)heap.largest_free_block / heap.total_free_bytes : 0.0);
+    }
+
+    if (err == ESP_OK) {
+        err = emit(req, buf, &len,
+                   "# TYPE alpaca_request_arena_exhausted_total counter\n"
+                   "alpaca_request_arena_exhausted_total %lu\n"
+                   "# TYPE alpaca_request_arena_size_bytes gauge\n"
+                   "alpaca_request_arena_size_bytes %u\n"
+                   "# TYPE alpaca_request_arena_high_water_bytes gauge\n",
+                   (unsigned long)RequestArena::exhaustedCount(), (unsigned int)REQUEST_ARENA_SIZE);
+    }
+    int workers = RequestArena::workerCount();
+    for (int i = 0; i < workers && err == ESP_OK; i++) {
+        request_arena_stats_t stats;
+        RequestArena::getStats(i, &stats);
+        err = emit(req, buf, &len, "alpaca_request_arena_high_water_bytes{worker=\"%d\"} %u\n",
+                   stats.worker, (unsigned int)stats.high_water);
+    }
+    if (err == ESP_OK) {
+        err = emit(req, buf, &len, "# TYPE alpaca_request_arena_requests_total counter\n");
+    }
+    for (int i = 0; i < workers && err == ESP_OK; i++) {
+        request_arena_stats_t stats;
+        RequestArena::getStats(i, &stats);
+        err = emit(req, buf, &len, "alpaca_request_arena_requests_total{worker=\"%d\"} %lu\n",
+                   stats.worker, (unsigned long)stats.requests);
+    }
+
+    // Rule work per switch write; the time includes the write itself
+    if (err == ESP_OK) {
+        err = emit(req, buf, &len,
+                   "# TYPE alpaca_rules_entries gauge\n"
+                   "alpaca_rules_entries %d\n"
+                   "# TYPE alpaca_rules_writes_total counter\n"
+                   "alpaca_rules_writes_total %lu\n"
+                   "# TYPE alpaca_rules_evaluated_total counter\n"
+                   "alpaca_rules_evaluated_total %lu\n"
+                   "# TYPE alpaca_rules_evaluated_max gauge\n"
+                   "alpaca_rules_evaluated_max %lu\n"
+                   "# TYPE alpaca_rules_forced_total counter\n"
+                   "alpaca_rules_forced_total %lu\n"
+                   "# TYPE alpaca_rules_refused_total counter\n"
+                   "alpaca_rules_refused_total %lu\n"
+                   "# TYPE alpaca_rules_write_seconds_total counter\n"
+                   "alpaca_rules_write_seconds_total %.6f\n"
+                   "# TYPE alpaca_rules_write_seconds_max gauge\n"
+                   "alpaca_rules_write_seconds_max %.6f\n",
+                   s_rule_count,
+                   (unsigned long)s_rule_writes.load(std::memory_order_relaxed),
+                   (unsigned long)s_rules_evaluated.load(std::memory_order_relaxed),
+                   (unsigned long)s_rule_max_evaluated.load(std::memory_order_relaxed),
+                   (unsigned long)s_rules_forced.load(std::memory_order_relaxed),
+                   (unsigned long)s_rules_refused.load(std::memory_order_relaxed),
+                   s_rule_time_us.load(std::memory_order_relaxed) / 1e6,
+                   s_rule_max_time_us.load(std::memory_order_relaxed) / 1e6);
+    }
+
+    // Relay wear, for switches with an output
+    int32_t num_switches = 0;
+    relay_counter_t* counters = NULL;
+    bool* present = NULL;
+    if (s_device != NULL) {
+        s_device->get_maxswitch(&num_switches);
+        counters = (relay_counter_t*)RequestArena::alloc(num_switches * sizeof(relay_counter_t));
+        present = (bool*)RequestArena::alloc(num_switches * sizeof(bool));
+    }
+    if (counters != NULL && present != NULL && err == ESP_OK) {
+        for (int32_t i = 0; i < num_switches; i++) {
+            present[i] = s_device->getRelayCounter(i, &counters[i]) == ESP_OK;
+        }
+        
+        err = emit(req, buf, &len, "# TYPE alpaca_relay_cycles_total counter\n");
+        for (int32_t i = 0; i < num_switches && err == ESP_OK; i++) {
+            if (present[i]) {
+                err = emit(req, buf, &len, "alpaca_relay_cycles_total{switch=\"%ld\"} %lu\n", (long)i,
+                           (unsigned long)counters[i].cycles);
+            }
+        }
+        if (err == ESP_OK) {
+            err = emit(req, buf, &len, "# TYPE alpaca_relay_on_seconds_total counter\n");
+        }
+        for (int32_t i = 0; i < num_switches && err == ESP_OK; i++) {
+            if (present[i]) {
+                err = emit(req, buf, &len, "alpaca_relay_on_seconds_total{switch=\"%ld\"} %lu\n", (long)i,
+                           (unsigned long)counters[i].on_seconds);
+            }
+        }
+        
+        // Share of the rated cycles used, and whether that passed the warning level
+        if (err == ESP_OK) {
+            err = emit(req, buf, &len, "# TYPE alpaca_relay_life_used_ratio gauge\n");
+        }
+        for (int32_t i = 0; i < num_switches && err == ESP_OK; i++) {
+            if (present[i]) {
+                err = emit(req, buf, &len, "alpaca_relay_life_used_ratio{switch=\"%ld\"} %.4f\n", (long)i,
+                           (double)counters[i].cycles / RELAY_RATED_CYCLES);
+            }
+        }
+        if (err == ESP_OK) {
+            err = emit(req, buf, &len, "# TYPE alpaca_relay_worn gauge\n");
+        }
+        for (int32_t i = 0; i < num_switches && err == ESP_OK; i++) {
+            if (present[i]) {
+                bool worn = counters[i].cycles >= (uint64_t)RELAY_RATED_CYCLES * RELAY_WEAR_WARN_PERCENT / 100;
+                err = emit(req, buf, &len, "alpaca_relay_worn{switch=\"%ld\"} %d\n", (long)i, worn ? 1 : 0);
+            }
+        }
+    }
+
+    // Output expander writes; one per flush with changes, per chip for MCP23017s
+    if (s_expander != NULL && err == ESP_OK) {
+        err = emit(req, buf, &len,
+                   "# TYPE alpaca_output_bus_transactions_total counter\n"
+                   "alpaca_output_bus_transactions_total %lu\n"
+                   "# TYPE alpaca_output_bus_errors_total counter\n"
+                   "alpaca_output_bus_errors_total %lu\n",
+                   (unsigned long)s_expander->transactions(), (unsigned long)s_expander->errors());
+    }
+
+    // Scenes applied, timed from the lock to the last listener
+    if (err == ESP_OK) {
+        err = emit(req, buf, &len,
+                   "# TYPE alpaca_scene_applies_total counter\n"
+                   "alpaca_scene_applies_total %lu\n"
+                   "# TYPE alpaca_scene_refused_total counter\n"
+                   "alpaca_scene_refused_total %lu\n"
+                   "# TYPE alpaca_scene_switches_changed_total counter\n"
+                   "alpaca_scene_switches_changed_total %lu\n"
+                   "# TYPE alpaca_scene_apply_seconds_total counter\n"
+                   "alpaca_scene_apply_seconds_total %.6f\n"
+                   "# TYPE alpaca_scene_apply_seconds_max gauge\n"
+                   "alpaca_scene_apply_seconds_max %.6f\n",
+                   (unsigned long)s_scene_applies.load(std::memory_order_relaxed),
+                   (unsigned long)s_scene_refused.load(std::memory_order_relaxed),
+                   (unsigned long)s_scene_switches.load(std::memory_order_relaxed),
+                   s_scene_time_us.load(std::memory_order_relaxed) / 1e6,
+                   s_scene_max_time_us.load(std::memory_order_relaxed) / 1e6);
+    }
+
+    // Dew heater loop, once it runs
+    dew_status_t dew;
+    DewController::getStatus(&dew);
+    if (dew.running && err == ESP_OK) {
+        err = emit(req, buf, &len,
+                   "# TYPE alpaca_dew_ambient_celsius gauge\n"
+                   "alpaca_dew_ambient_celsius %.2f\n"
+                   "# TYPE alpaca_dew_humidity_percent gauge\n"
+                   "alpaca_dew_humidity_percent %.1f\n"
+                   "# TYPE alpaca_dew_point_celsius gauge\n"
+                   "alpaca_dew_point_celsius %.2f\n"
+                   "# TYPE alpaca_dew_optic_celsius gauge\n"
+                   "alpaca_dew_optic_celsius %.2f\n"
+                   "# TYPE alpaca_dew_target_celsius gauge\n"
+                   "alpaca_dew_target_celsius %.2f\n"
+                   "# TYPE alpaca_dew_heater_duty gauge\n"
+                   "alpaca_dew_heater_duty %.3f\n",
+                   dew.ambient, dew.humidity, dew.dew_point, dew.optic, dew.target, dew.duty);
+    }
+    if (dew.running && err == ESP_OK) {
+        err = emit(req, buf, &len,
+                   "# TYPE alpaca_dew_automatic gauge\n"
+                   "alpaca_dew_automatic %d\n"
+                   "# TYPE alpaca_dew_loops_total counter\n"
+                   "alpaca_dew_loops_total %lu\n"
+                   "# TYPE alpaca_dew_sensor_errors_total counter\n"
+                   "alpaca_dew_sensor_errors_total %lu\n"
+                   "# TYPE alpaca_dew_loop_seconds_max gauge\n"
+                   "alpaca_dew_loop_seconds_max %.6f\n",
+                   dew.automatic ? 1 : 0, (unsigned long)dew.loops, (unsigned long)dew.sensor_errors,
+                   dew.loop_max_us / 1e6);
+    }
+
+    // Load current per sensed relay, and the cost of the filters
+    if (CurrentSense::running() && err == ESP_OK) {
+        err = emit(req, buf, &len,
+                   "# TYPE alpaca_current_samples_total counter\n"
+                   "alpaca_current_samples_total %lu\n"
+                   "# TYPE alpaca_current_overruns_total counter\n"
+                   "alpaca_current_overruns_total %lu\n"
+                   "# TYPE alpaca_current_process_seconds_total counter\n"
+                   "alpaca_current_process_seconds_total %.6f\n",
+                   (unsigned long)CurrentSense::samples(), (unsigned long)CurrentSense::overruns(),
+                   CurrentSense::processUs() / 1e6);
+
+        // One reading per channel, so the three families agree
+        current_channel_status_t status[CURRENT_SENSE_CHANNELS];
+        for (int i = 0; i < CURRENT_SENSE_CHANNELS; i++) {
+            CurrentSense::getStatus(i, &status[i]);
+        }
+        if (err == ESP_OK) {
+            err = emit(req, buf, &len, "# TYPE alpaca_current_rms_amps gauge\n");
+        }
+        for (int i = 0; i < CURRENT_SENSE_CHANNELS && err == ESP_OK; i++) {
+            err = emit(req, buf, &len, "alpaca_current_rms_amps{switch=\"%ld\"} %.3f\n",
+                       (long)status[i].monitored_switch, status[i].reading.rms);
+        }
+        if (err == ESP_OK) {
+            err = emit(req, buf, &len, "# TYPE alpaca_current_peak_amps gauge\n");
+        }
+        for (int i = 0; i < CURRENT_SENSE_CHANNELS && err == ESP_OK; i++) {
+            err = emit(req, buf, &len, "alpaca_current_peak_amps{switch=\"%ld\"} %.3f\n",
+                       (long)status[i].monitored_switch, status[i].reading.peak);
+        }
+        if (err == ESP_OK) {
+            err = emit(req, buf, &len, "# TYPE alpaca_current_faults gauge\n");
+        }
+        for (int i = 0; i < CURRENT_SENSE_CHANNELS && err == ESP_OK; i++) {
+            err = emit(req, buf, &len, "alpaca_current_faults{switch=\"%ld\"} %u\n",
+                       (long)status[i].monitored_switch, (unsigned int)status[i].faults);
+        }
+    }
+
+#if CONFIG_FREERTOS_USE_TRACE_FACILITY
+    // Smallest amount of stack each task has had left since it started
+    if (err == ESP_OK) {
+        err = emit(req, buf, &len, "# TYPE alpaca_task_stack_free_min_bytes gauge\n");
+    }
+    UBaseType_t task_count = uxTaskGetNumberOfTasks() + 2;     // Room for tasks started meanwhile
+    TaskStatus_t* tasks = (TaskStatus_t*)RequestArena::alloc(task_count * sizeof(TaskStatus_t));
+    if (tasks != NULL) {
+        task_count = uxTaskGetSystemState(tasks, task_count, NULL);
+        for (UBaseType_t i = 0; i < task_count && err == ESP_OK; i++) {
+            err = emit(req, buf, &len, "alpaca_task_stack_free_min_bytes{task=\"%s\"} %lu\n",
+                       tasks[i].pcTaskName, (unsigned long)tasks[i].usStackHighWaterMark);
+        }
+    }
+#endif
+
+    if (err == ESP_OK && len > 0) {
+        err = httpd_resp_send_chunk(req, buf, len);
+    }
+    if (err == ESP_OK) {
+        err = httpd_resp_send_chunk(req, NULL, 0);
+    }
+
+    return err;
+}
@@ -0,0 +1,64 @@
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <esp_err.h>
+#include <esp_http_server.h>
+#include <atomic>
+#include <stdint.h>
+
+class AlpacaSwitch;
+class ExpanderOutput;
+
+// Upper bounds of the latency histogram buckets, in microseconds
+#define METRICS_LATENCY_BUCKETS { 1000, 2500, 5000, 10000, 25000, 50000, 100000, 250000, 500000, 1000000 }
+#define METRICS_LATENCY_BUCKET_COUNT 10
+
+// Fixed-bucket latency histogram, updated with relaxed atomic increments
+typedef struct {
+    std::atomic<uint32_t> buckets[METRICS_LATENCY_BUCKET_COUNT + 1];   // Last one is +Inf
+    std::atomic<uint32_t> count;
+    std::atomic<uint64_t> sum_us;
+} metrics_histogram_t;
+
+// Request metrics and device health, served in Prometheus text format at
+// /metrics. Every URI handler is timed: httpd_register_uri_handler is
+// wrapped at link time (see src/CMakeLists.txt), so the routes the Alpaca
+// library registers are covered without changes to the library.
+class Metrics {
+public:
+    // Register the /metrics endpoint with the HTTP server
+    static esp_err_t registerHandlers(httpd_handle_t server);
+
+    // Record one sample in a histogram
+    static void observe(metrics_histogram_t* histogram, int64_t duration_us);
+
+    // Record the time spent checking credentials
+    static void recordAuth(int64_t duration_us, bool ok);
+
+    // HTTP server socket hooks, set as open_fn/close_fn in the server config
+    static esp_err_t onSocketOpen(httpd_handle_t hd, int sockfd);
+    static void onSocketClose(httpd_handle_t hd, int sockfd);
+
+    // Remember the configured socket limit for reporting
+    static void setSocketLimit(int max_sockets);
+
+    // Record the rule work done for one switch write
+    static void recordRules(int64_t duration_us, int evaluated, int forced, bool refused);
+
+    // Remember the number of rule entries loaded, for reporting
+    static void setRuleCount(int count);
+
+    // Report the relay wear counters of this device
+    static void setSwitchDevice(AlpacaSwitch* device);
+
+    // Report the bus transactions of the output expander
+    static void setOutputExpander(const ExpanderOutput* expander);
+
+    // Record one scene applied, or refused, with the switches it changed
+    static void recordScene(int64_t duration_us, int changed, bool refused);
+
+private:
+    static esp_err_t metricsHandler(httpd_req_t* req);
+};
+
+#endif // METRICS_H
@@ -0,0 +1,258 @@
+#include "modbus_pdu.h"
+#include <math.h>
+#include <string.h>
+
+// Function codes
+#define FC_READ_COILS 0x01
+#define FC_READ_HOLDING_REGISTERS 0x03
+#define FC_WRITE_SINGLE_COIL 0x05
+#define FC_WRITE_SINGLE_REGISTER 0x06
+#define FC_WRITE_MULTIPLE_COILS 0x0F
+#define FC_WRITE_MULTIPLE_REGISTERS 0x10
+
+// Quantity limits from the Modbus application protocol
+#define MAX_READ_COILS 2000
+#define MAX_READ_REGISTERS 125
+#define MAX_WRITE_COILS 1968
+#define MAX_WRITE_REGISTERS 123
+
+static uint16_t get_u16(const uint8_t* p) {
+    return (uint16_t)((p[0] << 8) | p[1]);
+}
+
+static void put_u16(uint8_t* p, uint16_t value) {
+    p[0] = value >> 8;
+    p[1] = value & 0xFF;
+}
+
+static int exception(uint8_t function, uint8_t code, uint8_t* response) {
+    response[0] = function | 0x80;
+    response[1] = code;
+    return 2;
+}
+
+ModbusPdu::ModbusPdu(ModbusBank* bank) : _bank(bank) {
+    int32_t count = bank->count();
+    _ids = new int32_t[count > 0 ? count : 1];
+    _values = new double[count > 0 ? count : 1];
+}
+
+ModbusPdu::~ModbusPdu() {
+    delete[] _ids;
+    delete[] _values;
+}
+
+int ModbusPdu::frameLength(const uint8_t* buf, int len) {
+    if (len < MBAP_HEADER_SIZE) {
+        return 0;
+    }
+    uint16_t protocol = get_u16(buf + 2);
+    uint16_t length = get_u16(buf + 4);
+    if (protocol != 0 || length < 2 || length > MODBUS_MAX_PDU_SIZE + 1) {
+        return -1;
+    }
+    int frame_len = 6 + length;
+    return len < frame_len ? 0 : frame_len;
+}
+
+int ModbusPdu::handleFrame(const uint8_t* frame, uint8_t* response) {
+    uint16_t length = get_u16(frame + 4);
+    int pdu_len = handle(frame + MBAP_HEADER_SIZE, length - 1, response + MBAP_HEADER_SIZE);
+    memcpy(response, frame, MBAP_HEADER_SIZE);
+    put_u16(response + 4, pdu_len + 1);
+    return MBAP_HEADER_SIZE + pdu_len;
+}
+
+int ModbusPdu::handle(const uint8_t* request, int len, uint8_t* response) {
+    switch (request[0]) {
+        case FC_READ_COILS:
+            return readCoils(request, len, response);
+        case FC_READ_HOLDING_REGISTERS:
+            return readRegisters(request, len, response);
+        case FC_WRITE_SINGLE_COIL:
+            return writeCoil(request, len, response);
+        case FC_WRITE_SINGLE_REGISTER:
+            return writeRegister(request, len, response);
+        case FC_WRITE_MULTIPLE_COILS:
+            return writeCoils(request, len, response);
+        case FC_WRITE_MULTIPLE_REGISTERS:
+            return writeRegisters(request, len, response);
+        default:
+            return exception(request[0], MODBUS_EX_ILLEGAL_FUNCTION, response);
+    }
+}
+
+uint16_t ModbusPdu::valueToRegister(int32_t id) {
+    double step = _bank->getStep(id);
+    double steps = round((_bank->getValue(id) - _bank->getMin(id)) / (step > 0 ? step : 1.0));
+    return steps <= 0 ? 0 : steps >= 65535 ? 65535 : (uint16_t)steps;
+}
+
+double ModbusPdu::registerToValue(int32_t id, uint16_t reg) {
+    double step = _bank->getStep(id);
+    return _bank->getMin(id) + reg * (step > 0 ? step : 1.0);
+}
+
+// Check quantity, then address range, in the order the protocol reports them
+uint8_t ModbusPdu::checkRange(uint16_t start, uint16_t quantity, uint16_t max_quantity) {
+    if (quantity < 1 || quantity > max_quantity) {
+        return MODBUS_EX_ILLEGAL_DATA_VALUE;
+    }
+    if ((int32_t)start + quantity > _bank->count()) {
+        return MODBUS_EX_ILLEGAL_DATA_ADDRESS;
+    }
+    return 0;
+}
+
+int ModbusPdu::readCoils(const uint8_t* request, int len, uint8_t* response) {
+    if (len != 5) {
+        return exception(request[0], MODBUS_EX_ILLEGAL_DATA_VALUE, response);
+    }
+    uint16_t start = get_u16(request + 1);
+    uint16_t quantity = get_u16(request + 3);
+    uint8_t ex = checkRange(start, quantity, MAX_READ_COILS);
+    if (ex != 0) {
+        return exception(request[0], ex, response);
+    }
+
+    int bytes = (quantity + 7) / 8;
+    response[0] = request[0];
+    response[1] = bytes;
+    memset(response + 2, 0, bytes);
+
+    // Hold the bank so it is read as one snapshot
+    _bank->hold();
+    for (int i = 0; i < quantity; i++) {
+        if (_bank->getState(start + i)) {
+            response[2 + i / 8] |= 1 << (i % 8);
+        }
+    }
+    _bank->release();
+    return 2 + bytes;
+}
+
+int ModbusPdu::readRegisters(const uint8_t* request, int len, uint8_t* response) {
+    if (len != 5) {
+        return exception(request[0], MODBUS_EX_ILLEGAL_DATA_VALUE, response);
+    }
+    uint16_t start = get_u16(request + 1);
+    uint16_t quantity = get_u16(request + 3);
+    uint8_t ex = checkRange(start, quantity, MAX_READ_REGISTERS);
+    if (ex != 0) {
+        return exception(request[0], ex, response);
+    }
+
+    response[0] = request[0];
+    response[1] = quantity * 2;
+    _bank->hold();
+    for (int i = 0; i < quantity; i++) {
+        put_u16(response + 2 + i * 2, valueToRegister(start + i));
+    }
+    _bank->release();
+    return 2 + quantity * 2;
+}
+
+int ModbusPdu::writeCoil(const uint8_t* request, int len, uint8_t* response) {
+    if (len != 5) {
+        return exception(request[0], MODBUS_EX_ILLEGAL_DATA_VALUE, response);
+    }
+    uint16_t address = get_u16(request + 1);
+    uint16_t value = get_u16(request + 3);
+    if (value != 0xFF00 && value != 0x0000) {
+        return exception(request[0], MODBUS_EX_ILLEGAL_DATA_VALUE, response);
+    }
+    if (address >= _bank->count()) {
+        return exception(request[0], MODBUS_EX_ILLEGAL_DATA_ADDRESS, response);
+    }
+
+    _ids[0] = address;
+    _values[0] = value == 0xFF00 ? 1.0 : 0.0;
+    uint8_t ex = _bank->setValues(_ids, _values, 1);
+    if (ex != 0) {
+        return exception(request[0], ex, response);
+    }
+
+    // The response echoes the request
+    memcpy(response, request, 5);
+    return 5;
+}
+
+int ModbusPdu::writeRegister(const uint8_t* request, int len, uint8_t* response) {
+    if (len != 5) {
+        return exception(request[0], MODBUS_EX_ILLEGAL_DATA_VALUE, response);
+    }
+    uint16_t address = get_u16(request + 1);
+    if (address >= _bank->count()) {
+        return exception(request[0], MODBUS_EX_ILLEGAL_DATA_ADDRESS, response);
+    }
+
+    _ids[0] = address;
+    _values[0] = registerToValue(address, get_u16(request + 3));
+    uint8_t ex = _bank->setValues(_ids, _values, 1);
+    if (ex != 0) {
+        return exception(request[0], ex, response);
+    }
+
+    memcpy(response, request, 5);
+    return 5;
+}
+
+int ModbusPdu::writeCoils(const uint8_t* request, int len, uint8_t* response) {
+    if (len < 6) {
+        return exception(request[0], MODBUS_EX_ILLEGAL_DATA_VALUE, response);
+    }
+    uint16_t start = get_u16(request + 1);
+    uint16_t quantity = get_u16(request + 3);
+    uint8_t bytes = request[5];
+    uint8_t ex = checkRange(start, quantity, MAX_WRITE_COILS);
+    if (ex == MODBUS_EX_ILLEGAL_DATA_VALUE || bytes != (quantity + 7) / 8 || len != 6 + bytes) {
+        return exception(request[0], MODBUS_EX_ILLEGAL_DATA_VALUE, response);
+    }
+    if (ex != 0) {
+        return exception(request[0], ex, response);
+    }
+
+    // One transition, so an interlock between two coils of the frame is
+    // judged by the states the whole frame leaves
+    for (int i = 0; i < quantity; i++) {
+        _ids[i] = start + i;
+        _values[i] = ((request[6 + i / 8] >> (i % 8)) & 1) ? 1.0 : 0.0;
+    }
+    ex = _bank->setValues(_ids, _values, quantity);
+    if (ex != 0) {
+        return exception(request[0], ex, response);
+    }
+
+    memcpy(response, request, 5);
+    return 5;
+}
+
+int ModbusPdu::writeRegisters(const uint8_t* request, int len, uint8_t* response) {
+    if (len < 6) {
+        return exception(request[0], MODBUS_EX_ILLEGAL_DATA_VALUE, response);
+    }
+    uint16_t start = get_u16(request + 1);
+    uint16_t quantity = get_u16(request + 3);
+    uint8_t bytes = request[5];
+    uint8_t ex = checkRange(start, quantity, MAX_WRITE_REGISTERS);
+    if (ex == MODBUS_EX_ILLEGAL_DATA_VALUE || bytes != quantity * 2 || len != 6 + bytes) {
+        return exception(request[0], MODBUS_EX_ILLEGAL_DATA_VALUE, response);
+    }
+    if (ex != 0) {
+        return exception(request[0], ex, response);
+    }
+
+    _bank->hold();
+    for (int i = 0; i < quantity; i++) {
+        _ids[i] = start + i;
+        _values[i] = registerToValue(start + i, get_u16(request + 6 + i * 2));
+    }
+    ex = _bank->setValues(_ids, _values, quantity);
+    _bank->release();
+    if (ex != 0) {
+        return exception(request[0], ex, response);
+    }
+
+    memcpy(response, request, 5);
+    return 5;
+}
@@ -0,0 +1,82 @@
+#ifndef MODBUS_PDU_H
+#define MODBUS_PDU_H
+
+#include <stdint.h>
+
+// Modbus TCP framing and request handling, free of sockets and of the
+// switch device, which it reaches through ModbusBank.
+// tools/modbus_check.cpp feeds it frames on the host.
+
+// MBAP header: transaction id, protocol id, length, unit id
+#define MBAP_HEADER_SIZE 7
+#define MODBUS_MAX_PDU_SIZE 253
+#define MODBUS_MAX_ADU_SIZE (MBAP_HEADER_SIZE + MODBUS_MAX_PDU_SIZE)
+
+// Exception codes
+#define MODBUS_EX_ILLEGAL_FUNCTION 0x01
+#define MODBUS_EX_ILLEGAL_DATA_ADDRESS 0x02
+#define MODBUS_EX_ILLEGAL_DATA_VALUE 0x03
+#define MODBUS_EX_SERVER_DEVICE_FAILURE 0x04
+
+// The switches as Modbus sees them: switch n is coil n and holding
+// register n
+class ModbusBank {
+public:
+    virtual ~ModbusBank() {}
+
+    virtual int32_t count() = 0;
+
+    // Reads between hold() and release() see one snapshot of the bank
+    virtual void hold() = 0;
+    virtual void release() = 0;
+
+    virtual bool getState(int32_t id) = 0;
+    virtual double getValue(int32_t id) = 0;
+    virtual double getMin(int32_t id) = 0;
+    virtual double getStep(int32_t id) = 0;
+
+    // Set switches ids to values in one transition: either all are made
+    // or none. Returns 0, or the exception code refusing them.
+    virtual uint8_t setValues(const int32_t* ids, const double* values, int count) = 0;
+};
+
+// Answers requests for one bank. A register holds the value as a step
+// count above the minimum, value = min + reg * step, so every valid value
+// is an exact integer; a coil sets the value to 1 or 0. A write of
+// several coils or registers goes to the bank as one transition.
+class ModbusPdu {
+public:
+    // Buffers for a write of every switch are allocated here
+    explicit ModbusPdu(ModbusBank* bank);
+    ~ModbusPdu();
+
+    // Length of the frame at the start of buf, from its MBAP header: 0
+    // while the header or the frame is incomplete, -1 if the header is
+    // malformed and the connection cannot be resynchronised
+    static int frameLength(const uint8_t* buf, int len);
+
+    // Answer one complete frame; returns the length of the response,
+    // which echoes the transaction, protocol and unit id
+    int handleFrame(const uint8_t* frame, uint8_t* response);
+
+    // Handle one request PDU and write the response PDU; returns its length
+    int handle(const uint8_t* request, int len, uint8_t* response);
+
+private:
+    ModbusBank* _bank;
+    int32_t* _ids;
+    double* _values;
+
+    uint16_t valueToRegister(int32_t id);
+    double registerToValue(int32_t id, uint16_t reg);
+    uint8_t checkRange(uint16_t start, uint16_t quantity, uint16_t max_quantity);
+
+    int readCoils(const uint8_t* request, int len, uint8_t* response);
+    int readRegisters(const uint8_t* request, int len, uint8_t* response);
+    int writeCoil(const uint8_t* request, int len, uint8_t* response);
+    int writeRegister(const uint8_t* request, int len, uint8_t* response);
+    int writeCoils(const uint8_t* request, int len, uint8_t* response);
+    int writeRegisters(const uint8_t* request, int len, uint8_t* response);
+};
+
+#endif // MODBUS_PDU_H
@@ -0,0 +1,222 @@
+#include "modbus_server.h"
+#include "modbus_pdu.h"
+#include "config.h"
+#include <esp_log.h>
+#include <esp_timer.h>
+#include <lwip/sockets.h>
+#include <errno.h>
+#include <string.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
+
+static const char* TAG = "modbus_server";
+
+typedef struct {
+    int sock;
+    int len;
+    int64_t last_active_us;
+    uint8_t buf[MODBUS_MAX_ADU_SIZE];
+} modbus_client_t;
+
+// The switch device as a Modbus bank
+class DeviceBank : public ModbusBank {
+public:
+    explicit DeviceBank(AlpacaSwitch* device) : _device(device), _count(0) {
+        device->get_maxswitch(&_count);
+    }
+
+    int32_t count() override { return _count; }
+    void hold() override { _device->beginBatch(); }
+    void release() override { _device->endBatch(); }
+
+    bool getState(int32_t id) override {
+        bool state = false;
+        _device->get_getswitch(id, &state);
+        return state;
+    }
+
+    double getValue(int32_t id) override {
+        double value = 0;
+        _device->get_getswitchvalue(id, &value);
+        return value;
+    }
+
+    double getMin(int32_t id) override {
+        double min = 0;
+        _device->get_minswitchvalue(id, &min);
+        return min;
+    }
+
+    double getStep(int32_t id) override {
+        double step = 0;
+        _device->get_switchstep(id, &step);
+        return step;
+    }
+
+    uint8_t setValues(const int32_t* ids, const double* values, int count) override {
+        switch (_device->setValues(ids, values, count)) {
+            case ALPACA_OK:
+                return 0;
+            case ALPACA_ERR_INVALID_VALUE:
+                return MODBUS_EX_ILLEGAL_DATA_VALUE;
+            case ALPACA_ERR_INVALID_OPERATION:
+                return MODBUS_EX_ILLEGAL_DATA_ADDRESS;     // Read-only switch, or refused by a rule
+            default:
+                return MODBUS_EX_SERVER_DEVICE_FAILURE;
+        }
+    }
+
+private:
+    AlpacaSwitch* _device;
+    int32_t _count;
+};
+
+static ModbusPdu* s_pdu = NULL;
+static int32_t s_num_switches = 0;
+static modbus_client_t s_clients[MODBUS_MAX_CLIENTS];
+
+esp_err_t ModbusServer::start(AlpacaSwitch* device) {
+    s_pdu = new ModbusPdu(new DeviceBank(device));
+    device->get_maxswitch(&s_num_switches);
+    for (int i = 0; i < MODBUS_MAX_CLIENTS; i++) {
+        s_clients[i].sock = -1;
+    }
+
+    if (xTaskCreatePinnedToCore(serverTask, "modbus_server", 4096, NULL, MODBUS_TASK_PRIORITY,
+                                NULL, MODBUS_TASK_CORE) != pdPASS) {
+        ESP_LOGE(TAG, "Failed to create server task");
+        return ESP_ERR_NO_MEM;
+    }
+    return ESP_OK;
+}
+
+static void close_client(modbus_client_t* client) {
+    close(client->sock);
+    client->sock = -1;
+    client->len = 0;
+}
+
+// Read from a client and answer every complete frame; returns false
+// when the connection should be dropped
+bool ModbusServer::serveClient(int index) {
+    modbus_client_t* client = &s_clients[index];
+    uint8_t response[MODBUS_MAX_ADU_SIZE];
+
+    int received = recv(client->sock, client->buf + client->len, sizeof(client->buf) - client->len, 0);
+    if (received <= 0) {
+        return false;
+    }
+    client->len += received;
+    client->last_active_us = esp_timer_get_time();
+
+    while (true) {
+        int frame_len = ModbusPdu::frameLength(client->buf, client->len);
+        if (frame_len < 0) {
+            ESP_LOGW(TAG, "Dropping client after a malformed header");
+            return false;
+        }
+        if (frame_len == 0) {
+            break;
+        }
+
+        int response_len = s_pdu->handleFrame(client->buf, response);
+        if (send(client->sock, response, response_len, 0) < 0) {
+            return false;
+        }
+
+        client->len -= frame_len;
+        memmove(client->buf, client->buf + frame_len, client->len);
+    }
+    return true;
+}
+
+void ModbusServer::serverTask(void* pvParameter) {
+    int listen_sock = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+    if (listen_sock < 0) {
+        ESP_LOGE(TAG, "Failed to create socket: errno %d", errno);
+        vTaskDelete(NULL);
+        return;
+    }
+
+    int reuse = 1;
+    setsockopt(listen_sock, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+
+    struct sockaddr_in addr = {};
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(MODBUS_TCP_PORT);
+    addr.sin_addr.s_addr = htonl(INADDR_ANY);
+    if (bind(listen_sock, (struct sockaddr*)&addr, sizeof(addr)) < 0 || listen(listen_sock, 2) < 0) {
+        ESP_LOGE(TAG, "Failed to listen on port %d: errno %d", MODBUS_TCP_PORT, errno);
+        close(listen_sock);
+        vTaskDelete(NULL);
+        return;
+    }
+
+    ESP_LOGI(TAG, "Modbus TCP server on port %d, %ld coils and holding registers",
+             MODBUS_TCP_PORT, (long)s_num_switches);
+
+    while (true) {
+        fd_set readable;
+        FD_ZERO(&readable);
+        FD_SET(listen_sock, &readable);
+        int max_fd = listen_sock;
+        for (int i = 0; i < MODBUS_MAX_CLIENTS; i++) {
+            if (s_clients[i].sock >= 0) {
+                FD_SET(s_clients[i].sock, &readable);
+                max_fd = s_clients[i].sock > max_fd ? s_clients[i].sock : max_fd;
+            }
+        }
+
+        struct timeval timeout = { 1, 0 };
+        if (select(max_fd + 1, &readable, NULL, NULL, &timeout) < 0) {
+            ESP_LOGW(TAG, "select failed: errno %d", errno);
+            vTaskDelay(pdMS_TO_TICKS(100));
+            continue;
+        }
+
+        for (int i = 0; i < MODBUS_MAX_CLIENTS; i++) {
+            if (s_clients[i].sock >= 0 && FD_ISSET(s_clients[i].sock, &readable) && !serveClient(i)) {
+                close_client(&s_clients[i]);
+            }
+        }
+
+        int64_t now = esp_timer_get_time();
+        if (FD_ISSET(listen_sock, &readable)) {
+            int sock = accept(listen_sock, NULL, NULL);
+            if (sock >= 0) {
+                // Take a free slot, or the least recently active one: a
+                // PLC that reconnects must not be locked out by its own
+                // half-open connection
+                modbus_client_t* slot = &s_clients[0];
+                for (int i = 0; i < MODBUS_MAX_CLIENTS; i++) {
+                    if (s_clients[i].sock < 0) {
+                        slot = &s_clients[i];
+                        break;
+                    }
+                    if (s_clients[i].last_active_us < slot->last_active_us) {
+                        slot = &s_clients[i];
+                    }
+                }
+                if (slot->sock >= 0) {
+                    ESP_LOGW(TAG, "Client limit reached, dropping the least recently active one");
+                    close_client(slot);
+                }
+
+                // Responses are single small frames, send them at once
+                int nodelay = 1;
+                setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof(nodelay));
+                slot->sock = sock;
+                slot->len = 0;
+                slot->last_active_us = now;
+            }
+        }
+
+        for (int i = 0; i < MODBUS_MAX_CLIENTS; i++) {
+            if (s_clients[i].sock >= 0 &&
+                now - s_clients[i].last_active_us > (int64_t)MODBUS_IDLE_TIMEOUT_S * 1000000) {
+                ESP_LOGI(TAG, "Closing idle client");
+                close_client(&s_clients[i]);
+            }
+        }
+    }
+}
@@ -0,0 +1,31 @@
+#ifndef MODBUS_SERVER_H
+#define MODBUS_SERVER_H
+
+#include <esp_err.h>
+#include <stdint.h>
+#include "alpaca_switch.h"
+
+// Modbus TCP server for PLCs that do not speak Alpaca.
+//
+// Switch n is coil n (state) and holding register n (value). A register
+// holds the value as a step count above the minimum, value = min + reg *
+// step, so every valid value is an exact integer. Writes go through
+// AlpacaSwitch::setValues(), and so through the same can_write, range and
+// rule checks as the Alpaca API. A multi-coil or multi-register write is
+// one transition: the rules are checked against the states the whole
+// frame leaves, and it either switches the whole range or nothing.
+//
+// Supported function codes: 01 read coils, 03 read holding registers,
+// 05 write single coil, 06 write single register, 15 write multiple
+// coils, 16 write multiple registers. Modbus has no authentication.
+class ModbusServer {
+public:
+    // Start serving on MODBUS_TCP_PORT
+    static esp_err_t start(AlpacaSwitch* device);
+
+private:
+    static void serverTask(void* pvParameter);
+    static bool serveClient(int index);
+};
+
+#endif // MODBUS_SERVER_H
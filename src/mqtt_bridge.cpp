@@ -0,0 +1,357 @@
+#include "mqtt_bridge.h"
+#include "config.h"
+#include <esp_log.h>
+#include <nvs.h>
+#include <atomic>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
+#include <freertos/semphr.h>
+
+static const char* TAG = "mqtt_bridge";
+const char* MqttBridge::NVS_NAMESPACE = "mqtt";
+
+// Longest topic built from the prefix
+#define MQTT_TOPIC_SIZE 96
+
+// Size of the combined changes message
+#define MQTT_CHANGES_SIZE 512
+
+static AlpacaSwitch* s_device = NULL;
+static int32_t s_num_switches = 0;
+static mqtt_bridge_config_t s_config;
+static esp_mqtt_client_handle_t s_client = NULL;
+
+// Held while the client or the settings are used outside the MQTT task
+static SemaphoreHandle_t s_client_lock = NULL;
+
+static TaskHandle_t s_publish_task = NULL;
+static std::atomic<bool>* s_pending = NULL;     // Per switch, changed since last published
+static std::atomic<bool> s_resync(false);       // Publish every switch, after connecting
+static std::atomic<bool> s_connected(false);
+
+esp_err_t MqttBridge::start(AlpacaSwitch* device) {
+    s_device = device;
+    device->get_maxswitch(&s_num_switches);
+    s_pending = new std::atomic<bool>[s_num_switches]();
+
+    s_client_lock = xSemaphoreCreateMutex();
+    if (s_client_lock == NULL) {
+        return ESP_ERR_NO_MEM;
+    }
+
+    loadConfig(&s_config);
+
+    if (xTaskCreatePinnedToCore(publishTask, "mqtt_publish", 3072, NULL, MQTT_PUBLISH_TASK_PRIORITY,
+                                &s_publish_task, MQTT_PUBLISH_TASK_CORE) != pdPASS) {
+        ESP_LOGE(TAG, "Failed to create publish task");
+        return ESP_ERR_NO_MEM;
+    }
+
+    esp_err_t err = device->addChangeListener(onSwitchChange, NULL);
+    if (err != ESP_OK) {
+        return err;
+    }
+
+    if (s_config.uri[0] == '\0') {
+        ESP_LOGI(TAG, "No broker configured, MQTT bridge idle");
+        return ESP_OK;
+    }
+
+    xSemaphoreTake(s_client_lock, portMAX_DELAY);
+    err = connect();
+    xSemaphoreGive(s_client_lock);
+    return err;
+}
+
+esp_err_t MqttBridge::setConfig(const mqtt_bridge_config_t* config) {
+    if (strncmp(config->uri, "mqtt://", 7) != 0 && strncmp(config->uri, "mqtts://", 8) != 0 &&
+        config->uri[0] != '\0') {
+        ESP_LOGW(TAG, "Broker URI must start with mqtt:// or mqtts://");
+        return ESP_ERR_INVALID_ARG;
+    }
+    if (config->prefix[0] == '\0' || strpbrk(config->prefix, "+#") != NULL) {
+        ESP_LOGW(TAG, "Invalid topic prefix");
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    esp_err_t err = saveConfig(config);
+    if (err != ESP_OK) {
+        return err;
+    }
+
+    xSemaphoreTake(s_client_lock, portMAX_DELAY);
+
+    // Stop the old client first so its task no longer reads the settings
+    if (s_client != NULL) {
+        esp_mqtt_client_stop(s_client);
+        esp_mqtt_client_destroy(s_client);
+        s_client = NULL;
+        s_connected = false;
+    }
+
+    s_config = *config;
+    if (s_config.uri[0] != '\0') {
+        err = connect();
+    }
+
+    xSemaphoreGive(s_client_lock);
+    return err;
+}
+
+void MqttBridge::getConfig(mqtt_bridge_config_t* config) {
+    xSemaphoreTake(s_client_lock, portMAX_DELAY);
+    *config = s_config;
+    xSemaphoreGive(s_client_lock);
+}
+
+bool MqttBridge::isConnected() {
+    return s_connected;
+}
+
+esp_err_t MqttBridge::loadConfig(mqtt_bridge_config_t* config) {
+    memset(config, 0, sizeof(*config));
+    strlcpy(config->prefix, MQTT_DEFAULT_TOPIC_PREFIX, sizeof(config->prefix));
+
+    nvs_handle_t handle;
+    esp_err_t err = nvs_open(NVS_NAMESPACE, NVS_READONLY, &handle);
+    if (err != ESP_OK) {
+        if (err == ESP_ERR_NVS_NOT_FOUND) {
+            return ESP_OK;
+        }
+        ESP_LOGE(TAG, "Failed to open NVS handle: %s", esp_err_to_name(err));
+        return err;
+    }
+
+    size_t len = sizeof(config->uri);
+    nvs_get_str(handle, "uri", config->uri, &len);
+    len = sizeof(config->username);
+    nvs_get_str(handle, "username", config->username, &len);
+    len = sizeof(config->password);
+    nvs_get_str(handle, "password", config->password, &len);
+    len = sizeof(config->prefix);
+    nvs_get_str(handle, "prefix", config->prefix, &len);
+
+    nvs_close(handle);
+    return ESP_OK;
+}
+
+esp_err_t MqttBridge::saveConfig(const mqtt_bridge_config_t* config) {
+    nvs_handle_t handle;
+    esp_err_t err = nvs_open(NVS_NAMESPACE, NVS_READWRITE, &handle);
+    if (err != ESP_OK) {
+        ESP_LOGE(TAG, "Failed to open NVS handle: %s", esp_err_to_name(err));
+        return err;
+    }
+
+    err = nvs_set_str(handle, "uri", config->uri);
+    if (err == ESP_OK) {
+        err = nvs_set_str(handle, "username", config->username);
+    }
+    if (err == ESP_OK) {
+        err = nvs_set_str(handle, "password", config->password);
+    }
+    if (err == ESP_OK) {
+        err = nvs_set_str(handle, "prefix", config->prefix);
+    }
+    if (err == ESP_OK) {
+        err = nvs_commit(handle);
+    }
+    nvs_close(handle);
+
+    if (err != ESP_OK) {
+        ESP_LOGE(TAG, "Failed to save MQTT settings: %s", esp_err_to_name(err));
+    }
+    return err;
+}
+
+esp_err_t MqttBridge::connect() {
+    static char will_topic[MQTT_TOPIC_SIZE];
+    snprintf(will_topic, sizeof(will_topic), "%s/status", s_config.prefix);
+
+    esp_mqtt_client_config_t mqtt_config = {};
+    mqtt_config.broker.address.uri = s_config.uri;
+    mqtt_config.credentials.client_id = DEVICE_SERIAL;
+    if (s_config.username[0] != '\0') {
+        mqtt_config.credentials.username = s_config.username;
+        mqtt_config.credentials.authentication.password = s_config.password;
+    }
+    mqtt_config.session.keepalive = MQTT_KEEPALIVE_S;
+    mqtt_config.session.last_will.topic = will_topic;
+    mqtt_config.session.last_will.msg = "offline";
+    mqtt_config.session.last_will.qos = 1;
+    mqtt_config.session.last_will.retain = 1;
+    mqtt_config.task.priority = MQTT_TASK_PRIORITY;
+
+    s_client = esp_mqtt_client_init(&mqtt_config);
+    if (s_client == NULL) {
+        ESP_LOGE(TAG, "Failed to create MQTT client");
+        return ESP_FAIL;
+    }
+
+    esp_mqtt_client_register_event(s_client, MQTT_EVENT_ANY, eventHandler, NULL);
+    esp_err_t err = esp_mqtt_client_start(s_client);
+    if (err != ESP_OK) {
+        ESP_LOGE(TAG, "Failed to start MQTT client: %s", esp_err_to_name(err));
+        esp_mqtt_client_destroy(s_client);
+        s_client = NULL;
+        return err;
+    }
+
+    ESP_LOGI(TAG, "Connecting to %s", s_config.uri);
+    return ESP_OK;
+}
+
+void MqttBridge::eventHandler(void* arg, esp_event_base_t base, int32_t event_id, void* event_data) {
+    esp_mqtt_event_handle_t event = static_cast<esp_mqtt_event_handle_t>(event_data);
+    char topic[MQTT_TOPIC_SIZE];
+
+    switch ((esp_mqtt_event_id_t)event_id) {
+        case MQTT_EVENT_CONNECTED:
+            ESP_LOGI(TAG, "Connected to broker");
+            snprintf(topic, sizeof(topic), "%s/+/set", s_config.prefix);
+            esp_mqtt_client_subscribe(event->client, topic, 1);
+            snprintf(topic, sizeof(topic), "%s/status", s_config.prefix);
+            esp_mqtt_client_publish(event->client, topic, "online", 0, 1, 1);
+
+            // The broker may hold stale retained state from before
+            s_connected = true;
+            s_resync = true;
+            xTaskNotifyGive(s_publish_task);
+            break;
+
+        case MQTT_EVENT_DISCONNECTED:
+            ESP_LOGW(TAG, "Disconnected from broker");
+            s_connected = false;
+            break;
+
+        case MQTT_EVENT_DATA:
+            // Commands are short; a payload split over several events is not one
+            if (event->current_data_offset == 0 && event->data_len == event->total_data_len) {
+                handleCommand(event);
+            }
+            break;
+
+        default:
+            break;
+    }
+}
+
+void MqttBridge::handleCommand(esp_mqtt_event_handle_t event) {
+    // Expect <prefix>/<id>/set
+    const char* topic = event->topic;
+    int topic_len = event->topic_len;
+    size_t prefix_len = strlen(s_config.prefix);
+    if (topic_len <= (int)prefix_len + 1 || strncmp(topic, s_config.prefix, prefix_len) != 0 ||
+        topic[prefix_len] != '/') {
+        return;
+    }
+
+    char rest[16];
+    int rest_len = topic_len - (int)prefix_len - 1;
+    if (rest_len >= (int)sizeof(rest)) {
+        return;
+    }
+    memcpy(rest, topic + prefix_len + 1, rest_len);
+    rest[rest_len] = '\0';
+
+    char* end;
+    long id = strtol(rest, &end, 10);
+    if (end == rest || strcmp(end, "/set") != 0) {
+        return;
+    }
+
+    char payload[32];
+    if (event->data_len <= 0 || event->data_len >= (int)sizeof(payload)) {
+        ESP_LOGW(TAG, "Ignoring command for switch %ld, bad payload length", id);
+        return;
+    }
+    memcpy(payload, event->data, event->data_len);
+    payload[event->data_len] = '\0';
+
+    // Same entry points, and so the same checks, as the Alpaca API
+    esp_err_t err;
+    double value = strtod(payload, &end);
+    if (end != payload && *end == '\0') {
+        err = s_device->put_setswitchvalue((int32_t)id, value);
+    } else if (strcasecmp(payload, "on") == 0 || strcasecmp(payload, "true") == 0) {
+        err = s_device->put_setswitch((int32_t)id, true);
+    } else if (strcasecmp(payload, "off") == 0 || strcasecmp(payload, "false") == 0) {
+        err = s_device->put_setswitch((int32_t)id, false);
+    } else {
+        err = ALPACA_ERR_INVALID_VALUE;
+    }
+
+    if (err != ALPACA_OK) {
+        char error_topic[MQTT_TOPIC_SIZE];
+        char message[64];
+        snprintf(error_topic, sizeof(error_topic), "%s/%ld/error", s_config.prefix, id);
+        snprintf(message, sizeof(message), "\"%s\" refused, Alpaca error 0x%x", payload, (unsigned int)err);
+        esp_mqtt_client_publish(event->client, error_topic, message, 0, 0, 0);
+    }
+}
+
+void MqttBridge::onSwitchChange(void* ctx, const switch_change_t* changes, int count) {
+    // Called on the switch path: only mark the switches and wake the task
+    for (int i = 0; i < count; i++) {
+        s_pending[changes[i].id] = true;
+    }
+    xTaskNotifyGive(s_publish_task);
+}
+
+void MqttBridge::publishTask(void* pvParameter) {
+    static char changes[MQTT_CHANGES_SIZE];
+    char topic[MQTT_TOPIC_SIZE];
+    char payload[24];
+
+    while (true) {
+        ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+
+        // Let changes made together arrive, then publish them in one go
+        vTaskDelay(pdMS_TO_TICKS(MQTT_BATCH_WINDOW_MS));
+        ulTaskNotifyTake(pdTRUE, 0);
+
+        if (!s_connected) {
+            continue;       // Everything is published again on connect
+        }
+
+        xSemaphoreTake(s_client_lock, portMAX_DELAY);
+        bool all = s_resync.exchange(false);
+        size_t len = snprintf(changes, sizeof(changes), "{\"sw\":[");
+        int published = 0;
+
+        for (int32_t id = 0; id < s_num_switches && s_client != NULL; id++) {
+            if (!s_pending[id].exchange(false) && !all) {
+                continue;
+            }
+
+            bool state = false;
+            double value = 0;
+            s_device->get_getswitch(id, &state);
+            s_device->get_getswitchvalue(id, &value);
+
+            snprintf(topic, sizeof(topic), "%s/%ld/state", s_config.prefix, (long)id);
+            esp_mqtt_client_publish(s_client, topic, state ? "on" : "off", 0, 1, 1);
+            snprintf(topic, sizeof(topic), "%s/%ld/value", s_config.prefix, (long)id);
+            snprintf(payload, sizeof(payload), "%g", value);
+            esp_mqtt_client_publish(s_client, topic, payload, 0, 1, 1);
+
+            if (len + 48 < sizeof(changes)) {
+                len += snprintf(changes + len, sizeof(changes) - len, "%s[%ld,%d,%g]",
+                                published > 0 ? "," : "", (long)id, state ? 1 : 0, value);
+            }
+            published++;
+        }
+
+        if (published > 0 && s_client != NULL) {
+            len += snprintf(changes + len, sizeof(changes) - len, "]}");
+            snprintf(topic, sizeof(topic), "%s/changes", s_config.prefix);
+            esp_mqtt_client_publish(s_client, topic, changes, len, 0, 0);
+            ESP_LOGD(TAG, "Published %d switches", published);
+        }
+        xSemaphoreGive(s_client_lock);
+    }
+}
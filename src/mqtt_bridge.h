@@ -0,0 +1,59 @@
+#ifndef MQTT_BRIDGE_H
+#define MQTT_BRIDGE_H
+
+#include <esp_err.h>
+#include <esp_event.h>
+#include <mqtt_client.h>
+#include "alpaca_switch.h"
+
+// Broker settings, stored in NVS
+typedef struct {
+    char uri[128];              // mqtt://host:1883 or mqtts://host:8883; empty disables the bridge
+    char username[64];
+    char password[64];
+    char prefix[64];            // Topic prefix, e.g. observatory/switch
+} mqtt_bridge_config_t;
+
+// MQTT bridge for the switch device. Under the configured prefix:
+//
+//     <prefix>/status         online/offline, retained (offline is the will)
+//     <prefix>/<id>/state     on/off, retained
+//     <prefix>/<id>/value     switch value, retained
+//     <prefix>/<id>/set       commands: a value, or on/off/true/false
+//     <prefix>/<id>/error     why the last command was refused
+//     <prefix>/changes        {"sw":[[id,state,value],...]} per batch
+//
+// Commands call put_setswitchvalue/put_setswitch, so they are checked
+// exactly like Alpaca requests. Switch changes are picked up by a change
+// listener and published from the bridge's own task; changes that arrive
+// together are published as one burst with the latest values.
+class MqttBridge {
+public:
+    // Start the bridge; it connects once a broker URI is configured
+    static esp_err_t start(AlpacaSwitch* device);
+
+    // Store new broker settings and reconnect with them
+    static esp_err_t setConfig(const mqtt_bridge_config_t* config);
+
+    // Get the current broker settings
+    static void getConfig(mqtt_bridge_config_t* config);
+
+    // Check if the bridge is connected to the broker
+    static bool isConnected();
+
+private:
+    static const char* NVS_NAMESPACE;
+
+    static esp_err_t loadConfig(mqtt_bridge_config_t* config);
+    static esp_err_t saveConfig(const mqtt_bridge_config_t* config);
+
+    // Create and start the client for the current settings
+    static esp_err_t connect();
+
+    static void eventHandler(void* arg, esp_event_base_t base, int32_t event_id, void* event_data);
+    static void handleCommand(esp_mqtt_event_handle_t event);
+    static void onSwitchChange(void* ctx, const switch_change_t* changes, int count);
+    static void publishTask(void* pvParameter);
+};
+
+#endif // MQTT_BRIDGE_H
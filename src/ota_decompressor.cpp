@@ -0,0 +1,244 @@
+#include "ota_decompressor.h"
+#include <esp_log.h>
+#include <esp_rom_crc.h>
+#include <rom/miniz.h>
+#include <stdlib.h>
+
+static const char* TAG = "ota_decompressor";
+
+// gzip header fields (RFC 1952)
+#define GZIP_ID1 0x1f
+#define GZIP_ID2 0x8b
+#define GZIP_CM_DEFLATE 8
+#define GZIP_FLAG_FHCRC 0x02
+#define GZIP_FLAG_FEXTRA 0x04
+#define GZIP_FLAG_FNAME 0x08
+#define GZIP_FLAG_FCOMMENT 0x10
+#define GZIP_HEADER_SIZE 10
+#define GZIP_TRAILER_SIZE 8
+
+static uint32_t read_le32(const uint8_t* p) {
+    return (uint32_t)p[0] | ((uint32_t)p[1] << 8) | ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+OtaDecompressor::OtaDecompressor()
+    : _state(STATE_HEADER), _flags(0), _fieldPos(0), _skip(0),
+      _inflator(NULL), _window(NULL), _windowPos(0), _crc(0),
+      _inputSize(0), _outputSize(0)
+{
+}
+
+OtaDecompressor::~OtaDecompressor()
+{
+    end();
+}
+
+bool OtaDecompressor::isGzip(const uint8_t* data, size_t len)
+{
+    return len > 0 && data[0] == GZIP_ID1;
+}
+
+esp_err_t OtaDecompressor::begin()
+{
+    if (_inflator == NULL) {
+        _inflator = (tinfl_decompressor*)malloc(sizeof(tinfl_decompressor));
+    }
+    if (_window == NULL) {
+        _window = (uint8_t*)malloc(TINFL_LZ_DICT_SIZE);
+    }
+    if (_inflator == NULL || _window == NULL) {
+        ESP_LOGE(TAG, "Failed to allocate decompression window");
+        end();
+        return ESP_ERR_NO_MEM;
+    }
+
+    tinfl_init(_inflator);
+    _state = STATE_HEADER;
+    _flags = 0;
+    _fieldPos = 0;
+    _skip = 0;
+    _windowPos = 0;
+    _crc = 0;
+    _inputSize = 0;
+    _outputSize = 0;
+    return ESP_OK;
+}
+
+void OtaDecompressor::end()
+{
+    free(_inflator);
+    _inflator = NULL;
+    free(_window);
+    _window = NULL;
+}
+
+esp_err_t OtaDecompressor::feed(const uint8_t* data, size_t len, ota_sink_fn_t sink, void* ctx)
+{
+    if (_inflator == NULL) {
+        return ESP_ERR_INVALID_STATE;
+    }
+
+    _inputSize += len;
+
+    while (len > 0) {
+        esp_err_t err = ESP_OK;
+
+        switch (_state) {
+            case STATE_DEFLATE:
+                err = inflate(data, len, sink, ctx);
+                break;
+
+            case STATE_TRAILER:
+                _field[_fieldPos++] = *data++;
+                len--;
+                if (_fieldPos == GZIP_TRAILER_SIZE) {
+                    err = checkTrailer();
+                }
+                break;
+
+            case STATE_DONE:
+                // Trailing bytes after the gzip member are ignored
+                ESP_LOGW(TAG, "Ignoring %u bytes after end of stream", (unsigned int)len);
+                return ESP_OK;
+
+            default:
+                err = parseHeaderByte(*data++);
+                len--;
+                break;
+        }
+
+        if (err != ESP_OK) {
+            return err;
+        }
+    }
+
+    return ESP_OK;
+}
+
+esp_err_t OtaDecompressor::parseHeaderByte(uint8_t byte)
+{
+    switch (_state) {
+        case STATE_HEADER:
+            _field[_fieldPos++] = byte;
+            if (_fieldPos < GZIP_HEADER_SIZE) {
+                return ESP_OK;
+            }
+            if (_field[0] != GZIP_ID1 || _field[1] != GZIP_ID2 || _field[2] != GZIP_CM_DEFLATE) {
+                ESP_LOGE(TAG, "Not a gzip deflate stream");
+                return ESP_ERR_INVALID_RESPONSE;
+            }
+            _flags = _field[3];
+            _fieldPos = 0;
+            _state = STATE_EXTRA_LEN;
+            break;
+
+        case STATE_EXTRA_LEN:
+            _field[_fieldPos++] = byte;
+            if (_fieldPos < 2) {
+                return ESP_OK;
+            }
+            _skip = (size_t)_field[0] | ((size_t)_field[1] << 8);
+            _fieldPos = 0;
+            _state = STATE_EXTRA;
+            break;
+
+        case STATE_EXTRA:
+            _skip--;
+            break;
+
+        case STATE_NAME:
+        case STATE_COMMENT:
+            if (byte != 0) {
+                return ESP_OK;
+            }
+            _state = (_state == STATE_NAME) ? STATE_COMMENT : STATE_HCRC;
+            break;
+
+        case STATE_HCRC:
+            _fieldPos++;
+            if (_fieldPos == 2) {
+                _fieldPos = 0;
+                _state = STATE_DEFLATE;
+            }
+            return ESP_OK;
+
+        default:
+            return ESP_ERR_INVALID_STATE;
+    }
+
+    // Advance past optional header fields that are not present
+    if (_state == STATE_EXTRA_LEN && !(_flags & GZIP_FLAG_FEXTRA)) {
+        _state = STATE_NAME;
+    }
+    if (_state == STATE_EXTRA && _skip > 0) {
+        return ESP_OK;
+    }
+    if (_state == STATE_EXTRA) {
+        _state = STATE_NAME;
+    }
+    if (_state == STATE_NAME && !(_flags & GZIP_FLAG_FNAME)) {
+        _state = STATE_COMMENT;
+    }
+    if (_state == STATE_COMMENT && !(_flags & GZIP_FLAG_FCOMMENT)) {
+        _state = STATE_HCRC;
+    }
+    if (_state == STATE_HCRC && !(_flags & GZIP_FLAG_FHCRC)) {
+        _state = STATE_DEFLATE;
+    }
+    return ESP_OK;
+}
+
+esp_err_t OtaDecompressor::inflate(const uint8_t*& data, size_t& len, ota_sink_fn_t sink, void* ctx)
+{
+    while (true) {
+        size_t in_bytes = len;
+        size_t out_bytes = TINFL_LZ_DICT_SIZE - _windowPos;
+
+        // The window doubles as the LZ dictionary, so output wraps around it
+        tinfl_status status = tinfl_decompress(_inflator, data, &in_bytes,
+                                               _window, _window + _windowPos, &out_bytes,
+                                               TINFL_FLAG_HAS_MORE_INPUT);
+        data += in_bytes;
+        len -= in_bytes;
+
+        if (out_bytes > 0) {
+            _crc = esp_rom_crc32_le(_crc, _window + _windowPos, out_bytes);
+            esp_err_t err = sink(ctx, _window + _windowPos, out_bytes);
+            if (err != ESP_OK) {
+                return err;
+            }
+            _windowPos = (_windowPos + out_bytes) & (TINFL_LZ_DICT_SIZE - 1);
+            _outputSize += out_bytes;
+        }
+
+        if (status == TINFL_STATUS_DONE) {
+            _fieldPos = 0;
+            _state = STATE_TRAILER;
+            return ESP_OK;
+        }
+        if (status < 0) {
+            ESP_LOGE(TAG, "Corrupt deflate stream (%d)", (int)status);
+            return ESP_ERR_INVALID_RESPONSE;
+        }
+        if (status == TINFL_STATUS_NEEDS_MORE_INPUT && len == 0) {
+            return ESP_OK;
+        }
+        // TINFL_STATUS_HAS_MORE_OUTPUT: the window wrapped, keep going
+    }
+}
+
+esp_err_t OtaDecompressor::checkTrailer()
+{
+    uint32_t crc = read_le32(&_field[0]);
+    uint32_t size = read_le32(&_field[4]);
+
+    if (crc != _crc || size != (uint32_t)_outputSize) {
+        ESP_LOGE(TAG, "gzip trailer mismatch (crc %08lx/%08lx, size %lu/%lu)",
+                 (unsigned long)crc, (unsigned long)_crc,
+                 (unsigned long)size, (unsigned long)_outputSize);
+        return ESP_ERR_INVALID_CRC;
+    }
+
+    _state = STATE_DONE;
+    return ESP_OK;
+}
@@ -0,0 +1,71 @@
+#ifndef OTA_DECOMPRESSOR_H
+#define OTA_DECOMPRESSOR_H
+
+#include <esp_err.h>
+#include <stdint.h>
+#include <stddef.h>
+
+// Receives a block of decompressed image data
+typedef esp_err_t (*ota_sink_fn_t)(void* ctx, const uint8_t* data, size_t len);
+
+struct tinfl_decompressor_tag;
+
+// Streaming gzip decoder for OTA images. Input is inflated by the ROM
+// tinfl decompressor into a fixed 32 KB dictionary window and handed to
+// the sink as it is produced, so the image is never held in RAM.
+class OtaDecompressor {
+public:
+    OtaDecompressor();
+    ~OtaDecompressor();
+
+    // Check for the gzip magic byte at the start of a stream. An ESP
+    // application image starts with 0xE9, so one byte is enough.
+    static bool isGzip(const uint8_t* data, size_t len);
+
+    // Allocate the window and reset for a new stream
+    esp_err_t begin();
+
+    // Decode the next block of the compressed stream
+    esp_err_t feed(const uint8_t* data, size_t len, ota_sink_fn_t sink, void* ctx);
+
+    // Check whether the trailer has been read and verified
+    bool isFinished() const { return _state == STATE_DONE; }
+
+    // Release the window
+    void end();
+
+    // Get the number of compressed/decompressed bytes processed
+    size_t getInputSize() const { return _inputSize; }
+    size_t getOutputSize() const { return _outputSize; }
+
+private:
+    enum State {
+        STATE_HEADER,       // Fixed 10-byte gzip header
+        STATE_EXTRA_LEN,    // FEXTRA length field
+        STATE_EXTRA,        // FEXTRA payload
+        STATE_NAME,         // Zero-terminated FNAME
+        STATE_COMMENT,      // Zero-terminated FCOMMENT
+        STATE_HCRC,         // FHCRC header checksum
+        STATE_DEFLATE,      // Raw deflate stream
+        STATE_TRAILER,      // CRC32 and ISIZE
+        STATE_DONE
+    };
+
+    esp_err_t parseHeaderByte(uint8_t byte);
+    esp_err_t inflate(const uint8_t*& data, size_t& len, ota_sink_fn_t sink, void* ctx);
+    esp_err_t checkTrailer();
+
+    State _state;
+    uint8_t _flags;
+    uint8_t _field[10];         // Bytes of the header or trailer being collected
+    size_t _fieldPos;
+    size_t _skip;               // Remaining FEXTRA bytes
+    tinfl_decompressor_tag* _inflator;
+    uint8_t* _window;
+    size_t _windowPos;
+    uint32_t _crc;
+    size_t _inputSize;
+    size_t _outputSize;
+};
+
+#endif // OTA_DECOMPRESSOR_H
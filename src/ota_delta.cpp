@@ -0,0 +1,285 @@
+#include "ota_delta.h"
+#include <esp_log.h>
+#include <stdlib.h>
+#include <string.h>
+
+static const char* TAG = "ota_delta";
+
+// Source bytes read per step of a COPY or DIFF op
+#define DELTA_BUFFER_SIZE 1024
+
+// Patch opcodes
+#define DELTA_OP_END 0x00
+#define DELTA_OP_COPY 0x01
+#define DELTA_OP_DIFF 0x02
+#define DELTA_OP_INSERT 0x03
+
+static uint32_t read_le32(const uint8_t* p) {
+    return (uint32_t)p[0] | ((uint32_t)p[1] << 8) | ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+OtaDeltaPatcher::OtaDeltaPatcher()
+    : _state(STATE_HEADER), _op(0), _fieldPos(0), _fieldSize(OTA_DELTA_HEADER_SIZE),
+      _srcOffset(0), _remaining(0), _sourceLimit(0), _read(NULL), _readCtx(NULL),
+      _targetSize(0), _buf(NULL), _patchSize(0), _outputSize(0)
+{
+    mbedtls_sha256_init(&_sha);
+}
+
+OtaDeltaPatcher::~OtaDeltaPatcher()
+{
+    end();
+    mbedtls_sha256_free(&_sha);
+}
+
+bool OtaDeltaPatcher::isPatch(const uint8_t* data, size_t len)
+{
+    return len > 0 && data[0] == (uint8_t)OTA_DELTA_MAGIC[0];
+}
+
+esp_err_t OtaDeltaPatcher::begin(const uint8_t source_sha256[32], size_t source_limit,
+                                 ota_source_fn_t read, void* read_ctx)
+{
+    if (_buf == NULL) {
+        _buf = (uint8_t*)malloc(DELTA_BUFFER_SIZE);
+        if (_buf == NULL) {
+            ESP_LOGE(TAG, "Failed to allocate patch buffer");
+            return ESP_ERR_NO_MEM;
+        }
+    }
+
+    memcpy(_sourceSha, source_sha256, sizeof(_sourceSha));
+    _sourceLimit = source_limit;
+    _read = read;
+    _readCtx = read_ctx;
+
+    _state = STATE_HEADER;
+    _fieldPos = 0;
+    _fieldSize = OTA_DELTA_HEADER_SIZE;
+    _remaining = 0;
+    _patchSize = 0;
+    _outputSize = 0;
+
+    mbedtls_sha256_free(&_sha);
+    mbedtls_sha256_init(&_sha);
+    mbedtls_sha256_starts(&_sha, 0);
+    return ESP_OK;
+}
+
+void OtaDeltaPatcher::end()
+{
+    free(_buf);
+    _buf = NULL;
+}
+
+esp_err_t OtaDeltaPatcher::feed(const uint8_t* data, size_t len, ota_sink_fn_t sink, void* ctx)
+{
+    if (_buf == NULL) {
+        return ESP_ERR_INVALID_STATE;
+    }
+
+    _patchSize += len;
+
+    while (len > 0) {
+        esp_err_t err = ESP_OK;
+
+        switch (_state) {
+            case STATE_HEADER:
+            case STATE_ARGS: {
+                size_t n = _fieldSize - _fieldPos;
+                if (n > len) {
+                    n = len;
+                }
+                memcpy(&_field[_fieldPos], data, n);
+                _fieldPos += n;
+                data += n;
+                len -= n;
+                if (_fieldPos == _fieldSize) {
+                    err = (_state == STATE_HEADER) ? checkHeader() : startOp(sink, ctx);
+                }
+                break;
+            }
+
+            case STATE_OPCODE:
+                _op = *data++;
+                len--;
+                _fieldPos = 0;
+                if (_op == DELTA_OP_COPY || _op == DELTA_OP_DIFF) {
+                    _fieldSize = 8;
+                } else if (_op == DELTA_OP_INSERT) {
+                    _fieldSize = 4;
+                } else if (_op == DELTA_OP_END) {
+                    err = finish();
+                    break;
+                } else {
+                    ESP_LOGE(TAG, "Unknown patch opcode 0x%02x", _op);
+                    err = ESP_ERR_INVALID_RESPONSE;
+                    break;
+                }
+                _state = STATE_ARGS;
+                break;
+
+            case STATE_DIFF: {
+                size_t n = _remaining;
+                if (n > len) {
+                    n = len;
+                }
+                if (n > DELTA_BUFFER_SIZE) {
+                    n = DELTA_BUFFER_SIZE;
+                }
+                err = _read(_readCtx, _srcOffset, _buf, n);
+                if (err != ESP_OK) {
+                    break;
+                }
+                for (size_t i = 0; i < n; i++) {
+                    _buf[i] += data[i];
+                }
+                data += n;
+                len -= n;
+                _srcOffset += n;
+                _remaining -= n;
+                err = emit(_buf, n, sink, ctx);
+                if (_remaining == 0) {
+                    _state = STATE_OPCODE;
+                }
+                break;
+            }
+
+            case STATE_INSERT: {
+                size_t n = _remaining;
+                if (n > len) {
+                    n = len;
+                }
+                err = emit(data, n, sink, ctx);
+                data += n;
+                len -= n;
+                _remaining -= n;
+                if (_remaining == 0) {
+                    _state = STATE_OPCODE;
+                }
+                break;
+            }
+
+            case STATE_DONE:
+                ESP_LOGW(TAG, "Ignoring %u bytes after end of patch", (unsigned int)len);
+                return ESP_OK;
+        }
+
+        if (err != ESP_OK) {
+            return err;
+        }
+    }
+
+    return ESP_OK;
+}
+
+esp_err_t OtaDeltaPatcher::checkHeader()
+{
+    if (memcmp(_field, OTA_DELTA_MAGIC, 4) != 0) {
+        ESP_LOGE(TAG, "Invalid patch magic");
+        return ESP_ERR_INVALID_RESPONSE;
+    }
+
+    uint32_t source_size = read_le32(&_field[4]);
+    if (memcmp(&_field[8], _sourceSha, 32) != 0) {
+        ESP_LOGE(TAG, "Patch was built against a different firmware image");
+        return ESP_ERR_INVALID_VERSION;
+    }
+    if (source_size > _sourceLimit) {
+        ESP_LOGE(TAG, "Patch source size %lu exceeds running partition", (unsigned long)source_size);
+        return ESP_ERR_INVALID_SIZE;
+    }
+    _sourceLimit = source_size;
+
+    _targetSize = read_le32(&_field[40]);
+    memcpy(_targetSha, &_field[44], sizeof(_targetSha));
+
+    ESP_LOGI(TAG, "Applying patch: %lu byte source -> %lu byte target",
+             (unsigned long)source_size, (unsigned long)_targetSize);
+    _state = STATE_OPCODE;
+    return ESP_OK;
+}
+
+esp_err_t OtaDeltaPatcher::startOp(ota_sink_fn_t sink, void* ctx)
+{
+    if (_op == DELTA_OP_INSERT) {
+        _remaining = read_le32(&_field[0]);
+    } else {
+        _srcOffset = read_le32(&_field[0]);
+        _remaining = read_le32(&_field[4]);
+        if (_srcOffset > _sourceLimit || _remaining > _sourceLimit - _srcOffset) {
+            ESP_LOGE(TAG, "Patch op reads outside the source image");
+            return ESP_ERR_INVALID_RESPONSE;
+        }
+    }
+
+    if (_remaining > _targetSize - _outputSize) {
+        ESP_LOGE(TAG, "Patch produces more than the declared target size");
+        return ESP_ERR_INVALID_SIZE;
+    }
+
+    if (_remaining == 0) {
+        _state = STATE_OPCODE;
+        return ESP_OK;
+    }
+
+    switch (_op) {
+        case DELTA_OP_COPY:
+            // Needs no patch data, so it completes right away
+            _state = STATE_OPCODE;
+            return copySource(sink, ctx);
+        case DELTA_OP_DIFF:
+            _state = STATE_DIFF;
+            return ESP_OK;
+        default:
+            _state = STATE_INSERT;
+            return ESP_OK;
+    }
+}
+
+esp_err_t OtaDeltaPatcher::copySource(ota_sink_fn_t sink, void* ctx)
+{
+    while (_remaining > 0) {
+        size_t n = _remaining > DELTA_BUFFER_SIZE ? DELTA_BUFFER_SIZE : _remaining;
+        esp_err_t err = _read(_readCtx, _srcOffset, _buf, n);
+        if (err != ESP_OK) {
+            return err;
+        }
+        err = emit(_buf, n, sink, ctx);
+        if (err != ESP_OK) {
+            return err;
+        }
+        _srcOffset += n;
+        _remaining -= n;
+    }
+    return ESP_OK;
+}
+
+esp_err_t OtaDeltaPatcher::emit(const uint8_t* data, size_t len, ota_sink_fn_t sink, void* ctx)
+{
+    mbedtls_sha256_update(&_sha, data, len);
+    _outputSize += len;
+    return sink(ctx, data, len);
+}
+
+esp_err_t OtaDeltaPatcher::finish()
+{
+    uint8_t digest[32];
+
+    if (_outputSize != _targetSize) {
+        ESP_LOGE(TAG, "Patch produced %u bytes, expected %lu",
+                 (unsigned int)_outputSize, (unsigned long)_targetSize);
+        return ESP_ERR_INVALID_SIZE;
+    }
+
+    mbedtls_sha256_finish(&_sha, digest);
+    if (memcmp(digest, _targetSha, sizeof(digest)) != 0) {
+        ESP_LOGE(TAG, "Patched image SHA-256 mismatch");
+        return ESP_ERR_INVALID_CRC;
+    }
+
+    ESP_LOGI(TAG, "Patched image verified (%u bytes from %u byte patch)",
+             (unsigned int)_outputSize, (unsigned int)_patchSize);
+    _state = STATE_DONE;
+    return ESP_OK;
+}
@@ -0,0 +1,92 @@
+#ifndef OTA_DELTA_H
+#define OTA_DELTA_H
+
+#include <esp_err.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <mbedtls/sha256.h>
+#include "ota_decompressor.h"
+
+// Reads a block of the source image (the running firmware)
+typedef esp_err_t (*ota_source_fn_t)(void* ctx, size_t offset, void* buf, size_t len);
+
+// Patch stream layout, as produced by tools/ota_delta.py (little-endian):
+//
+//   header:  "ADP1" | u32 source size | source SHA-256 (32)
+//                   | u32 target size | target SHA-256 (32)
+//   ops:     0x01 COPY   u32 source offset, u32 length
+//            0x02 DIFF   u32 source offset, u32 length, <length> bytes
+//                        (target byte = source byte + patch byte, mod 256)
+//            0x03 INSERT u32 length, <length> bytes
+//            0x00 END
+#define OTA_DELTA_MAGIC "ADP1"
+#define OTA_DELTA_HEADER_SIZE (4 + 4 + 32 + 4 + 32)
+
+// Streaming applier for binary delta patches. The patch is consumed as
+// it arrives; COPY and DIFF ops read the source image through a callback,
+// and the reconstructed target is handed to the sink in order. The target
+// is hashed on the way out and checked against the header at END.
+class OtaDeltaPatcher {
+public:
+    OtaDeltaPatcher();
+    ~OtaDeltaPatcher();
+
+    // Check for the patch magic at the start of a (decompressed) stream.
+    // An ESP application image starts with 0xE9, so one byte is enough.
+    static bool isPatch(const uint8_t* data, size_t len);
+
+    // Prepare for a new patch against a source image with the given hash
+    esp_err_t begin(const uint8_t source_sha256[32], size_t source_limit,
+                    ota_source_fn_t read, void* read_ctx);
+
+    // Apply the next block of the patch stream
+    esp_err_t feed(const uint8_t* data, size_t len, ota_sink_fn_t sink, void* ctx);
+
+    // Check whether END was reached and the target hash matched
+    bool isFinished() const { return _state == STATE_DONE; }
+
+    // Release the work buffer
+    void end();
+
+    // Get the number of patch/target bytes processed
+    size_t getPatchSize() const { return _patchSize; }
+    size_t getOutputSize() const { return _outputSize; }
+
+private:
+    enum State {
+        STATE_HEADER,
+        STATE_OPCODE,
+        STATE_ARGS,
+        STATE_DIFF,
+        STATE_INSERT,
+        STATE_DONE
+    };
+
+    esp_err_t checkHeader();
+    esp_err_t startOp(ota_sink_fn_t sink, void* ctx);
+    esp_err_t copySource(ota_sink_fn_t sink, void* ctx);
+    esp_err_t emit(const uint8_t* data, size_t len, ota_sink_fn_t sink, void* ctx);
+    esp_err_t finish();
+
+    State _state;
+    uint8_t _op;
+    uint8_t _field[OTA_DELTA_HEADER_SIZE];  // Header or op arguments being collected
+    size_t _fieldPos;
+    size_t _fieldSize;
+    uint32_t _srcOffset;
+    uint32_t _remaining;                    // Bytes left in the current op
+
+    uint8_t _sourceSha[32];
+    size_t _sourceLimit;
+    ota_source_fn_t _read;
+    void* _readCtx;
+    uint32_t _targetSize;
+    uint8_t _targetSha[32];
+
+    uint8_t* _buf;
+    mbedtls_sha256_context _sha;
+    size_t _patchSize;
+    size_t _outputSize;
+};
+
+#endif // OTA_DELTA_H
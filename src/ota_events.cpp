@@ -0,0 +1,150 @@
+#include "ota_events.h"
+#include "ota_updater.h"
+#include "alpaca_auth.h"
+#include "config.h"
+#include <esp_log.h>
+#include <string.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
+
+static const char* TAG = "ota_events";
+
+// Connected clients. Slots are reserved and filled by the httpd task and
+// emptied by the push task; the lock only guards the short slot updates.
+static httpd_req_t* s_clients[OTA_EVENTS_MAX_CLIENTS];
+static bool s_reserved[OTA_EVENTS_MAX_CLIENTS];
+static portMUX_TYPE s_clients_lock = portMUX_INITIALIZER_UNLOCKED;
+static TaskHandle_t s_push_task = NULL;
+
+// Drop a client whose connection failed and release its async request
+static void close_client(int slot, httpd_req_t* req) {
+    portENTER_CRITICAL(&s_clients_lock);
+    s_clients[slot] = NULL;
+    s_reserved[slot] = false;
+    portEXIT_CRITICAL(&s_clients_lock);
+
+    httpd_sess_trigger_close(req->handle, httpd_req_to_sockfd(req));
+    httpd_req_async_handler_complete(req);
+}
+
+esp_err_t OtaEvents::registerHandlers(httpd_handle_t server) {
+    if (s_push_task == NULL &&
+        xTaskCreate(pushTask, "ota_events", 4096, NULL, 4, &s_push_task) != pdPASS) {
+        ESP_LOGE(TAG, "Failed to create push task");
+        return ESP_ERR_NO_MEM;
+    }
+
+    httpd_uri_t events_uri = {};
+    events_uri.uri = "/ota/events";
+    events_uri.method = HTTP_GET;
+    events_uri.handler = eventsHandler;
+    return httpd_register_uri_handler(server, &events_uri);
+}
+
+esp_err_t OtaEvents::eventsHandler(httpd_req_t* req) {
+    if (!AlpacaAuth::verifyRequest(req)) {
+        AlpacaAuth::addAuthHeaders(req);
+        return httpd_resp_send_err(req, HTTPD_401_UNAUTHORIZED, "Authentication required");
+    }
+
+    // Claim a slot first so a refused client never gets a stream
+    int slot = -1;
+    portENTER_CRITICAL(&s_clients_lock);
+    for (int i = 0; i < OTA_EVENTS_MAX_CLIENTS; i++) {
+        if (!s_reserved[i]) {
+            s_reserved[i] = true;
+            slot = i;
+            break;
+        }
+    }
+    portEXIT_CRITICAL(&s_clients_lock);
+
+    if (slot < 0) {
+        httpd_resp_set_status(req, "503 Service Unavailable");
+        return httpd_resp_sendstr(req, "Too many event listeners");
+    }
+
+    // Send headers and the current state right away
+    char event[OTA_PROGRESS_EVENT_SIZE];
+    ota_progress_t progress;
+    OtaUpdater::getProgress(&progress);
+    int len = OtaProgress::formatEvent(event, sizeof(event), progress);
+
+    httpd_resp_set_type(req, "text/event-stream");
+    httpd_resp_set_hdr(req, "Cache-Control", "no-cache");
+    esp_err_t err = httpd_resp_send_chunk(req, event, len);
+
+    httpd_req_t* async_req = NULL;
+    if (err == ESP_OK) {
+        err = httpd_req_async_handler_begin(req, &async_req);
+    }
+
+    portENTER_CRITICAL(&s_clients_lock);
+    s_clients[slot] = (err == ESP_OK) ? async_req : NULL;
+    s_reserved[slot] = (err == ESP_OK);
+    portEXIT_CRITICAL(&s_clients_lock);
+
+    if (err != ESP_OK) {
+        ESP_LOGW(TAG, "Failed to start event stream: %s", esp_err_to_name(err));
+        return err;
+    }
+
+    xTaskNotifyGive(s_push_task);
+    ESP_LOGI(TAG, "Event listener connected");
+    return ESP_OK;
+}
+
+void OtaEvents::pushTask(void* pvParameter) {
+    ota_progress_t last = {};
+    TickType_t last_send = 0;
+    char event[OTA_PROGRESS_EVENT_SIZE];
+
+    while (true) {
+        httpd_req_t* clients[OTA_EVENTS_MAX_CLIENTS];
+        int count = 0;
+
+        portENTER_CRITICAL(&s_clients_lock);
+        for (int i = 0; i < OTA_EVENTS_MAX_CLIENTS; i++) {
+            clients[i] = s_clients[i];
+            if (clients[i] != NULL) {
+                count++;
+            }
+        }
+        portEXIT_CRITICAL(&s_clients_lock);
+
+        if (count == 0) {
+            // Sleep until the handler brings in a listener
+            ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+            OtaUpdater::getProgress(&last);
+            last_send = xTaskGetTickCount();
+            continue;
+        }
+
+        vTaskDelay(pdMS_TO_TICKS(OTA_EVENTS_INTERVAL_MS));
+
+        ota_progress_t progress;
+        OtaUpdater::getProgress(&progress);
+        bool changed = memcmp(&progress, &last, sizeof(progress)) != 0;
+        bool keepalive = (xTaskGetTickCount() - last_send) >= pdMS_TO_TICKS(OTA_EVENTS_KEEPALIVE_MS);
+        if (!changed && !keepalive) {
+            continue;
+        }
+
+        int len;
+        if (changed) {
+            len = OtaProgress::formatEvent(event, sizeof(event), progress);
+            last = progress;
+        } else {
+            // Comment line, keeps proxies and the socket from timing out
+            len = snprintf(event, sizeof(event), ": keepalive\n\n");
+        }
+        last_send = xTaskGetTickCount();
+
+        for (int i = 0; i < OTA_EVENTS_MAX_CLIENTS; i++) {
+            if (clients[i] != NULL && httpd_resp_send_chunk(clients[i], event, len) != ESP_OK) {
+                ESP_LOGI(TAG, "Event listener disconnected");
+                close_client(i, clients[i]);
+            }
+        }
+    }
+}
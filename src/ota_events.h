@@ -0,0 +1,21 @@
+#ifndef OTA_EVENTS_H
+#define OTA_EVENTS_H
+
+#include <esp_err.h>
+#include <esp_http_server.h>
+
+// Server-Sent Events stream of OTA progress at /ota/events. Each client
+// connection is handed off as an async request, so watching an update
+// does not hold up the httpd task; a single push task sends a snapshot to
+// all clients whenever it changes, at most every OTA_EVENTS_INTERVAL_MS.
+class OtaEvents {
+public:
+    // Register the event stream endpoint with the HTTP server
+    static esp_err_t registerHandlers(httpd_handle_t server);
+
+private:
+    static esp_err_t eventsHandler(httpd_req_t* req);
+    static void pushTask(void* pvParameter);
+};
+
+#endif // OTA_EVENTS_H
@@ -0,0 +1,72 @@
+#include "ota_progress.h"
+#include <stdio.h>
+
+OtaProgress::OtaProgress()
+    : _seq(0), _phase(OTA_PHASE_IDLE), _error(ESP_OK), _bytes(0), _total(0), _download_rate(0), _flash_rate(0) {
+}
+
+void OtaProgress::publish(const ota_progress_t& progress) {
+    uint32_t seq = _seq.load(std::memory_order_relaxed);
+    _seq.store(seq + 1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+
+    _phase.store(progress.phase, std::memory_order_relaxed);
+    _error.store(progress.error, std::memory_order_relaxed);
+    _bytes.store(progress.bytes, std::memory_order_relaxed);
+    _total.store(progress.total, std::memory_order_relaxed);
+    _download_rate.store(progress.download_rate, std::memory_order_relaxed);
+    _flash_rate.store(progress.flash_rate, std::memory_order_relaxed);
+
+    _seq.store(seq + 2, std::memory_order_release);
+}
+
+void OtaProgress::read(ota_progress_t* progress) const {
+    uint32_t before;
+    uint32_t after;
+
+    do {
+        before = _seq.load(std::memory_order_acquire);
+        progress->phase = (ota_phase_t)_phase.load(std::memory_order_relaxed);
+        progress->error = _error.load(std::memory_order_relaxed);
+        progress->bytes = _bytes.load(std::memory_order_relaxed);
+        progress->total = _total.load(std::memory_order_relaxed);
+        progress->download_rate = _download_rate.load(std::memory_order_relaxed);
+        progress->flash_rate = _flash_rate.load(std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_acquire);
+        after = _seq.load(std::memory_order_relaxed);
+    } while ((before & 1) || before != after);
+}
+
+const char* OtaProgress::phaseName(ota_phase_t phase) {
+    switch (phase) {
+        case OTA_PHASE_IDLE:        return "idle";
+        case OTA_PHASE_STARTING:    return "starting";
+        case OTA_PHASE_DOWNLOADING: return "downloading";
+        case OTA_PHASE_RETRYING:    return "retrying";
+        case OTA_PHASE_VERIFYING:   return "verifying";
+        case OTA_PHASE_SUCCESS:     return "success";
+        case OTA_PHASE_FAILED:      return "failed";
+    }
+    return "unknown";
+}
+
+int OtaProgress::percent(const ota_progress_t& progress) {
+    if (progress.phase == OTA_PHASE_SUCCESS) {
+        return 100;
+    }
+    if (progress.total == 0) {
+        return 0;
+    }
+    return (int)(((uint64_t)progress.bytes * 100) / progress.total);
+}
+
+int OtaProgress::formatEvent(char* buf, size_t len, const ota_progress_t& progress) {
+    return snprintf(buf, len,
+                    "event: progress\n"
+                    "data: {\"phase\":\"%s\",\"progress\":%d,\"bytes\":%lu,\"total\":%lu,"
+                    "\"error\":\"%s\",\"download_rate\":%lu,\"flash_rate\":%lu}\n\n",
+                    phaseName(progress.phase), percent(progress),
+                    (unsigned long)progress.bytes, (unsigned long)progress.total,
+                    esp_err_to_name(progress.error),
+                    (unsigned long)progress.download_rate, (unsigned long)progress.flash_rate);
+}
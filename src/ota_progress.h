@@ -0,0 +1,72 @@
+#ifndef OTA_PROGRESS_H
+#define OTA_PROGRESS_H
+
+#include <esp_err.h>
+#include <atomic>
+#include <stddef.h>
+#include <stdint.h>
+
+// OTA progress as other tasks see it, and its Server-Sent Events form.
+// Free of FreeRTOS and allocation; tools/ota_progress_check.cpp reads it
+// from several threads on the host while one publishes.
+
+// Phase of an OTA update
+typedef enum {
+    OTA_PHASE_IDLE,             // No update attempted since boot
+    OTA_PHASE_STARTING,         // Task started, connecting
+    OTA_PHASE_DOWNLOADING,      // Streaming the image to flash
+    OTA_PHASE_RETRYING,         // Waiting to resume an interrupted download
+    OTA_PHASE_VERIFYING,        // Checking the image before switching boot partition
+    OTA_PHASE_SUCCESS,          // Image accepted, rebooting
+    OTA_PHASE_FAILED            // Update aborted, see error
+} ota_phase_t;
+
+// Consistent snapshot of OTA progress
+typedef struct {
+    ota_phase_t phase;
+    esp_err_t error;            // Reason for OTA_PHASE_FAILED, ESP_OK otherwise
+    uint32_t bytes;             // Bytes of the download stream received
+    uint32_t total;             // Size of the download stream, 0 if unknown
+    uint32_t download_rate;     // Download stage throughput (bytes/s)
+    uint32_t flash_rate;        // Flash-write stage throughput (bytes/s)
+} ota_progress_t;
+
+// Longest event formatEvent() produces, with its terminating NUL
+#define OTA_PROGRESS_EVENT_SIZE 256
+
+// Progress shared between tasks. There is one writer at a time, which
+// brackets each update with the sequence counter (odd while writing), so
+// readers take a consistent snapshot without locks or allocation.
+class OtaProgress {
+public:
+    OtaProgress();
+
+    // Publish a new snapshot; one writer at a time
+    void publish(const ota_progress_t& progress);
+
+    // Take a consistent snapshot; safe from any task
+    void read(ota_progress_t* progress) const;
+
+    // Phase as last published, without the rest of the snapshot
+    ota_phase_t phase() const { return (ota_phase_t)_phase.load(std::memory_order_relaxed); }
+
+    // Get the name of an update phase
+    static const char* phaseName(ota_phase_t phase);
+
+    // Share of the image received (0-100)
+    static int percent(const ota_progress_t& progress);
+
+    // Format a snapshot as one SSE event into buf; returns its length
+    static int formatEvent(char* buf, size_t len, const ota_progress_t& progress);
+
+private:
+    std::atomic<uint32_t> _seq;
+    std::atomic<uint32_t> _phase;
+    std::atomic<int32_t> _error;
+    std::atomic<uint32_t> _bytes;
+    std::atomic<uint32_t> _total;
+    std::atomic<uint32_t> _download_rate;
+    std::atomic<uint32_t> _flash_rate;
+};
+
+#endif // OTA_PROGRESS_H
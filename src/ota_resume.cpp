@@ -0,0 +1,38 @@
+#include "ota_resume.h"
+#include "config.h"
+#include <stdlib.h>
+#include <string.h>
+
+bool OtaResume::matches(const ota_resume_state_t* saved, const ota_resume_state_t* current,
+                        size_t partition_size) {
+    return strncmp(saved->url, current->url, sizeof(saved->url)) == 0 &&
+           saved->partition_address == current->partition_address &&
+           saved->etag[0] != '\0' && saved->offset > 0 && saved->offset <= partition_size;
+}
+
+ota_response_action_t OtaResume::classify(int status, size_t offset) {
+    if (status == 200) {
+        return offset > 0 ? OTA_RESPONSE_RESTART : OTA_RESPONSE_CONTINUE;
+    }
+    if (status == 206 && offset > 0) {
+        return OTA_RESPONSE_CONTINUE;
+    }
+    return OTA_RESPONSE_REJECT;
+}
+
+uint32_t OtaResume::rangeTotal(const char* content_range) {
+    // Format: "bytes <first>-<last>/<total>", total may be "*"
+    const char* slash = strchr(content_range, '/');
+    if (slash == NULL) {
+        return 0;
+    }
+    return strtoul(slash + 1, NULL, 10);
+}
+
+size_t OtaResume::erasedEnd(size_t offset, size_t sector_size) {
+    return (offset + sector_size - 1) & ~(sector_size - 1);
+}
+
+bool OtaResume::checkpointDue(const ota_resume_state_t* state, size_t written) {
+    return written - state->offset >= OTA_RESUME_CHECKPOINT_SIZE;
+}
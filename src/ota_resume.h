@@ -0,0 +1,55 @@
+#ifndef OTA_RESUME_H
+#define OTA_RESUME_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// The rules by which an interrupted download continues: which saved
+// progress still applies, what a response to a Range request means for
+// the bytes already on flash, and when progress is persisted. Free of
+// ESP-IDF; tools/ota_resume_check.cpp runs them on the host against a
+// server that drops connections, with reboots in between.
+
+// Progress of an interrupted download, persisted so a later attempt
+// (or a later boot) can continue with an HTTP Range request
+typedef struct {
+    char url[256];
+    char etag[64];              // ETag (or Last-Modified) identifying the image
+    uint32_t partition_address; // OTA partition the image is being written to
+    uint32_t offset;            // Bytes confirmed written to the partition
+    uint32_t total;             // Full image size, 0 if unknown
+} ota_resume_state_t;
+
+// What a response means for a download continuing at some offset
+typedef enum {
+    OTA_RESPONSE_CONTINUE,      // The rest of the image follows
+    OTA_RESPONSE_RESTART,       // The whole image follows, start over from 0
+    OTA_RESPONSE_REJECT         // Not an image, give up this attempt
+} ota_response_action_t;
+
+class OtaResume {
+public:
+    // A saved state continues the image about to be written: same URL and
+    // partition, an identity to check with If-Range, and written bytes
+    // that fit the partition
+    static bool matches(const ota_resume_state_t* saved, const ota_resume_state_t* current,
+                        size_t partition_size);
+
+    // Response status to a request for the image from offset. A server
+    // that ignores Range, or whose image no longer matches If-Range,
+    // sends 200 and the whole image.
+    static ota_response_action_t classify(int status, size_t offset);
+
+    // Image size from a Content-Range value ("bytes 100-999/1000"); 0 if
+    // the value carries none
+    static uint32_t rangeTotal(const char* content_range);
+
+    // How far the partition can be taken as erased when writing resumes
+    // at offset: the sector holding it was erased by the earlier attempt
+    static size_t erasedEnd(size_t offset, size_t sector_size);
+
+    // Enough has been written since the saved offset to persist it again
+    static bool checkpointDue(const ota_resume_state_t* state, size_t written);
+};
+
+#endif // OTA_RESUME_H
@@ -1,41 +1,281 @@
 #include "ota_updater.h"
+#include "ota_decompressor.h"
+#include "ota_delta.h"
+#include "ota_verifier.h"
+#include "wifi_manager.h"
+#include "event_journal.h"
+#include "config.h"
 #include <esp_ota_ops.h>
+#include <esp_app_format.h>
+#include <esp_partition.h>
 #include <esp_http_client.h>
 #include <esp_log.h>
+#include <esp_timer.h>
+#include <nvs.h>
+#include <string.h>
 #include <freertos/FreeRTOS.h>
 #include <freertos/task.h>
+#include <freertos/ringbuf.h>
 
 static const char* TAG = "ota_updater";
 
 std::string OtaUpdater::_firmware_url;
-bool OtaUpdater::_updateInProgress = false;
-int OtaUpdater::_updateProgress = 0;
-std::string OtaUpdater::_lastStatusMessage = "No update attempted";
+std::atomic<bool> OtaUpdater::_updateInProgress(false);
+const char* OtaUpdater::NVS_NAMESPACE = "ota_state";
 
-#define BUFFER_SIZE 1024
+// Progress shared with other tasks
+static OtaProgress s_progress;
+
+// How long a stage waits on the ring buffer before re-checking for failure
+#define OTA_STAGE_POLL_MS 100
+
+// Delay between a successful update and the reboot
+#define OTA_REBOOT_DELAY_MS 1000
+
+// Largest detached signature or manifest accepted
+#define OTA_DETACHED_MAX_SIZE 256
+
+// Encoding of the downloaded stream, detected from its first byte
+typedef enum {
+    OTA_FORMAT_UNKNOWN,
+    OTA_FORMAT_RAW,                 // Plain application image
+    OTA_FORMAT_GZIP                 // gzip-compressed application image
+} ota_format_t;
+
+// Content of the (decompressed) stream, detected from its first byte
+typedef enum {
+    OTA_PAYLOAD_UNKNOWN,
+    OTA_PAYLOAD_IMAGE,              // Complete application image
+    OTA_PAYLOAD_DELTA               // Patch against the running image
+} ota_payload_t;
+
+// State shared between the download stage and the flash-write stage.
+// The download stage (updateTask) fills the ring buffer from the network,
+// the flash stage (flashTask) drains it into the OTA partition, so network
+// reads and flash erase/write cycles overlap.
+struct ota_pipeline_t {
+    RingbufHandle_t ring;
+    const esp_partition_t* partition;
+    TaskHandle_t download_task;
+    volatile bool download_done;    // Set by download stage after its last send
+    volatile bool failed;           // Set by either stage to abort the other
+    esp_err_t flash_error;          // Why the flash stage set failed
+    ota_progress_t progress;        // Working copy, published by the download stage
+    ota_resume_state_t resume;      // Identity of the image and persisted offset
+    ota_format_t format;
+    ota_payload_t payload;
+    OtaDecompressor decompressor;   // Inflates gzip streams in the flash stage
+    OtaDeltaPatcher patcher;        // Applies delta patches in the flash stage
+    OtaVerifier verifier;           // Hashes the image as it is written
+    size_t write_offset;            // Next partition offset the flash stage writes
+    size_t erased_end;              // Partition offset up to which sectors are erased
+    size_t download_offset;         // Stream offset the download stage has reached
+    size_t bytes_downloaded;        // Totals across all attempts, for throughput
+    size_t bytes_flashed;
+    int64_t download_busy_us;       // Time spent inside esp_http_client_read
+    int64_t flash_busy_us;          // Time spent decoding, erasing and writing flash
+};
+
+// Response headers captured while opening a download request
+typedef struct {
+    char etag[64];
+    uint32_t range_total;           // Total size from Content-Range, 0 if absent
+} ota_response_t;
 
 // Task handle for the update process
 static TaskHandle_t update_task_handle = NULL;
 
+// Bytes per second for a byte count moved in the given time
+static uint32_t stage_rate(size_t bytes, int64_t busy_us) {
+    if (busy_us <= 0) {
+        return 0;
+    }
+    return (uint32_t)(((uint64_t)bytes * 1000000ULL) / (uint64_t)busy_us);
+}
+
+// Capture the headers needed to identify the image and validate a resume
+static esp_err_t http_event_handler(esp_http_client_event_t* evt) {
+    if (evt->event_id != HTTP_EVENT_ON_HEADER || evt->user_data == NULL) {
+        return ESP_OK;
+    }
+
+    ota_response_t* response = static_cast<ota_response_t*>(evt->user_data);
+    if (strcasecmp(evt->header_key, "ETag") == 0) {
+        strlcpy(response->etag, evt->header_value, sizeof(response->etag));
+    } else if (strcasecmp(evt->header_key, "Last-Modified") == 0 && response->etag[0] == '\0') {
+        // Weaker identity, only used when the server sends no ETag
+        strlcpy(response->etag, evt->header_value, sizeof(response->etag));
+    } else if (strcasecmp(evt->header_key, "Content-Range") == 0) {
+        response->range_total = OtaResume::rangeTotal(evt->header_value);
+    }
+    return ESP_OK;
+}
+
+// Erase sectors ahead of the write position as needed and write one chunk.
+// Sectors are erased lazily, so a resumed update never erases data that an
+// earlier attempt already wrote.
+static esp_err_t write_image(ota_pipeline_t* pipeline, const uint8_t* data, size_t len) {
+    const esp_partition_t* partition = pipeline->partition;
+    size_t end = pipeline->write_offset + len;
+    esp_err_t err;
+
+    if (end > partition->size) {
+        ESP_LOGE(TAG, "Image does not fit in partition (%u bytes)", (unsigned int)partition->size);
+        return ESP_ERR_INVALID_SIZE;
+    }
+
+    if (pipeline->write_offset == 0 && len > 0 && data[0] != ESP_IMAGE_HEADER_MAGIC) {
+        ESP_LOGE(TAG, "Invalid image magic byte 0x%02x", data[0]);
+        return ESP_ERR_OTA_VALIDATE_FAILED;
+    }
+
+    if (end > pipeline->erased_end) {
+        size_t erase_end = (end + SPI_FLASH_SEC_SIZE - 1) & ~(size_t)(SPI_FLASH_SEC_SIZE - 1);
+        err = esp_partition_erase_range(partition, pipeline->erased_end,
+                                        erase_end - pipeline->erased_end);
+        if (err != ESP_OK) {
+            return err;
+        }
+        pipeline->erased_end = erase_end;
+    }
+
+    err = esp_partition_write(partition, pipeline->write_offset, data, len);
+    if (err != ESP_OK) {
+        return err;
+    }
+
+    // Every image byte passes through here exactly once, in order
+    pipeline->verifier.update(data, len);
+
+    pipeline->write_offset = end;
+    pipeline->bytes_flashed += len;
+    return ESP_OK;
+}
+
+// Hash the part of the image an earlier boot already wrote. Only needed
+// when resuming after a reboot; the hash state of an in-task retry lives on.
+static esp_err_t hash_written_image(ota_pipeline_t* pipeline) {
+    uint8_t* buffer = (uint8_t*)malloc(OTA_CHUNK_SIZE);
+    if (buffer == NULL) {
+        return ESP_ERR_NO_MEM;
+    }
+
+    esp_err_t err = ESP_OK;
+    for (size_t offset = 0; offset < pipeline->write_offset; offset += OTA_CHUNK_SIZE) {
+        size_t len = pipeline->write_offset - offset;
+        if (len > OTA_CHUNK_SIZE) {
+            len = OTA_CHUNK_SIZE;
+        }
+        err = esp_partition_read(pipeline->partition, offset, buffer, len);
+        if (err != ESP_OK) {
+            break;
+        }
+        pipeline->verifier.update(buffer, len);
+    }
+
+    free(buffer);
+    return err;
+}
+
+static esp_err_t write_image_sink(void* ctx, const uint8_t* data, size_t len) {
+    return write_image(static_cast<ota_pipeline_t*>(ctx), data, len);
+}
+
+// Source reads for delta patches come from the running firmware
+static esp_err_t read_running_image(void* ctx, size_t offset, void* buf, size_t len) {
+    return esp_partition_read(static_cast<const esp_partition_t*>(ctx), offset, buf, len);
+}
+
+// Write decompressed stream data: either image bytes as-is, or a patch
+// that rebuilds the image from the running partition
+static esp_err_t process_payload(ota_pipeline_t* pipeline, const uint8_t* data, size_t len) {
+    if (pipeline->payload == OTA_PAYLOAD_UNKNOWN && len > 0) {
+        if (OtaDeltaPatcher::isPatch(data, len)) {
+            const esp_partition_t* running = esp_ota_get_running_partition();
+            uint8_t running_sha[32];
+            esp_err_t err = esp_partition_get_sha256(running, running_sha);
+            if (err != ESP_OK) {
+                ESP_LOGE(TAG, "Failed to hash running image (%s)", esp_err_to_name(err));
+                return err;
+            }
+            err = pipeline->patcher.begin(running_sha, running->size,
+                                          read_running_image, (void*)running);
+            if (err != ESP_OK) {
+                return err;
+            }
+            pipeline->payload = OTA_PAYLOAD_DELTA;
+            ESP_LOGI(TAG, "Update is a delta patch against the running image");
+        } else {
+            pipeline->payload = OTA_PAYLOAD_IMAGE;
+        }
+    }
+
+    if (pipeline->payload == OTA_PAYLOAD_DELTA) {
+        return pipeline->patcher.feed(data, len, write_image_sink, pipeline);
+    }
+    return write_image(pipeline, data, len);
+}
+
+static esp_err_t payload_sink(void* ctx, const uint8_t* data, size_t len) {
+    return process_payload(static_cast<ota_pipeline_t*>(ctx), data, len);
+}
+
+// Only a plain image can resume after a reboot: the inflater and patch
+// applier keep state in RAM, so those streams resume only in the same task
+static bool can_checkpoint(const ota_pipeline_t* pipeline) {
+    return pipeline->format == OTA_FORMAT_RAW && pipeline->payload == OTA_PAYLOAD_IMAGE &&
+           pipeline->resume.etag[0] != '\0';
+}
+
+// Pass one chunk of the download stream to flash, inflating it first if
+// the stream turned out to be compressed
+static esp_err_t process_chunk(ota_pipeline_t* pipeline, const uint8_t* data, size_t len) {
+    if (pipeline->format == OTA_FORMAT_UNKNOWN) {
+        if (OtaDecompressor::isGzip(data, len)) {
+            esp_err_t err = pipeline->decompressor.begin();
+            if (err != ESP_OK) {
+                return err;
+            }
+            pipeline->format = OTA_FORMAT_GZIP;
+            ESP_LOGI(TAG, "Image is gzip-compressed");
+        } else {
+            pipeline->format = OTA_FORMAT_RAW;
+        }
+    }
+
+    if (pipeline->format == OTA_FORMAT_GZIP) {
+        return pipeline->decompressor.feed(data, len, payload_sink, pipeline);
+    }
+    return process_payload(pipeline, data, len);
+}
+
 esp_err_t OtaUpdater::startUpdate(const std::string& url) {
-    if (_updateInProgress) {
-        _lastStatusMessage = "Update already in progress";
+    if (url.size() >= sizeof(((ota_resume_state_t*)0)->url)) {
+        ESP_LOGW(TAG, "Firmware URL too long");
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    bool expected = false;
+    if (!_updateInProgress.compare_exchange_strong(expected, true)) {
         ESP_LOGW(TAG, "Update already in progress");
         return ESP_ERR_INVALID_STATE;
     }
     
     // Reset progress and status
-    _updateProgress = 0;
-    _updateInProgress = true;
-    _lastStatusMessage = "Update started";
-    
+    ota_progress_t progress = {};
+    progress.phase = OTA_PHASE_STARTING;
+    setProgress(progress);
+
     // Store the URL for the update task
     _firmware_url = url;
-    
-    // Start update task
-    if (xTaskCreate(updateTask, "ota_update", 8192, NULL, 5, &update_task_handle) != pdPASS) {
+
+    // Start update task (download stage); it spawns the flash-write stage
+    if (xTaskCreatePinnedToCore(updateTask, "ota_update", 8192, NULL, OTA_DOWNLOAD_TASK_PRIORITY,
+                                &update_task_handle, OTA_DOWNLOAD_TASK_CORE) != pdPASS) {
+        progress.phase = OTA_PHASE_FAILED;
+        progress.error = ESP_ERR_NO_MEM;
+        setProgress(progress);
         _updateInProgress = false;
-        _lastStatusMessage = "Failed to start update task";
         ESP_LOGE(TAG, "Failed to create update task");
         return ESP_ERR_NO_MEM;
     }
@@ -48,40 +288,264 @@ bool OtaUpdater::isUpdateInProgress() {
 }
 
 int OtaUpdater::getUpdateProgress() {
-    return _updateProgress;
+    ota_progress_t progress;
+    getProgress(&progress);
+    return OtaProgress::percent(progress);
 }
 
-std::string OtaUpdater::getLastStatusMessage() {
-    return _lastStatusMessage;
+void OtaUpdater::setProgress(const ota_progress_t& progress) {
+    if (progress.phase != s_progress.phase()) {
+        EventJournal::record(JOURNAL_OTA, (uint16_t)progress.phase,
+                             progress.phase == OTA_PHASE_FAILED ? (uint32_t)progress.error : progress.bytes);
+    }
+    s_progress.publish(progress);
 }
 
-std::string OtaUpdater::getFirmwareVersion() {
-    esp_app_desc_t app_desc;
-    esp_ota_get_partition_description(esp_ota_get_running_partition(), &app_desc);
-    return std::string(app_desc.version);
+void OtaUpdater::getProgress(ota_progress_t* progress) {
+    s_progress.read(progress);
 }
 
-void OtaUpdater::updateTask(void* pvParameter) {
+const char* OtaUpdater::getPhaseName(ota_phase_t phase) {
+    return OtaProgress::phaseName(phase);
+}
+
+const char* OtaUpdater::getFirmwareVersion() {
+    // The running image's description is mapped from flash
+    return esp_app_get_description()->version;
+}
+
+esp_err_t OtaUpdater::loadResumeState(ota_resume_state_t* state) {
+    nvs_handle_t handle;
+    esp_err_t err;
+
+    err = nvs_open(NVS_NAMESPACE, NVS_READONLY, &handle);
+    if (err != ESP_OK) {
+        return err;
+    }
+
+    size_t required_size = sizeof(ota_resume_state_t);
+    err = nvs_get_blob(handle, "resume", state, &required_size);
+    if (err == ESP_OK && required_size != sizeof(ota_resume_state_t)) {
+        err = ESP_ERR_INVALID_SIZE;
+    }
+
+    nvs_close(handle);
+    return err;
+}
+
+esp_err_t OtaUpdater::saveResumeState(const ota_resume_state_t* state) {
+    nvs_handle_t handle;
+    esp_err_t err;
+
+    err = nvs_open(NVS_NAMESPACE, NVS_READWRITE, &handle);
+    if (err != ESP_OK) {
+        ESP_LOGE(TAG, "Failed to open NVS handle: %s", esp_err_to_name(err));
+        return err;
+    }
+
+    err = nvs_set_blob(handle, "resume", state, sizeof(ota_resume_state_t));
+    if (err == ESP_OK) {
+        err = nvs_commit(handle);
+    }
+    if (err != ESP_OK) {
+        ESP_LOGE(TAG, "Failed to save resume state: %s", esp_err_to_name(err));
+    }
+
+    nvs_close(handle);
+    return err;
+}
+
+esp_err_t OtaUpdater::clearResumeState() {
+    nvs_handle_t handle;
+    esp_err_t err;
+
+    err = nvs_open(NVS_NAMESPACE, NVS_READWRITE, &handle);
+    if (err != ESP_OK) {
+        return err;
+    }
+
+    err = nvs_erase_key(handle, "resume");
+    if (err == ESP_OK) {
+        err = nvs_commit(handle);
+    } else if (err == ESP_ERR_NVS_NOT_FOUND) {
+        err = ESP_OK;
+    }
+
+    nvs_close(handle);
+    return err;
+}
+
+void OtaUpdater::flashTask(void* pvParameter) {
+    ota_pipeline_t* pipeline = static_cast<ota_pipeline_t*>(pvParameter);
+
+    while (!pipeline->failed) {
+        // Sample the done flag before receiving: if the download stage had
+        // already finished, an empty receive means the buffer is drained.
+        bool done = pipeline->download_done;
+
+        size_t item_size = 0;
+        void* item = xRingbufferReceiveUpTo(pipeline->ring, &item_size,
+                                            pdMS_TO_TICKS(OTA_STAGE_POLL_MS), OTA_CHUNK_SIZE);
+        if (item == NULL) {
+            if (done) {
+                break;
+            }
+            continue;
+        }
+
+        int64_t start = esp_timer_get_time();
+        esp_err_t err = process_chunk(pipeline, static_cast<const uint8_t*>(item), item_size);
+        pipeline->flash_busy_us += esp_timer_get_time() - start;
+        vRingbufferReturnItem(pipeline->ring, item);
+
+        if (err != ESP_OK) {
+            ESP_LOGE(TAG, "Flash write failed (%s)", esp_err_to_name(err));
+            pipeline->flash_error = err;
+            pipeline->failed = true;
+            break;
+        }
+
+        ESP_LOGD(TAG, "Written image length %u", (unsigned int)pipeline->write_offset);
+
+        // Periodically persist how far the image is safely on flash
+        if (can_checkpoint(pipeline) && OtaResume::checkpointDue(&pipeline->resume, pipeline->write_offset)) {
+            pipeline->resume.offset = pipeline->write_offset;
+            saveResumeState(&pipeline->resume);
+        }
+    }
+
+    xTaskNotifyGive(pipeline->download_task);
+    vTaskDelete(NULL);
+}
+
+esp_err_t OtaUpdater::fetchDetached(const char* suffix, uint8_t* buf, size_t size, size_t* len) {
+    esp_err_t err;
+    esp_http_client_config_t config = {};
+    std::string url = _firmware_url + suffix;
+    int64_t content_length;
+    int status;
+    int bytes_read;
+
+    *len = 0;
+    config.url = url.c_str();
+    config.timeout_ms = 5000;
+    config.skip_cert_common_name_check = true;
+
+    esp_http_client_handle_t client = esp_http_client_init(&config);
+    if (client == NULL) {
+        return ESP_FAIL;
+    }
+
+    err = esp_http_client_open(client, 0);
+    if (err != ESP_OK) {
+        goto cleanup;
+    }
+
+    content_length = esp_http_client_fetch_headers(client);
+    status = esp_http_client_get_status_code(client);
+    if (status == 404) {
+        err = ESP_ERR_NOT_FOUND;
+        goto cleanup;
+    }
+    if (status != 200 || content_length < 0) {
+        ESP_LOGE(TAG, "Unexpected HTTP status %d for %s", status, url.c_str());
+        err = ESP_ERR_INVALID_RESPONSE;
+        goto cleanup;
+    }
+    if (content_length > (int64_t)size) {
+        ESP_LOGE(TAG, "%s is too large (%lld bytes)", url.c_str(), content_length);
+        err = ESP_ERR_INVALID_SIZE;
+        goto cleanup;
+    }
+
+    bytes_read = esp_http_client_read_response(client, (char*)buf, size);
+    if (bytes_read < 0) {
+        err = ESP_FAIL;
+        goto cleanup;
+    }
+    *len = bytes_read;
+
+cleanup:
+    esp_http_client_cleanup(client);
+    return err;
+}
+
+esp_err_t OtaUpdater::verifyImage(ota_pipeline_t* pipeline) {
+    uint8_t detached[OTA_DETACHED_MAX_SIZE];
+    size_t len = 0;
+    esp_err_t err;
+
+    pipeline->verifier.finish();
+    if (pipeline->verifier.getSize() != pipeline->write_offset) {
+        ESP_LOGE(TAG, "Hashed %u bytes but wrote %u", (unsigned int)pipeline->verifier.getSize(),
+                 (unsigned int)pipeline->write_offset);
+        return ESP_ERR_INVALID_STATE;
+    }
+
+    // With a signing key configured, only signed images are accepted
+    if (OTA_SIGNING_PUBLIC_KEY[0] != '\0') {
+        err = fetchDetached(OTA_SIGNATURE_SUFFIX, detached, sizeof(detached), &len);
+        if (err != ESP_OK) {
+            ESP_LOGE(TAG, "Failed to fetch image signature (%s)", esp_err_to_name(err));
+            return err == ESP_ERR_NOT_FOUND ? ESP_ERR_INVALID_CRC : err;
+        }
+        err = pipeline->verifier.verifySignature(OTA_SIGNING_PUBLIC_KEY, detached, len);
+        if (err == ESP_OK) {
+            ESP_LOGI(TAG, "Image signature verified");
+        }
+        return err;
+    }
+
+    // Otherwise check a published manifest hash if there is one
+    err = fetchDetached(OTA_MANIFEST_SUFFIX, detached, sizeof(detached), &len);
+    if (err == ESP_ERR_NOT_FOUND) {
+        ESP_LOGW(TAG, "No manifest published, relying on the image checksum only");
+        return ESP_OK;
+    }
+    if (err != ESP_OK) {
+        ESP_LOGE(TAG, "Failed to fetch image manifest (%s)", esp_err_to_name(err));
+        return err;
+    }
+    err = pipeline->verifier.verifyManifest((const char*)detached, len);
+    if (err == ESP_OK) {
+        ESP_LOGI(TAG, "Image SHA-256 matches manifest");
+    }
+    return err;
+}
+
+esp_err_t OtaUpdater::downloadImage(ota_pipeline_t* pipeline) {
     esp_err_t err;
     esp_http_client_config_t config = {};
     esp_http_client_handle_t client = NULL;
-    esp_ota_handle_t update_handle = 0;
-    const esp_partition_t *update_partition = NULL;
-    int content_length = 0;
-    int binary_file_length = 0;
+    ota_response_t response = {};
+    bool flash_task_running = false;
+    int64_t content_length = 0;
+    ota_response_action_t action;
+    int status = 0;
     int bytes_read = 0;
+    char range[32];
     char *buffer = NULL;
 
     config.url = _firmware_url.c_str();
     config.timeout_ms = 5000;
     config.skip_cert_common_name_check = true;
-
-    ESP_LOGI(TAG, "Starting OTA update from: %s", config.url);
+    config.buffer_size = OTA_CHUNK_SIZE;
+    config.event_handler = http_event_handler;
+    config.user_data = &response;
 
     client = esp_http_client_init(&config);
     if (client == NULL) {
         ESP_LOGE(TAG, "Failed to initialize HTTP client");
-        goto cleanup;
+        return ESP_FAIL;
+    }
+
+    // Ask only for the missing tail; If-Range makes the server send the
+    // whole image instead if it no longer matches what we started with
+    if (pipeline->download_offset > 0) {
+        snprintf(range, sizeof(range), "bytes=%u-", (unsigned int)pipeline->download_offset);
+        esp_http_client_set_header(client, "Range", range);
+        esp_http_client_set_header(client, "If-Range", pipeline->resume.etag);
+        ESP_LOGI(TAG, "Resuming download at offset %u", (unsigned int)pipeline->download_offset);
     }
 
     err = esp_http_client_open(client, 0);
@@ -93,80 +557,282 @@ void OtaUpdater::updateTask(void* pvParameter) {
     content_length = esp_http_client_fetch_headers(client);
     if (content_length < 0) {
         ESP_LOGE(TAG, "Failed to get content length");
+        err = ESP_FAIL;
         goto cleanup;
     }
 
-    update_partition = esp_ota_get_next_update_partition(NULL);
-    if (update_partition == NULL) {
-        ESP_LOGE(TAG, "Failed to get update partition");
+    status = esp_http_client_get_status_code(client);
+    action = OtaResume::classify(status, pipeline->download_offset);
+    if (action == OTA_RESPONSE_REJECT) {
+        ESP_LOGE(TAG, "Unexpected HTTP status %d", status);
+        err = ESP_ERR_INVALID_RESPONSE;
         goto cleanup;
     }
+    if (action == OTA_RESPONSE_RESTART) {
+        // Range ignored or image changed on the server: start over
+        ESP_LOGW(TAG, "Server sent the full image, restarting from offset 0");
+        pipeline->download_offset = 0;
+        pipeline->write_offset = 0;
+        pipeline->erased_end = 0;
+        pipeline->format = OTA_FORMAT_UNKNOWN;
+        pipeline->payload = OTA_PAYLOAD_UNKNOWN;
+        pipeline->verifier.begin();
+    }
+    if (pipeline->download_offset == 0) {
+        pipeline->resume.total = (uint32_t)content_length;
+    } else if (response.range_total > 0) {
+        pipeline->resume.total = response.range_total;
+    }
 
-    ESP_LOGI(TAG, "Writing to partition subtype %d at offset 0x%x",
-             update_partition->subtype, (unsigned int)update_partition->address);
-
-    err = esp_ota_begin(update_partition, OTA_WITH_SEQUENTIAL_WRITES, &update_handle);
-    if (err != ESP_OK) {
-        ESP_LOGE(TAG, "esp_ota_begin failed (%s)", esp_err_to_name(err));
-        goto cleanup;
+    // A fresh download adopts the identity the server reports; without one
+    // the image cannot be safely resumed, so nothing is persisted
+    if (pipeline->download_offset == 0) {
+        strlcpy(pipeline->resume.etag, response.etag, sizeof(pipeline->resume.etag));
+        pipeline->resume.offset = 0;
+        if (pipeline->resume.etag[0] != '\0') {
+            saveResumeState(&pipeline->resume);
+        } else {
+            clearResumeState();
+        }
     }
 
-    buffer = (char *)malloc(BUFFER_SIZE);
+    buffer = (char *)malloc(OTA_CHUNK_SIZE);
     if (!buffer) {
         ESP_LOGE(TAG, "Failed to allocate buffer");
+        err = ESP_ERR_NO_MEM;
+        goto cleanup;
+    }
+
+    pipeline->download_done = false;
+    if (xTaskCreatePinnedToCore(flashTask, "ota_flash", 4096, pipeline, OTA_FLASH_TASK_PRIORITY,
+                                NULL, OTA_FLASH_TASK_CORE) != pdPASS) {
+        ESP_LOGE(TAG, "Failed to create flash-write task");
+        err = ESP_ERR_NO_MEM;
         goto cleanup;
     }
+    flash_task_running = true;
 
-    while (1) {
-        bytes_read = esp_http_client_read(client, buffer, BUFFER_SIZE);
+    while (!pipeline->failed) {
+        int64_t start = esp_timer_get_time();
+        bytes_read = esp_http_client_read(client, buffer, OTA_CHUNK_SIZE);
+        pipeline->download_busy_us += esp_timer_get_time() - start;
         if (bytes_read < 0) {
             ESP_LOGE(TAG, "Failed to read data");
-            goto cleanup;
+            err = ESP_FAIL;
+            break;
         }
         else if (bytes_read == 0) {
+            if (!esp_http_client_is_complete_data_received(client)) {
+                ESP_LOGE(TAG, "Connection closed before end of image");
+                err = ESP_FAIL;
+            }
             break;
         }
 
-        err = esp_ota_write(update_handle, buffer, bytes_read);
+        // Hand the chunk to the flash stage; blocks only while the ring is full
+        while (xRingbufferSend(pipeline->ring, buffer, bytes_read,
+                               pdMS_TO_TICKS(OTA_STAGE_POLL_MS)) != pdTRUE) {
+            if (pipeline->failed) {
+                break;
+            }
+        }
+
+        pipeline->download_offset += bytes_read;
+        pipeline->bytes_downloaded += bytes_read;
+
+        // Publish progress; fixed-size and allocation-free on every chunk
+        pipeline->progress.phase = OTA_PHASE_DOWNLOADING;
+        pipeline->progress.bytes = pipeline->download_offset;
+        pipeline->progress.total = pipeline->resume.total;
+        pipeline->progress.download_rate = stage_rate(pipeline->bytes_downloaded, pipeline->download_busy_us);
+        pipeline->progress.flash_rate = stage_rate(pipeline->bytes_flashed, pipeline->flash_busy_us);
+        setProgress(pipeline->progress);
+    }
+
+cleanup:
+    if (flash_task_running) {
+        // Let the flash stage drain the ring buffer and wait for it to exit
+        pipeline->download_done = true;
+        ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+    }
+    if (pipeline->failed) {
+        err = pipeline->flash_error;
+    }
+    if (buffer) {
+        free(buffer);
+    }
+    esp_http_client_cleanup(client);
+    return err;
+}
+
+void OtaUpdater::updateTask(void* pvParameter) {
+    // The pipeline lives in runUpdate(), so the inflate window and patch
+    // buffer are freed by its destructors before the task deletes itself
+    runUpdate();
+    _updateInProgress = false;
+    vTaskDelete(NULL);
+}
+
+esp_err_t OtaUpdater::runUpdate() {
+    esp_err_t err = ESP_FAIL;
+    ota_pipeline_t pipeline = {};
+    ota_resume_state_t saved = {};
+    uint32_t retry_delay_ms = OTA_RETRY_BASE_DELAY_MS;
+    int64_t started_us = esp_timer_get_time();
+
+    ESP_LOGI(TAG, "Starting OTA update from: %s", _firmware_url.c_str());
+
+    pipeline.partition = esp_ota_get_next_update_partition(NULL);
+    if (pipeline.partition == NULL) {
+        ESP_LOGE(TAG, "Failed to get update partition");
+        err = ESP_ERR_NOT_FOUND;
+        goto cleanup;
+    }
+
+    ESP_LOGI(TAG, "Writing to partition subtype %d at offset 0x%x",
+             pipeline.partition->subtype, (unsigned int)pipeline.partition->address);
+
+    strlcpy(pipeline.resume.url, _firmware_url.c_str(), sizeof(pipeline.resume.url));
+    pipeline.resume.partition_address = pipeline.partition->address;
+
+    // Continue an earlier interrupted download of the same image into the
+    // same partition; the If-Range check catches a changed image
+    if (loadResumeState(&saved) == ESP_OK &&
+        OtaResume::matches(&saved, &pipeline.resume, pipeline.partition->size)) {
+        pipeline.resume = saved;
+        pipeline.download_offset = saved.offset;
+        pipeline.write_offset = saved.offset;
+        pipeline.erased_end = OtaResume::erasedEnd(saved.offset, SPI_FLASH_SEC_SIZE);
+
+        // Only plain images are checkpointed; the first resumed bytes are
+        // from the middle of the image, too late to detect the format
+        pipeline.format = OTA_FORMAT_RAW;
+        pipeline.payload = OTA_PAYLOAD_IMAGE;
+        ESP_LOGI(TAG, "Found interrupted update, %u bytes already written", (unsigned int)saved.offset);
+    }
+
+    pipeline.verifier.begin();
+    if (pipeline.write_offset > 0) {
+        err = hash_written_image(&pipeline);
         if (err != ESP_OK) {
-            goto cleanup;
+            // Start over rather than trust a prefix that cannot be hashed
+            ESP_LOGW(TAG, "Failed to read back written image (%s), restarting", esp_err_to_name(err));
+            pipeline.verifier.begin();
+            pipeline.download_offset = 0;
+            pipeline.write_offset = 0;
+            pipeline.erased_end = 0;
+            pipeline.format = OTA_FORMAT_UNKNOWN;
+            pipeline.payload = OTA_PAYLOAD_UNKNOWN;
         }
+    }
+
+    pipeline.ring = xRingbufferCreate(OTA_RING_BUFFER_SIZE, RINGBUF_TYPE_BYTEBUF);
+    if (pipeline.ring == NULL) {
+        ESP_LOGE(TAG, "Failed to allocate ring buffer");
+        err = ESP_ERR_NO_MEM;
+        goto cleanup;
+    }
+    pipeline.download_task = xTaskGetCurrentTaskHandle();
+
+    for (int attempt = 0; attempt <= OTA_MAX_RETRIES; attempt++) {
+        if (attempt > 0) {
+            pipeline.progress.phase = OTA_PHASE_RETRYING;
+            pipeline.progress.error = err;
+            setProgress(pipeline.progress);
+            ESP_LOGW(TAG, "Retrying download in %lu ms (%d/%d)",
+                     (unsigned long)retry_delay_ms, attempt, OTA_MAX_RETRIES);
+            vTaskDelay(pdMS_TO_TICKS(retry_delay_ms));
+
+            // No point retrying before the station has an address again
+            xEventGroupWaitBits(WiFiManager::getInstance().getEventGroup(), WIFI_CONNECTED_BIT,
+                                pdFALSE, pdTRUE, pdMS_TO_TICKS(OTA_RETRY_MAX_DELAY_MS));
+
+            retry_delay_ms *= 2;
+            if (retry_delay_ms > OTA_RETRY_MAX_DELAY_MS) {
+                retry_delay_ms = OTA_RETRY_MAX_DELAY_MS;
+            }
+        }
+
+        err = downloadImage(&pipeline);
+        if (err == ESP_OK || pipeline.failed) {
+            // Done, or the flash stage failed and retrying will not help
+            break;
+        }
+    }
+
+    if (err != ESP_OK) {
+        goto cleanup;
+    }
 
-        binary_file_length += bytes_read;
-        
-        // Update progress (0-100%)
-        if (content_length > 0) {
-            _updateProgress = (binary_file_length * 100) / content_length;
-            _lastStatusMessage = "Downloading firmware: " + std::to_string(_updateProgress) + "%";
+    if (pipeline.format == OTA_FORMAT_GZIP) {
+        if (!pipeline.decompressor.isFinished() || pipeline.decompressor.getOutputSize() == 0) {
+            ESP_LOGE(TAG, "Compressed image ended before the gzip trailer");
+            err = ESP_ERR_INVALID_SIZE;
+            goto cleanup;
         }
-        
-        ESP_LOGD(TAG, "Written image length %d", binary_file_length);
+        ESP_LOGI(TAG, "Decompressed %u bytes to %u bytes (%u%% of image size transferred)",
+                 (unsigned int)pipeline.decompressor.getInputSize(),
+                 (unsigned int)pipeline.decompressor.getOutputSize(),
+                 (unsigned int)((uint64_t)pipeline.decompressor.getInputSize() * 100 /
+                                pipeline.decompressor.getOutputSize()));
+    }
+
+    // The patch applier has checked the rebuilt image's SHA-256 at END
+    if (pipeline.payload == OTA_PAYLOAD_DELTA && !pipeline.patcher.isFinished()) {
+        ESP_LOGE(TAG, "Delta patch ended before it was complete");
+        err = ESP_ERR_INVALID_SIZE;
+        goto cleanup;
     }
 
-    if (esp_ota_end(update_handle) != ESP_OK) {
-        ESP_LOGE(TAG, "esp_ota_end failed!");
+    pipeline.progress.phase = OTA_PHASE_VERIFYING;
+    pipeline.progress.error = ESP_OK;
+    pipeline.progress.download_rate = stage_rate(pipeline.bytes_downloaded, pipeline.download_busy_us);
+    pipeline.progress.flash_rate = stage_rate(pipeline.bytes_flashed, pipeline.flash_busy_us);
+    setProgress(pipeline.progress);
+    ESP_LOGI(TAG, "Image of %u bytes in %lld ms (download %lu B/s, flash %lu B/s)",
+             (unsigned int)pipeline.write_offset, (esp_timer_get_time() - started_us) / 1000,
+             (unsigned long)pipeline.progress.download_rate, (unsigned long)pipeline.progress.flash_rate);
+
+    err = verifyImage(&pipeline);
+    if (err != ESP_OK) {
+        // The image on flash is complete but not trusted, never resume it
+        pipeline.failed = true;
         goto cleanup;
     }
 
-    if (esp_ota_set_boot_partition(update_partition) != ESP_OK) {
+    // The image is complete either way, a later attempt must start fresh
+    clearResumeState();
+    pipeline.resume.etag[0] = '\0';
+
+    // Validates the image header, segments and checksum before switching
+    err = esp_ota_set_boot_partition(pipeline.partition);
+    if (err != ESP_OK) {
         ESP_LOGE(TAG, "esp_ota_set_boot_partition failed!");
         goto cleanup;
     }
 
-    _lastStatusMessage = "Update successful! Rebooting...";
+    pipeline.progress.phase = OTA_PHASE_SUCCESS;
+    setProgress(pipeline.progress);
     ESP_LOGI(TAG, "Update successful! Rebooting...");
+
+    // Give status listeners a chance to see the result before the reboot
+    vTaskDelay(pdMS_TO_TICKS(OTA_REBOOT_DELAY_MS));
     esp_restart();
 
 cleanup:
-    if (update_handle) {
-        esp_ota_end(update_handle);
+    if (pipeline.failed) {
+        // Flash stage rejected the image, resuming it would fail again
+        clearResumeState();
+    } else if (can_checkpoint(&pipeline) && pipeline.write_offset > pipeline.resume.offset) {
+        // Keep everything that reached flash for the next attempt
+        pipeline.resume.offset = pipeline.write_offset;
+        saveResumeState(&pipeline.resume);
     }
-    if (buffer) {
-        free(buffer);
+    if (pipeline.ring) {
+        vRingbufferDelete(pipeline.ring);
     }
-    if (client) {
-        esp_http_client_cleanup(client);
-    }
-    _updateInProgress = false;
-    vTaskDelete(NULL);
+    pipeline.progress.phase = OTA_PHASE_FAILED;
+    pipeline.progress.error = err;
+    setProgress(pipeline.progress);
+    return err;
 }
\ No newline at end of file
@@ -2,17 +2,41 @@
 #define OTA_UPDATER_H
 
 #include <esp_err.h>
+#include "ota_progress.h"
+#include "ota_resume.h"
+#include <atomic>
 #include <string>
 
+struct ota_pipeline_t;
+
 class OtaUpdater {
 private:
-    static const size_t BUFFER_SIZE = 1024;
     static std::string _firmware_url;
-    static bool _updateInProgress;
-    static int _updateProgress;
-    static std::string _lastStatusMessage;
+    static std::atomic<bool> _updateInProgress;
+    static const char* NVS_NAMESPACE;
     static void updateTask(void* pvParameter);
 
+    // Download, check and activate an image; returns only if the update failed
+    static esp_err_t runUpdate();
+    static void flashTask(void* pvParameter);
+
+    // Run one HTTP request and stream its body into the flash stage
+    static esp_err_t downloadImage(ota_pipeline_t* pipeline);
+
+    // Fetch a small file published next to the image (URL + suffix)
+    static esp_err_t fetchDetached(const char* suffix, uint8_t* buf, size_t size, size_t* len);
+
+    // Check the streamed image hash against its signature or manifest
+    static esp_err_t verifyImage(ota_pipeline_t* pipeline);
+
+    // Load/save/clear the resume state in NVS
+    static esp_err_t loadResumeState(ota_resume_state_t* state);
+    static esp_err_t saveResumeState(const ota_resume_state_t* state);
+    static esp_err_t clearResumeState();
+
+    // Publish progress; only the update task writes it once started
+    static void setProgress(const ota_progress_t& progress);
+
 public:
     // Start OTA update from a URL
     static esp_err_t startUpdate(const std::string& url);
@@ -22,12 +46,15 @@ public:
     
     // Get update progress (0-100)
     static int getUpdateProgress();
-    
-    // Get last update status message
-    static std::string getLastStatusMessage();
-    
+
+    // Get a consistent snapshot of the update progress; safe from any task
+    static void getProgress(ota_progress_t* progress);
+
+    // Get the name of an update phase
+    static const char* getPhaseName(ota_phase_t phase);
+
     // Get firmware version
-    static std::string getFirmwareVersion();
+    static const char* getFirmwareVersion();
 };
 
 #endif // OTA_UPDATER_H
\ No newline at end of file
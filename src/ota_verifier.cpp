@@ -0,0 +1,117 @@
+#include "ota_verifier.h"
+#include <esp_log.h>
+#include <string.h>
+#include <mbedtls/pk.h>
+
+static const char* TAG = "ota_verifier";
+
+static int hex_value(char c) {
+    if (c >= '0' && c <= '9') {
+        return c - '0';
+    }
+    if (c >= 'a' && c <= 'f') {
+        return c - 'a' + 10;
+    }
+    if (c >= 'A' && c <= 'F') {
+        return c - 'A' + 10;
+    }
+    return -1;
+}
+
+OtaVerifier::OtaVerifier()
+    : _size(0), _finished(false)
+{
+    memset(_digest, 0, sizeof(_digest));
+    mbedtls_sha256_init(&_sha);
+}
+
+OtaVerifier::~OtaVerifier()
+{
+    mbedtls_sha256_free(&_sha);
+}
+
+void OtaVerifier::begin()
+{
+    mbedtls_sha256_free(&_sha);
+    mbedtls_sha256_init(&_sha);
+    mbedtls_sha256_starts(&_sha, 0);
+    memset(_digest, 0, sizeof(_digest));
+    _size = 0;
+    _finished = false;
+}
+
+void OtaVerifier::update(const uint8_t* data, size_t len)
+{
+    mbedtls_sha256_update(&_sha, data, len);
+    _size += len;
+}
+
+void OtaVerifier::finish()
+{
+    if (!_finished) {
+        mbedtls_sha256_finish(&_sha, _digest);
+        _finished = true;
+    }
+}
+
+esp_err_t OtaVerifier::verifySignature(const char* public_key_pem, const uint8_t* sig, size_t sig_len) const
+{
+    mbedtls_pk_context pk;
+    esp_err_t err = ESP_OK;
+
+    if (!_finished) {
+        return ESP_ERR_INVALID_STATE;
+    }
+
+    mbedtls_pk_init(&pk);
+
+    // PEM parsing needs the terminating NUL in the length
+    int ret = mbedtls_pk_parse_public_key(&pk, (const unsigned char*)public_key_pem,
+                                          strlen(public_key_pem) + 1);
+    if (ret != 0 || !mbedtls_pk_can_do(&pk, MBEDTLS_PK_ECDSA)) {
+        ESP_LOGE(TAG, "Invalid signing public key (-0x%04x)", (unsigned int)-ret);
+        err = ESP_ERR_INVALID_ARG;
+    } else {
+        ret = mbedtls_pk_verify(&pk, MBEDTLS_MD_SHA256, _digest, sizeof(_digest), sig, sig_len);
+        if (ret != 0) {
+            ESP_LOGE(TAG, "Image signature does not match (-0x%04x)", (unsigned int)-ret);
+            err = ESP_ERR_INVALID_CRC;
+        }
+    }
+
+    mbedtls_pk_free(&pk);
+    return err;
+}
+
+esp_err_t OtaVerifier::verifyManifest(const char* manifest, size_t len) const
+{
+    if (!_finished) {
+        return ESP_ERR_INVALID_STATE;
+    }
+
+    // Skip leading whitespace, then expect 64 hex digits
+    size_t pos = 0;
+    while (pos < len && (manifest[pos] == ' ' || manifest[pos] == '\t' ||
+                         manifest[pos] == '\r' || manifest[pos] == '\n')) {
+        pos++;
+    }
+    if (len - pos < sizeof(_digest) * 2) {
+        ESP_LOGE(TAG, "Manifest too short");
+        return ESP_ERR_INVALID_SIZE;
+    }
+
+    for (size_t i = 0; i < sizeof(_digest); i++) {
+        int high = hex_value(manifest[pos + 2 * i]);
+        int low = hex_value(manifest[pos + 2 * i + 1]);
+        if (high < 0 || low < 0) {
+            ESP_LOGE(TAG, "Manifest is not a SHA-256 hex digest");
+            return ESP_ERR_INVALID_ARG;
+        }
+        if ((uint8_t)((high << 4) | low) != _digest[i]) {
+            ESP_LOGE(TAG, "Image SHA-256 does not match manifest");
+            return ESP_ERR_INVALID_CRC;
+        }
+    }
+
+    return ESP_OK;
+}
@@ -0,0 +1,46 @@
+#ifndef OTA_VERIFIER_H
+#define OTA_VERIFIER_H
+
+#include <esp_err.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <mbedtls/sha256.h>
+
+// Incremental SHA-256 of an OTA image as it is written to flash, checked
+// against a detached signature or manifest once the image is complete,
+// so verification needs no second pass over the partition.
+//
+// Signatures are DER-encoded ECDSA over the SHA-256 of the image, as made
+// by `openssl dgst -sha256 -sign`. Manifests are `sha256sum` output.
+class OtaVerifier {
+public:
+    OtaVerifier();
+    ~OtaVerifier();
+
+    // Reset for a new image
+    void begin();
+
+    // Hash the next block of image data
+    void update(const uint8_t* data, size_t len);
+
+    // Finish the digest after the last block
+    void finish();
+
+    // Get the finished digest and the number of bytes hashed
+    const uint8_t* getDigest() const { return _digest; }
+    size_t getSize() const { return _size; }
+
+    // Check an ECDSA signature over the digest with a PEM public key
+    esp_err_t verifySignature(const char* public_key_pem, const uint8_t* sig, size_t sig_len) const;
+
+    // Check the digest against the first hash in a sha256sum manifest
+    esp_err_t verifyManifest(const char* manifest, size_t len) const;
+
+private:
+    mbedtls_sha256_context _sha;
+    uint8_t _digest[32];
+    size_t _size;
+    bool _finished;
+};
+
+#endif // OTA_VERIFIER_H
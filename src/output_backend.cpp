@@ -0,0 +1,171 @@
+#include "output_backend.h"
+#include <string.h>
+
+// MCP23017 registers with IOCON.BANK = 0, the power-on setting. Writes
+// continue into the following registers, so both ports take one
+// transaction.
+#define MCP23017_IODIRA 0x00
+#define MCP23017_GPIOA 0x12
+#define MCP23017_OLATA 0x14
+#define MCP23017_REGISTERS 0x16
+
+static int channels_per_chip(expander_type_t type) {
+    return type == EXPANDER_MCP23017 ? 16 : 8;
+}
+
+ExpanderOutput::ExpanderOutput(ExpanderBus* bus, expander_type_t type, int chips)
+    : _bus(bus), _type(type), _claimed(0), _shadow(0), _sent(0), _synced(0), _transactions(0), _errors(0) {
+    int max_chips = 64 / channels_per_chip(type);
+    _chips = chips < 1 ? 1 : chips > max_chips ? max_chips : chips;
+    _channels = _chips * channels_per_chip(type);
+}
+
+bool ExpanderOutput::claim(int channel) {
+    if (channel < 0 || channel >= _channels || (_claimed & (1ULL << channel))) {
+        return false;
+    }
+    _claimed |= 1ULL << channel;
+    _shadow &= ~(1ULL << channel);
+
+    // The pin turns to an output when its chip is next configured
+    if (_type == EXPANDER_MCP23017) {
+        _synced &= ~(1u << (channel / 16));
+    }
+    return true;
+}
+
+void ExpanderOutput::write(uint64_t mask, bool state) {
+    if (state) {
+        _shadow |= mask & _claimed;
+    } else {
+        _shadow &= ~mask;
+    }
+}
+
+bool ExpanderOutput::flush() {
+    return _type == EXPANDER_MCP23017 ? flushMcp23017() : flushShiftRegisters();
+}
+
+bool ExpanderOutput::send(int chip, const uint8_t* data, size_t len) {
+    _transactions.fetch_add(1, std::memory_order_relaxed);
+    if (!_bus->transmit(chip, data, len)) {
+        _errors.fetch_add(1, std::memory_order_relaxed);
+        return false;
+    }
+    return true;
+}
+
+bool ExpanderOutput::flushMcp23017() {
+    bool ok = true;
+    for (int chip = 0; chip < _chips; chip++) {
+        int shift = 16 * chip;
+        uint16_t levels = (uint16_t)(_shadow >> shift);
+        uint32_t bit = 1u << chip;
+        if ((_synced & bit) && levels == (uint16_t)(_sent >> shift)) {
+            continue;
+        }
+
+        // Latch the levels before pins turn to outputs, so a pin never
+        // drives a stale level; a failed chip may have reset, so it is
+        // configured again
+        uint8_t olat[3] = { MCP23017_OLATA, (uint8_t)levels, (uint8_t)(levels >> 8) };
+        if (!send(chip, olat, sizeof(olat))) {
+            _synced &= ~bit;
+            ok = false;
+            continue;
+        }
+        if (!(_synced & bit)) {
+            uint16_t inputs = (uint16_t)~(_claimed >> shift);
+            uint8_t iodir[3] = { MCP23017_IODIRA, (uint8_t)inputs, (uint8_t)(inputs >> 8) };
+            if (!send(chip, iodir, sizeof(iodir))) {
+                ok = false;
+                continue;
+            }
+        }
+        _sent = (_sent & ~(0xFFFFULL << shift)) | ((uint64_t)levels << shift);
+        _synced |= bit;
+    }
+    return ok;
+}
+
+bool ExpanderOutput::flushShiftRegisters() {
+    if (_synced && _shadow == _sent) {
+        return true;
+    }
+
+    // The first byte shifted in ends up in the farthest chip
+    uint8_t chain[EXPANDER_MAX_CHIPS];
+    for (int i = 0; i < _chips; i++) {
+        chain[i] = (uint8_t)(_shadow >> (8 * (_chips - 1 - i)));
+    }
+    if (!send(0, chain, _chips)) {
+        _synced = 0;
+        return false;
+    }
+    _sent = _shadow;
+    _synced = 1;
+    return true;
+}
+
+SimulatedExpanderBus::SimulatedExpanderBus(expander_type_t type, int chips)
+    : _type(type), _fail(0), _transactions(0), _bytes(0) {
+    _chips = chips < 1 ? 1 : chips > EXPANDER_MAX_CHIPS ? EXPANDER_MAX_CHIPS : chips;
+    memset(_latches, 0, sizeof(_latches));
+    for (int i = 0; i < EXPANDER_MAX_CHIPS; i++) {
+        resetChip(i);
+    }
+}
+
+void SimulatedExpanderBus::resetChip(int chip) {
+    memset(_registers[chip], 0, sizeof(_registers[chip]));
+    _registers[chip][MCP23017_IODIRA] = 0xFF;
+    _registers[chip][MCP23017_IODIRA + 1] = 0xFF;
+}
+
+bool SimulatedExpanderBus::transmit(int chip, const uint8_t* data, size_t len) {
+    _transactions++;
+    _bytes += len;
+    if (_fail > 0) {
+        _fail--;
+        return false;
+    }
+    if (chip < 0 || chip >= _chips || len == 0) {
+        return false;
+    }
+
+    if (_type == EXPANDER_74HC595) {
+        // Each byte pushes the chain one chip along, then all latch
+        for (size_t i = 0; i < len; i++) {
+            memmove(&_latches[1], &_latches[0], _chips - 1);
+            _latches[0] = data[i];
+        }
+        return true;
+    }
+
+    // A register address, then data for it and the registers after
+    int reg = data[0];
+    for (size_t i = 1; i < len; i++, reg++) {
+        if (reg >= MCP23017_REGISTERS) {
+            return false;
+        }
+        // Writing GPIO writes the output latch
+        int target = reg == MCP23017_GPIOA || reg == MCP23017_GPIOA + 1 ? reg + 2 : reg;
+        _registers[chip][target] = data[i];
+    }
+    return true;
+}
+
+uint64_t SimulatedExpanderBus::outputs() const {
+    uint64_t outputs = 0;
+    for (int chip = 0; chip < _chips; chip++) {
+        if (_type == EXPANDER_74HC595) {
+            outputs |= (uint64_t)_latches[chip] << (8 * chip);
+            continue;
+        }
+        const uint8_t* regs = _registers[chip];
+        uint16_t olat = regs[MCP23017_OLATA] | (regs[MCP23017_OLATA + 1] << 8);
+        uint16_t iodir = regs[MCP23017_IODIRA] | (regs[MCP23017_IODIRA + 1] << 8);
+        outputs |= (uint64_t)(uint16_t)(olat & ~iodir) << (16 * chip);
+    }
+    return outputs;
+}
@@ -0,0 +1,133 @@
+#ifndef OUTPUT_BACKEND_H
+#define OUTPUT_BACKEND_H
+
+#include <atomic>
+#include <stddef.h>
+#include <stdint.h>
+
+// Where switch outputs go: the ESP32's own GPIOs, or the channels of an
+// I/O expander. Writes may be held until flush(), so the changes of one
+// switch write, with the rules it sets off, or of a whole scene, reach
+// the hardware together. levels() answers from memory.
+//
+// This header and output_backend.cpp are free of ESP-IDF, so the
+// expander logic runs on a host as well; tools/expander_check.cpp tests
+// it against the simulated bus.
+class OutputBackend {
+public:
+    virtual ~OutputBackend() {}
+
+    // Channels the backend has; for GPIO, the pin numbers
+    virtual int channels() const = 0;
+
+    // Take channel as an output, driven low. False if it cannot drive an
+    // output or is taken already.
+    virtual bool claim(int channel) = 0;
+
+    // Set or clear the channels in mask; may be held until flush()
+    virtual void write(uint64_t mask, bool state) = 0;
+
+    // Send held writes. False if the hardware refused them; they stay
+    // held for the next flush.
+    virtual bool flush() = 0;
+
+    // Channel levels as last written, sent or held. Never touches the
+    // hardware.
+    virtual uint64_t levels() const = 0;
+};
+
+// Output expander chips
+typedef enum {
+    EXPANDER_MCP23017,          // 16 outputs per chip on I2C, at consecutive addresses
+    EXPANDER_74HC595            // 8 outputs per chip, chained on SPI
+} expander_type_t;
+
+// Most chips an expander backend drives: a chain of 74HC595s as long as
+// the 64-bit channel mask, or half as many MCP23017s
+#define EXPANDER_MAX_CHIPS 8
+
+// Carries one transaction to the expander chips
+class ExpanderBus {
+public:
+    virtual ~ExpanderBus() {}
+
+    // Write len bytes in one transaction: to one MCP23017, or shifted
+    // into the whole 74HC595 chain and latched, chip being 0
+    virtual bool transmit(int chip, const uint8_t* data, size_t len) = 0;
+};
+
+// Outputs on MCP23017 or 74HC595 expanders. A shadow register holds
+// every channel's level; write() only changes it, and flush() sends the
+// chips whose outputs differ from what they were last sent: one
+// transaction for a 74HC595 chain, one per changed MCP23017. Writes that
+// leave the outputs as sent cost no transaction at all.
+//
+// An MCP23017 starts with its pins as inputs, and may reset with the
+// supply; a chip is configured before its first write, and again after
+// a transaction to it fails.
+class ExpanderOutput : public OutputBackend {
+public:
+    ExpanderOutput(ExpanderBus* bus, expander_type_t type, int chips);
+
+    virtual int channels() const override { return _channels; }
+    virtual bool claim(int channel) override;
+    virtual void write(uint64_t mask, bool state) override;
+    virtual bool flush() override;
+    virtual uint64_t levels() const override { return _shadow; }
+
+    // Bus transactions attempted, and those that failed, since start;
+    // safe to read from any task
+    uint32_t transactions() const { return _transactions.load(std::memory_order_relaxed); }
+    uint32_t errors() const { return _errors.load(std::memory_order_relaxed); }
+
+private:
+    bool send(int chip, const uint8_t* data, size_t len);
+    bool flushMcp23017();
+    bool flushShiftRegisters();
+
+    ExpanderBus* _bus;
+    expander_type_t _type;
+    int _chips;
+    int _channels;
+    uint64_t _claimed;
+    uint64_t _shadow;           // Levels as written
+    uint64_t _sent;             // Levels the chips were last sent
+    uint32_t _synced;           // Chips holding _sent and configured, one bit each
+    std::atomic<uint32_t> _transactions;
+    std::atomic<uint32_t> _errors;
+};
+
+// Stands in for the expander bus without hardware. Emulates the chips'
+// output registers from the bytes it is sent, counts transactions and
+// can fail them on demand, for bench testing on the device and checks
+// on a host.
+class SimulatedExpanderBus : public ExpanderBus {
+public:
+    SimulatedExpanderBus(expander_type_t type, int chips);
+
+    virtual bool transmit(int chip, const uint8_t* data, size_t len) override;
+
+    // Levels on the chips' output pins; pins not yet configured as
+    // outputs read low
+    uint64_t outputs() const;
+
+    // Make the next count transactions fail
+    void failNext(int count) { _fail = count; }
+
+    // Put a chip back to its power-on state, as a supply dip would
+    void resetChip(int chip);
+
+    uint32_t transactions() const { return _transactions; }
+    uint32_t bytes() const { return _bytes; }
+
+private:
+    expander_type_t _type;
+    int _chips;
+    int _fail;
+    uint32_t _transactions;
+    uint32_t _bytes;
+    uint8_t _registers[EXPANDER_MAX_CHIPS][0x16];  // MCP23017 registers, IOCON.BANK = 0
+    uint8_t _latches[EXPANDER_MAX_CHIPS];          // 74HC595 output latches, nearest chip first
+};
+
+#endif // OUTPUT_BACKEND_H
@@ -0,0 +1,112 @@
+#include "output_drivers.h"
+#include "config.h"
+#include <driver/gpio.h>
+#include <soc/gpio_reg.h>
+
+#define EXPANDER_TIMEOUT_MS 20
+
+GpioOutput::GpioOutput() : _claimed(0), _levels(0) {
+}
+
+bool GpioOutput::claim(int channel) {
+    if (!GPIO_IS_VALID_OUTPUT_GPIO(channel) || (_claimed & (1ULL << channel))) {
+        return false;
+    }
+    gpio_reset_pin((gpio_num_t)channel);
+    gpio_set_direction((gpio_num_t)channel, GPIO_MODE_OUTPUT);
+    gpio_set_level((gpio_num_t)channel, 0);
+    _claimed |= 1ULL << channel;
+    _levels &= ~(1ULL << channel);
+    return true;
+}
+
+void GpioOutput::write(uint64_t mask, bool state) {
+    mask &= _claimed;
+    uint32_t low = (uint32_t)mask;
+    uint32_t high = (uint32_t)(mask >> 32);
+    if (low != 0) {
+        REG_WRITE(state ? GPIO_OUT_W1TS_REG : GPIO_OUT_W1TC_REG, low);
+    }
+    if (high != 0) {
+        REG_WRITE(state ? GPIO_OUT1_W1TS_REG : GPIO_OUT1_W1TC_REG, high);
+    }
+    _levels = state ? _levels | mask : _levels & ~mask;
+}
+
+I2cExpanderBus::I2cExpanderBus(int sda_pin, int scl_pin, uint8_t address, int chips)
+    : _sda_pin(sda_pin), _scl_pin(scl_pin), _address(address), _bus(NULL) {
+    _chips = chips > EXPANDER_MAX_CHIPS ? EXPANDER_MAX_CHIPS : chips;
+    for (int i = 0; i < EXPANDER_MAX_CHIPS; i++) {
+        _devs[i] = NULL;
+    }
+}
+
+esp_err_t I2cExpanderBus::begin() {
+    i2c_master_bus_config_t bus_config = {};
+    bus_config.i2c_port = -1;   // Any free controller
+    bus_config.sda_io_num = (gpio_num_t)_sda_pin;
+    bus_config.scl_io_num = (gpio_num_t)_scl_pin;
+    bus_config.clk_source = I2C_CLK_SRC_DEFAULT;
+    bus_config.glitch_ignore_cnt = 7;
+    bus_config.flags.enable_internal_pullup = true;
+    esp_err_t err = i2c_new_master_bus(&bus_config, &_bus);
+    if (err != ESP_OK) {
+        return err;
+    }
+
+    for (int i = 0; i < _chips; i++) {
+        i2c_device_config_t dev_config = {};
+        dev_config.dev_addr_length = I2C_ADDR_BIT_LEN_7;
+        dev_config.device_address = _address + i;
+        dev_config.scl_speed_hz = OUTPUT_EXPANDER_I2C_SPEED_HZ;
+        err = i2c_master_bus_add_device(_bus, &dev_config, &_devs[i]);
+        if (err != ESP_OK) {
+            return err;
+        }
+    }
+    return ESP_OK;
+}
+
+bool I2cExpanderBus::transmit(int chip, const uint8_t* data, size_t len) {
+    if (chip < 0 || chip >= _chips || _devs[chip] == NULL) {
+        return false;
+    }
+    return i2c_master_transmit(_devs[chip], data, len, EXPANDER_TIMEOUT_MS) == ESP_OK;
+}
+
+SpiExpanderBus::SpiExpanderBus(int mosi_pin, int sclk_pin, int latch_pin)
+    : _mosi_pin(mosi_pin), _sclk_pin(sclk_pin), _latch_pin(latch_pin), _dev(NULL) {
+}
+
+esp_err_t SpiExpanderBus::begin() {
+    spi_bus_config_t bus_config = {};
+    bus_config.mosi_io_num = _mosi_pin;
+    bus_config.miso_io_num = -1;
+    bus_config.sclk_io_num = _sclk_pin;
+    bus_config.quadwp_io_num = -1;
+    bus_config.quadhd_io_num = -1;
+    bus_config.max_transfer_sz = EXPANDER_MAX_CHIPS;
+    esp_err_t err = spi_bus_initialize(SPI3_HOST, &bus_config, SPI_DMA_DISABLED);
+    if (err != ESP_OK) {
+        return err;
+    }
+
+    spi_device_interface_config_t dev_config = {};
+    dev_config.clock_speed_hz = OUTPUT_EXPANDER_SPI_SPEED_HZ;
+    dev_config.mode = 0;
+    dev_config.spics_io_num = _latch_pin;
+    dev_config.queue_size = 1;
+    return spi_bus_add_device(SPI3_HOST, &dev_config, &_dev);
+}
+
+bool SpiExpanderBus::transmit(int chip, const uint8_t* data, size_t len) {
+    if (_dev == NULL) {
+        return false;
+    }
+
+    // Short enough to poll; the chain is at most EXPANDER_MAX_CHIPS bytes
+    spi_transaction_t transaction = {};
+    transaction.length = len * 8;
+    transaction.tx_buffer = data;
+    return spi_device_polling_transmit(_dev, &transaction) == ESP_OK;
+}
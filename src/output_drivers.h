@@ -0,0 +1,62 @@
+#ifndef OUTPUT_DRIVERS_H
+#define OUTPUT_DRIVERS_H
+
+#include <esp_err.h>
+#include <stdint.h>
+#include <driver/i2c_master.h>
+#include <driver/spi_master.h>
+#include "output_backend.h"
+
+// The ESP32's own GPIOs; channels are pin numbers. A write goes straight
+// to the GPIO set or clear register, one write for every pin in the mask
+// below 32 and one for those above, so there is nothing to flush.
+class GpioOutput : public OutputBackend {
+public:
+    GpioOutput();
+
+    virtual int channels() const override { return GPIO_NUM_MAX; }
+    virtual bool claim(int channel) override;
+    virtual void write(uint64_t mask, bool state) override;
+    virtual bool flush() override { return true; }
+    virtual uint64_t levels() const override { return _levels; }
+
+private:
+    uint64_t _claimed;
+    uint64_t _levels;
+};
+
+// MCP23017s on their own I2C bus, at consecutive addresses from address
+class I2cExpanderBus : public ExpanderBus {
+public:
+    I2cExpanderBus(int sda_pin, int scl_pin, uint8_t address, int chips);
+
+    esp_err_t begin();
+    virtual bool transmit(int chip, const uint8_t* data, size_t len) override;
+
+private:
+    int _sda_pin;
+    int _scl_pin;
+    uint8_t _address;
+    int _chips;
+    i2c_master_bus_handle_t _bus;
+    i2c_master_dev_handle_t _devs[EXPANDER_MAX_CHIPS];
+};
+
+// A chain of 74HC595s on SPI. Chip select drives the storage register
+// clock, so its rising edge at the end of a transaction latches the
+// whole chain at once.
+class SpiExpanderBus : public ExpanderBus {
+public:
+    SpiExpanderBus(int mosi_pin, int sclk_pin, int latch_pin);
+
+    esp_err_t begin();
+    virtual bool transmit(int chip, const uint8_t* data, size_t len) override;
+
+private:
+    int _mosi_pin;
+    int _sclk_pin;
+    int _latch_pin;
+    spi_device_handle_t _dev;
+};
+
+#endif // OUTPUT_DRIVERS_H
@@ -0,0 +1,160 @@
+#include "power_fail.h"
+#include "switch_snapshot.h"
+#include "switch_storage.h"
+#include "config.h"
+#include <esp_attr.h>
+#include <esp_log.h>
+#include <esp_timer.h>
+#include <driver/gpio.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
+
+static const char* TAG = "power_fail";
+
+// Not cleared at reset; holds garbage after power-on, which
+// SwitchSnapshot::valid() tells apart
+static RTC_NOINIT_ATTR snapshot_store_t s_store;
+
+// Switch states as last delivered to the listener, so the power-fail
+// interrupt can capture without touching the device or its lock
+static bool s_states[POWER_FAIL_MAX_SWITCHES];
+static double s_values[POWER_FAIL_MAX_SWITCHES];
+static int s_count = 0;
+
+// Nothing has changed since boot until this is set; until then NVS
+// already holds everything worth keeping
+static bool s_changed = false;
+
+// Guards the copy and the store between the listener and the interrupt
+static portMUX_TYPE s_mux = portMUX_INITIALIZER_UNLOCKED;
+static TaskHandle_t s_task = NULL;
+static power_fail_status_t s_status = {};
+
+esp_err_t PowerFail::recover(bool* states, double* values, int count) {
+    // A snapshot newer than NVS means the last boot lost power before
+    // its flush. Write it, then start afresh so it is not written again.
+    esp_err_t err = SwitchStorage::loadAllStates(states, values, count);
+    bool loaded = err == ESP_OK;
+    bool keep = false;
+    if (SwitchSnapshot::restore(&s_store, states, values, count, loaded)) {
+        loaded = true;
+        err = SwitchStorage::saveAllStates(states, values, count);
+        if (err == ESP_OK) {
+            s_status.recovered = true;
+            ESP_LOGW(TAG, "Committed switch states lost from NVS at the last reset");
+        } else {
+            // The switches still start at the snapshot; the next boot
+            // tries the write again if nothing changes before then
+            keep = true;
+            ESP_LOGE(TAG, "Failed to commit snapshot: %s", esp_err_to_name(err));
+        }
+    }
+    if (!keep) {
+        SwitchSnapshot::reset(&s_store);
+    }
+    return loaded ? ESP_OK : err;
+}
+
+esp_err_t PowerFail::start(AlpacaSwitch* device) {
+    int32_t count = 0;
+    device->get_maxswitch(&count);
+    if (count > POWER_FAIL_MAX_SWITCHES) {
+        ESP_LOGW(TAG, "Only the first %d of %ld switches are snapshot", POWER_FAIL_MAX_SWITCHES, (long)count);
+        count = POWER_FAIL_MAX_SWITCHES;
+    }
+
+    for (int i = 0; i < count; i++) {
+        device->get_getswitch(i, &s_states[i]);
+        device->get_getswitchvalue(i, &s_values[i]);
+    }
+    s_count = count;
+
+    esp_err_t err = device->addChangeListener(onSwitchChange, NULL);
+    if (err != ESP_OK) {
+        return err;
+    }
+
+#if POWER_FAIL_GPIO >= 0
+    if (xTaskCreatePinnedToCore(supervisorTask, "power_fail", 3072, NULL, POWER_FAIL_TASK_PRIORITY,
+                                &s_task, POWER_FAIL_TASK_CORE) != pdPASS) {
+        ESP_LOGE(TAG, "Failed to create supervisor task");
+        return ESP_ERR_NO_MEM;
+    }
+
+    gpio_config_t io_conf = {};
+    io_conf.pin_bit_mask = (1ULL << POWER_FAIL_GPIO);
+    io_conf.mode = GPIO_MODE_INPUT;
+    io_conf.pull_up_en = GPIO_PULLUP_ENABLE;
+    io_conf.intr_type = GPIO_INTR_NEGEDGE;
+    err = gpio_config(&io_conf);
+    if (err != ESP_OK) {
+        return err;
+    }
+
+    // Another driver may have installed the service already
+    err = gpio_install_isr_service(0);
+    if (err != ESP_OK && err != ESP_ERR_INVALID_STATE) {
+        return err;
+    }
+    err = gpio_isr_handler_add((gpio_num_t)POWER_FAIL_GPIO, onPowerFail, NULL);
+    if (err != ESP_OK) {
+        return err;
+    }
+    ESP_LOGI(TAG, "Power-fail signal on GPIO %d", POWER_FAIL_GPIO);
+#endif
+    return ESP_OK;
+}
+
+void PowerFail::getStatus(power_fail_status_t* status) {
+    portENTER_CRITICAL(&s_mux);
+    *status = s_status;
+    portEXIT_CRITICAL(&s_mux);
+}
+
+// Called with s_mux held
+void PowerFail::capture() {
+    int64_t start = esp_timer_get_time();
+    SwitchSnapshot::capture(&s_store, s_states, s_values, s_count);
+    uint32_t elapsed = (uint32_t)(esp_timer_get_time() - start);
+    s_status.captures++;
+    if (elapsed > s_status.capture_max_us) {
+        s_status.capture_max_us = elapsed;
+    }
+}
+
+void PowerFail::onPowerFail(void* arg) {
+    BaseType_t woken = pdFALSE;
+    portENTER_CRITICAL_ISR(&s_mux);
+    s_status.signals++;
+    if (s_changed) {
+        capture();
+    }
+    portEXIT_CRITICAL_ISR(&s_mux);
+
+    vTaskNotifyGiveFromISR(s_task, &woken);
+    portYIELD_FROM_ISR(woken);
+}
+
+void PowerFail::supervisorTask(void* pvParameter) {
+    while (true) {
+        ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+
+        // Skip the flush delay: the supply may not last that long
+        esp_err_t err = SwitchStorage::flush();
+        SwitchStorage::flushCounters(true);
+        ESP_LOGW(TAG, "Power failing, switch states %s", err == ESP_OK ? "written" : esp_err_to_name(err));
+    }
+}
+
+void PowerFail::onSwitchChange(void* ctx, const switch_change_t* changes, int count) {
+    portENTER_CRITICAL(&s_mux);
+    for (int i = 0; i < count; i++) {
+        if (changes[i].id < s_count) {
+            s_states[changes[i].id] = changes[i].state;
+            s_values[changes[i].id] = changes[i].value;
+        }
+    }
+    s_changed = true;
+    capture();
+    portEXIT_CRITICAL(&s_mux);
+}
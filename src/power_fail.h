@@ -0,0 +1,48 @@
+#ifndef POWER_FAIL_H
+#define POWER_FAIL_H
+
+#include <esp_err.h>
+#include <stdint.h>
+#include "alpaca_switch.h"
+
+// Power-fail snapshot state, for metrics
+typedef struct {
+    bool recovered;             // This boot committed a snapshot left by the last one
+    uint32_t captures;          // Snapshots taken since boot
+    uint32_t signals;           // Power-fail interrupts since boot
+    uint32_t capture_max_us;    // Longest capture
+} power_fail_status_t;
+
+// Keeps the last commanded switch states through a brown-out. Every
+// change is sealed into a double-buffered snapshot in RTC memory, which
+// keeps its contents through the reset, within microseconds and without
+// waiting for the coalesced NVS flush. At the next boot recover() writes
+// the snapshot to SwitchStorage if NVS missed it, before the switches
+// are set up from it.
+//
+// The ESP32's brown-out detector resets the chip from its own handler,
+// so the snapshot is kept current rather than taken there. A supply
+// supervisor wired to POWER_FAIL_GPIO adds a warning: its interrupt
+// captures the states again and writes them to NVS at once, while the
+// supply still holds up. Nothing survives the supply collapsing
+// completely but what reached NVS.
+class PowerFail {
+public:
+    // Load the switch states saved in NVS, with a snapshot left by the
+    // last boot committed over them; an error if there are none. Runs
+    // before the switch device is created.
+    static esp_err_t recover(bool* states, double* values, int count);
+
+    // Snapshot switch changes from now on
+    static esp_err_t start(AlpacaSwitch* device);
+
+    static void getStatus(power_fail_status_t* status);
+
+private:
+    static void capture();
+    static void supervisorTask(void* pvParameter);
+    static void onPowerFail(void* arg);
+    static void onSwitchChange(void* ctx, const switch_change_t* changes, int count);
+};
+
+#endif // POWER_FAIL_H
@@ -0,0 +1,118 @@
+#include "request_arena.h"
+#include "config.h"
+#include <esp_log.h>
+#include <atomic>
+#include <string.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
+
+static const char* TAG = "request_arena";
+
+// One worker's arena. Only the owning task touches used and the buffer;
+// the counters are read by the metrics handler on any task.
+typedef struct {
+    std::atomic<TaskHandle_t> owner;
+    std::atomic<size_t> used;
+    std::atomic<size_t> high_water;
+    std::atomic<uint32_t> requests;
+    alignas(8) uint8_t buf[REQUEST_ARENA_SIZE];
+} request_arena_t;
+
+static request_arena_t s_arenas[REQUEST_ARENA_WORKERS];
+static std::atomic<uint32_t> s_exhausted(0);
+
+// The calling task's arena, claiming a free one on first use
+static request_arena_t* current_arena(bool claim) {
+    TaskHandle_t task = xTaskGetCurrentTaskHandle();
+
+    for (int i = 0; i < REQUEST_ARENA_WORKERS; i++) {
+        if (s_arenas[i].owner.load(std::memory_order_acquire) == task) {
+            return &s_arenas[i];
+        }
+    }
+    if (!claim) {
+        return NULL;
+    }
+
+    for (int i = 0; i < REQUEST_ARENA_WORKERS; i++) {
+        TaskHandle_t expected = NULL;
+        if (s_arenas[i].owner.compare_exchange_strong(expected, task, std::memory_order_acq_rel)) {
+            ESP_LOGI(TAG, "Arena %d assigned to task %s", i, pcTaskGetName(task));
+            return &s_arenas[i];
+        }
+    }
+    return NULL;
+}
+
+void* RequestArena::alloc(size_t size) {
+    request_arena_t* arena = current_arena(true);
+    if (arena == NULL) {
+        ESP_LOGW(TAG, "No request arena free for task %s", pcTaskGetName(NULL));
+        s_exhausted.fetch_add(1, std::memory_order_relaxed);
+        return NULL;
+    }
+
+    size_t start = (arena->used.load(std::memory_order_relaxed) + 7) & ~(size_t)7;
+    if (start > REQUEST_ARENA_SIZE || size > REQUEST_ARENA_SIZE - start) {
+        ESP_LOGW(TAG, "Request arena full, %u bytes refused", (unsigned int)size);
+        s_exhausted.fetch_add(1, std::memory_order_relaxed);
+        return NULL;
+    }
+
+    size_t used = start + size;
+    arena->used.store(used, std::memory_order_relaxed);
+    if (used > arena->high_water.load(std::memory_order_relaxed)) {
+        arena->high_water.store(used, std::memory_order_relaxed);
+    }
+    return &arena->buf[start];
+}
+
+char* RequestArena::strdup(const char* str) {
+    size_t len = strlen(str) + 1;
+    char* copy = (char*)alloc(len);
+    if (copy != NULL) {
+        memcpy(copy, str, len);
+    }
+    return copy;
+}
+
+size_t RequestArena::mark() {
+    request_arena_t* arena = current_arena(false);
+    return arena != NULL ? arena->used.load(std::memory_order_relaxed) : 0;
+}
+
+void RequestArena::release(size_t mark) {
+    request_arena_t* arena = current_arena(false);
+    if (arena != NULL && mark <= arena->used.load(std::memory_order_relaxed)) {
+        arena->used.store(mark, std::memory_order_relaxed);
+    }
+}
+
+void RequestArena::reset() {
+    request_arena_t* arena = current_arena(false);
+    if (arena != NULL) {
+        arena->used.store(0, std::memory_order_relaxed);
+        arena->requests.fetch_add(1, std::memory_order_relaxed);
+    }
+}
+
+int RequestArena::workerCount() {
+    int count = 0;
+    while (count < REQUEST_ARENA_WORKERS &&
+           s_arenas[count].owner.load(std::memory_order_acquire) != NULL) {
+        count++;
+    }
+    return count;
+}
+
+void RequestArena::getStats(int worker, request_arena_stats_t* stats) {
+    request_arena_t* arena = &s_arenas[worker];
+    stats->worker = worker;
+    stats->used = arena->used.load(std::memory_order_relaxed);
+    stats->high_water = arena->high_water.load(std::memory_order_relaxed);
+    stats->requests = arena->requests.load(std::memory_order_relaxed);
+}
+
+uint32_t RequestArena::exhaustedCount() {
+    return s_exhausted.load(std::memory_order_relaxed);
+}
@@ -0,0 +1,50 @@
+#ifndef REQUEST_ARENA_H
+#define REQUEST_ARENA_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Usage of one worker's arena, for metrics
+typedef struct {
+    int worker;                         // Slot index
+    size_t used;                        // Bytes held by the request in progress
+    size_t high_water;                  // Most bytes any request has used
+    uint32_t requests;                  // Requests the arena has been reset after
+} request_arena_stats_t;
+
+// Scratch memory for HTTP request handlers, in place of small heap
+// allocations that fragment the heap over long uptimes. Each HTTP server
+// task gets a fixed bump arena, claimed the first time it allocates;
+// everything in it is released at once when the request ends (the metrics
+// route trampoline calls reset() after every handler).
+//
+// Memory from the arena is only valid until the current request ends.
+// alloc() returns NULL when the arena is full, so callers treat it like a
+// failed malloc.
+class RequestArena {
+public:
+    // Allocate size bytes, 8-byte aligned, for the rest of the request
+    static void* alloc(size_t size);
+
+    // Copy a string into the arena
+    static char* strdup(const char* str);
+
+    // Current position, and release everything allocated after it. Lets a
+    // helper return its scratch memory before the request ends.
+    static size_t mark();
+    static void release(size_t mark);
+
+    // Release everything allocated by the calling task's request
+    static void reset();
+
+    // Number of arenas claimed by a task so far
+    static int workerCount();
+
+    // Usage of one arena
+    static void getStats(int worker, request_arena_stats_t* stats);
+
+    // Allocations refused because an arena was full or none was free
+    static uint32_t exhaustedCount();
+};
+
+#endif // REQUEST_ARENA_H
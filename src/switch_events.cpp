@@ -0,0 +1,265 @@
+#include "switch_events.h"
+#include "alpaca_auth.h"
+#include "config.h"
+#include "metrics.h"
+#include <esp_log.h>
+#include <atomic>
+#include <stdio.h>
+#include <string.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
+#include <freertos/queue.h>
+#include <freertos/semphr.h>
+
+static const char* TAG = "switch_events";
+
+// Largest frame sent; bigger updates are split over several frames
+#define SWITCH_EVENTS_FRAME_SIZE 512
+
+// Room left in a frame before another entry is not attempted
+#define SWITCH_EVENTS_ENTRY_SIZE 48
+
+// One WebSocket client. The slot and its queue are created once; fd marks
+// it in use. The switch path only reads fd and posts to the queue.
+typedef struct {
+    std::atomic<int> fd;                // Socket, -1 when the slot is free
+    std::atomic<bool> resync;           // Send the full state, queue overflowed
+    httpd_handle_t server;              // Server the client is connected to
+    QueueHandle_t queue;                // Pending switch_change_t entries
+} switch_client_t;
+
+static switch_client_t s_clients[SWITCH_EVENTS_MAX_CLIENTS];
+static AlpacaSwitch* s_device = NULL;
+static TaskHandle_t s_push_task = NULL;
+
+// Held while a slot is claimed, released or sent on, so a socket is never
+// closed and handed to another client in the middle of a send
+static SemaphoreHandle_t s_clients_lock = NULL;
+
+// Start a frame; entries are appended with append_entry
+static size_t begin_frame(char* frame) {
+    return snprintf(frame, SWITCH_EVENTS_FRAME_SIZE, "{\"sw\":[");
+}
+
+static size_t append_entry(char* frame, size_t len, const switch_change_t* change) {
+    return len + snprintf(frame + len, SWITCH_EVENTS_FRAME_SIZE - len, "%s[%ld,%d,%g]",
+                          frame[len - 1] == '[' ? "" : ",",
+                          (long)change->id, change->state ? 1 : 0, change->value);
+}
+
+static esp_err_t send_frame(switch_client_t* client, char* frame, size_t len) {
+    // A socket closed behind our back may already belong to a plain HTTP client
+    if (httpd_ws_get_fd_info(client->server, client->fd) != HTTPD_WS_CLIENT_WEBSOCKET) {
+        return ESP_ERR_INVALID_STATE;
+    }
+
+    len += snprintf(frame + len, SWITCH_EVENTS_FRAME_SIZE - len, "]}");
+
+    httpd_ws_frame_t ws_frame = {};
+    ws_frame.final = true;
+    ws_frame.type = HTTPD_WS_TYPE_TEXT;
+    ws_frame.payload = (uint8_t*)frame;
+    ws_frame.len = len;
+    return httpd_ws_send_frame_async(client->server, client->fd, &ws_frame);
+}
+
+// Send every switch, used on connect and after a queue overflow
+static esp_err_t send_full_state(switch_client_t* client, char* frame) {
+    int32_t count = 0;
+    s_device->get_maxswitch(&count);
+
+    size_t len = begin_frame(frame);
+    for (int32_t id = 0; id < count; id++) {
+        switch_change_t change;
+        change.id = id;
+        s_device->get_getswitch(id, &change.state);
+        s_device->get_getswitchvalue(id, &change.value);
+
+        if (len + SWITCH_EVENTS_ENTRY_SIZE > SWITCH_EVENTS_FRAME_SIZE) {
+            esp_err_t err = send_frame(client, frame, len);
+            if (err != ESP_OK) {
+                return err;
+            }
+            len = begin_frame(frame);
+        }
+        len = append_entry(frame, len, &change);
+    }
+    return send_frame(client, frame, len);
+}
+
+// Send whatever is queued for a client, batched into as few frames as fit
+static esp_err_t send_queued(switch_client_t* client, char* frame) {
+    switch_change_t change;
+    size_t len = begin_frame(frame);
+    bool pending = false;
+
+    while (xQueueReceive(client->queue, &change, 0) == pdTRUE) {
+        if (len + SWITCH_EVENTS_ENTRY_SIZE > SWITCH_EVENTS_FRAME_SIZE) {
+            esp_err_t err = send_frame(client, frame, len);
+            if (err != ESP_OK) {
+                return err;
+            }
+            len = begin_frame(frame);
+        }
+        len = append_entry(frame, len, &change);
+        pending = true;
+    }
+
+    return pending ? send_frame(client, frame, len) : ESP_OK;
+}
+
+static void release_client(switch_client_t* client) {
+    ESP_LOGI(TAG, "WebSocket client %d disconnected", client->fd.load());
+    client->fd = -1;
+}
+
+esp_err_t SwitchEvents::registerHandlers(httpd_handle_t server, AlpacaSwitch* device) {
+    // Clients of every server share the slots and the push task
+    if (s_device == NULL) {
+        s_clients_lock = xSemaphoreCreateMutex();
+        if (s_clients_lock == NULL) {
+            return ESP_ERR_NO_MEM;
+        }
+        for (int i = 0; i < SWITCH_EVENTS_MAX_CLIENTS; i++) {
+            s_clients[i].fd = -1;
+            s_clients[i].queue = xQueueCreate(SWITCH_EVENTS_QUEUE_LENGTH, sizeof(switch_change_t));
+            if (s_clients[i].queue == NULL) {
+                return ESP_ERR_NO_MEM;
+            }
+        }
+
+        if (xTaskCreate(pushTask, "switch_events", 3072, NULL, 4, &s_push_task) != pdPASS) {
+            ESP_LOGE(TAG, "Failed to create push task");
+            return ESP_ERR_NO_MEM;
+        }
+
+        esp_err_t err = device->addChangeListener(onSwitchChange, NULL);
+        if (err != ESP_OK) {
+            return err;
+        }
+        s_device = device;
+    }
+
+    httpd_uri_t ws_uri = {};
+    ws_uri.uri = "/ws";
+    ws_uri.method = HTTP_GET;
+    ws_uri.handler = wsHandler;
+    ws_uri.is_websocket = true;
+    return httpd_register_uri_handler(server, &ws_uri);
+}
+
+esp_err_t SwitchEvents::wsHandler(httpd_req_t* req) {
+    int fd = httpd_req_to_sockfd(req);
+
+    // Handshake done; the upgrade request carries the credentials
+    if (req->method == HTTP_GET) {
+        if (!AlpacaAuth::verifyRequest(req)) {
+            ESP_LOGW(TAG, "Rejecting unauthenticated WebSocket client");
+            httpd_sess_trigger_close(req->handle, fd);
+            return ESP_OK;
+        }
+
+        xSemaphoreTake(s_clients_lock, portMAX_DELAY);
+        for (int i = 0; i < SWITCH_EVENTS_MAX_CLIENTS; i++) {
+            switch_client_t* client = &s_clients[i];
+            // Free slots, and slots whose socket is no longer ours
+            if (client->fd == -1 || (client->fd == fd && client->server == req->handle) ||
+                httpd_ws_get_fd_info(client->server, client->fd) != HTTPD_WS_CLIENT_WEBSOCKET) {
+                xQueueReset(client->queue);
+                client->resync = true;
+                client->server = req->handle;
+                client->fd = fd;
+                xTaskNotifyGive(s_push_task);
+                ESP_LOGI(TAG, "WebSocket client %d connected", fd);
+                xSemaphoreGive(s_clients_lock);
+                return ESP_OK;
+            }
+        }
+        xSemaphoreGive(s_clients_lock);
+
+        ESP_LOGW(TAG, "Too many WebSocket clients, closing %d", fd);
+        httpd_sess_trigger_close(req->handle, fd);
+        return ESP_OK;
+    }
+
+    // Clients have nothing to say; read and discard what they send
+    uint8_t payload[64];
+    httpd_ws_frame_t frame = {};
+    esp_err_t err = httpd_ws_recv_frame(req, &frame, 0);
+    if (err != ESP_OK) {
+        return err;
+    }
+    if (frame.len > sizeof(payload)) {
+        return ESP_ERR_INVALID_SIZE;
+    }
+    frame.payload = payload;
+    return httpd_ws_recv_frame(req, &frame, sizeof(payload));
+}
+
+void SwitchEvents::onSwitchChange(void* ctx, const switch_change_t* changes, int count) {
+    bool queued = false;
+
+    for (int i = 0; i < SWITCH_EVENTS_MAX_CLIENTS; i++) {
+        switch_client_t* client = &s_clients[i];
+        if (client->fd == -1 || client->resync) {
+            continue;
+        }
+        for (int j = 0; j < count; j++) {
+            // Never wait on a slow client; fall back to a full resync
+            if (xQueueSend(client->queue, &changes[j], 0) != pdTRUE) {
+                client->resync = true;
+                break;
+            }
+        }
+        queued = true;
+    }
+
+    if (queued) {
+        xTaskNotifyGive(s_push_task);
+    }
+}
+
+void SwitchEvents::pushTask(void* pvParameter) {
+    static char frame[SWITCH_EVENTS_FRAME_SIZE];
+
+    while (true) {
+        ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+
+        for (int i = 0; i < SWITCH_EVENTS_MAX_CLIENTS; i++) {
+            switch_client_t* client = &s_clients[i];
+            xSemaphoreTake(s_clients_lock, portMAX_DELAY);
+            if (client->fd == -1) {
+                xSemaphoreGive(s_clients_lock);
+                continue;
+            }
+
+            esp_err_t err;
+            if (client->resync.exchange(false)) {
+                xQueueReset(client->queue);
+                err = send_full_state(client, frame);
+            } else {
+                err = send_queued(client, frame);
+            }
+
+            if (err != ESP_OK) {
+                release_client(client);
+            }
+            xSemaphoreGive(s_clients_lock);
+        }
+    }
+}
+
+void SwitchEvents::onSocketClose(httpd_handle_t hd, int sockfd) {
+    // Free the slot before the socket number can be reused
+    if (s_clients_lock != NULL) {
+        xSemaphoreTake(s_clients_lock, portMAX_DELAY);
+        for (int i = 0; i < SWITCH_EVENTS_MAX_CLIENTS; i++) {
+            switch_client_t* client = &s_clients[i];
+            if (client->fd == sockfd && client->server == hd) {
+                release_client(client);
+            }
+        }
+        xSemaphoreGive(s_clients_lock);
+    }
+    Metrics::onSocketClose(hd, sockfd);
+}
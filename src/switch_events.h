@@ -0,0 +1,33 @@
+#ifndef SWITCH_EVENTS_H
+#define SWITCH_EVENTS_H
+
+#include <esp_err.h>
+#include <esp_http_server.h>
+#include "alpaca_switch.h"
+
+// WebSocket push of switch changes at /ws. Every frame is a text frame
+// listing switches as [id, state, value]:
+//
+//     {"sw":[[0,1,1],[3,0,0]]}
+//
+// A client gets the full state on connect and then only what changed;
+// changes made together (one batch) arrive in one frame. The switch path
+// only posts to a bounded queue per client without waiting; a client
+// whose queue overflows is sent the full state again instead.
+class SwitchEvents {
+public:
+    // Register the WebSocket endpoint and listen for switch changes; call
+    // once per server, clients of all servers share the slots
+    static esp_err_t registerHandlers(httpd_handle_t server, AlpacaSwitch* device);
+
+    // Server close_fn: frees the client's slot, then closes the socket
+    // through Metrics::onSocketClose
+    static void onSocketClose(httpd_handle_t hd, int sockfd);
+
+private:
+    static esp_err_t wsHandler(httpd_req_t* req);
+    static void pushTask(void* pvParameter);
+    static void onSwitchChange(void* ctx, const switch_change_t* changes, int count);
+};
+
+#endif // SWITCH_EVENTS_H
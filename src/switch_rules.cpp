@@ -0,0 +1,255 @@
+#include "switch_rules.h"
+#include <ctype.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define RULES_MAGIC 'R'
+#define RULES_VERSION 2     // 2: "requires" also holds the required switch on
+#define RULES_HEADER_SIZE 4
+
+// Most words on one rule line
+#define RULES_MAX_TOKENS 6
+
+SwitchRules::SwitchRules() : _count(0) {
+    memset(&_table, 0, sizeof(_table));
+    _table.magic = RULES_MAGIC;
+    _table.version = RULES_VERSION;
+    index();
+}
+
+// Switch whose state a rule depends on for this lookup: inhibits are
+// found by the switch being written, forces by the switch that changed
+static uint8_t rule_key(const switch_rule_t* rule) {
+    return rule->kind == SWITCH_RULE_INHIBIT ? rule->target : rule->trigger;
+}
+
+static bool rule_before(const switch_rule_t* a, const switch_rule_t* b) {
+    if (a->kind != b->kind) {
+        return a->kind < b->kind;
+    }
+    return rule_key(a) < rule_key(b);
+}
+
+void SwitchRules::index() {
+    // Stable sort, so rules on one switch keep the order they were written in
+    for (int i = 1; i < _count; i++) {
+        switch_rule_t rule = _table.rules[i];
+        int j = i;
+        for (; j > 0 && rule_before(&rule, &_table.rules[j - 1]); j--) {
+            _table.rules[j] = _table.rules[j - 1];
+        }
+        _table.rules[j] = rule;
+    }
+
+    int pos = 0;
+    for (int id = 0; id <= SWITCH_RULES_MAX_SWITCHES; id++) {
+        while (pos < _count && _table.rules[pos].kind == SWITCH_RULE_INHIBIT && _table.rules[pos].target < id) {
+            pos++;
+        }
+        _inhibit_start[id] = pos;
+    }
+    while (pos < _count && _table.rules[pos].kind == SWITCH_RULE_INHIBIT) {
+        pos++;
+    }
+    for (int id = 0; id <= SWITCH_RULES_MAX_SWITCHES; id++) {
+        while (pos < _count && _table.rules[pos].trigger < id) {
+            pos++;
+        }
+        _force_start[id] = pos;
+    }
+    _table.count = _count;
+}
+
+// Parse a switch id
+static bool parse_id(const char* token, int num_switches, uint8_t* id) {
+    char* end;
+    long value = strtol(token, &end, 10);
+    if (end == token || *end != '\0' || value < 0 || value >= num_switches ||
+        value >= SWITCH_RULES_MAX_SWITCHES) {
+        return false;
+    }
+    *id = (uint8_t)value;
+    return true;
+}
+
+static bool parse_state(const char* token, bool* on) {
+    if (strcasecmp(token, "on") == 0) {
+        *on = true;
+    } else if (strcasecmp(token, "off") == 0) {
+        *on = false;
+    } else {
+        return false;
+    }
+    return true;
+}
+
+esp_err_t SwitchRules::compile(const char* text, int num_switches, char* error, size_t error_len) {
+    _count = 0;
+    _table.num_switches = num_switches;
+
+    int line = 1;
+    const char* p = text;
+    while (*p != '\0') {
+        // Cut out one rule, dropping any comment
+        const char* end = p + strcspn(p, "\n;");
+        const char* comment = (const char*)memchr(p, '#', end - p);
+        char rule_text[64];
+        size_t rule_len = (comment != NULL ? comment : end) - p;
+        if (rule_len >= sizeof(rule_text)) {
+            snprintf(error, error_len, "line %d: rule too long", line);
+            return ESP_ERR_INVALID_ARG;
+        }
+        memcpy(rule_text, p, rule_len);
+        rule_text[rule_len] = '\0';
+
+        char* tokens[RULES_MAX_TOKENS];
+        int count = 0;
+        char* save = NULL;
+        for (char* token = strtok_r(rule_text, " \t\r", &save); token != NULL;
+             token = strtok_r(NULL, " \t\r", &save)) {
+            if (count == RULES_MAX_TOKENS) {
+                count++;
+                break;
+            }
+            tokens[count++] = token;
+        }
+
+        if (count > 0) {
+            switch_rule_t rules[2];
+            int added = 0;
+            uint8_t a = 0;
+            uint8_t b = 0;
+            bool a_on = false;
+            bool b_on = false;
+
+            if (count == 5 && strcmp(tokens[2], "->") == 0 && parse_id(tokens[0], num_switches, &a) &&
+                parse_state(tokens[1], &a_on) && parse_id(tokens[3], num_switches, &b) &&
+                parse_state(tokens[4], &b_on)) {
+                rules[added++] = { SWITCH_RULE_FORCE, a, b,
+                                   (uint8_t)((a_on ? SWITCH_RULE_TRIGGER_ON : 0) | (b_on ? SWITCH_RULE_TARGET_ON : 0)) };
+            } else if (count == 3 && strcasecmp(tokens[1], "excludes") == 0 &&
+                       parse_id(tokens[0], num_switches, &a) && parse_id(tokens[2], num_switches, &b)) {
+                rules[added++] = { SWITCH_RULE_INHIBIT, a, b, SWITCH_RULE_TRIGGER_ON | SWITCH_RULE_TARGET_ON };
+                rules[added++] = { SWITCH_RULE_INHIBIT, b, a, SWITCH_RULE_TRIGGER_ON | SWITCH_RULE_TARGET_ON };
+            } else if (count == 3 && strcasecmp(tokens[1], "requires") == 0 &&
+                       parse_id(tokens[0], num_switches, &b) && parse_id(tokens[2], num_switches, &a)) {
+                // b may not turn on while a is off, nor a turn off while b is on
+                rules[added++] = { SWITCH_RULE_INHIBIT, a, b, SWITCH_RULE_TARGET_ON };
+                rules[added++] = { SWITCH_RULE_INHIBIT, b, a, SWITCH_RULE_TRIGGER_ON };
+            } else {
+                snprintf(error, error_len, "line %d: expected \"A on|off -> B on|off\", "
+                         "\"A excludes B\" or \"A requires B\" with switch ids below %d",
+                         line, num_switches < SWITCH_RULES_MAX_SWITCHES ? num_switches : SWITCH_RULES_MAX_SWITCHES);
+                return ESP_ERR_INVALID_ARG;
+            }
+
+            if (a == b) {
+                snprintf(error, error_len, "line %d: a rule needs two different switches", line);
+                return ESP_ERR_INVALID_ARG;
+            }
+            if (_count + added > SWITCH_RULES_MAX) {
+                snprintf(error, error_len, "line %d: more than %d rule entries", line, SWITCH_RULES_MAX);
+                return ESP_ERR_INVALID_ARG;
+            }
+            for (int i = 0; i < added; i++) {
+                _table.rules[_count++] = rules[i];
+            }
+        }
+
+        if (*end == '\n') {
+            line++;
+        }
+        p = (*end != '\0') ? end + 1 : end;
+    }
+
+    // With "a off -> b off" as well, a turning off takes b with it rather
+    // than being refused, so the force keeps "b requires a" instead
+    int kept = 0;
+    for (int i = 0; i < _count; i++) {
+        const switch_rule_t* rule = &_table.rules[i];
+        bool replaced = false;
+        if (rule->kind == SWITCH_RULE_INHIBIT && rule->flags == SWITCH_RULE_TRIGGER_ON) {
+            for (int j = 0; j < _count && !replaced; j++) {
+                const switch_rule_t* force = &_table.rules[j];
+                replaced = force->kind == SWITCH_RULE_FORCE && force->flags == 0 &&
+                           force->trigger == rule->target && force->target == rule->trigger;
+            }
+        }
+        if (!replaced) {
+            _table.rules[kept++] = *rule;
+        }
+    }
+    _count = kept;
+
+    index();
+    return ESP_OK;
+}
+
+esp_err_t SwitchRules::load(const uint8_t* data, size_t len, int num_switches) {
+    if (len < RULES_HEADER_SIZE || data[0] != RULES_MAGIC || data[1] != RULES_VERSION ||
+        data[2] > SWITCH_RULES_MAX || data[3] != num_switches ||
+        len != RULES_HEADER_SIZE + data[2] * sizeof(switch_rule_t)) {
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    const switch_rule_t* rules = (const switch_rule_t*)(data + RULES_HEADER_SIZE);
+    for (int i = 0; i < data[2]; i++) {
+        if ((rules[i].kind != SWITCH_RULE_INHIBIT && rules[i].kind != SWITCH_RULE_FORCE) ||
+            rules[i].trigger >= num_switches || rules[i].target >= num_switches ||
+            rules[i].trigger >= SWITCH_RULES_MAX_SWITCHES || rules[i].target >= SWITCH_RULES_MAX_SWITCHES) {
+            return ESP_ERR_INVALID_ARG;
+        }
+    }
+
+    memcpy(_table.rules, rules, data[2] * sizeof(switch_rule_t));
+    _count = data[2];
+    _table.num_switches = num_switches;
+    index();
+    return ESP_OK;
+}
+
+const uint8_t* SwitchRules::serialize(size_t* len) const {
+    *len = RULES_HEADER_SIZE + _count * sizeof(switch_rule_t);
+    return (const uint8_t*)&_table;
+}
+
+const switch_rule_t* SwitchRules::check(int id, bool state, const bool* states, int* evaluated) const {
+    if (id < 0 || id >= SWITCH_RULES_MAX_SWITCHES) {
+        return NULL;
+    }
+    for (int i = _inhibit_start[id]; i < _inhibit_start[id + 1]; i++) {
+        const switch_rule_t* rule = &_table.rules[i];
+        (*evaluated)++;
+        if (state == ((rule->flags & SWITCH_RULE_TARGET_ON) != 0) &&
+            states[rule->trigger] == ((rule->flags & SWITCH_RULE_TRIGGER_ON) != 0)) {
+            return rule;
+        }
+    }
+    return NULL;
+}
+
+const switch_rule_t* SwitchRules::checkTransition(const int32_t* ids, int count, const bool* states,
+                                                  const bool* next, int* evaluated, int32_t* refused) const {
+    for (int i = 0; i < count; i++) {
+        int32_t id = ids[i];
+        if (next[id] == states[id]) {
+            continue;
+        }
+        const switch_rule_t* rule = check(id, next[id], next, evaluated);
+        if (rule != NULL) {
+            *refused = id;
+            return rule;
+        }
+    }
+    return NULL;
+}
+
+const switch_rule_t* SwitchRules::forces(int id, int* count) const {
+    if (id < 0 || id >= SWITCH_RULES_MAX_SWITCHES) {
+        *count = 0;
+        return NULL;
+    }
+    *count = _force_start[id + 1] - _force_start[id];
+    return &_table.rules[_force_start[id]];
+}
@@ -0,0 +1,92 @@
+#ifndef SWITCH_RULES_H
+#define SWITCH_RULES_H
+
+#include <esp_err.h>
+#include <stddef.h>
+#include <stdint.h>
+#include "config.h"
+
+// Rule kinds
+#define SWITCH_RULE_INHIBIT 1   // While trigger is in its state, target may not enter its state
+#define SWITCH_RULE_FORCE 2     // When trigger enters its state, target is set to its state
+
+// Rule flags
+#define SWITCH_RULE_TRIGGER_ON 0x01
+#define SWITCH_RULE_TARGET_ON 0x02
+
+// One compiled rule
+typedef struct {
+    uint8_t kind;
+    uint8_t trigger;
+    uint8_t target;
+    uint8_t flags;
+} switch_rule_t;
+
+// Interlock and automation rules, compiled once into a decision table.
+//
+// Rules are written one per line (or separated by ';'), with switches by
+// id and '#' starting a comment:
+//
+//     0 off -> 1 off      when switch 0 turns off, turn switch 1 off
+//     2 excludes 3        switches 2 and 3 are never on together
+//     1 requires 0        switch 1 may only be on while switch 0 is on:
+//                         1 may not turn on while 0 is off, nor 0 turn
+//                         off while 1 is on, unless "0 off -> 1 off"
+//                         turns 1 off with it
+//
+// "excludes" and "requires" compile to inhibit entries, keyed by the
+// switch whose write they can refuse; "->" compiles to force entries,
+// keyed by the switch whose change sets them off. The table is sorted by
+// key and indexed per switch, so a change only looks at the rules for
+// the switch that changed. The serialized table is what gets stored, so
+// rules are not parsed again at boot.
+class SwitchRules {
+public:
+    SwitchRules();
+
+    // Compile rule text. On a syntax error returns ESP_ERR_INVALID_ARG
+    // and describes it, with the line, in error.
+    esp_err_t compile(const char* text, int num_switches, char* error, size_t error_len);
+
+    // Load a table produced by serialize(), checking it against the device
+    esp_err_t load(const uint8_t* data, size_t len, int num_switches);
+
+    // Serialized table and its length
+    const uint8_t* serialize(size_t* len) const;
+
+    // The first inhibit rule refusing switch id entering state, given the
+    // current states, or NULL. Adds the rules looked at to *evaluated.
+    const switch_rule_t* check(int id, bool state, const bool* states, int* evaluated) const;
+
+    // The first inhibit rule refusing switches ids moving from states to
+    // next at once, or NULL, with the switch it refuses in *refused. Each
+    // switch that changes is checked against next, the states the whole
+    // move leaves, so the order of ids does not matter.
+    const switch_rule_t* checkTransition(const int32_t* ids, int count, const bool* states, const bool* next,
+                                         int* evaluated, int32_t* refused) const;
+
+    // Force rules keyed by switch id; the caller matches the trigger state
+    const switch_rule_t* forces(int id, int* count) const;
+
+    int count() const { return _count; }
+
+private:
+    void index();
+
+    // Serialized form: header, then the rules
+    struct {
+        uint8_t magic;
+        uint8_t version;
+        uint8_t count;
+        uint8_t num_switches;
+        switch_rule_t rules[SWITCH_RULES_MAX];
+    } _table;
+    int _count;
+
+    // Per switch, where its inhibit and force rules start; the entry
+    // after it is where they end
+    uint8_t _inhibit_start[SWITCH_RULES_MAX_SWITCHES + 1];
+    uint8_t _force_start[SWITCH_RULES_MAX_SWITCHES + 1];
+};
+
+#endif // SWITCH_RULES_H
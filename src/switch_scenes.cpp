@@ -0,0 +1,213 @@
+#include "switch_scenes.h"
+#include <ctype.h>
+#include <math.h>
+#include <string.h>
+
+#define SCENES_MAGIC 'S'
+#define SCENES_VERSION 1
+#define SCENES_HEADER_SIZE 4
+#define SCENES_ENTRY_SIZE 5     // Switch id, then the value's float bytes
+
+static_assert(SWITCH_SCENE_ENTRIES_MAX <= 255, "Scene settings are indexed with a byte");
+static_assert(sizeof(switch_scene_t) == SWITCH_SCENE_NAME_LEN + 2, "Scenes are stored unpadded");
+
+SwitchScenes::SwitchScenes() {
+    memset(&_table, 0, sizeof(_table));
+}
+
+static bool valid_name(const char* name) {
+    size_t len = strlen(name);
+    if (len == 0 || len >= SWITCH_SCENE_NAME_LEN) {
+        return false;
+    }
+    for (size_t i = 0; i < len; i++) {
+        if (!isalnum((unsigned char)name[i]) && name[i] != '-' && name[i] != '_') {
+            return false;
+        }
+    }
+    return true;
+}
+
+int SwitchScenes::find(const char* name) const {
+    int low = 0;
+    int high = _table.count - 1;
+    while (low <= high) {
+        int mid = (low + high) / 2;
+        int cmp = strcmp(name, _table.scenes[mid].name);
+        if (cmp == 0) {
+            return mid;
+        }
+        if (cmp < 0) {
+            high = mid - 1;
+        } else {
+            low = mid + 1;
+        }
+    }
+    return -1;
+}
+
+void SwitchScenes::removeAt(int index) {
+    // Close the gap in the pool, then in the table
+    int first = _table.scenes[index].first;
+    int count = _table.scenes[index].count;
+    int after = _table.used - first - count;
+    memmove(&_table.ids[first], &_table.ids[first + count], after);
+    memmove(&_table.values[first], &_table.values[first + count], after * sizeof(float));
+    _table.used -= count;
+    for (int i = 0; i < _table.count; i++) {
+        if (_table.scenes[i].first > first) {
+            _table.scenes[i].first -= count;
+        }
+    }
+
+    memmove(&_table.scenes[index], &_table.scenes[index + 1], (_table.count - index - 1) * sizeof(switch_scene_t));
+    _table.count--;
+}
+
+esp_err_t SwitchScenes::set(const char* name, const int* ids, const double* values, int count, int num_switches) {
+    if (!valid_name(name) || count < 0 || num_switches > 255) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    for (int i = 0; i < count; i++) {
+        if (ids[i] < 0 || ids[i] >= num_switches || !isfinite(values[i])) {
+            return ESP_ERR_INVALID_ARG;
+        }
+        for (int j = 0; j < i; j++) {
+            if (ids[j] == ids[i]) {
+                return ESP_ERR_INVALID_ARG;
+            }
+        }
+    }
+
+    int existing = find(name);
+    int freed = existing >= 0 ? _table.scenes[existing].count : 0;
+    if ((existing < 0 && _table.count >= SWITCH_SCENES_MAX) ||
+        _table.used - freed + count > SWITCH_SCENE_ENTRIES_MAX) {
+        return ESP_ERR_NO_MEM;
+    }
+    if (existing >= 0) {
+        removeAt(existing);
+    }
+
+    // Insert in name order
+    int index = _table.count;
+    while (index > 0 && strcmp(name, _table.scenes[index - 1].name) < 0) {
+        _table.scenes[index] = _table.scenes[index - 1];
+        index--;
+    }
+    switch_scene_t* scene = &_table.scenes[index];
+    memset(scene->name, 0, sizeof(scene->name));
+    strcpy(scene->name, name);
+    scene->first = _table.used;
+    scene->count = (uint8_t)count;
+    _table.count++;
+
+    // Append the settings sorted by switch id
+    for (int i = 0; i < count; i++) {
+        int pos = _table.used + i;
+        while (pos > _table.used && _table.ids[pos - 1] > ids[i]) {
+            _table.ids[pos] = _table.ids[pos - 1];
+            _table.values[pos] = _table.values[pos - 1];
+            pos--;
+        }
+        _table.ids[pos] = (uint8_t)ids[i];
+        _table.values[pos] = (float)values[i];
+    }
+    _table.used += count;
+    _table.num_switches = (uint8_t)num_switches;
+    return ESP_OK;
+}
+
+esp_err_t SwitchScenes::remove(const char* name) {
+    int index = find(name);
+    if (index < 0) {
+        return ESP_ERR_NOT_FOUND;
+    }
+    removeAt(index);
+    return ESP_OK;
+}
+
+int SwitchScenes::entries(int index, const uint8_t** ids, const float** values) const {
+    const switch_scene_t* scene = &_table.scenes[index];
+    *ids = &_table.ids[scene->first];
+    *values = &_table.values[scene->first];
+    return scene->count;
+}
+
+esp_err_t SwitchScenes::load(const uint8_t* data, size_t len, int num_switches) {
+    if (len < SCENES_HEADER_SIZE || data[0] != SCENES_MAGIC || data[1] != SCENES_VERSION ||
+        data[2] > SWITCH_SCENES_MAX || data[3] != num_switches) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    int count = data[2];
+    size_t pos = SCENES_HEADER_SIZE;
+    if (len < pos + count * sizeof(switch_scene_t)) {
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    // Check everything in place before touching the table, which is too
+    // big to build a second copy of on the caller's stack. Settings follow
+    // the scenes in pool order.
+    const uint8_t* scenes = data + pos;
+    pos += count * sizeof(switch_scene_t);
+    switch_scene_t scene;
+    switch_scene_t previous;
+    int used = 0;
+    for (int i = 0; i < count; i++) {
+        memcpy(&scene, scenes + i * sizeof(switch_scene_t), sizeof(scene));
+        if (scene.name[SWITCH_SCENE_NAME_LEN - 1] != '\0' || !valid_name(scene.name) ||
+            (i > 0 && strcmp(previous.name, scene.name) >= 0)) {
+            return ESP_ERR_INVALID_ARG;
+        }
+        used += scene.count;
+        previous = scene;
+    }
+    if (used > SWITCH_SCENE_ENTRIES_MAX || len != pos + used * SCENES_ENTRY_SIZE) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    for (int i = 0; i < count; i++) {
+        memcpy(&scene, scenes + i * sizeof(switch_scene_t), sizeof(scene));
+        if (scene.first + scene.count > used) {
+            return ESP_ERR_INVALID_ARG;
+        }
+    }
+    for (int i = 0; i < used; i++) {
+        float value;
+        memcpy(&value, data + pos + i * SCENES_ENTRY_SIZE + 1, sizeof(float));
+        if (data[pos + i * SCENES_ENTRY_SIZE] >= num_switches || !isfinite(value)) {
+            return ESP_ERR_INVALID_ARG;
+        }
+    }
+
+    memcpy(_table.scenes, scenes, count * sizeof(switch_scene_t));
+    for (int i = 0; i < used; i++) {
+        _table.ids[i] = data[pos];
+        memcpy(&_table.values[i], data + pos + 1, sizeof(float));
+        pos += SCENES_ENTRY_SIZE;
+    }
+    _table.count = (uint8_t)count;
+    _table.used = (uint8_t)used;
+    _table.num_switches = (uint8_t)num_switches;
+    return ESP_OK;
+}
+
+size_t SwitchScenes::serialize(uint8_t* buf, size_t len) const {
+    size_t total = SCENES_HEADER_SIZE + _table.count * sizeof(switch_scene_t) + _table.used * SCENES_ENTRY_SIZE;
+    if (len < total) {
+        return 0;
+    }
+
+    buf[0] = SCENES_MAGIC;
+    buf[1] = SCENES_VERSION;
+    buf[2] = _table.count;
+    buf[3] = _table.num_switches;
+    size_t pos = SCENES_HEADER_SIZE;
+    memcpy(buf + pos, _table.scenes, _table.count * sizeof(switch_scene_t));
+    pos += _table.count * sizeof(switch_scene_t);
+    for (int i = 0; i < _table.used; i++) {
+        buf[pos] = _table.ids[i];
+        memcpy(buf + pos + 1, &_table.values[i], sizeof(float));
+        pos += SCENES_ENTRY_SIZE;
+    }
+    return total;
+}
@@ -0,0 +1,69 @@
+#ifndef SWITCH_SCENES_H
+#define SWITCH_SCENES_H
+
+#include <esp_err.h>
+#include <stddef.h>
+#include <stdint.h>
+#include "config.h"
+
+// One scene: its name and where its switch settings sit in the pool
+typedef struct {
+    char name[SWITCH_SCENE_NAME_LEN];
+    uint8_t first;
+    uint8_t count;
+} switch_scene_t;
+
+// Longest serialized table: header, scenes, then an id and a float per setting
+#define SWITCH_SCENES_BLOB_MAX (4 + SWITCH_SCENES_MAX * sizeof(switch_scene_t) + SWITCH_SCENE_ENTRIES_MAX * 5)
+
+// Named presets of switch values, such as "imaging" or "park", each
+// setting some or all of the switches. Scenes are kept sorted by name,
+// so finding one is a binary search; their settings share one pool,
+// sorted by switch id within a scene. Values are kept as floats, which
+// hold the on/off and stepped values switches take exactly.
+//
+// The serialized table is packed, five bytes per setting, and is what
+// gets stored in NVS.
+class SwitchScenes {
+public:
+    SwitchScenes();
+
+    // Add a scene, or replace the one with the same name. Names are 1 to
+    // SWITCH_SCENE_NAME_LEN - 1 letters, digits, '-' or '_'; ids must be
+    // distinct switches below num_switches, and values finite.
+    // ESP_ERR_NO_MEM when the table is full.
+    esp_err_t set(const char* name, const int* ids, const double* values, int count, int num_switches);
+
+    // Remove a scene; ESP_ERR_NOT_FOUND if there is none by that name
+    esp_err_t remove(const char* name);
+
+    // Index of the named scene, or -1
+    int find(const char* name) const;
+
+    // Name and settings of the scene at index, in name order
+    const char* name(int index) const { return _table.scenes[index].name; }
+    int entries(int index, const uint8_t** ids, const float** values) const;
+
+    int count() const { return _table.count; }
+
+    // Load a table produced by serialize(), checking it against the device;
+    // a table that fails leaves this one as it was
+    esp_err_t load(const uint8_t* data, size_t len, int num_switches);
+
+    // Write the table to buf; returns its length, 0 if buf is too small
+    size_t serialize(uint8_t* buf, size_t len) const;
+
+private:
+    void removeAt(int index);
+
+    struct {
+        uint8_t count;
+        uint8_t num_switches;
+        uint8_t used;           // Settings in the pool
+        switch_scene_t scenes[SWITCH_SCENES_MAX];
+        uint8_t ids[SWITCH_SCENE_ENTRIES_MAX];
+        float values[SWITCH_SCENE_ENTRIES_MAX];
+    } _table;
+};
+
+#endif // SWITCH_SCENES_H
@@ -0,0 +1,133 @@
+#include "switch_snapshot.h"
+#include <atomic>
+#include <stddef.h>
+#include <string.h>
+
+// Changes whenever the layout does, so an old snapshot is ignored
+#define SNAPSHOT_MAGIC 0x534E5031   // "SNP1"
+
+// CRC-32 (reflected, polynomial 0xEDB88320) a nibble at a time: a
+// 16-entry table is small enough to live in RAM next to the code
+static const uint32_t s_crc_nibbles[16] = {
+    0x00000000, 0x1DB71064, 0x3B6E20C8, 0x26D930AC, 0x76DC4190, 0x6B6B51F4, 0x4DB26158, 0x5005713C,
+    0xEDB88320, 0xF00F9344, 0xD6D6A3E8, 0xCB61B38C, 0x9B64C2B0, 0x86D3D2D4, 0xA00AE278, 0xBDBDF21C,
+};
+
+static uint32_t crc32_update(uint32_t crc, const void* data, size_t len) {
+    const uint8_t* bytes = (const uint8_t*)data;
+    for (size_t i = 0; i < len; i++) {
+        crc ^= bytes[i];
+        crc = (crc >> 4) ^ s_crc_nibbles[crc & 0x0F];
+        crc = (crc >> 4) ^ s_crc_nibbles[crc & 0x0F];
+    }
+    return crc;
+}
+
+static uint32_t snapshot_crc(const switch_snapshot_t* snapshot) {
+    uint32_t count = snapshot->count;
+    uint32_t crc = 0xFFFFFFFF;
+    crc = crc32_update(crc, &snapshot->seq, sizeof(snapshot->seq));
+    crc = crc32_update(crc, &snapshot->count, sizeof(snapshot->count));
+    crc = crc32_update(crc, snapshot->states, count);
+    crc = crc32_update(crc, snapshot->values, count * sizeof(double));
+    return ~crc;
+}
+
+static bool snapshot_intact(const switch_snapshot_t* snapshot) {
+    return snapshot->seq != 0 && snapshot->count <= POWER_FAIL_MAX_SWITCHES &&
+           snapshot->crc == snapshot_crc(snapshot);
+}
+
+void SwitchSnapshot::reset(snapshot_store_t* store) {
+    memset(store, 0, sizeof(*store));
+    store->magic = SNAPSHOT_MAGIC;
+}
+
+bool SwitchSnapshot::valid(const snapshot_store_t* store) {
+    return store->magic == SNAPSHOT_MAGIC && store->active < 2;
+}
+
+void SwitchSnapshot::capture(snapshot_store_t* store, const bool* states, const double* values, int count) {
+    if (count > POWER_FAIL_MAX_SWITCHES) {
+        count = POWER_FAIL_MAX_SWITCHES;
+    }
+    uint32_t active = store->active & 1;
+    switch_snapshot_t* target = &store->buffers[active ^ 1];
+
+    // The sequence number follows the active buffer even if it is torn:
+    // the newer buffer always has the higher number
+    uint32_t seq = store->buffers[active].seq + 1;
+    if (seq == 0) {
+        seq = 1;
+    }
+
+    target->seq = seq;
+    target->count = (uint32_t)count;
+    for (int i = 0; i < count; i++) {
+        target->states[i] = states[i] ? 1 : 0;
+        target->values[i] = values[i];
+    }
+    target->crc = snapshot_crc(target);
+
+    // latest() goes by the CRC, not by this; it only has to land after
+    // the buffer so the next capture does not write over the newest one
+    std::atomic_signal_fence(std::memory_order_release);
+    store->active = active ^ 1;
+}
+
+// Newest intact buffer in the store, NULL if there is none
+static const switch_snapshot_t* newest(const snapshot_store_t* store) {
+    if (!SwitchSnapshot::valid(store)) {
+        return NULL;
+    }
+
+    // Prefer the active buffer; if a reset tore it, the other one holds
+    // the capture before
+    const switch_snapshot_t* first = &store->buffers[store->active];
+    const switch_snapshot_t* second = &store->buffers[store->active ^ 1];
+    bool first_ok = snapshot_intact(first);
+    bool second_ok = snapshot_intact(second);
+    if (first_ok && second_ok) {
+        return (int32_t)(first->seq - second->seq) >= 0 ? first : second;
+    } else if (first_ok) {
+        return first;
+    } else if (second_ok) {
+        return second;
+    }
+    return NULL;
+}
+
+bool SwitchSnapshot::latest(const snapshot_store_t* store, switch_snapshot_t* snapshot) {
+    const switch_snapshot_t* chosen = newest(store);
+    if (chosen == NULL) {
+        return false;
+    }
+    memcpy(snapshot, chosen, sizeof(*snapshot));
+    return true;
+}
+
+bool SwitchSnapshot::restore(const snapshot_store_t* store, bool* states, double* values, int count,
+                             bool have_saved) {
+    int covered = count < POWER_FAIL_MAX_SWITCHES ? count : POWER_FAIL_MAX_SWITCHES;
+    if (!have_saved && covered != count) {
+        return false;
+    }
+
+    // Read in place: a copy would take a few hundred bytes of the stack
+    const switch_snapshot_t* snapshot = newest(store);
+    if (snapshot == NULL || snapshot->count != (uint32_t)covered) {
+        return false;
+    }
+    bool differs = !have_saved;
+    for (int i = 0; i < covered && !differs; i++) {
+        differs = states[i] != (snapshot->states[i] != 0) || values[i] != snapshot->values[i];
+    }
+    if (!differs) {
+        return false;
+    }
+    for (int i = 0; i < covered; i++) {
+        states[i] = snapshot->states[i] != 0;
+        values[i] = snapshot->values[i];
+    }
+    return true;
+}
@@ -0,0 +1,52 @@
+#ifndef SWITCH_SNAPSHOT_H
+#define SWITCH_SNAPSHOT_H
+
+#include <stdint.h>
+#include "config.h"
+
+// Switch states and values kept in memory that outlives a reset, double
+// buffered so a reset in the middle of a capture leaves the previous
+// snapshot intact. Free of ESP-IDF, allocations and locks: capture() is
+// plain stores into the given store, fit for an interrupt handler. The
+// caller keeps captures from overlapping. tools/snapshot_check.cpp tests
+// it on the host, with a reset at every byte of a capture.
+
+// One sealed copy of the switches
+typedef struct {
+    uint32_t seq;               // Counts captures; 0 for an empty buffer
+    uint32_t count;
+    uint8_t states[POWER_FAIL_MAX_SWITCHES];
+    double values[POWER_FAIL_MAX_SWITCHES];
+    uint32_t crc;               // CRC-32 of the fields above, over count switches
+} switch_snapshot_t;
+
+typedef struct {
+    uint32_t magic;
+    uint32_t active;            // Buffer written last
+    switch_snapshot_t buffers[2];
+} snapshot_store_t;
+
+class SwitchSnapshot {
+public:
+    // Empty the store
+    static void reset(snapshot_store_t* store);
+
+    // The store holds a snapshot layout this firmware knows, rather than
+    // whatever memory held at power-on
+    static bool valid(const snapshot_store_t* store);
+
+    // Seal the switches into the buffer not written last, then make it
+    // the active one. count is capped at POWER_FAIL_MAX_SWITCHES.
+    static void capture(snapshot_store_t* store, const bool* states, const double* values, int count);
+
+    // Newest snapshot whose CRC checks out; false if there is none
+    static bool latest(const snapshot_store_t* store, switch_snapshot_t* snapshot);
+
+    // Put the newest snapshot over states and values of count switches as
+    // NVS holds them; false if there is none for that many switches, or it
+    // matches them already. Without saved states (nothing in NVS), the
+    // snapshot has to cover all count switches.
+    static bool restore(const snapshot_store_t* store, bool* states, double* values, int count, bool have_saved);
+};
+
+#endif // SWITCH_SNAPSHOT_H
@@ -1,10 +1,23 @@
 #include "switch_storage.h"
+#include "config.h"
 #include <nvs_flash.h>
 #include <nvs.h>
 #include <esp_log.h>
+#include <string.h>
 
 static const char* TAG = "switch_storage";
 const char* SwitchStorage::NVS_NAMESPACE = "switch_cfg";
+AlpacaSwitch* SwitchStorage::_device = NULL;
+TaskHandle_t SwitchStorage::_flushTask = NULL;
+SemaphoreHandle_t SwitchStorage::_flushLock = NULL;
+volatile bool SwitchStorage::_dirty = false;
+int SwitchStorage::_count = 0;
+bool* SwitchStorage::_states = NULL;
+double* SwitchStorage::_values = NULL;
+relay_counter_t* SwitchStorage::_counters = NULL;
+relay_counter_t* SwitchStorage::_saved_counters = NULL;
+TickType_t SwitchStorage::_counters_saved_at = 0;
+bool* SwitchStorage::_worn = NULL;
 
 esp_err_t SwitchStorage::init() {
     // Initialize NVS
@@ -155,6 +168,231 @@ esp_err_t SwitchStorage::loadAllStates(bool* states, double* values, int count)
     return ESP_OK;
 }
 
+esp_err_t SwitchStorage::saveRules(const char* text, const SwitchRules* rules) {
+    nvs_handle_t handle;
+    esp_err_t err;
+    
+    err = nvs_open(NVS_NAMESPACE, NVS_READWRITE, &handle);
+    if (err != ESP_OK) {
+        ESP_LOGE(TAG, "Failed to open NVS handle: %s", esp_err_to_name(err));
+        return err;
+    }
+    
+    // The table is what gets loaded at boot; the text is kept for editing
+    size_t table_len;
+    const uint8_t* table = rules->serialize(&table_len);
+    err = nvs_set_blob(handle, "rules", table, table_len);
+    if (err == ESP_OK) {
+        err = nvs_set_str(handle, "rules_text", text);
+    }
+    if (err == ESP_OK) {
+        err = nvs_commit(handle);
+    }
+    if (err != ESP_OK) {
+        ESP_LOGE(TAG, "Failed to save rules: %s", esp_err_to_name(err));
+    } else {
+        ESP_LOGI(TAG, "Saved %d rule entries", rules->count());
+    }
+    
+    nvs_close(handle);
+    return err;
+}
+
+esp_err_t SwitchStorage::loadRules(SwitchRules* rules, int num_switches) {
+    nvs_handle_t handle;
+    esp_err_t err;
+    
+    err = nvs_open(NVS_NAMESPACE, NVS_READONLY, &handle);
+    if (err != ESP_OK) {
+        return err;
+    }
+    
+    uint8_t table[4 + SWITCH_RULES_MAX * sizeof(switch_rule_t)];
+    size_t table_len = sizeof(table);
+    err = nvs_get_blob(handle, "rules", table, &table_len);
+    nvs_close(handle);
+    if (err != ESP_OK) {
+        return err;
+    }
+    
+    err = rules->load(table, table_len, num_switches);
+    if (err != ESP_OK) {
+        ESP_LOGW(TAG, "Stored rules do not match this device, ignoring them");
+    }
+    return err;
+}
+
+esp_err_t SwitchStorage::loadRulesText(char* text, size_t len) {
+    nvs_handle_t handle;
+    esp_err_t err;
+    
+    text[0] = '\0';
+    err = nvs_open(NVS_NAMESPACE, NVS_READONLY, &handle);
+    if (err != ESP_OK) {
+        return err;
+    }
+    
+    err = nvs_get_str(handle, "rules_text", text, &len);
+    nvs_close(handle);
+    return err;
+}
+
+esp_err_t SwitchStorage::saveCounters(const relay_counter_t* counters, int count) {
+    nvs_handle_t handle;
+    esp_err_t err;
+    
+    err = nvs_open(NVS_NAMESPACE, NVS_READWRITE, &handle);
+    if (err != ESP_OK) {
+        ESP_LOGE(TAG, "Failed to open NVS handle: %s", esp_err_to_name(err));
+        return err;
+    }
+    
+    err = nvs_set_blob(handle, "relay_wear", counters, count * sizeof(relay_counter_t));
+    if (err == ESP_OK) {
+        err = nvs_commit(handle);
+    }
+    if (err != ESP_OK) {
+        ESP_LOGE(TAG, "Failed to save relay counters: %s", esp_err_to_name(err));
+    }
+    
+    nvs_close(handle);
+    return err;
+}
+
+esp_err_t SwitchStorage::loadCounters(relay_counter_t* counters, int count) {
+    nvs_handle_t handle;
+    esp_err_t err;
+    
+    memset(counters, 0, count * sizeof(relay_counter_t));
+    err = nvs_open(NVS_NAMESPACE, NVS_READONLY, &handle);
+    if (err != ESP_OK) {
+        return err;
+    }
+    
+    // Counters saved with a different number of switches still count
+    // for the switches both have
+    size_t stored_len = 0;
+    err = nvs_get_blob(handle, "relay_wear", NULL, &stored_len);
+    if (err == ESP_OK) {
+        int stored = stored_len / sizeof(relay_counter_t);
+        relay_counter_t* saved = new relay_counter_t[stored > 0 ? stored : 1];
+        err = nvs_get_blob(handle, "relay_wear", saved, &stored_len);
+        if (err == ESP_OK) {
+            memcpy(counters, saved, (stored < count ? stored : count) * sizeof(relay_counter_t));
+        }
+        delete[] saved;
+    }
+    nvs_close(handle);
+    return err;
+}
+
+esp_err_t SwitchStorage::saveGang(int id, const switch_gang_t* gang) {
+    nvs_handle_t handle;
+    esp_err_t err;
+    
+    char key[16];
+    snprintf(key, sizeof(key), "gang_%d", id);
+    
+    err = nvs_open(NVS_NAMESPACE, NVS_READWRITE, &handle);
+    if (err != ESP_OK) {
+        ESP_LOGE(TAG, "Failed to open NVS handle: %s", esp_err_to_name(err));
+        return err;
+    }
+    
+    if (gang->count > 0) {
+        err = nvs_set_blob(handle, key, gang, sizeof(switch_gang_t));
+    } else {
+        err = nvs_erase_key(handle, key);
+        if (err == ESP_ERR_NVS_NOT_FOUND) {
+            err = ESP_OK;
+        }
+    }
+    if (err == ESP_OK) {
+        err = nvs_commit(handle);
+    }
+    if (err != ESP_OK) {
+        ESP_LOGE(TAG, "Failed to save gang of switch %d: %s", id, esp_err_to_name(err));
+    }
+    
+    nvs_close(handle);
+    return err;
+}
+
+esp_err_t SwitchStorage::loadGang(int id, switch_gang_t* gang) {
+    nvs_handle_t handle;
+    esp_err_t err;
+    
+    char key[16];
+    snprintf(key, sizeof(key), "gang_%d", id);
+    
+    memset(gang, 0, sizeof(switch_gang_t));
+    err = nvs_open(NVS_NAMESPACE, NVS_READONLY, &handle);
+    if (err != ESP_OK) {
+        return err;
+    }
+    
+    size_t len = sizeof(switch_gang_t);
+    err = nvs_get_blob(handle, key, gang, &len);
+    if (err == ESP_OK && (len != sizeof(switch_gang_t) || gang->count > SWITCH_GANG_MAX_PINS - 1)) {
+        ESP_LOGW(TAG, "Ignoring malformed gang of switch %d", id);
+        memset(gang, 0, sizeof(switch_gang_t));
+        err = ESP_ERR_INVALID_SIZE;
+    }
+    nvs_close(handle);
+    return err;
+}
+
+esp_err_t SwitchStorage::saveScenes(const SwitchScenes* scenes) {
+    nvs_handle_t handle;
+    esp_err_t err;
+    
+    uint8_t* table = new uint8_t[SWITCH_SCENES_BLOB_MAX];
+    size_t table_len = scenes->serialize(table, SWITCH_SCENES_BLOB_MAX);
+    err = nvs_open(NVS_NAMESPACE, NVS_READWRITE, &handle);
+    if (err != ESP_OK) {
+        ESP_LOGE(TAG, "Failed to open NVS handle: %s", esp_err_to_name(err));
+        delete[] table;
+        return err;
+    }
+    
+    err = nvs_set_blob(handle, "scenes", table, table_len);
+    if (err == ESP_OK) {
+        err = nvs_commit(handle);
+    }
+    if (err != ESP_OK) {
+        ESP_LOGE(TAG, "Failed to save scenes: %s", esp_err_to_name(err));
+    } else {
+        ESP_LOGI(TAG, "Saved %d scenes in %u bytes", scenes->count(), (unsigned)table_len);
+    }
+    
+    nvs_close(handle);
+    delete[] table;
+    return err;
+}
+
+esp_err_t SwitchStorage::loadScenes(SwitchScenes* scenes, int num_switches) {
+    nvs_handle_t handle;
+    esp_err_t err;
+    
+    err = nvs_open(NVS_NAMESPACE, NVS_READONLY, &handle);
+    if (err != ESP_OK) {
+        return err;
+    }
+    
+    uint8_t* table = new uint8_t[SWITCH_SCENES_BLOB_MAX];
+    size_t table_len = SWITCH_SCENES_BLOB_MAX;
+    err = nvs_get_blob(handle, "scenes", table, &table_len);
+    nvs_close(handle);
+    if (err == ESP_OK) {
+        err = scenes->load(table, table_len, num_switches);
+        if (err != ESP_OK) {
+            ESP_LOGW(TAG, "Stored scenes do not match this device, ignoring them");
+        }
+    }
+    delete[] table;
+    return err;
+}
+
 esp_err_t SwitchStorage::clear() {
     nvs_handle_t handle;
     esp_err_t err;
@@ -179,4 +417,129 @@ esp_err_t SwitchStorage::clear() {
     
     nvs_close(handle);
     return err;
-}
\ No newline at end of file
+}
+
+esp_err_t SwitchStorage::startFlushTask(AlpacaSwitch* device) {
+    int32_t count = 0;
+    device->get_maxswitch(&count);
+    
+    _device = device;
+    _count = count;
+    _states = new bool[count];
+    _values = new double[count];
+    _counters = new relay_counter_t[count];
+    _saved_counters = new relay_counter_t[count];
+    _worn = new bool[count]();
+    _flushLock = xSemaphoreCreateMutex();
+    if (_flushLock == NULL) {
+        return ESP_ERR_NO_MEM;
+    }
+    
+    // The device counts from zero at every boot
+    if (loadCounters(_saved_counters, count) == ESP_OK) {
+        device->addRelayCounters(_saved_counters, count);
+    }
+    _counters_saved_at = xTaskGetTickCount();
+    flushCounters(false);
+    
+    if (xTaskCreatePinnedToCore(flushTask, "storage_flush", 3072, NULL, STORAGE_FLUSH_TASK_PRIORITY,
+                                &_flushTask, STORAGE_FLUSH_TASK_CORE) != pdPASS) {
+        ESP_LOGE(TAG, "Failed to create flush task");
+        return ESP_ERR_NO_MEM;
+    }
+    
+    return device->addChangeListener(onSwitchChange, NULL);
+}
+
+esp_err_t SwitchStorage::flush() {
+    if (_device == NULL) {
+        return ESP_ERR_INVALID_STATE;
+    }
+    
+    xSemaphoreTake(_flushLock, portMAX_DELAY);
+    esp_err_t err = ESP_OK;
+    if (_dirty) {
+        // Clear first, so a change made during the write is not lost
+        _dirty = false;
+        for (int i = 0; i < _count; i++) {
+            _device->get_getswitch(i, &_states[i]);
+            _device->get_getswitchvalue(i, &_values[i]);
+        }
+        err = saveAllStates(_states, _values, _count);
+        if (err != ESP_OK) {
+            _dirty = true;
+        }
+    }
+    xSemaphoreGive(_flushLock);
+    return err;
+}
+
+esp_err_t SwitchStorage::flushCounters(bool force) {
+    if (_device == NULL) {
+        return ESP_ERR_INVALID_STATE;
+    }
+    
+    xSemaphoreTake(_flushLock, portMAX_DELAY);
+    bool changed = false;
+    bool due = force || xTaskGetTickCount() - _counters_saved_at >= pdMS_TO_TICKS(RELAY_COUNTER_FLUSH_INTERVAL_S * 1000ULL);
+    for (int i = 0; i < _count; i++) {
+        if (_device->getRelayCounter(i, &_counters[i]) != ESP_OK) {
+            _counters[i] = _saved_counters[i];
+            continue;
+        }
+        if (_counters[i].cycles != _saved_counters[i].cycles || _counters[i].on_seconds != _saved_counters[i].on_seconds) {
+            changed = true;
+        }
+        if (_counters[i].cycles - _saved_counters[i].cycles >= RELAY_COUNTER_FLUSH_CYCLES) {
+            due = true;
+        }
+        
+        if (!_worn[i] && _counters[i].cycles >= (uint64_t)RELAY_RATED_CYCLES * RELAY_WEAR_WARN_PERCENT / 100) {
+            _worn[i] = true;
+            ESP_LOGW(TAG, "Relay on switch %d has made %lu of its %lu rated cycles, plan to replace it", i,
+                     (unsigned long)_counters[i].cycles, (unsigned long)RELAY_RATED_CYCLES);
+        }
+    }
+    
+    esp_err_t err = ESP_OK;
+    if (changed && due) {
+        err = saveCounters(_counters, _count);
+        if (err == ESP_OK) {
+            memcpy(_saved_counters, _counters, _count * sizeof(relay_counter_t));
+            _counters_saved_at = xTaskGetTickCount();
+        }
+    }
+    xSemaphoreGive(_flushLock);
+    return err;
+}
+
+void SwitchStorage::onSwitchChange(void* ctx, const switch_change_t* changes, int count) {
+    // Switches under a control loop change all the time and are recomputed
+    // after a restart anyway, so they do not cost a flash write on their own
+    bool persist = false;
+    for (int i = 0; i < count; i++) {
+        if (!_device->isAutomatic(changes[i].id)) {
+            persist = true;
+        }
+    }
+    if (!persist) {
+        return;
+    }
+
+    // Called on the switch path: only flag the change and wake the task
+    _dirty = true;
+    xTaskNotifyGive(_flushTask);
+}
+
+void SwitchStorage::flushTask(void* pvParameter) {
+    while (true) {
+        // Wake for a change, or now and then to save relay on-time
+        if (ulTaskNotifyTake(pdTRUE, pdMS_TO_TICKS(RELAY_COUNTER_FLUSH_INTERVAL_S * 1000ULL)) > 0) {
+            // Let further changes pile up, then write them all at once
+            vTaskDelay(pdMS_TO_TICKS(STORAGE_FLUSH_DELAY_MS));
+            ulTaskNotifyTake(pdTRUE, 0);
+            flush();
+        }
+        flushCounters(false);
+    }
+}
@@ -3,6 +3,12 @@
 #include <esp_err.h>
 #include <stdint.h>
 #include <stdbool.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
+#include <freertos/semphr.h>
+#include "alpaca_switch.h"
+#include "switch_rules.h"
+#include "switch_scenes.h"
 
 // Structure for storing switch configuration
 typedef struct {
@@ -38,6 +44,66 @@ public:
     // Clear all storage
     static esp_err_t clear();
     
+    // Save rule text together with its compiled table
+    static esp_err_t saveRules(const char* text, const SwitchRules* rules);
+    
+    // Load the compiled rule table for a device with num_switches
+    static esp_err_t loadRules(SwitchRules* rules, int num_switches);
+    
+    // Load the rule text as it was saved
+    static esp_err_t loadRulesText(char* text, size_t len);
+    
+    // Save the scene table
+    static esp_err_t saveScenes(const SwitchScenes* scenes);
+    
+    // Load the scene table for a device with num_switches
+    static esp_err_t loadScenes(SwitchScenes* scenes, int num_switches);
+    
+    // Save relay wear counters, one per switch
+    static esp_err_t saveCounters(const relay_counter_t* counters, int count);
+    
+    // Load relay wear counters; switches the saved counters do not cover
+    // start from zero
+    static esp_err_t loadCounters(relay_counter_t* counters, int count);
+    
+    // Save the pins switch id drives besides its own; a gang with count 0
+    // removes them
+    static esp_err_t saveGang(int id, const switch_gang_t* gang);
+    
+    // Load the gang of switch id; ESP_ERR_NVS_NOT_FOUND if none was saved
+    static esp_err_t loadGang(int id, switch_gang_t* gang);
+    
+    // Start persisting the device's switch states in the background.
+    // Changes are coalesced: one write follows STORAGE_FLUSH_DELAY_MS
+    // after the first unsaved change, however many changes come after it.
+    // Relay counters saved by earlier boots are added to the device's, and
+    // written back as flushCounters() describes.
+    static esp_err_t startFlushTask(AlpacaSwitch* device);
+    
+    // Write unsaved switch states now
+    static esp_err_t flush();
+    
+    // Write the relay counters if a relay has RELAY_COUNTER_FLUSH_CYCLES
+    // unsaved cycles, or if they changed and the last write was
+    // RELAY_COUNTER_FLUSH_INTERVAL_S ago; with force, whenever they
+    // changed. Counting every toggle in flash would wear it out faster
+    // than the relays.
+    static esp_err_t flushCounters(bool force);
+    
 private:
     static const char* NVS_NAMESPACE;
+    static AlpacaSwitch* _device;
+    static TaskHandle_t _flushTask;
+    static SemaphoreHandle_t _flushLock;
+    static volatile bool _dirty;
+    static int _count;
+    static bool* _states;
+    static double* _values;
+    static relay_counter_t* _counters;
+    static relay_counter_t* _saved_counters;
+    static TickType_t _counters_saved_at;
+    static bool* _worn;
+    
+    static void flushTask(void* pvParameter);
+    static void onSwitchChange(void* ctx, const switch_change_t* changes, int count);
 };
\ No newline at end of file
@@ -0,0 +1,323 @@
+#include "udp_control.h"
+#include "event_journal.h"
+#include "config.h"
+#include <esp_log.h>
+#include <esp_random.h>
+#include <nvs.h>
+#include <mbedtls/md.h>
+#include <lwip/sockets.h>
+#include <errno.h>
+#include <math.h>
+#include <string.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/semphr.h>
+#include <freertos/task.h>
+
+static const char* TAG = "udp_control";
+const char* UdpControl::NVS_NAMESPACE = "udpctl";
+
+// Datagram layout, all fields big-endian. Request:
+//   0  magic "AS"      2  version       3  op
+//   4  client id       5  switch id     6  reserved (2)
+//   8  boot id (4)    12  sequence (8) 20  value, IEEE 754 double (8)
+//  28  HMAC-SHA256 of bytes 0-27, first 16 bytes
+// Reply:
+//   0  magic "AS"      2  version       3  op | 0x80
+//   4  client id       5  entry count   6  status (2)
+//   8  boot id (4)    12  sequence (8), echoed
+//  20  entries: switch id (1), state (1), value (8)
+//      then HMAC-SHA256 of everything before it, first 16 bytes
+// A snapshot lists up to UDP_MAX_ENTRIES switches from the requested
+// switch id on, with status UDP_STATUS_PARTIAL when more follow; the
+// client asks again from the switch after the last entry.
+#define UDP_MAGIC_0 'A'
+#define UDP_MAGIC_1 'S'
+#define UDP_VERSION 1
+#define UDP_HEADER_SIZE 20
+#define UDP_TAG_SIZE 16
+#define UDP_REQUEST_SIZE (UDP_HEADER_SIZE + 8 + UDP_TAG_SIZE)
+#define UDP_ENTRY_SIZE 10
+#define UDP_MAX_ENTRIES 32
+#define UDP_MAX_REPLY_SIZE (UDP_HEADER_SIZE + UDP_MAX_ENTRIES * UDP_ENTRY_SIZE + UDP_TAG_SIZE)
+
+// Operations
+#define UDP_OP_GET 1
+#define UDP_OP_SET_STATE 2
+#define UDP_OP_SET_VALUE 3
+#define UDP_OP_SNAPSHOT 4
+
+// Reply statuses outside the Alpaca error range
+#define UDP_STATUS_STALE_BOOT 0xFF01     // Retry with the boot id in the reply
+#define UDP_STATUS_REPLAYED 0xFF02       // Sequence not above the last accepted one
+#define UDP_STATUS_BAD_REQUEST 0xFF03    // Unknown op or client id out of range
+#define UDP_STATUS_PARTIAL 0xFF04        // Snapshot continues after the last entry
+
+// Switch ids are one byte on the wire
+#define UDP_MAX_SWITCHES 256
+
+static AlpacaSwitch* s_device = NULL;
+static int32_t s_num_switches = 0;
+static uint32_t s_boot_id = 0;
+static uint64_t s_last_sequence[UDP_CONTROL_MAX_CLIENTS];
+
+// The key is written from the HTTP server and read by the responder
+static SemaphoreHandle_t s_key_lock = NULL;
+static uint8_t s_key[UDP_CONTROL_KEY_SIZE];
+static bool s_key_set = false;
+
+static uint32_t get_u32(const uint8_t* p) {
+    return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 8) | p[3];
+}
+
+static uint64_t get_u64(const uint8_t* p) {
+    return ((uint64_t)get_u32(p) << 32) | get_u32(p + 4);
+}
+
+static void put_u32(uint8_t* p, uint32_t value) {
+    p[0] = value >> 24;
+    p[1] = value >> 16;
+    p[2] = value >> 8;
+    p[3] = value;
+}
+
+static void put_u64(uint8_t* p, uint64_t value) {
+    put_u32(p, value >> 32);
+    put_u32(p + 4, (uint32_t)value);
+}
+
+static double get_double(const uint8_t* p) {
+    uint64_t bits = get_u64(p);
+    double value;
+    memcpy(&value, &bits, sizeof(value));
+    return value;
+}
+
+static void put_double(uint8_t* p, double value) {
+    uint64_t bits;
+    memcpy(&bits, &value, sizeof(bits));
+    put_u64(p, bits);
+}
+
+// Truncated HMAC-SHA256 over data under the current key
+static void compute_tag(const uint8_t* data, size_t len, uint8_t* tag) {
+    uint8_t digest[32];
+    xSemaphoreTake(s_key_lock, portMAX_DELAY);
+    mbedtls_md_hmac(mbedtls_md_info_from_type(MBEDTLS_MD_SHA256), s_key, sizeof(s_key), data, len, digest);
+    xSemaphoreGive(s_key_lock);
+    memcpy(tag, digest, UDP_TAG_SIZE);
+}
+
+// Compare without an early exit, so timing reveals nothing about the tag
+static bool tag_matches(const uint8_t* a, const uint8_t* b) {
+    uint8_t diff = 0;
+    for (int i = 0; i < UDP_TAG_SIZE; i++) {
+        diff |= a[i] ^ b[i];
+    }
+    return diff == 0;
+}
+
+// Append one switch to the reply; returns the bytes written
+static int put_entry(uint8_t* p, int32_t id) {
+    bool state = false;
+    double value = 0;
+    s_device->get_getswitch(id, &state);
+    s_device->get_getswitchvalue(id, &value);
+    p[0] = (uint8_t)id;
+    p[1] = state ? 1 : 0;
+    put_double(p + 2, value);
+    return UDP_ENTRY_SIZE;
+}
+
+esp_err_t UdpControl::start(AlpacaSwitch* device) {
+    s_device = device;
+    device->get_maxswitch(&s_num_switches);
+    if (s_num_switches > UDP_MAX_SWITCHES) {
+        ESP_LOGW(TAG, "Only the first %d of %ld switches can be addressed", UDP_MAX_SWITCHES,
+                 (long)s_num_switches);
+        s_num_switches = UDP_MAX_SWITCHES;
+    }
+    if (s_num_switches > UDP_MAX_ENTRIES) {
+        ESP_LOGI(TAG, "Snapshots of %ld switches are sent %d switches per reply", (long)s_num_switches,
+                 UDP_MAX_ENTRIES);
+    }
+    s_boot_id = esp_random();
+
+    s_key_lock = xSemaphoreCreateMutex();
+    if (s_key_lock == NULL) {
+        return ESP_ERR_NO_MEM;
+    }
+
+    nvs_handle_t handle;
+    if (nvs_open(NVS_NAMESPACE, NVS_READONLY, &handle) == ESP_OK) {
+        size_t size = sizeof(s_key);
+        s_key_set = nvs_get_blob(handle, "key", s_key, &size) == ESP_OK && size == sizeof(s_key);
+        nvs_close(handle);
+    }
+    if (!s_key_set) {
+        ESP_LOGI(TAG, "No key stored, UDP control disabled");
+    }
+
+    if (xTaskCreatePinnedToCore(responderTask, "udp_control", 4096, NULL, UDP_CONTROL_TASK_PRIORITY,
+                                NULL, UDP_CONTROL_TASK_CORE) != pdPASS) {
+        ESP_LOGE(TAG, "Failed to create responder task");
+        return ESP_ERR_NO_MEM;
+    }
+    return ESP_OK;
+}
+
+esp_err_t UdpControl::setKey(const uint8_t* key) {
+    nvs_handle_t handle;
+    esp_err_t err = nvs_open(NVS_NAMESPACE, NVS_READWRITE, &handle);
+    if (err != ESP_OK) {
+        return err;
+    }
+
+    if (key != NULL) {
+        err = nvs_set_blob(handle, "key", key, UDP_CONTROL_KEY_SIZE);
+    } else {
+        err = nvs_erase_key(handle, "key");
+        if (err == ESP_ERR_NVS_NOT_FOUND) {
+            err = ESP_OK;
+        }
+    }
+    if (err == ESP_OK) {
+        err = nvs_commit(handle);
+    }
+    nvs_close(handle);
+    if (err != ESP_OK) {
+        return err;
+    }
+
+    xSemaphoreTake(s_key_lock, portMAX_DELAY);
+    if (key != NULL) {
+        memcpy(s_key, key, sizeof(s_key));
+    } else {
+        memset(s_key, 0, sizeof(s_key));
+    }
+    s_key_set = key != NULL;
+    // Sequences were accepted under the old key
+    memset(s_last_sequence, 0, sizeof(s_last_sequence));
+    xSemaphoreGive(s_key_lock);
+
+    ESP_LOGI(TAG, "UDP control %s", key != NULL ? "key updated" : "disabled");
+    return ESP_OK;
+}
+
+int UdpControl::handleRequest(const uint8_t* request, uint8_t* reply) {
+    uint8_t op = request[3];
+    uint8_t client = request[4];
+    int32_t id = request[5];
+    uint32_t boot_id = get_u32(request + 8);
+    uint64_t sequence = get_u64(request + 12);
+
+    memcpy(reply, request, UDP_HEADER_SIZE);
+    reply[3] = op | 0x80;
+    reply[5] = 0;
+    put_u32(reply + 8, s_boot_id);
+    int len = UDP_HEADER_SIZE;
+
+    uint16_t status = ALPACA_OK;
+    if (client >= UDP_CONTROL_MAX_CLIENTS) {
+        status = UDP_STATUS_BAD_REQUEST;
+    } else if (boot_id != s_boot_id) {
+        status = UDP_STATUS_STALE_BOOT;
+    } else if (sequence <= s_last_sequence[client]) {
+        status = UDP_STATUS_REPLAYED;
+    } else {
+        s_last_sequence[client] = sequence;
+        esp_err_t err = ALPACA_OK;
+        double value;
+        switch (op) {
+            case UDP_OP_GET:
+                err = (id < s_num_switches) ? ALPACA_OK : ALPACA_ERR_INVALID_VALUE;
+                break;
+            case UDP_OP_SET_STATE:
+                // NaN is not zero, but is no state either
+                value = get_double(request + 20);
+                err = isfinite(value) ? s_device->put_setswitch(id, value != 0) : ALPACA_ERR_INVALID_VALUE;
+                break;
+            case UDP_OP_SET_VALUE:
+                err = s_device->put_setswitchvalue(id, get_double(request + 20));
+                break;
+            case UDP_OP_SNAPSHOT:
+                // From switch id on; each reply is consistent in itself
+                if (id > 0 && id >= s_num_switches) {
+                    err = ALPACA_ERR_INVALID_VALUE;
+                    break;
+                }
+                s_device->beginBatch();
+                for (int32_t i = id; i < s_num_switches && reply[5] < UDP_MAX_ENTRIES; i++) {
+                    len += put_entry(reply + len, i);
+                    reply[5]++;
+                }
+                s_device->endBatch();
+                if (id + reply[5] < s_num_switches) {
+                    status = UDP_STATUS_PARTIAL;
+                }
+                break;
+            default:
+                status = UDP_STATUS_BAD_REQUEST;
+                break;
+        }
+        if (err != ALPACA_OK) {
+            status = (uint16_t)err;
+        } else if (status == ALPACA_OK && op != UDP_OP_SNAPSHOT) {
+            // Every other op answers with the switch as it now is
+            len += put_entry(reply + len, id);
+            reply[5] = 1;
+        }
+    }
+
+    reply[6] = status >> 8;
+    reply[7] = status & 0xFF;
+    compute_tag(reply, len, reply + len);
+    return len + UDP_TAG_SIZE;
+}
+
+void UdpControl::responderTask(void* pvParameter) {
+    int sock = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+    if (sock < 0) {
+        ESP_LOGE(TAG, "Failed to create socket: errno %d", errno);
+        vTaskDelete(NULL);
+        return;
+    }
+
+    struct sockaddr_in addr = {};
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(UDP_CONTROL_PORT);
+    addr.sin_addr.s_addr = htonl(INADDR_ANY);
+    if (bind(sock, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
+        ESP_LOGE(TAG, "Failed to bind port %d: errno %d", UDP_CONTROL_PORT, errno);
+        close(sock);
+        vTaskDelete(NULL);
+        return;
+    }
+
+    ESP_LOGI(TAG, "UDP control on port %d", UDP_CONTROL_PORT);
+
+    uint8_t request[UDP_REQUEST_SIZE + 1];
+    uint8_t reply[UDP_MAX_REPLY_SIZE];
+    while (true) {
+        struct sockaddr_in source;
+        socklen_t source_len = sizeof(source);
+        int len = recvfrom(sock, request, sizeof(request), 0, (struct sockaddr*)&source, &source_len);
+        if (len != UDP_REQUEST_SIZE || !s_key_set || request[0] != UDP_MAGIC_0 ||
+            request[1] != UDP_MAGIC_1 || request[2] != UDP_VERSION) {
+            continue;
+        }
+
+        // Unauthenticated datagrams get no reply at all
+        uint8_t tag[UDP_TAG_SIZE];
+        compute_tag(request, UDP_REQUEST_SIZE - UDP_TAG_SIZE, tag);
+        if (!tag_matches(tag, request + UDP_REQUEST_SIZE - UDP_TAG_SIZE)) {
+            ESP_LOGD(TAG, "Dropping datagram with a bad tag");
+            EventJournal::record(JOURNAL_AUTH_FAILURE, JOURNAL_AUTH_UDP, source.sin_addr.s_addr);
+            continue;
+        }
+
+        int reply_len = handleRequest(request, reply);
+        if (sendto(sock, reply, reply_len, 0, (struct sockaddr*)&source, source_len) < 0) {
+            ESP_LOGW(TAG, "Failed to send reply: errno %d", errno);
+        }
+    }
+}
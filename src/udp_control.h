@@ -0,0 +1,42 @@
+#ifndef UDP_CONTROL_H
+#define UDP_CONTROL_H
+
+#include <esp_err.h>
+#include <stddef.h>
+#include <stdint.h>
+#include "alpaca_switch.h"
+
+// Length of the shared HMAC-SHA256 key
+#define UDP_CONTROL_KEY_SIZE 32
+
+// Authenticated binary UDP protocol for low-latency local switching.
+//
+// Each request is one fixed 44-byte datagram tagged with HMAC-SHA256
+// under a shared key; datagrams with a bad tag are dropped without a
+// reply. Replays are rejected by a per-client sequence number that must
+// increase, together with a random boot id so datagrams captured before
+// a restart are not accepted after it. Requests go through the
+// AlpacaSwitch setters, so validation matches the Alpaca API and the
+// reply carries the Alpaca error number. See tools/udp_control.py for
+// the layout and a client.
+//
+// The protocol is off until a key is stored (see setKey).
+class UdpControl {
+public:
+    // Start the responder on UDP_CONTROL_PORT
+    static esp_err_t start(AlpacaSwitch* device);
+
+    // Store a new key, used at once. A NULL key disables the protocol.
+    static esp_err_t setKey(const uint8_t* key);
+
+private:
+    static const char* NVS_NAMESPACE;
+
+    static void responderTask(void* pvParameter);
+
+    // Handle one authenticated request; returns the reply length, or 0
+    // for no reply
+    static int handleRequest(const uint8_t* request, uint8_t* reply);
+};
+
+#endif // UDP_CONTROL_H
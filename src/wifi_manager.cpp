@@ -1,5 +1,6 @@
 // wifi_manager.cpp
 #include "wifi_manager.h"
+#include "event_journal.h"
 #include <string.h>
 #include <esp_log.h>
 #include <esp_wifi.h>
@@ -20,14 +21,18 @@ static void wifi_event_handler(void* arg, esp_event_base_t event_base,
         switch (event_id) {
             case WIFI_EVENT_STA_START:
                 ESP_LOGI(TAG, "WiFi station started");
+                EventJournal::record(JOURNAL_WIFI, JOURNAL_WIFI_STARTED, 0);
                 break;
                 
             case WIFI_EVENT_STA_CONNECTED:
                 ESP_LOGI(TAG, "Connected to access point");
+                EventJournal::record(JOURNAL_WIFI, JOURNAL_WIFI_CONNECTED, 0);
                 break;
                 
             case WIFI_EVENT_STA_DISCONNECTED:
                 ESP_LOGW(TAG, "Disconnected from access point");
+                EventJournal::record(JOURNAL_WIFI, JOURNAL_WIFI_DISCONNECTED,
+                                     ((wifi_event_sta_disconnected_t*)event_data)->reason);
                 
                 // Clear connected bit, set disconnected bit
                 xEventGroupClearBits(eventGroup, WIFI_CONNECTED_BIT);
@@ -41,16 +46,20 @@ static void wifi_event_handler(void* arg, esp_event_base_t event_base,
         if (event_id == IP_EVENT_STA_GOT_IP) {
             ip_event_got_ip_t* event = (ip_event_got_ip_t*)event_data;
             ESP_LOGI(TAG, "Got IP address: " IPSTR, IP2STR(&event->ip_info.ip));
+            EventJournal::record(JOURNAL_WIFI, JOURNAL_WIFI_GOT_IP, event->ip_info.ip.addr);
             
             // Set connected bit, clear disconnected bit
             xEventGroupSetBits(eventGroup, WIFI_CONNECTED_BIT);
             xEventGroupClearBits(eventGroup, WIFI_DISCONNECTED_BIT);
+            
+            manager->notifyIpChanged(&event->ip_info);
         }
     }
 }
 
 WiFiManager::WiFiManager()
-    : _taskHandle(NULL), _initialized(false), _netif(NULL)
+    : _taskHandle(NULL), _initialized(false), _netif(NULL),
+      _ipCallback(NULL), _ipCallbackCtx(NULL)
 {
     _eventGroup = xEventGroupCreate();
     xEventGroupSetBits(_eventGroup, WIFI_DISCONNECTED_BIT);
@@ -160,6 +169,19 @@ esp_err_t WiFiManager::setStaticIP(const esp_netif_ip_info_t& ip_info, esp_netif
     return ESP_OK;
 }
 
+void WiFiManager::setIpCallback(wifi_ip_callback_t callback, void* ctx)
+{
+    _ipCallbackCtx = ctx;
+    _ipCallback = callback;
+}
+
+void WiFiManager::notifyIpChanged(const esp_netif_ip_info_t* ip_info)
+{
+    if (_ipCallback != NULL) {
+        _ipCallback(_ipCallbackCtx, ip_info);
+    }
+}
+
 esp_err_t WiFiManager::disconnect()
 {
     return esp_wifi_disconnect();
@@ -11,6 +11,9 @@
 #define WIFI_DISCONNECTED_BIT BIT1
 #define WIFI_SCANNING_BIT BIT2
 
+// Called when the station gets an address, with the new address
+typedef void (*wifi_ip_callback_t)(void* ctx, const esp_netif_ip_info_t* ip_info);
+
 class WiFiManager {
 public:
     // Singleton instance getter
@@ -40,6 +43,16 @@ public:
     // Set static IP configuration
     esp_err_t setStaticIP(const esp_netif_ip_info_t& ip_info, esp_netif_dns_info_t& dns_info);
 
+    // Get the station network interface
+    esp_netif_t* getNetif() { return _netif; }
+
+    // Set the function called each time an address is obtained; it runs
+    // on the default event loop task and must not block
+    void setIpCallback(wifi_ip_callback_t callback, void* ctx);
+
+    // Called from the IP event handler
+    void notifyIpChanged(const esp_netif_ip_info_t* ip_info);
+
 private:
     // Private constructor for singleton
     WiFiManager();
@@ -69,4 +82,8 @@ private:
 
     // Network interface handle
     esp_netif_t* _netif;
+
+    // Address change callback
+    wifi_ip_callback_t _ipCallback;
+    void* _ipCallbackCtx;
 };
\ No newline at end of file
@@ -0,0 +1,302 @@
+// Replay a current sense capture through the device's filters on the
+// host, to check readings and fault detection against recorded loads and
+// measure the cost of the pipeline per sample.
+//
+// Build and run from the repository root:
+//
+//     g++ -O2 -Iinclude -Isrc -o current_replay tools/current_replay.cpp src/current_filter.cpp
+//     curl -u admin:admin -o load.bin http://[ESP32-IP-ADDRESS]/ui/api/current/capture
+//     ./current_replay load.bin                  # readings every publish interval
+//     ./current_replay load.bin --off            # judged as if the relays were off
+//     ./current_replay --synth test.bin          # write a synthetic capture
+//     ./current_replay                           # check the synthetic capture
+//
+// The synthetic capture lasts four seconds. Channel 0 is a 1 A DC load
+// whose wire breaks after two seconds; channel 1 is a 1.5 A RMS, 50 Hz
+// AC load on a noisy offset. Run without arguments, the tool replays it
+// with the relays on and checks that channel 0 reads about 1 A before the
+// break and raises an open load fault once the break has lasted
+// CURRENT_SENSE_FAULT_MS, and that channel 1 reads about 1.5 A with no
+// fault. Exits non-zero on the first failure.
+
+#include "config.h"
+#include "current_filter.h"
+#include <chrono>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <vector>
+
+#define SYNTH_SECONDS 4.0
+#define SYNTH_BREAK_MS 2000
+#define SYNTH_VOLTS_PER_CODE (3.1f / 4095)
+
+// Readings of the synthetic loads must be this close to their currents
+#define CHECK_TOLERANCE 0.05
+
+// Readings and fault flags of every channel at one publish
+typedef struct {
+    uint32_t now_ms;
+    current_reading_t reading[CURRENT_MAX_CHANNELS];
+    uint8_t faults[CURRENT_MAX_CHANNELS];
+} publish_t;
+
+// Deterministic noise in [-1, 1]
+static float noise(uint32_t* seed) {
+    *seed = *seed * 1664525u + 1013904223u;
+    return (float)(*seed >> 8) / (float)(1u << 23) - 1.0f;
+}
+
+static int fail(const char* what) {
+    printf("FAIL: %s\n", what);
+    return 1;
+}
+
+// A capture as the device would record it: the header, then the DMA words
+static void synthesize(std::vector<uint8_t>* capture) {
+    current_capture_header_t header = {};
+    header.magic = CURRENT_CAPTURE_MAGIC;
+    header.sample_rate_hz = CURRENT_SENSE_SAMPLE_RATE_HZ;
+    header.channels = 2;
+    for (int i = 0; i < 2; i++) {
+        header.channel[i].adc_channel = (uint8_t)(6 + i);
+        header.channel[i].ac = i == 1;
+        header.channel[i].volts_per_code = SYNTH_VOLTS_PER_CODE;
+        header.channel[i].volts_offset = 0.0f;
+        header.channel[i].amps_per_volt = 8.1f;
+        header.channel[i].zero_volts = 1.65f;
+    }
+
+    capture->assign((const uint8_t*)&header, (const uint8_t*)&header + sizeof(header));
+
+    // Conversions alternate between the channels, as the DMA pattern does
+    uint32_t seed = 1;
+    int conversions = (int)(SYNTH_SECONDS * CURRENT_SENSE_SAMPLE_RATE_HZ);
+    for (int n = 0; n < conversions; n++) {
+        int channel = n % 2;
+        double t = (double)n / CURRENT_SENSE_SAMPLE_RATE_HZ;
+        double amps;
+        if (channel == 0) {
+            amps = t * 1000 < SYNTH_BREAK_MS ? 1.0 : 0.0;
+        } else {
+            amps = 1.5 * sqrt(2.0) * sin(2.0 * M_PI * 50.0 * t);
+        }
+        double volts = 1.65 + amps / 8.1 + 0.004 * noise(&seed);
+        long code = lround(volts / SYNTH_VOLTS_PER_CODE);
+        code = code < 0 ? 0 : (code > 4095 ? 4095 : code);
+        uint16_t word = (uint16_t)((header.channel[channel].adc_channel << 12) | code);
+        capture->push_back((uint8_t)(word & 0xFF));
+        capture->push_back((uint8_t)(word >> 8));
+    }
+}
+
+static int write_synthetic(const char* path) {
+    std::vector<uint8_t> capture;
+    synthesize(&capture);
+    FILE* file = fopen(path, "wb");
+    if (file == NULL) {
+        perror(path);
+        return 1;
+    }
+    fwrite(capture.data(), 1, capture.size(), file);
+    fclose(file);
+    printf("Wrote %u conversions to %s\n",
+           (unsigned)((capture.size() - sizeof(current_capture_header_t)) / CURRENT_SAMPLE_BYTES), path);
+    return 0;
+}
+
+// Feed DMA data through the pipeline in DMA frame sized pieces, with a
+// reading at every publish interval of capture time, as the device's
+// sample task does
+static void replay(const current_capture_header_t& header, const std::vector<uint8_t>& data,
+                   CurrentPipeline* pipeline, bool switched_on, float min_amps, float max_amps,
+                   std::vector<publish_t>* publishes) {
+    CurrentFaultDetector detectors[CURRENT_MAX_CHANNELS];
+    for (uint32_t i = 0; i < header.channels; i++) {
+        detectors[i].configure(min_amps, max_amps);
+    }
+
+    const size_t frame_bytes = 256;
+    size_t publish_bytes = (size_t)header.sample_rate_hz * CURRENT_SAMPLE_BYTES * CURRENT_SENSE_PUBLISH_MS / 1000;
+    size_t next_publish = publish_bytes;
+    for (size_t offset = 0; offset < data.size(); offset += frame_bytes) {
+        size_t len = data.size() - offset < frame_bytes ? data.size() - offset : frame_bytes;
+        pipeline->ingest(&data[offset], len);
+        if (offset + len < next_publish && offset + len < data.size()) {
+            continue;
+        }
+        next_publish += publish_bytes;
+
+        publish_t publish = {};
+        publish.now_ms = (uint32_t)((offset + len) / CURRENT_SAMPLE_BYTES * 1000ull / header.sample_rate_hz);
+        for (uint32_t i = 0; i < header.channels; i++) {
+            pipeline->reading((int)i, &publish.reading[i]);
+            publish.faults[i] = detectors[i].update(publish.now_ms, switched_on, publish.reading[i]);
+        }
+        publishes->push_back(publish);
+    }
+}
+
+// Replay the synthetic capture with the relays on and judge the readings
+static int check_synthetic() {
+    std::vector<uint8_t> capture;
+    synthesize(&capture);
+    current_capture_header_t header;
+    memcpy(&header, capture.data(), sizeof(header));
+    std::vector<uint8_t> data(capture.begin() + sizeof(header), capture.end());
+
+    CurrentPipeline pipeline;
+    if (!pipeline.configure(header.channel, (int)header.channels)) {
+        return fail("the synthetic channel table was refused");
+    }
+    std::vector<publish_t> publishes;
+    replay(header, data, &pipeline, true, CURRENT_SENSE_MIN_AMPS[0], CURRENT_SENSE_MAX_AMPS[0], &publishes);
+
+    int dc_readings = 0;
+    int ac_readings = 0;
+    uint32_t raised_ms = 0;
+    for (size_t i = 0; i < publishes.size(); i++) {
+        const publish_t& publish = publishes[i];
+        if (publish.reading[0].valid && publish.now_ms <= SYNTH_BREAK_MS) {
+            if (fabs(publish.reading[0].rms - 1.0) > CHECK_TOLERANCE) {
+                printf("FAIL: channel 0 reads %.3f A at %u ms, before the break\n", publish.reading[0].rms,
+                       (unsigned)publish.now_ms);
+                return 1;
+            }
+            dc_readings++;
+        }
+        if ((publish.faults[0] & CURRENT_FAULT_OPEN_LOAD) != 0 && raised_ms == 0) {
+            raised_ms = publish.now_ms;
+        }
+        if ((publish.faults[0] & ~CURRENT_FAULT_OPEN_LOAD) != 0) {
+            printf("FAIL: channel 0 reports faults 0x%02x at %u ms\n", (unsigned)publish.faults[0],
+                   (unsigned)publish.now_ms);
+            return 1;
+        }
+        if (publish.reading[1].valid) {
+            if (fabs(publish.reading[1].rms - 1.5) > 1.5 * CHECK_TOLERANCE) {
+                printf("FAIL: channel 1 reads %.3f A at %u ms\n", publish.reading[1].rms,
+                       (unsigned)publish.now_ms);
+                return 1;
+            }
+            ac_readings++;
+        }
+        if (publish.faults[1] != 0) {
+            printf("FAIL: channel 1 reports faults 0x%02x at %u ms\n", (unsigned)publish.faults[1],
+                   (unsigned)publish.now_ms);
+            return 1;
+        }
+    }
+    if (dc_readings == 0 || ac_readings == 0) {
+        return fail("no full window was read");
+    }
+    if (raised_ms == 0) {
+        return fail("channel 0 never raised the open load fault");
+    }
+    if (raised_ms < SYNTH_BREAK_MS + CURRENT_SENSE_FAULT_MS) {
+        printf("FAIL: channel 0 raised the open load fault at %u ms, before the break had lasted %d ms\n",
+               (unsigned)raised_ms, CURRENT_SENSE_FAULT_MS);
+        return 1;
+    }
+    if ((publishes.back().faults[0] & CURRENT_FAULT_OPEN_LOAD) == 0) {
+        return fail("channel 0 cleared the open load fault while the wire was still broken");
+    }
+    printf("Synthetic: channel 0 at 1 A in %d readings, open load raised at %u ms after a break at %d ms; "
+           "channel 1 at 1.5 A in %d readings with no fault\n", dc_readings, (unsigned)raised_ms, SYNTH_BREAK_MS,
+           ac_readings);
+    return 0;
+}
+
+int main(int argc, char** argv) {
+    const char* path = NULL;
+    bool switched_on = true;
+    float min_amps = CURRENT_SENSE_MIN_AMPS[0];
+    float max_amps = CURRENT_SENSE_MAX_AMPS[0];
+
+    for (int i = 1; i < argc; i++) {
+        const char* arg = argv[i];
+        const char* value = i + 1 < argc ? argv[i + 1] : NULL;
+        if (strcmp(arg, "--synth") == 0 && value != NULL) {
+            return write_synthetic(value);
+        } else if (strcmp(arg, "--off") == 0) {
+            switched_on = false;
+        } else if (strcmp(arg, "--min") == 0 && value != NULL) {
+            min_amps = atof(value);
+            i++;
+        } else if (strcmp(arg, "--max") == 0 && value != NULL) {
+            max_amps = atof(value);
+            i++;
+        } else if (arg[0] != '-' && path == NULL) {
+            path = arg;
+        } else {
+            fprintf(stderr, "usage: %s CAPTURE [--off] [--min A] [--max A]\n"
+                    "       %s --synth CAPTURE\n"
+                    "       %s\n", argv[0], argv[0], argv[0]);
+            return 2;
+        }
+    }
+    if (path == NULL) {
+        return check_synthetic();
+    }
+
+    FILE* file = fopen(path, "rb");
+    if (file == NULL) {
+        perror(path);
+        return 1;
+    }
+    current_capture_header_t header;
+    if (fread(&header, sizeof(header), 1, file) != 1 || header.magic != CURRENT_CAPTURE_MAGIC ||
+        header.channels == 0 || header.channels > CURRENT_MAX_CHANNELS || header.sample_rate_hz == 0) {
+        fprintf(stderr, "%s: not a current capture\n", path);
+        fclose(file);
+        return 1;
+    }
+    std::vector<uint8_t> data;
+    uint8_t chunk[4096];
+    size_t got;
+    while ((got = fread(chunk, 1, sizeof(chunk), file)) > 0) {
+        data.insert(data.end(), chunk, chunk + got);
+    }
+    fclose(file);
+
+    CurrentPipeline pipeline;
+    if (!pipeline.configure(header.channel, (int)header.channels)) {
+        fprintf(stderr, "%s: bad channel table\n", path);
+        return 1;
+    }
+    std::vector<publish_t> publishes;
+    replay(header, data, &pipeline, switched_on, min_amps, max_amps, &publishes);
+
+    printf("%u channels, %u Hz, %.3f s, relays %s\n", (unsigned)header.channels, (unsigned)header.sample_rate_hz,
+           (double)data.size() / CURRENT_SAMPLE_BYTES / header.sample_rate_hz, switched_on ? "on" : "off");
+    printf("%8s", "time_s");
+    for (uint32_t i = 0; i < header.channels; i++) {
+        printf("   ch%u_rms  ch%u_peak ch%u_faults", (unsigned)i, (unsigned)i, (unsigned)i);
+    }
+    printf("\n");
+
+    for (size_t p = 0; p < publishes.size(); p++) {
+        printf("%8.3f", publishes[p].now_ms / 1000.0);
+        for (uint32_t i = 0; i < header.channels; i++) {
+            printf("  %8.3f  %8.3f  %9u", publishes[p].reading[i].rms, publishes[p].reading[i].peak,
+                   (unsigned)publishes[p].faults[i]);
+        }
+        printf("\n");
+    }
+
+    // Cost of ingestion alone, over the whole capture many times
+    const size_t frame_bytes = 256;
+    const int rounds = 200;
+    auto start = std::chrono::steady_clock::now();
+    for (int round = 0; round < rounds; round++) {
+        for (size_t offset = 0; offset < data.size(); offset += frame_bytes) {
+            size_t len = data.size() - offset < frame_bytes ? data.size() - offset : frame_bytes;
+            pipeline.ingest(&data[offset], len);
+        }
+    }
+    double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    double samples = (double)rounds * data.size() / CURRENT_SAMPLE_BYTES;
+    printf("Pipeline: %.2f ns per sample on this host\n", elapsed / samples * 1e9);
+    return 0;
+}
@@ -0,0 +1,135 @@
+// Run the dew heater loop against the thermal model on the host, to check
+// PID gains for stability and measure the cost of one control step.
+//
+// Build and run from the repository root:
+//
+//     g++ -O2 -Iinclude -Isrc -o dew_sim tools/dew_sim.cpp src/dew_model.cpp
+//     ./dew_sim                          # defaults from include/config.h
+//     ./dew_sim --kp 0.3 --ki 0.002      # try other gains
+//     ./dew_sim --csv > night.csv        # time series for plotting
+//
+// The sensors are modelled as the device sees them: the optic probe
+// lags the optic and is quantised to 1/16 °C like a DS18B20, and air
+// temperature and humidity carry a little noise like an SHT3x. Halfway
+// through the night a 30 minute gust doubles the heat lost to the air,
+// to show how the loop rejects a disturbance.
+
+#include "config.h"
+#include "dew_model.h"
+#include <chrono>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Deterministic noise in [-1, 1]
+static float noise(uint32_t* seed) {
+    *seed = *seed * 1664525u + 1013904223u;
+    return (float)(*seed >> 8) / (float)(1u << 23) - 1.0f;
+}
+
+int main(int argc, char** argv) {
+    dew_pid_config_t pid_config = { DEW_PID_KP, DEW_PID_KI, DEW_PID_KD, DEW_CONTROL_PERIOD_MS / 1000.0f,
+                                    DEW_DERIVATIVE_FILTER_S };
+    float margin = DEW_DEFAULT_MARGIN_C;
+    float hours = 8.0f;
+    bool csv = false;
+
+    for (int i = 1; i < argc; i++) {
+        const char* arg = argv[i];
+        const char* value = i + 1 < argc ? argv[i + 1] : "0";
+        if (strcmp(arg, "--csv") == 0) {
+            csv = true;
+            continue;
+        }
+        if (strcmp(arg, "--kp") == 0) {
+            pid_config.kp = atof(value);
+        } else if (strcmp(arg, "--ki") == 0) {
+            pid_config.ki = atof(value);
+        } else if (strcmp(arg, "--kd") == 0) {
+            pid_config.kd = atof(value);
+        } else if (strcmp(arg, "--period") == 0) {
+            pid_config.period_s = atof(value);
+        } else if (strcmp(arg, "--margin") == 0) {
+            margin = atof(value);
+        } else if (strcmp(arg, "--hours") == 0) {
+            hours = atof(value);
+        } else {
+            fprintf(stderr, "usage: %s [--kp K] [--ki K] [--kd K] [--period S] [--margin C] "
+                    "[--hours H] [--csv]\n", argv[0]);
+            return 2;
+        }
+        i++;
+    }
+
+    DewThermalModel model;
+    DewPid pid(pid_config);
+    uint32_t seed = 1;
+    int steps = (int)(hours * 3600.0f / pid_config.period_s);
+
+    float duty = 0.0f;
+    float last_duty = 0.0f;
+    float below_dew_s = 0.0f;
+    float settled_at = -1.0f;
+    float max_overshoot = 0.0f;
+    float max_undershoot = 0.0f;
+    double squared_error = 0.0;
+    int settled_steps = 0;
+    double duty_travel = 0.0;
+    double update_ns = 0.0;
+
+    if (csv) {
+        printf("seconds,ambient,humidity,dew_point,target,optic,duty\n");
+    }
+    for (int i = 0; i < steps; i++) {
+        bool gust = i >= steps / 2 && i < steps / 2 + (int)(1800.0f / pid_config.period_s);
+        model.setWind(gust ? 2.0f : 1.0f);
+        model.step(pid_config.period_s, duty);
+
+        float ambient = model.ambient() + 0.1f * noise(&seed);
+        float humidity = model.humidity() + 1.0f * noise(&seed);
+        float optic = roundf(model.probe() * 16.0f) / 16.0f;
+
+        auto start = std::chrono::steady_clock::now();
+        float dew = dew_point(ambient, humidity);
+        float target = dew + margin;
+        duty = pid.update(target, optic);
+        update_ns += std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count();
+
+        duty_travel += fabsf(duty - last_duty);
+        last_duty = duty;
+
+        // Judge against the true values, not the noisy readings
+        float true_target = dew_point(model.ambient(), model.humidity()) + margin;
+        if (model.optic() < true_target - margin) {
+            below_dew_s += pid_config.period_s;
+        }
+        if (settled_at < 0.0f && fabsf(model.optic() - true_target) < 0.25f) {
+            settled_at = model.elapsed();
+        }
+        if (settled_at >= 0.0f) {
+            float error = model.optic() - true_target;
+            max_overshoot = fmaxf(max_overshoot, error);
+            max_undershoot = fmaxf(max_undershoot, -error);
+            squared_error += error * error;
+            settled_steps++;
+        }
+
+        if (csv) {
+            printf("%.0f,%.2f,%.1f,%.2f,%.2f,%.3f,%.3f\n", model.elapsed(), ambient, humidity, dew, target,
+                   model.optic(), duty);
+        }
+    }
+
+    if (!csv) {
+        printf("gains        kp %.3f  ki %.4f  kd %.2f  period %.1f s  margin %.1f C\n", pid_config.kp,
+               pid_config.ki, pid_config.kd, pid_config.period_s, margin);
+        printf("in band      %s%.0f s after dusk\n", settled_at < 0 ? "never, " : "", settled_at);
+        printf("tracking     +%.2f / -%.2f C around the target from then, %.3f C RMS\n", max_overshoot,
+               max_undershoot, settled_steps > 0 ? sqrt(squared_error / settled_steps) : 0.0);
+        printf("dew          optic below the dew point for %.0f s\n", below_dew_s);
+        printf("duty travel  %.3f per step on average\n", duty_travel / steps);
+        printf("cost         %.0f ns per control step on this host\n", update_ns / steps);
+    }
+    return 0;
+}
@@ -0,0 +1,240 @@
+// Check the output expander backend on the host against the simulated
+// bus: that reads come from the shadow register without a transaction,
+// that writes between flushes reach the chips together, that the chips
+// end up driving exactly what was written, and that a failed or reset
+// chip catches up at the next flush. Also compares the bus traffic of a
+// flush per write with one per change.
+//
+// Build and run from the repository root:
+//
+//     g++ -O2 -Iinclude -Isrc -o expander_check tools/expander_check.cpp src/output_backend.cpp
+//     ./expander_check
+//
+// Exits non-zero on the first failure.
+
+#include "config.h"
+#include "output_backend.h"
+#include <stdio.h>
+
+#define RANDOM_ROUNDS 100000
+
+static uint32_t s_seed = 1;
+
+static uint32_t next_random() {
+    s_seed = s_seed * 1664525u + 1013904223u;
+    return s_seed >> 8;
+}
+
+// A sparse random mask, about one channel in eight
+static uint64_t random_mask() {
+    uint64_t masks[3];
+    for (int i = 0; i < 3; i++) {
+        masks[i] = (uint64_t)next_random() << 40 ^ (uint64_t)next_random() << 20 ^ next_random();
+    }
+    return masks[0] & masks[1] & masks[2];
+}
+
+static const char* type_name(expander_type_t type) {
+    return type == EXPANDER_MCP23017 ? "MCP23017" : "74HC595";
+}
+
+static int fail(expander_type_t type, const char* what) {
+    printf("FAIL (%s): %s\n", type_name(type), what);
+    return 1;
+}
+
+// Claim every channel, as a bank of one switch per channel does
+static void claim_all(ExpanderOutput* output) {
+    for (int i = 0; i < output->channels(); i++) {
+        output->claim(i);
+    }
+}
+
+static int check_shadow(expander_type_t type, int chips) {
+    SimulatedExpanderBus bus(type, chips);
+    ExpanderOutput output(&bus, type, chips);
+    claim_all(&output);
+    output.flush();
+
+    uint32_t before = bus.transactions();
+    uint64_t expected = 0;
+    for (int i = 0; i < 1000; i++) {
+        uint64_t mask = 1ULL << (next_random() % output.channels());
+        bool state = next_random() & 1;
+        output.write(mask, state);
+        expected = state ? expected | mask : expected & ~mask;
+        if (output.levels() != expected) {
+            return fail(type, "levels() does not hold the last write");
+        }
+    }
+    if (bus.transactions() != before) {
+        return fail(type, "a write or read touched the bus");
+    }
+    return 0;
+}
+
+static int check_coalescing(expander_type_t type, int chips) {
+    SimulatedExpanderBus bus(type, chips);
+    ExpanderOutput output(&bus, type, chips);
+    claim_all(&output);
+    output.flush();
+
+    // Every channel on, then one flush
+    uint32_t before = bus.transactions();
+    for (int i = 0; i < output.channels(); i++) {
+        output.write(1ULL << i, true);
+    }
+    output.flush();
+    uint32_t used = bus.transactions() - before;
+    uint32_t allowed = type == EXPANDER_MCP23017 ? chips : 1;
+    if (used != allowed) {
+        return fail(type, "a flush took more transactions than chips changed");
+    }
+
+    // Nothing changed, or changed and changed back, costs nothing
+    before = bus.transactions();
+    output.flush();
+    output.write(1, false);
+    output.write(1, true);
+    output.flush();
+    if (bus.transactions() != before) {
+        return fail(type, "a flush without changes used the bus");
+    }
+
+    // A change on one MCP23017 leaves the others alone
+    before = bus.transactions();
+    output.write(1, false);
+    output.flush();
+    if (bus.transactions() - before != 1) {
+        return fail(type, "one changed channel took more than one transaction");
+    }
+    printf("%s x%d: %d channels set in %lu transaction(s), unchanged flushes free\n", type_name(type), chips,
+           output.channels(), (unsigned long)allowed);
+    return 0;
+}
+
+static int check_random(expander_type_t type, int chips) {
+    SimulatedExpanderBus bus(type, chips);
+    ExpanderOutput output(&bus, type, chips);
+
+    // Claim part of the channels; the rest must stay inputs or low
+    uint64_t claimed = 0;
+    for (int i = 0; i < output.channels(); i++) {
+        if (next_random() % 4 != 0 && output.claim(i)) {
+            claimed |= 1ULL << i;
+        }
+    }
+    if (!(claimed & 1) && output.claim(0)) {
+        claimed |= 1;
+    }
+    if (output.claim(0)) {
+        return fail(type, "a channel was claimed twice");
+    }
+
+    int failures = 0;
+    for (int round = 0; round < RANDOM_ROUNDS; round++) {
+        int writes = 1 + next_random() % 8;
+        for (int i = 0; i < writes; i++) {
+            output.write(random_mask(), next_random() & 1);
+        }
+
+        // Now and then the bus drops a transaction or two
+        if (next_random() % 50 == 0) {
+            bus.failNext(1 + next_random() % 2);
+            failures++;
+        }
+        if (!output.flush()) {
+            continue;
+        }
+        if ((output.levels() & ~claimed) != 0) {
+            return fail(type, "an unclaimed channel was set");
+        }
+        if (bus.outputs() != output.levels()) {
+            return fail(type, "the chips drive something other than the levels written");
+        }
+    }
+    printf("%s x%d: %d rounds matched the shadow register through %d bus failures\n", type_name(type), chips,
+           RANDOM_ROUNDS, failures);
+    return 0;
+}
+
+static int check_chip_reset() {
+    // The last chip dips with its supply, losing its outputs, and the
+    // write to it fails; the retry must set it up again
+    SimulatedExpanderBus bus(EXPANDER_MCP23017, 2);
+    ExpanderOutput output(&bus, EXPANDER_MCP23017, 2);
+    claim_all(&output);
+    output.write(0x00FF00FFULL, true);
+    output.flush();
+
+    output.write(1ULL << 28, true);
+    bus.resetChip(1);
+    bus.failNext(1);
+    if (output.flush()) {
+        return fail(EXPANDER_MCP23017, "a failed transaction was not reported");
+    }
+    if (!output.flush() || bus.outputs() != output.levels()) {
+        return fail(EXPANDER_MCP23017, "a reset chip did not get its outputs back");
+    }
+    printf("MCP23017: a chip reset during a failed write is configured again by the next flush\n");
+    return 0;
+}
+
+// Approximate time on the wire: I2C sends the address byte and an
+// acknowledge per byte, SPI just the bits
+static double bus_seconds(expander_type_t type, uint32_t transactions, uint32_t bytes) {
+    if (type == EXPANDER_MCP23017) {
+        return ((transactions * 10.0) + (transactions + bytes) * 9.0) / OUTPUT_EXPANDER_I2C_SPEED_HZ;
+    }
+    return bytes * 8.0 / OUTPUT_EXPANDER_SPI_SPEED_HZ;
+}
+
+static void compare(expander_type_t type, int chips, int changes) {
+    SimulatedExpanderBus each_bus(type, chips);
+    ExpanderOutput each(&each_bus, type, chips);
+    SimulatedExpanderBus once_bus(type, chips);
+    ExpanderOutput once(&once_bus, type, chips);
+    claim_all(&each);
+    claim_all(&once);
+    each.flush();
+    once.flush();
+
+    // A scene switching changes channels: flushed after every write, or once
+    uint32_t each_tx = each_bus.transactions();
+    uint32_t each_bytes = each_bus.bytes();
+    uint32_t once_tx = once_bus.transactions();
+    uint32_t once_bytes = once_bus.bytes();
+    for (int i = 0; i < changes; i++) {
+        each.write(1ULL << (i % each.channels()), true);
+        each.flush();
+        once.write(1ULL << (i % once.channels()), true);
+    }
+    once.flush();
+    each_tx = each_bus.transactions() - each_tx;
+    each_bytes = each_bus.bytes() - each_bytes;
+    once_tx = once_bus.transactions() - once_tx;
+    once_bytes = once_bus.bytes() - once_bytes;
+    printf("%-8s x%d, %2d changes: per write %3lu transactions %4lu bytes %7.1f us, coalesced %lu %3lu %6.1f us\n",
+           type_name(type), chips, changes, (unsigned long)each_tx, (unsigned long)each_bytes,
+           bus_seconds(type, each_tx, each_bytes) * 1e6, (unsigned long)once_tx, (unsigned long)once_bytes,
+           bus_seconds(type, once_tx, once_bytes) * 1e6);
+}
+
+int main() {
+    const expander_type_t types[] = { EXPANDER_MCP23017, EXPANDER_74HC595 };
+    const int chips[] = { 2, 4 };
+    for (int t = 0; t < 2; t++) {
+        if (check_shadow(types[t], chips[t]) != 0 || check_coalescing(types[t], chips[t]) != 0 ||
+            check_random(types[t], chips[t]) != 0) {
+            return 1;
+        }
+    }
+    if (check_chip_reset() != 0) {
+        return 1;
+    }
+    for (int t = 0; t < 2; t++) {
+        compare(types[t], chips[t], 8);
+        compare(types[t], chips[t], 32);
+    }
+    return 0;
+}
@@ -0,0 +1,72 @@
+#ifndef HOST_MBEDTLS_PK_H
+#define HOST_MBEDTLS_PK_H
+
+// Host stand-in for the part of mbedtls/pk.h the OTA code uses: PEM
+// public keys and signature checks over a SHA-256 digest, carried by
+// OpenSSL's libcrypto (link with -lcrypto). Error codes match mbedtls.
+
+#include <stddef.h>
+#include <openssl/evp.h>
+#include <openssl/pem.h>
+
+#define MBEDTLS_ERR_PK_KEY_INVALID_FORMAT -0x3D00
+#define MBEDTLS_ERR_ECP_VERIFY_FAILED -0x4E00
+
+typedef enum {
+    MBEDTLS_PK_NONE = 0,
+    MBEDTLS_PK_RSA,
+    MBEDTLS_PK_ECKEY,
+    MBEDTLS_PK_ECKEY_DH,
+    MBEDTLS_PK_ECDSA
+} mbedtls_pk_type_t;
+
+typedef enum {
+    MBEDTLS_MD_NONE = 0,
+    MBEDTLS_MD_SHA256 = 9
+} mbedtls_md_type_t;
+
+typedef struct {
+    EVP_PKEY* key;
+} mbedtls_pk_context;
+
+static inline void mbedtls_pk_init(mbedtls_pk_context* pk) {
+    pk->key = NULL;
+}
+
+static inline void mbedtls_pk_free(mbedtls_pk_context* pk) {
+    EVP_PKEY_free(pk->key);
+    pk->key = NULL;
+}
+
+// As mbedtls, the length of a PEM key counts its terminating NUL
+static inline int mbedtls_pk_parse_public_key(mbedtls_pk_context* pk, const unsigned char* key, size_t keylen) {
+    if (keylen == 0 || key[keylen - 1] != '\0') {
+        return MBEDTLS_ERR_PK_KEY_INVALID_FORMAT;
+    }
+    BIO* bio = BIO_new_mem_buf(key, (int)keylen - 1);
+    pk->key = bio != NULL ? PEM_read_bio_PUBKEY(bio, NULL, NULL, NULL) : NULL;
+    BIO_free(bio);
+    return pk->key != NULL ? 0 : MBEDTLS_ERR_PK_KEY_INVALID_FORMAT;
+}
+
+static inline int mbedtls_pk_can_do(const mbedtls_pk_context* pk, mbedtls_pk_type_t type) {
+    if (pk->key == NULL) {
+        return 0;
+    }
+    if (type == MBEDTLS_PK_RSA) {
+        return EVP_PKEY_base_id(pk->key) == EVP_PKEY_RSA;
+    }
+    return (type == MBEDTLS_PK_ECKEY || type == MBEDTLS_PK_ECDSA) && EVP_PKEY_base_id(pk->key) == EVP_PKEY_EC;
+}
+
+static inline int mbedtls_pk_verify(mbedtls_pk_context* pk, mbedtls_md_type_t md_alg, const unsigned char* hash,
+                                    size_t hash_len, const unsigned char* sig, size_t sig_len) {
+    EVP_PKEY_CTX* ctx = EVP_PKEY_CTX_new(pk->key, NULL);
+    int ok = ctx != NULL && md_alg == MBEDTLS_MD_SHA256 && EVP_PKEY_verify_init(ctx) == 1 &&
+             EVP_PKEY_CTX_set_signature_md(ctx, EVP_sha256()) == 1 &&
+             EVP_PKEY_verify(ctx, sig, sig_len, hash, hash_len) == 1;
+    EVP_PKEY_CTX_free(ctx);
+    return ok ? 0 : MBEDTLS_ERR_ECP_VERIFY_FAILED;
+}
+
+#endif // HOST_MBEDTLS_PK_H
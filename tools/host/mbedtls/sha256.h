@@ -0,0 +1,42 @@
+#ifndef HOST_MBEDTLS_SHA256_H
+#define HOST_MBEDTLS_SHA256_H
+
+// Host stand-in for the part of mbedtls/sha256.h the OTA code uses,
+// carried by OpenSSL's libcrypto (link with -lcrypto)
+
+#include <stddef.h>
+#include <openssl/evp.h>
+
+typedef struct {
+    EVP_MD_CTX* ctx;
+} mbedtls_sha256_context;
+
+static inline void mbedtls_sha256_init(mbedtls_sha256_context* sha) {
+    sha->ctx = NULL;
+}
+
+static inline void mbedtls_sha256_free(mbedtls_sha256_context* sha) {
+    EVP_MD_CTX_free(sha->ctx);
+    sha->ctx = NULL;
+}
+
+// Only SHA-256 is supported, so is224 must be 0
+static inline int mbedtls_sha256_starts(mbedtls_sha256_context* sha, int is224) {
+    if (is224 != 0) {
+        return -1;
+    }
+    if (sha->ctx == NULL) {
+        sha->ctx = EVP_MD_CTX_new();
+    }
+    return sha->ctx != NULL && EVP_DigestInit_ex(sha->ctx, EVP_sha256(), NULL) == 1 ? 0 : -1;
+}
+
+static inline int mbedtls_sha256_update(mbedtls_sha256_context* sha, const unsigned char* input, size_t len) {
+    return EVP_DigestUpdate(sha->ctx, input, len) == 1 ? 0 : -1;
+}
+
+static inline int mbedtls_sha256_finish(mbedtls_sha256_context* sha, unsigned char output[32]) {
+    return EVP_DigestFinal_ex(sha->ctx, output, NULL) == 1 ? 0 : -1;
+}
+
+#endif // HOST_MBEDTLS_SHA256_H
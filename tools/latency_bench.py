@@ -0,0 +1,291 @@
+#!/usr/bin/env python3
+"""Measure Alpaca request latency and jitter on the switch device, idle and
+while an OTA update downloads.
+
+The tool alternates setswitch and getswitch requests against one switch at
+a fixed rate and reports latency percentiles for each phase:
+
+    idle   requests with nothing else running
+    ota    requests while the device downloads and flashes an image
+
+The OTA phase starts an update through /ui/api/ota and follows its progress
+on /ota/events; it ends when the download is done (verifying, success or
+failed). An update that verifies reboots the device, so point --ota-url at
+an image you are happy to run, usually the one already installed.
+
+Build the firmware once per TASK_LAYOUT (include/config.h) and run the tool
+against each with a matching --layout label. Results can be appended to a
+CSV file with --csv to compare layouts side by side.
+
+With --scene the tool also sets the switches of a stored scene repeatedly,
+alternating one scene:apply action with one setswitchvalue PUT per switch,
+and reports both as the phases "scene" and "puts".
+
+With --heap the heap gauges from /metrics are read before and after the run,
+which shows whether a long soak (--idle-seconds 86400) fragments the heap.
+
+Usage:
+    latency_bench.py 192.168.1.50 --layout isolated
+    latency_bench.py 192.168.1.50 --layout shared --ota-url http://host/fw.bin
+    latency_bench.py 192.168.1.50 --scene imaging
+"""
+
+import argparse
+import base64
+import json
+import statistics
+import sys
+import threading
+import time
+import urllib.error
+import urllib.parse
+import urllib.request
+
+API = "/api/v1/switch/0/"
+
+# Phases during which the image is still being downloaded and written
+OTA_ACTIVE_PHASES = ("starting", "downloading", "retrying")
+
+# Gauges compared by --heap
+HEAP_METRICS = (
+    "alpaca_heap_free_bytes",
+    "alpaca_heap_largest_free_block_bytes",
+    "alpaca_heap_free_blocks",
+    "alpaca_heap_allocated_blocks",
+    "alpaca_heap_fragmentation_ratio",
+)
+
+
+class Device:
+    def __init__(self, host, username=None, password=None, timeout=5.0):
+        self.base = "http://" + host
+        self.timeout = timeout
+        self.transaction = 0
+        self.headers = {}
+        if username:
+            token = base64.b64encode(f"{username}:{password or ''}".encode()).decode()
+            self.headers["Authorization"] = "Basic " + token
+
+    def request(self, path, form=None, method=None):
+        data = urllib.parse.urlencode(form).encode() if form is not None else None
+        req = urllib.request.Request(self.base + path, data=data, headers=self.headers,
+                                     method=method)
+        with urllib.request.urlopen(req, timeout=self.timeout) as response:
+            return response.read()
+
+    def alpaca(self, method, verb, **params):
+        self.transaction += 1
+        params.update(ClientID=1, ClientTransactionID=self.transaction)
+        if verb == "GET":
+            body = self.request(API + method + "?" + urllib.parse.urlencode(params))
+        else:
+            body = self.request(API + method, params, "PUT")
+        reply = json.loads(body)
+        if reply.get("ErrorNumber"):
+            raise RuntimeError(reply.get("ErrorMessage"))
+        return reply.get("Value")
+
+
+def measure(device, switch_id, interval, stop):
+    """Issue requests every interval seconds until stop() is true and return
+    the latencies in milliseconds and the number of failed requests."""
+    latencies = []
+    failures = 0
+    state = False
+    next_time = time.monotonic()
+    while not stop():
+        start = time.monotonic()
+        try:
+            if len(latencies) % 2 == 0:
+                state = not state
+                device.alpaca("setswitch", "PUT", Id=switch_id,
+                              State="true" if state else "false")
+            else:
+                device.alpaca("getswitch", "GET", Id=switch_id)
+            latencies.append((time.monotonic() - start) * 1000.0)
+        except (OSError, RuntimeError, urllib.error.URLError):
+            failures += 1
+        next_time += interval
+        time.sleep(max(0.0, next_time - time.monotonic()))
+    return latencies, failures
+
+
+def measure_scene(device, scene, rounds, interval):
+    """Set the switches of a scene rounds times each way, with one action and
+    with one PUT per switch, and return the latencies in milliseconds and
+    failures of both."""
+    scenes = json.loads(device.alpaca("action", "PUT", Action="scene:list", Parameters=""))
+    switches = next((s["switches"] for s in scenes if s["name"] == scene), None)
+    if switches is None:
+        raise SystemExit(f"no scene named {scene}")
+
+    applied, puts = [], []
+    applied_failures = puts_failures = 0
+    for _ in range(rounds):
+        start = time.monotonic()
+        try:
+            device.alpaca("action", "PUT", Action="scene:apply", Parameters=scene)
+            applied.append((time.monotonic() - start) * 1000.0)
+        except (OSError, RuntimeError, urllib.error.URLError):
+            applied_failures += 1
+        time.sleep(interval)
+
+        start = time.monotonic()
+        try:
+            for switch_id, value in switches.items():
+                device.alpaca("setswitchvalue", "PUT", Id=switch_id, Value=value)
+            puts.append((time.monotonic() - start) * 1000.0)
+        except (OSError, RuntimeError, urllib.error.URLError):
+            puts_failures += 1
+        time.sleep(interval)
+    return (applied, applied_failures), (puts, puts_failures)
+
+
+def watch_ota(device, done):
+    """Follow /ota/events and set done once the download stage has ended."""
+    req = urllib.request.Request(device.base + "/ota/events", headers=device.headers)
+    try:
+        with urllib.request.urlopen(req, timeout=60) as stream:
+            seen_active = False
+            for line in stream:
+                if not line.startswith(b"data:"):
+                    continue
+                phase = json.loads(line[5:]).get("phase")
+                if phase in OTA_ACTIVE_PHASES:
+                    seen_active = True
+                elif seen_active:
+                    print(f"  ota phase: {phase}", file=sys.stderr)
+                    break
+    except (OSError, urllib.error.URLError) as error:
+        print(f"  ota event stream ended: {error}", file=sys.stderr)
+    done.set()
+
+
+def read_heap(device):
+    values = {}
+    for line in device.request("/metrics").decode().splitlines():
+        name, _, value = line.partition(" ")
+        if name in HEAP_METRICS:
+            values[name] = float(value)
+    return values
+
+
+def print_heap(before, after):
+    print(f"{'heap metric':<40}{'before':>12}{'after':>12}{'change':>12}")
+    for name in HEAP_METRICS:
+        if name in before and name in after:
+            print(f"{name:<40}{before[name]:>12g}{after[name]:>12g}"
+                  f"{after[name] - before[name]:>+12g}")
+
+
+def summarize(name, latencies, failures):
+    if len(latencies) < 2:
+        return {"phase": name, "count": len(latencies), "failures": failures}
+    ordered = sorted(latencies)
+    percentile = lambda p: ordered[min(len(ordered) - 1, int(p * len(ordered)))]
+    return {
+        "phase": name,
+        "count": len(latencies),
+        "failures": failures,
+        "p50": percentile(0.50),
+        "p90": percentile(0.90),
+        "p99": percentile(0.99),
+        "max": ordered[-1],
+        "mean": statistics.fmean(latencies),
+        "stdev": statistics.stdev(latencies),
+        # Mean absolute difference between consecutive requests
+        "jitter": statistics.fmean(abs(a - b) for a, b in zip(latencies, latencies[1:])),
+    }
+
+
+def print_table(layout, results):
+    columns = ("count", "failures", "p50", "p90", "p99", "max", "stdev", "jitter")
+    print(f"layout: {layout}")
+    print(f"{'phase':<6}" + "".join(f"{c:>10}" for c in columns))
+    for result in results:
+        cells = []
+        for column in columns:
+            value = result.get(column, "-")
+            cells.append(f"{value:>10.1f}" if isinstance(value, float) else f"{value:>10}")
+        print(f"{result['phase']:<6}" + "".join(cells))
+    print("(latencies in ms)")
+
+
+def append_csv(path, layout, results):
+    columns = ("count", "failures", "p50", "p90", "p99", "max", "mean", "stdev", "jitter")
+    try:
+        new_file = open(path).read(1) == ""
+    except FileNotFoundError:
+        new_file = True
+    with open(path, "a") as out:
+        if new_file:
+            out.write("layout,phase," + ",".join(columns) + "\n")
+        for result in results:
+            values = [result.get(column, "") for column in columns]
+            out.write(f"{layout},{result['phase']}," +
+                      ",".join(f"{v:.3f}" if isinstance(v, float) else str(v) for v in values) +
+                      "\n")
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.split("\n\n")[0])
+    parser.add_argument("host", help="device address, optionally with :port")
+    parser.add_argument("--layout", default="unknown",
+                        help="label for the TASK_LAYOUT the device was built with")
+    parser.add_argument("--switch", type=int, default=0, help="switch id to toggle")
+    parser.add_argument("--rate", type=float, default=20.0, help="requests per second")
+    parser.add_argument("--idle-seconds", type=float, default=20.0,
+                        help="length of the idle phase")
+    parser.add_argument("--ota-url", help="firmware URL; runs the ota phase when given")
+    parser.add_argument("--ota-timeout", type=float, default=300.0,
+                        help="longest the ota phase may run")
+    parser.add_argument("--scene", help="scene to time against one PUT per switch")
+    parser.add_argument("--scene-rounds", type=int, default=50,
+                        help="times the scene is set each way")
+    parser.add_argument("--user", help="Alpaca username when authentication is enabled")
+    parser.add_argument("--password", help="Alpaca password")
+    parser.add_argument("--csv", help="append results to this CSV file")
+    parser.add_argument("--heap", action="store_true",
+                        help="compare heap metrics before and after the idle phase")
+    args = parser.parse_args()
+
+    device = Device(args.host, args.user, args.password)
+    interval = 1.0 / args.rate
+    results = []
+
+    heap_before = read_heap(device) if args.heap else None
+    print(f"idle phase: {args.idle_seconds:.0f} s at {args.rate:.0f} req/s", file=sys.stderr)
+    deadline = time.monotonic() + args.idle_seconds
+    latencies, failures = measure(device, args.switch, interval,
+                                  lambda: time.monotonic() >= deadline)
+    results.append(summarize("idle", latencies, failures))
+    heap_after = read_heap(device) if args.heap else None
+
+    if args.scene:
+        print(f"scene phase: {args.scene}, {args.scene_rounds} rounds", file=sys.stderr)
+        applied, puts = measure_scene(device, args.scene, args.scene_rounds, interval)
+        results.append(summarize("scene", *applied))
+        results.append(summarize("puts", *puts))
+
+    if args.ota_url:
+        print(f"ota phase: {args.ota_url}", file=sys.stderr)
+        done = threading.Event()
+        watcher = threading.Thread(target=watch_ota, args=(device, done), daemon=True)
+        watcher.start()
+        # Give the event stream time to connect before the update starts
+        time.sleep(0.5)
+        device.request("/ui/api/ota", {"url": args.ota_url})
+        deadline = time.monotonic() + args.ota_timeout
+        latencies, failures = measure(device, args.switch, interval,
+                                      lambda: done.is_set() or time.monotonic() >= deadline)
+        results.append(summarize("ota", latencies, failures))
+
+    print_table(args.layout, results)
+    if args.heap:
+        print_heap(heap_before, heap_after)
+    if args.csv:
+        append_csv(args.csv, args.layout, results)
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,459 @@
+// Check the Modbus TCP request handling on the host against a simulated
+// switch bank: MBAP framing, every function code and its exceptions, and
+// that a multi-write frame is one transition. An interlock between two
+// switches of one frame is judged by the states the whole frame leaves,
+// so the frame switches its whole range or nothing; the same frames
+// applied switch by switch, as a loop of single writes would, are shown
+// for comparison. Random frames check that nothing else gets through.
+//
+// Build and run from the repository root:
+//
+//     g++ -O2 -Iinclude -Isrc -Itools/host -o modbus_check tools/modbus_check.cpp src/modbus_pdu.cpp src/switch_rules.cpp
+//     ./modbus_check
+//
+// Exits non-zero on the first failure.
+
+#include "modbus_pdu.h"
+#include "switch_rules.h"
+#include <stdio.h>
+#include <string.h>
+#include <vector>
+
+#define BANK_SWITCHES 8
+#define RANDOM_FRAMES 200000
+
+static uint32_t s_seed = 1;
+
+static uint32_t next_random() {
+    s_seed = s_seed * 1664525u + 1013904223u;
+    return s_seed >> 8;
+}
+
+static int fail(const char* what) {
+    printf("FAIL: %s\n", what);
+    return 1;
+}
+
+// Switches with the checks AlpacaSwitch::setValues() makes, minus the
+// force rules
+class SimBank : public ModbusBank {
+public:
+    bool states[BANK_SWITCHES];
+    double values[BANK_SWITCHES];
+    double mins[BANK_SWITCHES];
+    double maxs[BANK_SWITCHES];
+    double steps[BANK_SWITCHES];
+    bool can_write[BANK_SWITCHES];
+    SwitchRules rules;
+    int held;
+    int transitions;            // setValues() calls
+    int unheld_reads;           // Reads of several switches outside hold()
+
+    SimBank() : held(0), transitions(0), unheld_reads(0) {
+        for (int i = 0; i < BANK_SWITCHES; i++) {
+            states[i] = false;
+            values[i] = 0;
+            mins[i] = 0;
+            maxs[i] = 1;
+            steps[i] = 1;
+            can_write[i] = true;
+        }
+    }
+
+    bool setRules(const char* text) {
+        char error[96];
+        rules = SwitchRules();
+        return rules.compile(text, BANK_SWITCHES, error, sizeof(error)) == ESP_OK;
+    }
+
+    int32_t count() override { return BANK_SWITCHES; }
+    void hold() override { held++; }
+    void release() override { held--; }
+
+    bool getState(int32_t id) override {
+        unheld_reads += held == 0;
+        return states[id];
+    }
+
+    double getValue(int32_t id) override { return values[id]; }
+    double getMin(int32_t id) override { return mins[id]; }
+    double getStep(int32_t id) override { return steps[id]; }
+
+    uint8_t setValues(const int32_t* ids, const double* new_values, int count) override {
+        transitions++;
+        bool next[BANK_SWITCHES];
+        memcpy(next, states, sizeof(next));
+        for (int i = 0; i < count; i++) {
+            int32_t id = ids[i];
+            if (!can_write[id]) {
+                return MODBUS_EX_ILLEGAL_DATA_ADDRESS;
+            }
+            if (!(new_values[i] >= mins[id] && new_values[i] <= maxs[id])) {
+                return MODBUS_EX_ILLEGAL_DATA_VALUE;
+            }
+            next[id] = new_values[i] > 0;
+        }
+        int evaluated = 0;
+        int32_t refused;
+        if (rules.checkTransition(ids, count, states, next, &evaluated, &refused) != NULL) {
+            return MODBUS_EX_ILLEGAL_DATA_ADDRESS;
+        }
+        for (int i = 0; i < count; i++) {
+            values[ids[i]] = new_values[i];
+            states[ids[i]] = next[ids[i]];
+        }
+        return 0;
+    }
+
+    // The same writes one switch at a time, each checked against the
+    // states the ones before it left; returns how many were made
+    int setOneByOne(const int32_t* ids, const double* new_values, int count) {
+        for (int i = 0; i < count; i++) {
+            if (setValues(&ids[i], &new_values[i], 1) != 0) {
+                return i;
+            }
+        }
+        return count;
+    }
+};
+
+static std::vector<uint8_t> frame(uint16_t transaction, uint8_t unit, const std::vector<uint8_t>& pdu) {
+    std::vector<uint8_t> adu = { (uint8_t)(transaction >> 8), (uint8_t)transaction, 0, 0,
+                                 (uint8_t)((pdu.size() + 1) >> 8), (uint8_t)(pdu.size() + 1), unit };
+    adu.insert(adu.end(), pdu.begin(), pdu.end());
+    return adu;
+}
+
+static std::vector<uint8_t> request(uint8_t function, uint16_t a, uint16_t b) {
+    return { function, (uint8_t)(a >> 8), (uint8_t)a, (uint8_t)(b >> 8), (uint8_t)b };
+}
+
+static std::vector<uint8_t> write_coils(uint16_t start, const std::vector<bool>& coils) {
+    std::vector<uint8_t> pdu = request(0x0F, start, (uint16_t)coils.size());
+    pdu.push_back((uint8_t)((coils.size() + 7) / 8));
+    pdu.resize(6 + pdu[5], 0);
+    for (size_t i = 0; i < coils.size(); i++) {
+        if (coils[i]) {
+            pdu[6 + i / 8] |= 1 << (i % 8);
+        }
+    }
+    return pdu;
+}
+
+static std::vector<uint8_t> write_registers(uint16_t start, const std::vector<uint16_t>& regs) {
+    std::vector<uint8_t> pdu = request(0x10, start, (uint16_t)regs.size());
+    pdu.push_back((uint8_t)(regs.size() * 2));
+    for (uint16_t reg : regs) {
+        pdu.push_back(reg >> 8);
+        pdu.push_back(reg & 0xFF);
+    }
+    return pdu;
+}
+
+// Response PDU to a request PDU
+static std::vector<uint8_t> handle(ModbusPdu* pdu, const std::vector<uint8_t>& req) {
+    uint8_t response[MODBUS_MAX_PDU_SIZE];
+    int len = pdu->handle(req.data(), (int)req.size(), response);
+    return std::vector<uint8_t>(response, response + len);
+}
+
+// Exception code of a response, 0 if it is not one
+static uint8_t exception_of(const std::vector<uint8_t>& req, const std::vector<uint8_t>& resp) {
+    return resp.size() == 2 && resp[0] == (req[0] | 0x80) ? resp[1] : 0;
+}
+
+static int check_framing() {
+    SimBank bank;
+    ModbusPdu pdu(&bank);
+    std::vector<uint8_t> adu = frame(0xBEEF, 0x11, request(0x01, 0, BANK_SWITCHES));
+
+    // Arriving a byte at a time, then with the next frame behind it
+    for (size_t len = 0; len < adu.size(); len++) {
+        if (ModbusPdu::frameLength(adu.data(), (int)len) != 0) {
+            return fail("an incomplete frame was taken as whole");
+        }
+    }
+    std::vector<uint8_t> two = adu;
+    two.insert(two.end(), adu.begin(), adu.end());
+    if (ModbusPdu::frameLength(adu.data(), (int)adu.size()) != (int)adu.size() ||
+        ModbusPdu::frameLength(two.data(), (int)two.size()) != (int)adu.size()) {
+        return fail("a complete frame has the wrong length");
+    }
+
+    // Another protocol, or lengths no PDU has
+    const uint16_t lengths[] = { 0, 1, MODBUS_MAX_PDU_SIZE + 2, 0xFFFF };
+    std::vector<uint8_t> bad = adu;
+    bad[3] = 1;
+    if (ModbusPdu::frameLength(bad.data(), (int)bad.size()) != -1) {
+        return fail("a frame of another protocol was accepted");
+    }
+    for (uint16_t length : lengths) {
+        bad = adu;
+        bad[4] = length >> 8;
+        bad[5] = length & 0xFF;
+        if (ModbusPdu::frameLength(bad.data(), (int)bad.size()) != -1) {
+            return fail("a frame with an impossible length was accepted");
+        }
+    }
+
+    uint8_t response[MODBUS_MAX_ADU_SIZE];
+    int len = pdu.handleFrame(adu.data(), response);
+    if (len != MBAP_HEADER_SIZE + 3 || response[0] != 0xBE || response[1] != 0xEF || response[2] != 0 ||
+        response[3] != 0 || response[4] != 0 || response[5] != 4 || response[6] != 0x11) {
+        return fail("the response header does not echo the request");
+    }
+    printf("Framing: partial, back-to-back and malformed headers handled, ids echoed\n");
+    return 0;
+}
+
+static int check_functions() {
+    SimBank bank;
+    ModbusPdu pdu(&bank);
+    bank.mins[3] = -10;
+    bank.maxs[3] = 10;
+    bank.steps[3] = 0.5;
+    bank.can_write[2] = false;
+
+    // Reads of every range, packed as the protocol packs them
+    for (int trial = 0; trial < 100; trial++) {
+        for (int i = 0; i < BANK_SWITCHES; i++) {
+            bank.states[i] = next_random() & 1;
+            bank.values[i] = i == 3 ? -10 + 0.5 * (next_random() % 41) : bank.states[i];
+        }
+        for (int start = 0; start < BANK_SWITCHES; start++) {
+            for (int quantity = 1; start + quantity <= BANK_SWITCHES; quantity++) {
+                std::vector<uint8_t> coils = handle(&pdu, request(0x01, start, quantity));
+                std::vector<uint8_t> regs = handle(&pdu, request(0x03, start, quantity));
+                if (coils.size() != 2 + (size_t)(quantity + 7) / 8 || coils[1] != (quantity + 7) / 8 ||
+                    regs.size() != 2 + (size_t)quantity * 2 || regs[1] != quantity * 2) {
+                    return fail("a read has the wrong length");
+                }
+                for (int i = 0; i < (quantity + 7) / 8 * 8; i++) {
+                    bool bit = (coils[2 + i / 8] >> (i % 8)) & 1;
+                    if (bit != (i < quantity && bank.states[start + i])) {
+                        return fail("a coil read the wrong state");
+                    }
+                }
+                for (int i = 0; i < quantity; i++) {
+                    int id = start + i;
+                    uint16_t reg = (uint16_t)(regs[2 + i * 2] << 8 | regs[3 + i * 2]);
+                    if (bank.mins[id] + reg * bank.steps[id] != bank.values[id]) {
+                        return fail("a register read the wrong value");
+                    }
+                }
+            }
+        }
+    }
+    if (bank.unheld_reads != 0) {
+        return fail("a multi-switch read was not one snapshot");
+    }
+
+    // Writes are echoed and reach the bank
+    std::vector<uint8_t> req = request(0x05, 1, 0xFF00);
+    if (handle(&pdu, req) != req || !bank.states[1] || bank.values[1] != 1.0) {
+        return fail("a coil write was not made");
+    }
+    req = request(0x06, 3, 30);
+    if (handle(&pdu, req) != req || bank.values[3] != 5.0 || !bank.states[3]) {
+        return fail("a register write was not made");
+    }
+    req = write_registers(3, { 0, 1 });
+    std::vector<uint8_t> echo(req.begin(), req.begin() + 5);
+    if (handle(&pdu, req) != echo || bank.values[3] != -10 || bank.states[3] || bank.values[4] != 1.0) {
+        return fail("a multiple register write was not made");
+    }
+
+    // Refusals, with the exception the protocol gives each
+    struct {
+        std::vector<uint8_t> req;
+        uint8_t ex;
+        const char* what;
+    } refusals[] = {
+        { { 0x2B, 0x0E, 0x01, 0x00 }, MODBUS_EX_ILLEGAL_FUNCTION, "an unknown function" },
+        { request(0x01, 0, 0), MODBUS_EX_ILLEGAL_DATA_VALUE, "a read of no coils" },
+        { request(0x01, 0, 2001), MODBUS_EX_ILLEGAL_DATA_VALUE, "a read of too many coils" },
+        { request(0x03, 0, 126), MODBUS_EX_ILLEGAL_DATA_VALUE, "a read of too many registers" },
+        { request(0x01, 7, 2), MODBUS_EX_ILLEGAL_DATA_ADDRESS, "a read past the last coil" },
+        { request(0x03, 0xFFFF, 1), MODBUS_EX_ILLEGAL_DATA_ADDRESS, "a read at address 65535" },
+        { { 0x01, 0x00, 0x00, 0x00 }, MODBUS_EX_ILLEGAL_DATA_VALUE, "a short read" },
+        { request(0x05, 0, 0x1234), MODBUS_EX_ILLEGAL_DATA_VALUE, "a coil value other than on or off" },
+        { request(0x05, BANK_SWITCHES, 0xFF00), MODBUS_EX_ILLEGAL_DATA_ADDRESS, "a coil past the last" },
+        { request(0x05, 2, 0xFF00), MODBUS_EX_ILLEGAL_DATA_ADDRESS, "a write to a read-only switch" },
+        { request(0x06, 0, 2), MODBUS_EX_ILLEGAL_DATA_VALUE, "a register out of range" },
+        { request(0x06, 3, 41), MODBUS_EX_ILLEGAL_DATA_VALUE, "a stepped register out of range" },
+        { write_coils(1, { true, true }), MODBUS_EX_ILLEGAL_DATA_ADDRESS, "a frame with a read-only switch" },
+        { write_registers(0, { 1, 7 }), MODBUS_EX_ILLEGAL_DATA_VALUE, "a frame with a value out of range" },
+        { write_coils(7, { true, true }), MODBUS_EX_ILLEGAL_DATA_ADDRESS, "a frame past the last coil" },
+    };
+    for (auto& refusal : refusals) {
+        bool states[BANK_SWITCHES];
+        memcpy(states, bank.states, sizeof(states));
+        if (exception_of(refusal.req, handle(&pdu, refusal.req)) != refusal.ex ||
+            memcmp(states, bank.states, sizeof(states)) != 0) {
+            printf("FAIL: %s was not refused with exception %d\n", refusal.what, refusal.ex);
+            return 1;
+        }
+    }
+
+    // A byte count or frame length that does not match the quantity
+    std::vector<uint8_t> coils = write_coils(0, { true, false, true });
+    coils[5] = 2;
+    std::vector<uint8_t> regs = write_registers(0, { 1, 0 });
+    regs.pop_back();
+    if (exception_of(coils, handle(&pdu, coils)) != MODBUS_EX_ILLEGAL_DATA_VALUE ||
+        exception_of(regs, handle(&pdu, regs)) != MODBUS_EX_ILLEGAL_DATA_VALUE) {
+        return fail("a frame with a wrong byte count was accepted");
+    }
+    printf("Functions: reads of every range, writes, and %d kinds of refusal answered as specified\n",
+           (int)(sizeof(refusals) / sizeof(refusals[0])) + 1);
+    return 0;
+}
+
+static int check_interlock() {
+    // Switches 0 and 1 are never on together: a frame turning both on
+    // must change neither
+    SimBank bank;
+    ModbusPdu pdu(&bank);
+    if (!bank.setRules("0 excludes 1")) {
+        return fail("rules did not compile");
+    }
+    std::vector<uint8_t> req = write_coils(0, { true, true });
+    if (exception_of(req, handle(&pdu, req)) != MODBUS_EX_ILLEGAL_DATA_ADDRESS || bank.states[0] ||
+        bank.states[1]) {
+        return fail("a frame breaking an interlock changed some of its switches");
+    }
+    req = write_registers(0, { 1, 1 });
+    if (exception_of(req, handle(&pdu, req)) != MODBUS_EX_ILLEGAL_DATA_ADDRESS || bank.states[0] ||
+        bank.states[1]) {
+        return fail("a register frame breaking an interlock changed some of its switches");
+    }
+
+    // Swapping which of the two is on is allowed in one frame, whichever
+    // comes first in it
+    bank.states[1] = true;
+    bank.values[1] = 1;
+    req = write_coils(0, { true, false });
+    if (handle(&pdu, req).size() != 5 || !bank.states[0] || bank.states[1]) {
+        return fail("a frame swapping two exclusive switches was refused");
+    }
+    int32_t ids[2] = { 0, 1 };
+    double on_on[2] = { 1, 1 };
+    SimBank by_switch;
+    by_switch.setRules("0 excludes 1");
+    int made_exclusive = by_switch.setOneByOne(ids, on_on, 2);
+
+    // Switch 0 may only be on while 1 is: turning both on together is
+    // fine, though 0 comes first in the frame and could not go on alone
+    if (!bank.setRules("0 requires 1")) {
+        return fail("rules did not compile");
+    }
+    memset(bank.states, 0, sizeof(bank.states));
+    memset(bank.values, 0, sizeof(bank.values));
+    req = write_coils(0, { true, true });
+    if (handle(&pdu, req).size() != 5 || !bank.states[0] || !bank.states[1]) {
+        return fail("a frame leaving a valid state was refused");
+    }
+    by_switch.setRules("0 requires 1");
+    memset(by_switch.states, 0, sizeof(by_switch.states));
+    memset(by_switch.values, 0, sizeof(by_switch.values));
+    int made_requires = by_switch.setOneByOne(ids, on_on, 2);
+
+    printf("Interlocks: frames judged by the states they leave; switch by switch, "
+           "%d of 2 were made breaking \"0 excludes 1\", %d of 2 keeping \"0 requires 1\"\n",
+           made_exclusive, made_requires);
+    if (made_exclusive != 1 || made_requires != 0) {
+        return fail("the switch-by-switch comparison did not behave as expected");
+    }
+    return 0;
+}
+
+static int check_random() {
+    const char* rule_sets[] = { "", "0 excludes 1", "2 requires 1; 1 requires 0", "3 excludes 4; 4 excludes 5",
+                                "0 excludes 7; 6 requires 7; 5 excludes 6" };
+    SimBank bank;
+    ModbusPdu pdu(&bank);
+    bank.steps[5] = 0.25;
+    bank.maxs[5] = 2;
+    int accepted = 0;
+    int refused = 0;
+    int garbage = 0;
+    for (int trial = 0; trial < RANDOM_FRAMES; trial++) {
+        if (trial % 1000 == 0 && !bank.setRules(rule_sets[next_random() % 5])) {
+            return fail("rules did not compile");
+        }
+        bool states[BANK_SWITCHES];
+        double values[BANK_SWITCHES];
+        memcpy(states, bank.states, sizeof(states));
+        memcpy(values, bank.values, sizeof(values));
+        int transitions = bank.transitions;
+
+        // A multiple write over a random range, or random bytes
+        uint16_t start = next_random() % BANK_SWITCHES;
+        uint16_t quantity = 1 + next_random() % (BANK_SWITCHES - start);
+        std::vector<uint8_t> req;
+        std::vector<double> wanted;
+        bool is_write = next_random() % 4 != 0;
+        if (is_write && next_random() % 2 == 0) {
+            std::vector<bool> coils;
+            for (int i = 0; i < quantity; i++) {
+                coils.push_back(next_random() & 1);
+                wanted.push_back(coils.back() ? 1.0 : 0.0);
+            }
+            req = write_coils(start, coils);
+        } else if (is_write) {
+            std::vector<uint16_t> regs;
+            for (int i = 0; i < quantity; i++) {
+                regs.push_back(next_random() % 10);
+                wanted.push_back(bank.mins[start + i] + regs.back() * bank.steps[start + i]);
+            }
+            req = write_registers(start, regs);
+        } else {
+            req.resize(1 + next_random() % MODBUS_MAX_PDU_SIZE);
+            for (auto& byte : req) {
+                byte = (uint8_t)next_random();
+            }
+        }
+
+        std::vector<uint8_t> resp = handle(&pdu, req);
+        uint8_t ex = exception_of(req, resp);
+        if (resp.size() < 2 || resp.size() > MODBUS_MAX_PDU_SIZE || (resp[0] & 0x80 && (ex < 1 || ex > 3))) {
+            return fail("a response is malformed");
+        }
+        if (bank.transitions - transitions > 1) {
+            return fail("one frame was made as several transitions");
+        }
+        if (!is_write) {
+            garbage++;
+            continue;
+        }
+
+        // All of the frame or none of it, and never past an interlock
+        bool all = true;
+        bool none = memcmp(values, bank.values, sizeof(values)) == 0;
+        for (int i = 0; i < BANK_SWITCHES; i++) {
+            bool in_frame = i >= start && i < start + quantity;
+            double expected = in_frame ? wanted[i - start] : values[i];
+            all = all && bank.values[i] == expected && bank.states[i] == (in_frame ? expected > 0 : states[i]);
+        }
+        if (ex == 0 ? !all : !none) {
+            return fail("a frame was applied in part");
+        }
+        for (int i = 0; i < BANK_SWITCHES; i++) {
+            int evaluated = 0;
+            if (bank.states[i] != states[i] && bank.rules.check(i, bank.states[i], bank.states, &evaluated) != NULL) {
+                return fail("a frame left switches breaking a rule");
+            }
+        }
+        ex == 0 ? accepted++ : refused++;
+    }
+    printf("Random: %d write frames made whole, %d refused whole, %d random PDUs answered\n", accepted, refused,
+           garbage);
+    return 0;
+}
+
+int main() {
+    if (check_framing() != 0 || check_functions() != 0 || check_interlock() != 0 || check_random() != 0) {
+        return 1;
+    }
+    return 0;
+}
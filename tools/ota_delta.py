@@ -0,0 +1,239 @@
+#!/usr/bin/env python3
+"""Build and apply delta OTA patches for the Alpaca switch firmware.
+
+A patch rebuilds a new firmware image from the image currently running on
+the device, so only the changed bytes travel over the network. The patch
+format is decoded on the device by OtaDeltaPatcher (src/ota_delta.h):
+
+    header:  "ADP1" | u32 source size | source SHA-256
+                    | u32 target size | target SHA-256
+    ops:     0x01 COPY   u32 source offset, u32 length
+             0x02 DIFF   u32 source offset, u32 length, <length> bytes
+             0x03 INSERT u32 length, <length> bytes
+             0x00 END
+
+The source SHA-256 is the digest ESP-IDF appends to every application
+image, which is what esp_partition_get_sha256() reports for the running
+partition on the device.
+
+Usage:
+    ota_delta.py diff old.bin new.bin -o update.patch [--gzip]
+    ota_delta.py apply old.bin update.patch -o new.bin
+"""
+
+import argparse
+import gzip
+import hashlib
+import struct
+import sys
+
+MAGIC = b"ADP1"
+OP_END = 0x00
+OP_COPY = 0x01
+OP_DIFF = 0x02
+OP_INSERT = 0x03
+
+# Length of the exact match used to find candidate alignments, and the
+# stride at which source positions are indexed
+MATCH_LEN = 16
+INDEX_STRIDE = 4
+
+# Shortest run of identical bytes worth a COPY inside a matched region
+MIN_COPY_RUN = 24
+
+# How far the match score may fall below its best before extension stops
+SCORE_SLACK = 64
+
+
+def image_sha256(image):
+    """Return the SHA-256 that ESP-IDF appends to an application image."""
+    if len(image) < 32 or hashlib.sha256(image[:-32]).digest() != image[-32:]:
+        sys.exit("error: image has no appended SHA-256 digest "
+                 "(ESP-IDF appends one to application images by default)")
+    return image[-32:]
+
+
+def build_index(source):
+    index = {}
+    for pos in range(0, len(source) - MATCH_LEN + 1, INDEX_STRIDE):
+        index.setdefault(source[pos:pos + MATCH_LEN], pos)
+    return index
+
+
+def extend_match(source, target, s, t):
+    """Extend a match forward bsdiff-style: keep going while more than half
+    of the bytes agree, and return the length with the best score."""
+    best_len = 0
+    best_score = 0
+    score = 0
+    length = 0
+    limit = min(len(source) - s, len(target) - t)
+    while length < limit:
+        score += 1 if source[s + length] == target[t + length] else -1
+        length += 1
+        if score > best_score:
+            best_score = score
+            best_len = length
+        elif score < best_score - SCORE_SLACK:
+            break
+    return best_len
+
+
+def emit_region(ops, source, target, s, t, length):
+    """Split a matched region into COPY runs of identical bytes and DIFF runs
+    covering the bytes in between."""
+    diff_start = None
+    i = 0
+    while i < length:
+        j = i
+        while j < length and source[s + j] == target[t + j]:
+            j += 1
+        if j - i >= MIN_COPY_RUN or (j == length and j > i and diff_start is None):
+            if diff_start is not None:
+                emit_diff(ops, source, target, s + diff_start, t + diff_start, i - diff_start)
+                diff_start = None
+            ops.append((OP_COPY, s + i, j - i))
+            i = j
+        else:
+            # Short identical run plus the mismatching byte after it
+            if diff_start is None:
+                diff_start = i
+            i = j + 1 if j < length else j
+    if diff_start is not None:
+        emit_diff(ops, source, target, s + diff_start, t + diff_start, length - diff_start)
+
+
+def emit_diff(ops, source, target, s, t, length):
+    data = bytes((target[t + i] - source[s + i]) & 0xFF for i in range(length))
+    ops.append((OP_DIFF, s, length, data))
+
+
+def make_patch(source, target):
+    index = build_index(source)
+    ops = []
+    literal_start = 0
+    t = 0
+    while t <= len(target) - MATCH_LEN:
+        s = index.get(target[t:t + MATCH_LEN])
+        if s is None:
+            t += 1
+            continue
+
+        # Pull the match back into the pending literal where bytes agree
+        while t > literal_start and s > 0 and source[s - 1] == target[t - 1]:
+            s -= 1
+            t -= 1
+
+        length = extend_match(source, target, s, t)
+        if length < MATCH_LEN:
+            t += 1
+            continue
+
+        if t > literal_start:
+            ops.append((OP_INSERT, target[literal_start:t]))
+        emit_region(ops, source, target, s, t, length)
+        t += length
+        literal_start = t
+
+    if literal_start < len(target):
+        ops.append((OP_INSERT, target[literal_start:]))
+    return ops
+
+
+def encode_patch(source, target, ops):
+    out = bytearray(MAGIC)
+    out += struct.pack("<I", len(source)) + image_sha256(source)
+    out += struct.pack("<I", len(target)) + hashlib.sha256(target).digest()
+    for op in ops:
+        if op[0] == OP_COPY:
+            out += struct.pack("<BII", OP_COPY, op[1], op[2])
+        elif op[0] == OP_DIFF:
+            out += struct.pack("<BII", OP_DIFF, op[1], op[2]) + op[3]
+        else:
+            out += struct.pack("<BI", OP_INSERT, len(op[1])) + op[1]
+    out.append(OP_END)
+    return bytes(out)
+
+
+def apply_patch(source, patch):
+    """Reference applier, mirroring OtaDeltaPatcher on the device."""
+    if patch[:2] == b"\x1f\x8b":
+        patch = gzip.decompress(patch)
+    if patch[:4] != MAGIC:
+        sys.exit("error: not a delta patch")
+    source_size, = struct.unpack_from("<I", patch, 4)
+    if patch[8:40] != image_sha256(source) or source_size != len(source):
+        sys.exit("error: patch was built against a different source image")
+    target_size, = struct.unpack_from("<I", patch, 40)
+    target_sha = patch[44:76]
+
+    out = bytearray()
+    pos = 76
+    while True:
+        op = patch[pos]
+        pos += 1
+        if op == OP_END:
+            break
+        if op in (OP_COPY, OP_DIFF):
+            s, length = struct.unpack_from("<II", patch, pos)
+            pos += 8
+            if op == OP_COPY:
+                out += source[s:s + length]
+            else:
+                out += bytes((source[s + i] + patch[pos + i]) & 0xFF for i in range(length))
+                pos += length
+        elif op == OP_INSERT:
+            length, = struct.unpack_from("<I", patch, pos)
+            pos += 4
+            out += patch[pos:pos + length]
+            pos += length
+        else:
+            sys.exit("error: unknown opcode 0x%02x" % op)
+
+    if len(out) != target_size or hashlib.sha256(out).digest() != target_sha:
+        sys.exit("error: patched image does not match the target hash")
+    return bytes(out)
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__,
+                                     formatter_class=argparse.RawDescriptionHelpFormatter)
+    sub = parser.add_subparsers(dest="command", required=True)
+
+    diff = sub.add_parser("diff", help="build a patch from old.bin to new.bin")
+    diff.add_argument("source")
+    diff.add_argument("target")
+    diff.add_argument("-o", "--output", required=True)
+    diff.add_argument("--gzip", action="store_true", help="gzip the patch (detected on the device)")
+
+    apply = sub.add_parser("apply", help="rebuild new.bin from old.bin and a patch")
+    apply.add_argument("source")
+    apply.add_argument("patch")
+    apply.add_argument("-o", "--output", required=True)
+
+    args = parser.parse_args()
+
+    with open(args.source, "rb") as f:
+        source = f.read()
+
+    if args.command == "diff":
+        with open(args.target, "rb") as f:
+            target = f.read()
+        patch = encode_patch(source, target, make_patch(source, target))
+        # Round-trip through the reference applier before shipping the patch
+        apply_patch(source, patch)
+        if args.gzip:
+            patch = gzip.compress(patch, 9)
+        with open(args.output, "wb") as f:
+            f.write(patch)
+        print("%s: %d bytes (%.1f%% of %d byte image)"
+              % (args.output, len(patch), 100.0 * len(patch) / len(target), len(target)))
+    else:
+        with open(args.patch, "rb") as f:
+            patch = f.read()
+        with open(args.output, "wb") as f:
+            f.write(apply_patch(source, patch))
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,327 @@
+// Check the delta patch applier on the host, with the running and update
+// partitions backed by files: that patches rebuild their target exactly
+// however the stream is split, and that patches for another image,
+// damaged or cut short, or reaching outside the source are refused.
+//
+// Build and run from the repository root (needs OpenSSL's libcrypto for
+// the SHA-256 behind tools/host/mbedtls):
+//
+//     g++ -O2 -Iinclude -Isrc -Itools/host -o ota_delta_check tools/ota_delta_check.cpp src/ota_delta.cpp -lcrypto
+//     ./ota_delta_check                              # generated images and patches
+//     ./ota_delta_check old.bin update.patch new.bin # a patch from tools/ota_delta.py
+//
+// Generated patches come from random edits of a random image: kept,
+// moved and changed blocks and new bytes, as a rebuilt firmware has.
+// Exits non-zero on the first failure.
+
+#include "ota_delta.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <vector>
+
+#define PARTITION_SIZE (1024 * 1024)
+#define TRIALS 50
+
+static uint32_t s_seed = 1;
+
+static uint32_t next_random() {
+    s_seed = s_seed * 1664525u + 1013904223u;
+    return s_seed >> 8;
+}
+
+static int fail(const char* what) {
+    printf("FAIL: %s\n", what);
+    return 1;
+}
+
+static void sha256(const uint8_t* data, size_t len, uint8_t digest[32]) {
+    mbedtls_sha256_context sha;
+    mbedtls_sha256_init(&sha);
+    mbedtls_sha256_starts(&sha, 0);
+    mbedtls_sha256_update(&sha, data, len);
+    mbedtls_sha256_finish(&sha, digest);
+    mbedtls_sha256_free(&sha);
+}
+
+// An OTA partition in a temporary file
+class FilePartition {
+public:
+    FilePartition() : _file(tmpfile()) {
+        std::vector<uint8_t> erased(PARTITION_SIZE, 0xFF);
+        fwrite(erased.data(), 1, erased.size(), _file);
+    }
+    ~FilePartition() { fclose(_file); }
+
+    esp_err_t read(size_t offset, void* buf, size_t len) {
+        if (offset + len > PARTITION_SIZE || fseek(_file, (long)offset, SEEK_SET) != 0 ||
+            fread(buf, 1, len, _file) != len) {
+            return ESP_FAIL;
+        }
+        return ESP_OK;
+    }
+
+    esp_err_t write(size_t offset, const void* data, size_t len) {
+        if (offset + len > PARTITION_SIZE || fseek(_file, (long)offset, SEEK_SET) != 0 ||
+            fwrite(data, 1, len, _file) != len) {
+            return ESP_FAIL;
+        }
+        return ESP_OK;
+    }
+
+private:
+    FILE* _file;
+};
+
+// The update partition as the OTA writer fills it: in order, from 0
+typedef struct {
+    FilePartition* partition;
+    size_t offset;
+} target_t;
+
+static esp_err_t read_source(void* ctx, size_t offset, void* buf, size_t len) {
+    return static_cast<FilePartition*>(ctx)->read(offset, buf, len);
+}
+
+static esp_err_t write_target(void* ctx, const uint8_t* data, size_t len) {
+    target_t* target = static_cast<target_t*>(ctx);
+    esp_err_t err = target->partition->write(target->offset, data, len);
+    target->offset += len;
+    return err;
+}
+
+static void put_le32(std::vector<uint8_t>* out, uint32_t value) {
+    for (int i = 0; i < 4; i++) {
+        out->push_back((uint8_t)(value >> (8 * i)));
+    }
+}
+
+// An application image ends in the SHA-256 of the rest, which is what
+// the device reports for the running partition
+static std::vector<uint8_t> make_image(size_t size) {
+    std::vector<uint8_t> image(size);
+    for (size_t i = 0; i < size - 32; i++) {
+        // Runs of repeated bytes among noise, like code and padding
+        image[i] = i % 64 < 16 ? (uint8_t)(i / 64) : (uint8_t)next_random();
+    }
+    image[0] = 0xE9;
+    sha256(image.data(), size - 32, &image[size - 32]);
+    return image;
+}
+
+// Edit source into a new image, writing the patch that does the same
+static void make_patch(const std::vector<uint8_t>& source, std::vector<uint8_t>* target,
+                       std::vector<uint8_t>* patch) {
+    std::vector<uint8_t> ops;
+    target->clear();
+    size_t wanted = source.size() - 4096 + next_random() % 8192;
+    while (target->size() < wanted - 32) {
+        uint32_t length = 1 + next_random() % 8192;
+        if (length > wanted - 32 - target->size()) {
+            length = wanted - 32 - target->size();
+        }
+        uint32_t offset = next_random() % (source.size() - length);
+        uint32_t kind = next_random() % 10;
+        if (kind < 6) {
+            ops.push_back(0x01);
+            put_le32(&ops, offset);
+            put_le32(&ops, length);
+            target->insert(target->end(), &source[offset], &source[offset] + length);
+        } else if (kind < 9) {
+            // Relocated code: most bytes shift by a small amount
+            ops.push_back(0x02);
+            put_le32(&ops, offset);
+            put_le32(&ops, length);
+            for (uint32_t i = 0; i < length; i++) {
+                uint8_t delta = next_random() % 4 == 0 ? (uint8_t)next_random() : 0;
+                ops.push_back(delta);
+                target->push_back((uint8_t)(source[offset + i] + delta));
+            }
+        } else {
+            ops.push_back(0x03);
+            put_le32(&ops, length);
+            for (uint32_t i = 0; i < length; i++) {
+                uint8_t byte = (uint8_t)next_random();
+                ops.push_back(byte);
+                target->push_back(byte);
+            }
+        }
+    }
+
+    // The new image's own digest arrives as new bytes
+    target->resize(target->size() + 32);
+    sha256(target->data(), target->size() - 32, &(*target)[target->size() - 32]);
+    ops.push_back(0x03);
+    put_le32(&ops, 32);
+    ops.insert(ops.end(), target->end() - 32, target->end());
+    ops.push_back(0x00);
+
+    patch->assign(OTA_DELTA_MAGIC, OTA_DELTA_MAGIC + 4);
+    put_le32(patch, source.size());
+    patch->insert(patch->end(), source.end() - 32, source.end());
+    put_le32(patch, target->size());
+    uint8_t digest[32];
+    sha256(target->data(), target->size(), digest);
+    patch->insert(patch->end(), digest, digest + 32);
+    patch->insert(patch->end(), ops.begin(), ops.end());
+}
+
+// Apply a patch fed in pieces of up to max_piece bytes; the target
+// partition must then hold expected, when one is given
+static esp_err_t apply(const std::vector<uint8_t>& source, const std::vector<uint8_t>& patch,
+                       size_t max_piece, const std::vector<uint8_t>* expected) {
+    FilePartition running;
+    FilePartition update;
+    running.write(0, source.data(), source.size());
+    target_t target = { &update, 0 };
+
+    OtaDeltaPatcher patcher;
+    esp_err_t err = patcher.begin(&source[source.size() - 32], PARTITION_SIZE, read_source, &running);
+    for (size_t pos = 0; err == ESP_OK && pos < patch.size();) {
+        size_t len = 1 + next_random() % max_piece;
+        if (len > patch.size() - pos) {
+            len = patch.size() - pos;
+        }
+        err = patcher.feed(&patch[pos], len, write_target, &target);
+        pos += len;
+    }
+    if (err != ESP_OK) {
+        return err;
+    }
+    if (!patcher.isFinished()) {
+        return ESP_ERR_INVALID_SIZE;
+    }
+    if (expected != NULL) {
+        std::vector<uint8_t> written(expected->size());
+        if (target.offset != expected->size() || update.read(0, written.data(), written.size()) != ESP_OK ||
+            written != *expected) {
+            return ESP_ERR_INVALID_CRC;
+        }
+    }
+    return ESP_OK;
+}
+
+static int check_round_trip() {
+    size_t patch_bytes = 0;
+    size_t image_bytes = 0;
+    for (int trial = 0; trial < TRIALS; trial++) {
+        std::vector<uint8_t> source = make_image(200 * 1024 + next_random() % (400 * 1024));
+        std::vector<uint8_t> target;
+        std::vector<uint8_t> patch;
+        make_patch(source, &target, &patch);
+
+        // Byte by byte, network-sized and whole
+        const size_t pieces[] = { 1, 1460, patch.size() };
+        for (size_t i = 0; i < 3; i++) {
+            if (trial % 10 != 0 && pieces[i] == 1) {
+                continue;
+            }
+            if (apply(source, patch, pieces[i], &target) != ESP_OK) {
+                return fail("a patch did not rebuild its target");
+            }
+        }
+        patch_bytes += patch.size();
+        image_bytes += target.size();
+    }
+    printf("Round trip: %d patches rebuilt their targets, fed whole, in network-sized pieces and byte by byte "
+           "(patches %.0f%% of the image)\n", TRIALS, 100.0 * patch_bytes / image_bytes);
+    return 0;
+}
+
+static int check_rejected() {
+    std::vector<uint8_t> source = make_image(256 * 1024);
+    std::vector<uint8_t> target;
+    std::vector<uint8_t> patch;
+    make_patch(source, &target, &patch);
+
+    // Built against another image
+    std::vector<uint8_t> other = make_image(256 * 1024);
+    if (apply(other, patch, 4096, NULL) != ESP_ERR_INVALID_VERSION) {
+        return fail("a patch for another image was applied");
+    }
+
+    // Any changed byte after the header breaks the target digest, or the
+    // op stream itself
+    int refused = 0;
+    for (int trial = 0; trial < 200; trial++) {
+        std::vector<uint8_t> damaged = patch;
+        size_t pos = OTA_DELTA_HEADER_SIZE + next_random() % (patch.size() - OTA_DELTA_HEADER_SIZE);
+        damaged[pos] ^= 1 + next_random() % 255;
+        if (apply(source, damaged, 4096, NULL) == ESP_OK) {
+            return fail("a damaged patch was applied");
+        }
+        refused++;
+    }
+
+    // Cut short anywhere
+    for (int trial = 0; trial < 50; trial++) {
+        std::vector<uint8_t> cut(patch.begin(), patch.begin() + next_random() % patch.size());
+        if (apply(source, cut, 4096, NULL) == ESP_OK) {
+            return fail("a truncated patch was applied");
+        }
+    }
+
+    // Ops that read past the source, or write past the declared target
+    std::vector<uint8_t> outside(patch.begin(), patch.begin() + OTA_DELTA_HEADER_SIZE);
+    outside.push_back(0x01);
+    put_le32(&outside, source.size() - 16);
+    put_le32(&outside, 32);
+    if (apply(source, outside, 4096, NULL) != ESP_ERR_INVALID_RESPONSE) {
+        return fail("a COPY past the end of the source was applied");
+    }
+    std::vector<uint8_t> longer(patch.begin(), patch.begin() + OTA_DELTA_HEADER_SIZE);
+    longer.push_back(0x03);
+    put_le32(&longer, target.size() + 1);
+    if (apply(source, longer, 4096, NULL) != ESP_ERR_INVALID_SIZE) {
+        return fail("an op past the declared target size was applied");
+    }
+    printf("Rejected: a patch for another image, %d damaged, 50 truncated, ops outside the images\n", refused);
+    return 0;
+}
+
+static bool read_file(const char* path, std::vector<uint8_t>* data) {
+    FILE* file = fopen(path, "rb");
+    if (file == NULL) {
+        return false;
+    }
+    uint8_t buf[4096];
+    size_t len;
+    data->clear();
+    while ((len = fread(buf, 1, sizeof(buf), file)) > 0) {
+        data->insert(data->end(), buf, buf + len);
+    }
+    fclose(file);
+    return true;
+}
+
+int main(int argc, char** argv) {
+    if (argc == 4) {
+        std::vector<uint8_t> source;
+        std::vector<uint8_t> patch;
+        std::vector<uint8_t> target;
+        if (!read_file(argv[1], &source) || !read_file(argv[2], &patch) || !read_file(argv[3], &target)) {
+            fprintf(stderr, "cannot read the images or the patch\n");
+            return 2;
+        }
+        if (source.size() < 32 || source.size() > PARTITION_SIZE || target.size() > PARTITION_SIZE) {
+            fprintf(stderr, "images must fit the %d byte partition\n", PARTITION_SIZE);
+            return 2;
+        }
+        esp_err_t err = apply(source, patch, 1460, &target);
+        if (err != ESP_OK) {
+            printf("FAIL: %s\n", esp_err_to_name(err));
+            return 1;
+        }
+        printf("%s rebuilt %s from %s (%u byte patch, %u byte image)\n", argv[2], argv[3], argv[1],
+               (unsigned int)patch.size(), (unsigned int)target.size());
+        return 0;
+    }
+    if (argc != 1) {
+        fprintf(stderr, "usage: %s [old.bin update.patch new.bin]\n", argv[0]);
+        return 2;
+    }
+    if (check_round_trip() != 0 || check_rejected() != 0) {
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,317 @@
+// Run the two OTA stages on the host against a simulated slow network and
+// slow flash: that every byte reaches the partition in order, that the
+// flash stage drains the ring after the last read, and that a failed
+// flash write stops the download. Also compares the time of the pipeline
+// with reading and writing in turn, as the updater did before.
+//
+// Build and run from the repository root:
+//
+//     g++ -O2 -Iinclude -pthread -o ota_pipeline_sim tools/ota_pipeline_sim.cpp
+//     ./ota_pipeline_sim
+//
+// The stages follow OtaUpdater::downloadImage and OtaUpdater::flashTask:
+// reads of up to OTA_CHUNK_SIZE go into a byte ring of
+// OTA_RING_BUFFER_SIZE, and the flash stage takes up to OTA_CHUNK_SIZE at
+// a time, erasing each sector ahead of its first write. The network
+// delivers TCP-sized reads with the odd stall; the flash costs a sector
+// erase and a page program time per byte, as on the ESP32. Time runs
+// TIME_SCALE times faster than on the device. Exits non-zero on the first
+// failure.
+
+#include "config.h"
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <thread>
+#include <vector>
+
+#define TIME_SCALE 20
+#define IMAGE_SIZE (1024 * 1024)
+#define SECTOR_SIZE 4096
+#define STAGE_POLL_MS 100           // As OTA_STAGE_POLL_MS
+
+// Device rates, before scaling
+#define SECTOR_ERASE_US 40000       // One 4 KB sector
+#define PROGRAM_US_PER_KB 2800      // 256-byte pages at about 0.7 ms each
+#define STALL_US 60000              // A lost segment waiting for retransmission
+
+static uint32_t s_seed = 1;
+
+static uint32_t next_random() {
+    s_seed = s_seed * 1664525u + 1013904223u;
+    return s_seed >> 8;
+}
+
+static void device_sleep(int64_t us) {
+    std::this_thread::sleep_for(std::chrono::microseconds(us / TIME_SCALE));
+}
+
+static int fail(const char* what) {
+    printf("FAIL: %s\n", what);
+    return 1;
+}
+
+// Byte ring with the semantics the stages rely on: a send waits until the
+// whole chunk fits, a receive returns what is contiguous up to a limit,
+// and the space is only given back once the receiver is done with it
+class ByteRing {
+public:
+    explicit ByteRing(size_t size) : _buf(size), _head(0), _used(0), _held(0) {}
+
+    bool send(const uint8_t* data, size_t len, int timeout_ms) {
+        std::unique_lock<std::mutex> lock(_mutex);
+        if (!_changed.wait_for(lock, std::chrono::milliseconds(timeout_ms),
+                               [&] { return _buf.size() - _used >= len; })) {
+            return false;
+        }
+        size_t tail = (_head + _used) % _buf.size();
+        for (size_t i = 0; i < len; i++) {
+            _buf[(tail + i) % _buf.size()] = data[i];
+        }
+        _used += len;
+        _changed.notify_all();
+        return true;
+    }
+
+    const uint8_t* receiveUpTo(size_t* len, int timeout_ms, size_t max) {
+        std::unique_lock<std::mutex> lock(_mutex);
+        if (!_changed.wait_for(lock, std::chrono::milliseconds(timeout_ms), [&] { return _used > 0; })) {
+            return NULL;
+        }
+        size_t contiguous = _buf.size() - _head;
+        _held = _used < contiguous ? _used : contiguous;
+        if (_held > max) {
+            _held = max;
+        }
+        *len = _held;
+        return &_buf[_head];
+    }
+
+    void returnItem() {
+        std::lock_guard<std::mutex> lock(_mutex);
+        _head = (_head + _held) % _buf.size();
+        _used -= _held;
+        _held = 0;
+        _changed.notify_all();
+    }
+
+private:
+    std::mutex _mutex;
+    std::condition_variable _changed;
+    std::vector<uint8_t> _buf;
+    size_t _head;
+    size_t _used;
+    size_t _held;
+};
+
+// A connection at a given rate; reads return what one or a few segments
+// carried, like esp_http_client_read
+class Network {
+public:
+    Network(const std::vector<uint8_t>* image, uint32_t rate) : _image(image), _rate(rate), _offset(0) {}
+
+    int read(uint8_t* buf, size_t size) {
+        size_t len = 536 + next_random() % (OTA_CHUNK_SIZE - 536 + 1);
+        if (len > size) {
+            len = size;
+        }
+        if (len > _image->size() - _offset) {
+            len = _image->size() - _offset;
+        }
+        int64_t us = (int64_t)len * 1000000 / _rate;
+        if (next_random() % 100 == 0) {
+            us += STALL_US;
+        }
+        device_sleep(us);
+        memcpy(buf, &(*_image)[_offset], len);
+        _offset += len;
+        return (int)len;
+    }
+
+private:
+    const std::vector<uint8_t>* _image;
+    uint32_t _rate;
+    size_t _offset;
+};
+
+// An OTA partition that takes the flash's time, and refuses writes to
+// sectors that were not erased or, on demand, any write past an offset
+class Flash {
+public:
+    Flash(size_t fail_at) : _data(IMAGE_SIZE, 0xFF), _erased(IMAGE_SIZE / SECTOR_SIZE, false),
+                            _erases(0), _write_offset(0), _erased_end(0), _fail_at(fail_at) {}
+
+    bool write(const uint8_t* data, size_t len) {
+        size_t end = _write_offset + len;
+        if (end > _data.size() || end > _fail_at) {
+            return false;
+        }
+        while (end > _erased_end) {
+            device_sleep(SECTOR_ERASE_US);
+            _erased[_erased_end / SECTOR_SIZE] = true;
+            _erases++;
+            _erased_end += SECTOR_SIZE;
+        }
+        for (size_t offset = _write_offset; offset < end; offset += SECTOR_SIZE - offset % SECTOR_SIZE) {
+            if (!_erased[offset / SECTOR_SIZE]) {
+                return false;
+            }
+        }
+        device_sleep((int64_t)len * PROGRAM_US_PER_KB / 1024);
+        memcpy(&_data[_write_offset], data, len);
+        _write_offset = end;
+        return true;
+    }
+
+    const std::vector<uint8_t>& data() const { return _data; }
+    size_t written() const { return _write_offset; }
+    int erases() const { return _erases; }
+
+private:
+    std::vector<uint8_t> _data;
+    std::vector<bool> _erased;
+    int _erases;
+    size_t _write_offset;
+    size_t _erased_end;
+    size_t _fail_at;
+};
+
+typedef struct {
+    ByteRing* ring;
+    Flash* flash;
+    std::atomic<bool> download_done;
+    std::atomic<bool> failed;
+} pipeline_t;
+
+// As OtaUpdater::flashTask
+static void flash_stage(pipeline_t* pipeline) {
+    while (!pipeline->failed) {
+        // Sampled before the receive, so an empty receive after the last
+        // send means the ring is drained
+        bool done = pipeline->download_done;
+
+        size_t len = 0;
+        const uint8_t* item = pipeline->ring->receiveUpTo(&len, STAGE_POLL_MS, OTA_CHUNK_SIZE);
+        if (item == NULL) {
+            if (done) {
+                break;
+            }
+            continue;
+        }
+        bool ok = pipeline->flash->write(item, len);
+        pipeline->ring->returnItem();
+        if (!ok) {
+            pipeline->failed = true;
+            break;
+        }
+    }
+}
+
+// As OtaUpdater::downloadImage; returns the bytes read from the network
+static size_t run_pipeline(Network* network, Flash* flash) {
+    ByteRing ring(OTA_RING_BUFFER_SIZE);
+    pipeline_t pipeline;
+    pipeline.ring = &ring;
+    pipeline.flash = flash;
+    pipeline.download_done = false;
+    pipeline.failed = false;
+    std::thread flash_task(flash_stage, &pipeline);
+
+    uint8_t buffer[OTA_CHUNK_SIZE];
+    size_t downloaded = 0;
+    while (!pipeline.failed) {
+        int bytes_read = network->read(buffer, sizeof(buffer));
+        if (bytes_read == 0) {
+            break;
+        }
+        while (!ring.send(buffer, bytes_read, STAGE_POLL_MS)) {
+            if (pipeline.failed) {
+                break;
+            }
+        }
+        downloaded += bytes_read;
+    }
+
+    pipeline.download_done = true;
+    flash_task.join();
+    return downloaded;
+}
+
+// The updater before the pipeline: read a chunk, write it, repeat
+static void run_in_turn(Network* network, Flash* flash) {
+    uint8_t buffer[OTA_CHUNK_SIZE];
+    int bytes_read;
+    while ((bytes_read = network->read(buffer, sizeof(buffer))) > 0) {
+        if (!flash->write(buffer, bytes_read)) {
+            return;
+        }
+    }
+}
+
+static double seconds_since(std::chrono::steady_clock::time_point start) {
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count() * TIME_SCALE;
+}
+
+static int check_delivery(const std::vector<uint8_t>& image, uint32_t rate, const char* name) {
+    Network in_turn_network(&image, rate);
+    Flash in_turn_flash(IMAGE_SIZE);
+    auto start = std::chrono::steady_clock::now();
+    run_in_turn(&in_turn_network, &in_turn_flash);
+    double in_turn = seconds_since(start);
+
+    Network network(&image, rate);
+    Flash flash(IMAGE_SIZE);
+    start = std::chrono::steady_clock::now();
+    run_pipeline(&network, &flash);
+    double pipelined = seconds_since(start);
+
+    if (flash.written() != image.size() || flash.data() != image) {
+        return fail("the partition does not hold the image");
+    }
+    if (flash.erases() != IMAGE_SIZE / SECTOR_SIZE) {
+        return fail("a sector was erased more than once");
+    }
+    if (pipelined >= in_turn) {
+        return fail("the pipeline was not faster than reading and writing in turn");
+    }
+    printf("%-13s %4lu KB/s: in turn %5.1f s, pipelined %5.1f s (%2.0f%% less)\n", name,
+           (unsigned long)(rate / 1024), in_turn, pipelined, (1.0 - pipelined / in_turn) * 100.0);
+    return 0;
+}
+
+static int check_flash_failure(const std::vector<uint8_t>& image) {
+    // A fast network fills the ring while the flash stage fails part way
+    for (int trial = 0; trial < 5; trial++) {
+        size_t fail_at = (1 + next_random() % 15) * IMAGE_SIZE / 16;
+        Network network(&image, 4 * 1024 * 1024);
+        Flash flash(fail_at);
+        size_t downloaded = run_pipeline(&network, &flash);
+        if (flash.written() > fail_at) {
+            return fail("a write past the failure was accepted");
+        }
+        if (downloaded >= image.size() || downloaded > flash.written() + OTA_RING_BUFFER_SIZE + 2 * OTA_CHUNK_SIZE) {
+            return fail("the download went on after the flash stage failed");
+        }
+    }
+    printf("Flash failure: the download stopped within a ring buffer of the failed write in 5 of 5\n");
+    return 0;
+}
+
+int main() {
+    std::vector<uint8_t> image(IMAGE_SIZE);
+    for (size_t i = 0; i < image.size(); i++) {
+        image[i] = (uint8_t)next_random();
+    }
+
+    // The flash writes about 70 KB/s with erases; networks either side of it
+    if (check_delivery(image, 40 * 1024, "Slow network") != 0 ||
+        check_delivery(image, 70 * 1024, "Even") != 0 ||
+        check_delivery(image, 400 * 1024, "Slow flash") != 0) {
+        return 1;
+    }
+    return check_flash_failure(image);
+}
@@ -0,0 +1,231 @@
+// Check the OTA progress snapshot on the host: that readers on other
+// threads never see fields from two different updates while the update
+// task publishes as fast as it can, and that every progress event is
+// well formed and fits its buffer. Also measures the cost of a publish
+// and a read, and shows how often a plain copy of the fields tears.
+//
+// Build and run from the repository root:
+//
+//     g++ -O2 -Iinclude -Isrc -Itools/host -pthread -o ota_progress_check tools/ota_progress_check.cpp src/ota_progress.cpp
+//     ./ota_progress_check
+//
+// Exits non-zero on the first failure.
+
+#include "ota_progress.h"
+#include <atomic>
+#include <chrono>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <thread>
+#include <vector>
+
+#define READERS 3
+#define RUN_SECONDS 2
+
+// Keeps the timed reads from being optimised away
+static volatile uint32_t s_sink;
+
+static int fail(const char* what) {
+    printf("FAIL: %s\n", what);
+    return 1;
+}
+
+// Every field is derived from n, so a mix of two updates shows
+static ota_progress_t progress_for(uint32_t n) {
+    ota_progress_t progress;
+    progress.phase = (ota_phase_t)(n % (OTA_PHASE_FAILED + 1));
+    progress.error = (esp_err_t)n;
+    progress.bytes = n * 3;
+    progress.total = n * 3 + 1;
+    progress.download_rate = ~n;
+    progress.flash_rate = n ^ 0x5A5A5A5A;
+    return progress;
+}
+
+static bool consistent(const ota_progress_t& progress) {
+    ota_progress_t expected = progress_for((uint32_t)progress.error);
+    return memcmp(&progress, &expected, sizeof(progress)) == 0;
+}
+
+typedef struct {
+    uint64_t reads;
+    uint64_t torn;
+    uint64_t backwards;
+} reader_result_t;
+
+static void reader(const OtaProgress* store, const std::atomic<bool>* stop, reader_result_t* result) {
+    uint32_t last = 0;
+    while (!stop->load(std::memory_order_relaxed)) {
+        ota_progress_t progress;
+        store->read(&progress);
+        result->reads++;
+        if (!consistent(progress)) {
+            result->torn++;
+        } else if ((uint32_t)progress.error < last) {
+            result->backwards++;
+        } else {
+            last = (uint32_t)progress.error;
+        }
+    }
+}
+
+// The same fields copied without the sequence counter, for comparison
+static void plain_reader(const std::atomic<uint32_t>* fields, const std::atomic<bool>* stop,
+                         reader_result_t* result) {
+    while (!stop->load(std::memory_order_relaxed)) {
+        uint32_t a = fields[0].load(std::memory_order_relaxed);
+        uint32_t b = fields[1].load(std::memory_order_relaxed);
+        result->reads++;
+        if (b != a * 3) {
+            result->torn++;
+        }
+    }
+}
+
+static int check_concurrent() {
+    OtaProgress store;
+    store.publish(progress_for(0));
+    std::atomic<bool> stop(false);
+    reader_result_t results[READERS] = {};
+    std::vector<std::thread> threads;
+    for (int i = 0; i < READERS; i++) {
+        threads.emplace_back(reader, &store, &stop, &results[i]);
+    }
+
+    uint32_t published = 0;
+    auto start = std::chrono::steady_clock::now();
+    while (std::chrono::steady_clock::now() - start < std::chrono::seconds(RUN_SECONDS)) {
+        for (int i = 0; i < 1000; i++) {
+            store.publish(progress_for(++published));
+        }
+    }
+    stop = true;
+    for (auto& thread : threads) {
+        thread.join();
+    }
+
+    uint64_t reads = 0;
+    for (int i = 0; i < READERS; i++) {
+        if (results[i].torn != 0) {
+            return fail("a reader saw fields from two updates");
+        }
+        if (results[i].backwards != 0) {
+            return fail("a reader saw progress go backwards");
+        }
+        reads += results[i].reads;
+    }
+    printf("Concurrent: %u publishes, %llu snapshots on %d readers, none torn\n", published,
+           (unsigned long long)reads, READERS);
+
+    // Without the counter, the same race does tear
+    std::atomic<uint32_t> fields[2];
+    fields[0] = 0;
+    fields[1] = 0;
+    stop = false;
+    reader_result_t plain = {};
+    std::thread plain_thread(plain_reader, fields, &stop, &plain);
+    start = std::chrono::steady_clock::now();
+    for (uint32_t n = 1; std::chrono::steady_clock::now() - start < std::chrono::milliseconds(500); n++) {
+        fields[0].store(n, std::memory_order_relaxed);
+        fields[1].store(n * 3, std::memory_order_relaxed);
+    }
+    stop = true;
+    plain_thread.join();
+    printf("Plain copy: %llu of %llu reads mixed two updates\n", (unsigned long long)plain.torn,
+           (unsigned long long)plain.reads);
+    return 0;
+}
+
+// Pull the value after "key": out of an event's JSON
+static bool field(const char* event, const char* key, char* value, size_t len) {
+    char pattern[32];
+    snprintf(pattern, sizeof(pattern), "\"%s\":", key);
+    const char* start = strstr(event, pattern);
+    if (start == NULL) {
+        return false;
+    }
+    start += strlen(pattern);
+    if (*start == '"') {
+        start++;
+    }
+    size_t n = strcspn(start, "\",}");
+    if (n >= len) {
+        return false;
+    }
+    memcpy(value, start, n);
+    value[n] = '\0';
+    return true;
+}
+
+static int check_events() {
+    const esp_err_t errors[] = { ESP_OK, ESP_FAIL, ESP_ERR_NO_MEM, ESP_ERR_INVALID_RESPONSE, ESP_ERR_INVALID_VERSION,
+                                 0x7FFF };
+    int checked = 0;
+    for (int phase = OTA_PHASE_IDLE; phase <= OTA_PHASE_FAILED; phase++) {
+        for (size_t e = 0; e < sizeof(errors) / sizeof(errors[0]); e++) {
+            const uint32_t sizes[][2] = { { 0, 0 }, { 524288, 1245184 }, { 1245184, 1245184 },
+                                          { UINT32_MAX, UINT32_MAX } };
+            for (size_t s = 0; s < 4; s++) {
+                ota_progress_t progress = { (ota_phase_t)phase, errors[e], sizes[s][0], sizes[s][1],
+                                            UINT32_MAX, UINT32_MAX };
+                char event[OTA_PROGRESS_EVENT_SIZE];
+                int len = OtaProgress::formatEvent(event, sizeof(event), progress);
+                if (len <= 0 || len >= (int)sizeof(event)) {
+                    return fail("an event does not fit its buffer");
+                }
+                if (strncmp(event, "event: progress\ndata: {", 23) != 0 ||
+                    strcmp(event + len - 3, "}\n\n") != 0 || strchr(event + 23, '\n') != event + len - 2) {
+                    return fail("an event is not one SSE event with one data line");
+                }
+
+                char value[32];
+                int percent = OtaProgress::percent(progress);
+                if (!field(event, "phase", value, sizeof(value)) ||
+                    strcmp(value, OtaProgress::phaseName(progress.phase)) != 0 ||
+                    !field(event, "progress", value, sizeof(value)) || atoi(value) != percent ||
+                    !field(event, "bytes", value, sizeof(value)) || strtoul(value, NULL, 10) != progress.bytes ||
+                    !field(event, "total", value, sizeof(value)) || strtoul(value, NULL, 10) != progress.total ||
+                    !field(event, "error", value, sizeof(value)) || strcmp(value, esp_err_to_name(progress.error)) != 0) {
+                    return fail("an event does not carry its snapshot");
+                }
+                if (percent < 0 || percent > 100 || (phase == OTA_PHASE_SUCCESS && percent != 100)) {
+                    return fail("progress is out of range");
+                }
+                checked++;
+            }
+        }
+    }
+    if (strcmp(OtaProgress::phaseName((ota_phase_t)99), "unknown") != 0) {
+        return fail("an unknown phase has a name");
+    }
+    printf("Events: %d snapshots formatted as one event each, within %d bytes\n", checked, OTA_PROGRESS_EVENT_SIZE);
+    return 0;
+}
+
+static void measure() {
+    OtaProgress store;
+    ota_progress_t progress = progress_for(1);
+    const int rounds = 10000000;
+    auto start = std::chrono::steady_clock::now();
+    for (int i = 0; i < rounds; i++) {
+        progress.bytes = i;
+        store.publish(progress);
+    }
+    double publish = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    start = std::chrono::steady_clock::now();
+    for (int i = 0; i < rounds; i++) {
+        store.read(&progress);
+        s_sink = progress.bytes;
+    }
+    double read = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    printf("Publish %.1f ns, read %.1f ns on this host\n", publish / rounds * 1e9, read / rounds * 1e9);
+}
+
+int main() {
+    if (check_concurrent() != 0 || check_events() != 0) {
+        return 1;
+    }
+    measure();
+    return 0;
+}
@@ -0,0 +1,347 @@
+// Check on the host that interrupted OTA downloads resume into a correct
+// image: against a server that drops connections at random offsets, with
+// reboots between and during attempts, a server whose image changes part
+// way, and one that ignores Range requests. Also reports how much was
+// downloaded again.
+//
+// Build and run from the repository root:
+//
+//     g++ -O2 -Iinclude -Isrc -o ota_resume_check tools/ota_resume_check.cpp src/ota_resume.cpp
+//     ./ota_resume_check
+//
+// The device side follows OtaUpdater::updateTask and downloadImage, and
+// uses the same OtaResume rules. The partition is NOR flash: a write can
+// only clear bits, so writing over bytes that were not erased shows up as
+// a corrupt image rather than passing unnoticed. A reboot keeps the
+// partition and the persisted state and loses everything else. Exits
+// non-zero on the first failure.
+
+#include "config.h"
+#include "ota_resume.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+#include <vector>
+
+#define IMAGE_SIZE (600 * 1024 + 123)
+#define PARTITION_SIZE (1024 * 1024)
+#define SECTOR_SIZE 4096
+#define PARTITION_ADDRESS 0x110000
+#define TRIALS 200
+
+static const char* IMAGE_URL = "http://firmware.local/switch.bin";
+
+static uint32_t s_seed = 1;
+
+static uint32_t next_random() {
+    s_seed = s_seed * 1664525u + 1013904223u;
+    return s_seed >> 8;
+}
+
+static int fail(const char* scenario, const char* what) {
+    printf("FAIL (%s): %s\n", scenario, what);
+    return 1;
+}
+
+static std::vector<uint8_t> make_image(size_t size) {
+    std::vector<uint8_t> image(size);
+    for (size_t i = 0; i < size; i++) {
+        image[i] = (uint8_t)next_random();
+    }
+    image[0] = 0xE9;
+    return image;
+}
+
+// Stands in for the firmware server. Every connection may be cut after a
+// random number of bytes, ending in a read error or an early close.
+class Server {
+public:
+    Server(const std::vector<uint8_t>* image, bool etags, bool ranges, int drop_percent)
+        : _image(image), _version(1), _etags(etags), _ranges(ranges), _drop_percent(drop_percent),
+          _offset(0), _end(0), _error_at_end(false), _bytes_sent(0) {}
+
+    void publish(const std::vector<uint8_t>* image) {
+        _image = image;
+        _version++;
+    }
+
+    std::string etag() const { return _etags ? "\"v" + std::to_string(_version) + "\"" : ""; }
+
+    // Answer a request; returns the status, fills the headers the device reads
+    int open(size_t offset, const char* if_range, std::string* etag_header, std::string* content_range) {
+        *etag_header = etag();
+        content_range->clear();
+        _offset = 0;
+        if (offset > 0 && _ranges && offset < _image->size() && !etag_header->empty() && *etag_header == if_range) {
+            _offset = offset;
+            *content_range = "bytes " + std::to_string(offset) + "-" + std::to_string(_image->size() - 1) + "/" +
+                             std::to_string(_image->size());
+        }
+        _end = _image->size();
+        _error_at_end = false;
+        if ((int)(next_random() % 100) < _drop_percent) {
+            _end = _offset + next_random() % (_image->size() - _offset);
+            _error_at_end = next_random() & 1;
+        }
+        return _offset > 0 ? 206 : 200;
+    }
+
+    size_t contentLength() const { return _image->size() - _offset; }
+
+    // As esp_http_client_read: bytes, 0 at the end, -1 on error
+    int read(uint8_t* buf, size_t size) {
+        if (_offset >= _end) {
+            return _error_at_end ? -1 : 0;
+        }
+        size_t len = 536 + next_random() % (size - 536 + 1);
+        if (len > _end - _offset) {
+            len = _end - _offset;
+        }
+        memcpy(buf, &(*_image)[_offset], len);
+        _offset += len;
+        _bytes_sent += len;
+        return (int)len;
+    }
+
+    bool completed() const { return _offset == _image->size(); }
+    size_t bytesSent() const { return _bytes_sent; }
+
+private:
+    const std::vector<uint8_t>* _image;
+    int _version;
+    bool _etags;
+    bool _ranges;
+    int _drop_percent;
+    size_t _offset;
+    size_t _end;
+    bool _error_at_end;
+    size_t _bytes_sent;
+};
+
+// What survives a reboot: the partition and the persisted resume state
+typedef struct {
+    std::vector<uint8_t> partition;
+    bool saved_valid;
+    ota_resume_state_t saved;
+    bool corrupt;               // A write needed a bit set that was not erased
+} device_flash_t;
+
+// What an update keeps in RAM, as ota_pipeline_t
+typedef struct {
+    ota_resume_state_t resume;
+    size_t download_offset;
+    size_t write_offset;
+    size_t erased_end;
+} update_state_t;
+
+typedef enum {
+    ATTEMPT_DONE,
+    ATTEMPT_FAILED,
+    ATTEMPT_REBOOTED
+} attempt_t;
+
+static void write_image(device_flash_t* flash, update_state_t* update, const uint8_t* data, size_t len) {
+    size_t end = update->write_offset + len;
+    if (end > update->erased_end) {
+        size_t erase_end = OtaResume::erasedEnd(end, SECTOR_SIZE);
+        memset(&flash->partition[update->erased_end], 0xFF, erase_end - update->erased_end);
+        update->erased_end = erase_end;
+    }
+    for (size_t i = 0; i < len; i++) {
+        uint8_t* byte = &flash->partition[update->write_offset + i];
+        if ((*byte & data[i]) != data[i]) {
+            flash->corrupt = true;
+        }
+        *byte &= data[i];
+    }
+    update->write_offset = end;
+}
+
+// One HTTP request, as OtaUpdater::downloadImage
+static attempt_t download(Server* server, device_flash_t* flash, update_state_t* update, int reboot_per_mille) {
+    std::string etag;
+    std::string content_range;
+    int status = server->open(update->download_offset, update->resume.etag, &etag, &content_range);
+
+    ota_response_action_t action = OtaResume::classify(status, update->download_offset);
+    if (action == OTA_RESPONSE_REJECT) {
+        return ATTEMPT_FAILED;
+    }
+    if (action == OTA_RESPONSE_RESTART) {
+        update->download_offset = 0;
+        update->write_offset = 0;
+        update->erased_end = 0;
+    }
+    if (update->download_offset == 0) {
+        update->resume.total = server->contentLength();
+    } else if (OtaResume::rangeTotal(content_range.c_str()) > 0) {
+        update->resume.total = OtaResume::rangeTotal(content_range.c_str());
+    }
+    if (update->download_offset == 0) {
+        strncpy(update->resume.etag, etag.c_str(), sizeof(update->resume.etag) - 1);
+        update->resume.offset = 0;
+        flash->saved_valid = update->resume.etag[0] != '\0';
+        flash->saved = update->resume;
+    }
+
+    uint8_t buffer[OTA_CHUNK_SIZE];
+    for (;;) {
+        int bytes_read = server->read(buffer, sizeof(buffer));
+        if (bytes_read < 0) {
+            return ATTEMPT_FAILED;
+        }
+        if (bytes_read == 0) {
+            return server->completed() ? ATTEMPT_DONE : ATTEMPT_FAILED;
+        }
+        write_image(flash, update, buffer, bytes_read);
+        update->download_offset += bytes_read;
+
+        if (update->resume.etag[0] != '\0' && OtaResume::checkpointDue(&update->resume, update->write_offset)) {
+            update->resume.offset = update->write_offset;
+            flash->saved_valid = true;
+            flash->saved = update->resume;
+        }
+        if ((int)(next_random() % 1000) < reboot_per_mille) {
+            return ATTEMPT_REBOOTED;
+        }
+    }
+}
+
+// One update after a boot, as OtaUpdater::updateTask
+static attempt_t update(Server* server, device_flash_t* flash, int reboot_per_mille, int* resumes) {
+    update_state_t state = {};
+    strncpy(state.resume.url, IMAGE_URL, sizeof(state.resume.url) - 1);
+    state.resume.partition_address = PARTITION_ADDRESS;
+    if (flash->saved_valid && OtaResume::matches(&flash->saved, &state.resume, PARTITION_SIZE)) {
+        state.resume = flash->saved;
+        state.download_offset = flash->saved.offset;
+        state.write_offset = flash->saved.offset;
+        state.erased_end = OtaResume::erasedEnd(flash->saved.offset, SECTOR_SIZE);
+        (*resumes)++;
+    }
+
+    attempt_t result = ATTEMPT_FAILED;
+    for (int attempt = 0; attempt <= OTA_MAX_RETRIES; attempt++) {
+        result = download(server, flash, &state, reboot_per_mille);
+        if (result != ATTEMPT_FAILED) {
+            break;
+        }
+    }
+    if (result == ATTEMPT_DONE) {
+        if (state.write_offset != state.resume.total) {
+            flash->corrupt = true;
+        }
+        flash->saved_valid = false;
+    } else if (result == ATTEMPT_FAILED && state.resume.etag[0] != '\0' &&
+               state.write_offset > state.resume.offset) {
+        state.resume.offset = state.write_offset;
+        flash->saved_valid = true;
+        flash->saved = state.resume;
+    }
+    return result;
+}
+
+typedef struct {
+    const char* name;
+    bool etags;
+    bool ranges;
+    int drop_percent;           // Connections cut short
+    int reboot_per_mille;       // Reboots per chunk read
+    bool replace_image;         // The server publishes a new image part way
+} scenario_t;
+
+static int run(const scenario_t* scenario, const std::vector<uint8_t>& image, const std::vector<uint8_t>& newer) {
+    size_t sent = 0;
+    int resumes = 0;
+    int updates = 0;
+    for (int trial = 0; trial < TRIALS; trial++) {
+        Server server(&image, scenario->etags, scenario->ranges, scenario->drop_percent);
+        device_flash_t flash;
+        flash.partition.assign(PARTITION_SIZE, 0x00);   // Whatever an older image left
+        flash.saved_valid = false;
+        flash.corrupt = false;
+        const std::vector<uint8_t>* expected = &image;
+
+        attempt_t result = ATTEMPT_FAILED;
+        for (int round = 0; round < 100 && result != ATTEMPT_DONE; round++) {
+            if (scenario->replace_image && round == 1) {
+                server.publish(&newer);
+                expected = &newer;
+            }
+            result = update(&server, &flash, scenario->reboot_per_mille, &resumes);
+            updates++;
+        }
+        if (result != ATTEMPT_DONE) {
+            return fail(scenario->name, "the update never completed");
+        }
+        if (flash.corrupt || memcmp(&flash.partition[0], &(*expected)[0], expected->size()) != 0) {
+            return fail(scenario->name, "the partition does not hold the image");
+        }
+        sent += server.bytesSent();
+    }
+    printf("%-24s %d images intact after %d updates, %d resumed from a saved offset, %.2fx the image downloaded\n",
+           scenario->name, TRIALS, updates, resumes, (double)sent / ((double)TRIALS * image.size()));
+    return 0;
+}
+
+static int check_rules() {
+    ota_resume_state_t current = {};
+    strncpy(current.url, IMAGE_URL, sizeof(current.url) - 1);
+    current.partition_address = PARTITION_ADDRESS;
+    ota_resume_state_t saved = current;
+    strcpy(saved.etag, "\"v1\"");
+    saved.offset = 65536;
+    if (!OtaResume::matches(&saved, &current, PARTITION_SIZE)) {
+        return fail("rules", "a matching saved state was not resumed");
+    }
+    ota_resume_state_t other = saved;
+    other.partition_address += PARTITION_SIZE;
+    if (OtaResume::matches(&other, &current, PARTITION_SIZE)) {
+        return fail("rules", "a state for the other partition was resumed");
+    }
+    other = saved;
+    other.etag[0] = '\0';
+    if (OtaResume::matches(&other, &current, PARTITION_SIZE)) {
+        return fail("rules", "a state without an identity was resumed");
+    }
+    other = saved;
+    other.offset = PARTITION_SIZE + 1;
+    if (OtaResume::matches(&other, &current, PARTITION_SIZE)) {
+        return fail("rules", "an offset past the partition was resumed");
+    }
+    if (OtaResume::classify(206, 0) != OTA_RESPONSE_REJECT || OtaResume::classify(416, 100) != OTA_RESPONSE_REJECT ||
+        OtaResume::classify(200, 100) != OTA_RESPONSE_RESTART || OtaResume::classify(206, 100) != OTA_RESPONSE_CONTINUE) {
+        return fail("rules", "a response status was misread");
+    }
+    if (OtaResume::rangeTotal("bytes 100-999/1000") != 1000 || OtaResume::rangeTotal("bytes */1000") != 1000 ||
+        OtaResume::rangeTotal("bytes 100-999/*") != 0 || OtaResume::rangeTotal("garbage") != 0) {
+        return fail("rules", "a Content-Range value was misread");
+    }
+    if (OtaResume::erasedEnd(0, SECTOR_SIZE) != 0 || OtaResume::erasedEnd(1, SECTOR_SIZE) != SECTOR_SIZE ||
+        OtaResume::erasedEnd(SECTOR_SIZE, SECTOR_SIZE) != SECTOR_SIZE) {
+        return fail("rules", "the erased end was not rounded to a sector");
+    }
+    return 0;
+}
+
+int main() {
+    std::vector<uint8_t> image = make_image(IMAGE_SIZE);
+    std::vector<uint8_t> newer = make_image(IMAGE_SIZE - 5000);
+    const scenario_t scenarios[] = {
+        { "Dropped connections", true, true, 60, 0, false },
+        { "Drops and reboots", true, true, 60, 3, false },
+        { "Image replaced", true, true, 60, 3, true },
+        { "No ETag", false, true, 30, 0, false },
+        { "Range ignored", true, false, 30, 0, false },
+    };
+    if (check_rules() != 0) {
+        return 1;
+    }
+    for (size_t i = 0; i < sizeof(scenarios) / sizeof(scenarios[0]); i++) {
+        if (run(&scenarios[i], image, newer) != 0) {
+            return 1;
+        }
+    }
+    return 0;
+}
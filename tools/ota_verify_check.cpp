@@ -0,0 +1,274 @@
+// Check the OTA image verifier on the host: that a good image passes its
+// ECDSA signature and its sha256sum manifest however it is split into
+// writes, and that a tampered or truncated image, a signature by another
+// key or a damaged signature or manifest is refused.
+//
+// Build and run from the repository root (needs OpenSSL's libcrypto,
+// which also signs the test images):
+//
+//     g++ -O2 -Iinclude -Isrc -Itools/host -o ota_verify_check tools/ota_verify_check.cpp src/ota_verifier.cpp -lcrypto
+//     ./ota_verify_check                                    # generated images and keys
+//     ./ota_verify_check firmware.bin ota_signing_pub.pem firmware.bin.sig [firmware.bin.sha256]
+//
+// Given files, it runs the device's check on a release before it is
+// published. Exits non-zero on the first failure.
+
+#include "ota_verifier.h"
+#include <openssl/evp.h>
+#include <ctype.h>
+#include <openssl/pem.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+#include <vector>
+
+#define IMAGE_SIZE (1024 * 1024 + 77)
+#define TAMPER_TRIALS 100
+
+static uint32_t s_seed = 1;
+
+static uint32_t next_random() {
+    s_seed = s_seed * 1664525u + 1013904223u;
+    return s_seed >> 8;
+}
+
+static int fail(const char* what) {
+    printf("FAIL: %s\n", what);
+    return 1;
+}
+
+// A signing key pair, as made with openssl ecparam -name prime256v1
+typedef struct {
+    EVP_PKEY* key;
+    std::string public_pem;
+} key_pair_t;
+
+static bool make_key(key_pair_t* pair) {
+    pair->key = EVP_PKEY_Q_keygen(NULL, NULL, "EC", "P-256");
+    if (pair->key == NULL) {
+        return false;
+    }
+    BIO* bio = BIO_new(BIO_s_mem());
+    PEM_write_bio_PUBKEY(bio, pair->key);
+    char* pem;
+    long len = BIO_get_mem_data(bio, &pem);
+    pair->public_pem.assign(pem, len);
+    BIO_free(bio);
+    return true;
+}
+
+static void digest(const std::vector<uint8_t>& image, uint8_t out[32]) {
+    EVP_Digest(image.data(), image.size(), out, NULL, EVP_sha256(), NULL);
+}
+
+// DER signature over the image's SHA-256, as openssl dgst -sha256 -sign
+static std::vector<uint8_t> sign(const key_pair_t* pair, const std::vector<uint8_t>& image) {
+    uint8_t hash[32];
+    digest(image, hash);
+    EVP_PKEY_CTX* ctx = EVP_PKEY_CTX_new(pair->key, NULL);
+    size_t len = 0;
+    EVP_PKEY_sign_init(ctx);
+    EVP_PKEY_CTX_set_signature_md(ctx, EVP_sha256());
+    EVP_PKEY_sign(ctx, NULL, &len, hash, sizeof(hash));
+    std::vector<uint8_t> sig(len);
+    EVP_PKEY_sign(ctx, sig.data(), &len, hash, sizeof(hash));
+    sig.resize(len);
+    EVP_PKEY_CTX_free(ctx);
+    return sig;
+}
+
+// sha256sum output for the image
+static std::string manifest(const std::vector<uint8_t>& image) {
+    uint8_t hash[32];
+    digest(image, hash);
+    char hex[65];
+    for (int i = 0; i < 32; i++) {
+        snprintf(&hex[2 * i], 3, "%02x", hash[i]);
+    }
+    return std::string(hex) + "  firmware.bin\n";
+}
+
+// Hash the image as the flash stage writes it, in pieces of up to
+// max_piece bytes
+static void hash_image(OtaVerifier* verifier, const std::vector<uint8_t>& image, size_t max_piece) {
+    verifier->begin();
+    for (size_t pos = 0; pos < image.size();) {
+        size_t len = 1 + next_random() % max_piece;
+        if (len > image.size() - pos) {
+            len = image.size() - pos;
+        }
+        verifier->update(&image[pos], len);
+        pos += len;
+    }
+    verifier->finish();
+}
+
+static esp_err_t check_signature(const std::vector<uint8_t>& image, const std::string& public_pem,
+                                 const std::vector<uint8_t>& sig) {
+    OtaVerifier verifier;
+    hash_image(&verifier, image, 4096);
+    return verifier.verifySignature(public_pem.c_str(), sig.data(), sig.size());
+}
+
+static esp_err_t check_manifest(const std::vector<uint8_t>& image, const std::string& text) {
+    OtaVerifier verifier;
+    hash_image(&verifier, image, 4096);
+    return verifier.verifyManifest(text.data(), text.size());
+}
+
+static int check_good(const key_pair_t* pair, const std::vector<uint8_t>& image) {
+    std::vector<uint8_t> sig = sign(pair, image);
+    std::string text = manifest(image);
+    const size_t pieces[] = { 1, 1460, 4096, image.size() };
+    for (size_t i = 0; i < 4; i++) {
+        OtaVerifier verifier;
+        hash_image(&verifier, image, pieces[i]);
+        if (verifier.getSize() != image.size()) {
+            return fail("the verifier counted the wrong number of bytes");
+        }
+        if (verifier.verifySignature(pair->public_pem.c_str(), sig.data(), sig.size()) != ESP_OK) {
+            return fail("a good image failed its signature");
+        }
+        if (verifier.verifyManifest(text.data(), text.size()) != ESP_OK) {
+            return fail("a good image failed its manifest");
+        }
+    }
+
+    // What sha256sum -c also accepts: uppercase hex, leading blank lines
+    std::string upper = text;
+    for (size_t i = 0; i < 64; i++) {
+        upper[i] = toupper(upper[i]);
+    }
+    if (check_manifest(image, upper) != ESP_OK || check_manifest(image, "\r\n  " + text) != ESP_OK) {
+        return fail("an equivalent manifest was refused");
+    }
+    printf("Good image: signature and manifest accepted, written byte by byte, in segments and whole\n");
+    return 0;
+}
+
+static int check_tampered(const key_pair_t* pair, const key_pair_t* other, const std::vector<uint8_t>& image) {
+    std::vector<uint8_t> sig = sign(pair, image);
+    std::string text = manifest(image);
+
+    // One flipped bit anywhere in the image
+    for (int trial = 0; trial < TAMPER_TRIALS; trial++) {
+        std::vector<uint8_t> tampered = image;
+        tampered[next_random() % tampered.size()] ^= 1 << (next_random() % 8);
+        if (check_signature(tampered, pair->public_pem, sig) != ESP_ERR_INVALID_CRC ||
+            check_manifest(tampered, text) != ESP_ERR_INVALID_CRC) {
+            return fail("a tampered image was accepted");
+        }
+    }
+
+    // Cut short, or with bytes appended
+    std::vector<uint8_t> truncated(image.begin(), image.end() - 4096);
+    std::vector<uint8_t> appended = image;
+    appended.push_back(0xFF);
+    if (check_signature(truncated, pair->public_pem, sig) == ESP_OK ||
+        check_signature(appended, pair->public_pem, sig) == ESP_OK || check_manifest(truncated, text) == ESP_OK) {
+        return fail("a truncated or extended image was accepted");
+    }
+
+    // Signed by someone else, or checked against the wrong key
+    if (check_signature(image, pair->public_pem, sign(other, image)) != ESP_ERR_INVALID_CRC ||
+        check_signature(image, other->public_pem, sig) != ESP_ERR_INVALID_CRC) {
+        return fail("a signature by another key was accepted");
+    }
+
+    // A damaged signature, or an empty one
+    for (int trial = 0; trial < TAMPER_TRIALS; trial++) {
+        std::vector<uint8_t> damaged = sig;
+        damaged[next_random() % damaged.size()] ^= 1 + next_random() % 255;
+        if (check_signature(image, pair->public_pem, damaged) == ESP_OK) {
+            return fail("a damaged signature was accepted");
+        }
+    }
+    if (check_signature(image, pair->public_pem, std::vector<uint8_t>()) == ESP_OK) {
+        return fail("an empty signature was accepted");
+    }
+
+    // A manifest for another image, cut short, or not hex
+    std::string damaged = text;
+    damaged[next_random() % 64] = damaged[0] == '0' ? '1' : '0';
+    if (check_manifest(image, damaged) != ESP_ERR_INVALID_CRC ||
+        check_manifest(image, manifest(appended)) != ESP_ERR_INVALID_CRC ||
+        check_manifest(image, text.substr(0, 40)) != ESP_ERR_INVALID_SIZE ||
+        check_manifest(image, std::string(64, 'g')) != ESP_ERR_INVALID_ARG) {
+        return fail("a wrong manifest was accepted");
+    }
+
+    // A key that is not a P-256 public key, and a check before the hash
+    OtaVerifier verifier;
+    verifier.begin();
+    if (check_signature(image, "-----BEGIN PUBLIC KEY-----\nAAAA\n-----END PUBLIC KEY-----\n", sig) !=
+            ESP_ERR_INVALID_ARG ||
+        verifier.verifySignature(pair->public_pem.c_str(), sig.data(), sig.size()) != ESP_ERR_INVALID_STATE) {
+        return fail("a bad key or an unfinished hash was not refused");
+    }
+    printf("Tampered: %d flipped bits, truncated and extended images, another key's signature, "
+           "%d damaged signatures and wrong manifests refused\n", TAMPER_TRIALS, TAMPER_TRIALS);
+    return 0;
+}
+
+static bool read_file(const char* path, std::vector<uint8_t>* data) {
+    FILE* file = fopen(path, "rb");
+    if (file == NULL) {
+        return false;
+    }
+    uint8_t buf[4096];
+    size_t len;
+    data->clear();
+    while ((len = fread(buf, 1, sizeof(buf), file)) > 0) {
+        data->insert(data->end(), buf, buf + len);
+    }
+    fclose(file);
+    return true;
+}
+
+// Check release files as the device will
+static int check_files(int argc, char** argv) {
+    std::vector<uint8_t> image;
+    std::vector<uint8_t> key;
+    std::vector<uint8_t> sig;
+    std::vector<uint8_t> text;
+    if (!read_file(argv[1], &image) || !read_file(argv[2], &key) || !read_file(argv[3], &sig) ||
+        (argc == 5 && !read_file(argv[4], &text))) {
+        fprintf(stderr, "cannot read the release files\n");
+        return 2;
+    }
+    std::string public_pem(key.begin(), key.end());
+    esp_err_t err = check_signature(image, public_pem, sig);
+    printf("%s: signature %s\n", argv[1], err == ESP_OK ? "good" : esp_err_to_name(err));
+    if (argc == 5 && err == ESP_OK) {
+        err = check_manifest(image, std::string(text.begin(), text.end()));
+        printf("%s: manifest %s\n", argv[1], err == ESP_OK ? "good" : esp_err_to_name(err));
+    }
+    return err == ESP_OK ? 0 : 1;
+}
+
+int main(int argc, char** argv) {
+    if (argc == 4 || argc == 5) {
+        return check_files(argc, argv);
+    }
+    if (argc != 1) {
+        fprintf(stderr, "usage: %s [image public_key.pem image.sig [image.sha256]]\n", argv[0]);
+        return 2;
+    }
+
+    key_pair_t pair;
+    key_pair_t other;
+    if (!make_key(&pair) || !make_key(&other)) {
+        return fail("cannot make a P-256 key");
+    }
+    std::vector<uint8_t> image(IMAGE_SIZE);
+    for (size_t i = 0; i < image.size(); i++) {
+        image[i] = (uint8_t)next_random();
+    }
+    image[0] = 0xE9;
+
+    int result = check_good(&pair, image) != 0 || check_tampered(&pair, &other, image) != 0;
+    EVP_PKEY_free(pair.key);
+    EVP_PKEY_free(other.key);
+    return result;
+}
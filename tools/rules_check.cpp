@@ -0,0 +1,184 @@
+// Check the switch rule compiler and its inhibit checks on the host: that
+// "B requires A" holds both ways, refusing B on while A is off and A off
+// while B is on, unless "A off -> B off" takes B with it; that "excludes"
+// holds both ways; and that random writes allowed by random rule sets
+// never leave a requires or excludes rule broken.
+//
+// Build and run from the repository root:
+//
+//     g++ -O2 -Iinclude -Isrc -Itools/host -o rules_check tools/rules_check.cpp src/switch_rules.cpp
+//     ./rules_check
+//
+// Exits non-zero on the first failure.
+
+#include "switch_rules.h"
+#include <stdio.h>
+#include <string.h>
+#include <string>
+
+#define CHECK_SWITCHES 8
+#define RANDOM_SETS 2000
+#define RANDOM_WRITES 500
+
+static uint32_t s_seed = 1;
+
+static uint32_t next_random() {
+    s_seed = s_seed * 1664525u + 1013904223u;
+    return s_seed >> 8;
+}
+
+static int fail(const char* what) {
+    printf("FAIL: %s\n", what);
+    return 1;
+}
+
+static bool compile(SwitchRules* rules, const char* text) {
+    char error[96];
+    *rules = SwitchRules();
+    if (rules->compile(text, CHECK_SWITCHES, error, sizeof(error)) != ESP_OK) {
+        printf("FAIL: \"%s\" did not compile: %s\n", text, error);
+        return false;
+    }
+    return true;
+}
+
+// Whether switch id may enter state from states
+static bool allowed(const SwitchRules& rules, int id, bool state, const bool* states) {
+    int evaluated = 0;
+    return rules.check(id, state, states, &evaluated) == NULL;
+}
+
+static int check_requires() {
+    SwitchRules rules;
+    if (!compile(&rules, "1 requires 0")) {
+        return 1;
+    }
+    bool off_off[CHECK_SWITCHES] = {};
+    bool on_off[CHECK_SWITCHES] = { true, false };
+    bool on_on[CHECK_SWITCHES] = { true, true };
+    if (allowed(rules, 1, true, off_off) || !allowed(rules, 1, true, on_off)) {
+        return fail("\"1 requires 0\" does not hold switch 1 off while 0 is off");
+    }
+    if (allowed(rules, 0, false, on_on) || !allowed(rules, 0, false, on_off)) {
+        return fail("\"1 requires 0\" does not hold switch 0 on while 1 is on");
+    }
+
+    // Both off, or both on, in one move is fine whichever comes first
+    int32_t ids[2] = { 0, 1 };
+    int32_t reversed[2] = { 1, 0 };
+    int evaluated = 0;
+    int32_t refused;
+    if (rules.checkTransition(ids, 2, on_on, off_off, &evaluated, &refused) != NULL ||
+        rules.checkTransition(reversed, 2, off_off, on_on, &evaluated, &refused) != NULL) {
+        return fail("a move leaving both switches in step was refused");
+    }
+
+    // A force turning 1 off with 0 keeps the rule instead of a refusal
+    if (!compile(&rules, "0 off -> 1 off; 1 requires 0")) {
+        return 1;
+    }
+    int count;
+    rules.forces(0, &count);
+    if (!allowed(rules, 0, false, on_on) || allowed(rules, 1, true, off_off) || count != 1) {
+        return fail("\"0 off -> 1 off\" did not take the place of refusing 0 off");
+    }
+
+    // Other forces do not
+    if (!compile(&rules, "0 on -> 1 off; 2 off -> 1 off; 1 requires 0") || allowed(rules, 0, false, on_on)) {
+        return fail("an unrelated force lifted the hold on switch 0");
+    }
+
+    if (!compile(&rules, "2 excludes 3")) {
+        return 1;
+    }
+    bool two_on[CHECK_SWITCHES] = { false, false, true };
+    bool three_on[CHECK_SWITCHES] = { false, false, false, true };
+    if (allowed(rules, 3, true, two_on) || allowed(rules, 2, true, three_on) ||
+        !allowed(rules, 2, false, two_on)) {
+        return fail("\"2 excludes 3\" does not hold both ways");
+    }
+    printf("Requires: held both ways, lifted only by the matching force; excludes held both ways\n");
+    return 0;
+}
+
+static int check_stored() {
+    SwitchRules rules;
+    if (!compile(&rules, "1 requires 0; 2 excludes 3; 0 off -> 4 on")) {
+        return 1;
+    }
+    size_t len;
+    const uint8_t* data = rules.serialize(&len);
+    uint8_t copy[4 + SWITCH_RULES_MAX * sizeof(switch_rule_t)];
+    memcpy(copy, data, len);
+    SwitchRules loaded;
+    bool on_on[CHECK_SWITCHES] = { true, true };
+    if (loaded.load(copy, len, CHECK_SWITCHES) != ESP_OK || loaded.count() != rules.count() ||
+        allowed(loaded, 0, false, on_on)) {
+        return fail("a stored table did not load as it was compiled");
+    }
+
+    // A table from before "requires" held both ways is compiled again
+    copy[1] = 1;
+    if (loaded.load(copy, len, CHECK_SWITCHES) == ESP_OK) {
+        return fail("a table of the old version was loaded");
+    }
+    printf("Stored: table loads as compiled, version 1 tables refused\n");
+    return 0;
+}
+
+// Random rule sets and random writes through check(): nothing allowed
+// may break a requires or excludes rule
+static int check_random() {
+    int allowed_writes = 0;
+    int refused_writes = 0;
+    for (int set = 0; set < RANDOM_SETS; set++) {
+        int kinds[6];
+        int firsts[6];
+        int seconds[6];
+        int rule_count = 1 + next_random() % 6;
+        std::string text;
+        for (int i = 0; i < rule_count; i++) {
+            kinds[i] = next_random() % 2;
+            firsts[i] = next_random() % CHECK_SWITCHES;
+            seconds[i] = (firsts[i] + 1 + next_random() % (CHECK_SWITCHES - 1)) % CHECK_SWITCHES;
+            char rule[32];
+            snprintf(rule, sizeof(rule), "%d %s %d;", firsts[i], kinds[i] ? "requires" : "excludes", seconds[i]);
+            text += rule;
+        }
+        SwitchRules rules;
+        if (!compile(&rules, text.c_str())) {
+            return 1;
+        }
+
+        bool states[CHECK_SWITCHES] = {};
+        for (int write = 0; write < RANDOM_WRITES; write++) {
+            int id = next_random() % CHECK_SWITCHES;
+            bool state = !states[id];
+            if (!allowed(rules, id, state, states)) {
+                refused_writes++;
+                continue;
+            }
+            states[id] = state;
+            allowed_writes++;
+            for (int i = 0; i < rule_count; i++) {
+                bool broken = kinds[i] ? states[firsts[i]] && !states[seconds[i]]
+                                       : states[firsts[i]] && states[seconds[i]];
+                if (broken) {
+                    printf("FAIL: \"%s\" left broken by switch %d turning %s\n", text.c_str(), id,
+                           state ? "on" : "off");
+                    return 1;
+                }
+            }
+        }
+    }
+    printf("Random: %d writes allowed and %d refused over %d rule sets, no rule ever broken\n", allowed_writes,
+           refused_writes, RANDOM_SETS);
+    return 0;
+}
+
+int main() {
+    if (check_requires() != 0 || check_stored() != 0 || check_random() != 0) {
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,278 @@
+// Check the power-fail switch snapshot on the host: that a reset at any
+// point of a capture leaves either the snapshot before it or the one it
+// was writing, never a mix, that the memory found at power-on is not
+// mistaken for a snapshot, and that the boot after a brown-out starts the
+// switches at the last states commanded. Also measures the cost of a
+// capture.
+//
+// Build and run from the repository root:
+//
+//     g++ -O2 -Iinclude -Isrc -o snapshot_check tools/snapshot_check.cpp src/switch_snapshot.cpp
+//     ./snapshot_check
+//
+// A reset is simulated by applying a random part of the bytes a capture
+// changes, in any order, as a write cut short and a cache that wrote
+// back out of order would leave them. Exits non-zero on the first
+// failure.
+
+#include "config.h"
+#include "switch_snapshot.h"
+#include <chrono>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <vector>
+
+#define CHECK_SWITCHES 8
+#define TORN_TRIALS 200000
+
+static uint32_t s_seed = 1;
+
+static uint32_t next_random() {
+    s_seed = s_seed * 1664525u + 1013904223u;
+    return s_seed >> 8;
+}
+
+// Switch states as the device would hold them
+typedef struct {
+    bool states[POWER_FAIL_MAX_SWITCHES];
+    double values[POWER_FAIL_MAX_SWITCHES];
+} switches_t;
+
+static void change_randomly(switches_t* switches, int count) {
+    int id = next_random() % count;
+    switches->states[id] = !switches->states[id];
+    switches->values[id] = switches->states[id] ? (double)(next_random() % 1000) / 10.0 : 0.0;
+}
+
+static bool matches(const switch_snapshot_t* snapshot, const switches_t* switches, int count) {
+    if (snapshot->count != (uint32_t)count) {
+        return false;
+    }
+    for (int i = 0; i < count; i++) {
+        if ((snapshot->states[i] != 0) != switches->states[i] || snapshot->values[i] != switches->values[i]) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static bool matches_switches(const switches_t* a, const switches_t* b, int count) {
+    for (int i = 0; i < count; i++) {
+        if (a->states[i] != b->states[i] || a->values[i] != b->values[i]) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static int fail(const char* what) {
+    printf("FAIL: %s\n", what);
+    return 1;
+}
+
+static int check_power_on() {
+    // Whatever RTC memory holds after the supply came up
+    snapshot_store_t store;
+    switch_snapshot_t snapshot;
+    for (int trial = 0; trial < 1000; trial++) {
+        uint8_t* bytes = (uint8_t*)&store;
+        for (size_t i = 0; i < sizeof(store); i++) {
+            bytes[i] = (uint8_t)next_random();
+        }
+        if (SwitchSnapshot::latest(&store, &snapshot)) {
+            return fail("random memory taken for a snapshot");
+        }
+    }
+
+    // Right layout, nothing captured yet
+    SwitchSnapshot::reset(&store);
+    if (!SwitchSnapshot::valid(&store) || SwitchSnapshot::latest(&store, &snapshot)) {
+        return fail("an empty store returned a snapshot");
+    }
+    printf("Power-on memory: no snapshot found in 1000 random stores\n");
+    return 0;
+}
+
+static int check_torn() {
+    snapshot_store_t store;
+    SwitchSnapshot::reset(&store);
+    switches_t switches = {};
+    SwitchSnapshot::capture(&store, switches.states, switches.values, CHECK_SWITCHES);
+
+    int kept_old = 0;
+    int kept_new = 0;
+    switch_snapshot_t snapshot;
+    for (int trial = 0; trial < TORN_TRIALS; trial++) {
+        switches_t before = switches;
+        change_randomly(&switches, CHECK_SWITCHES);
+
+        snapshot_store_t old_store = store;
+        SwitchSnapshot::capture(&store, switches.states, switches.values, CHECK_SWITCHES);
+
+        // Bytes the capture changed, and a reset after some of them
+        std::vector<size_t> changed;
+        const uint8_t* old_bytes = (const uint8_t*)&old_store;
+        const uint8_t* new_bytes = (const uint8_t*)&store;
+        for (size_t i = 0; i < sizeof(store); i++) {
+            if (old_bytes[i] != new_bytes[i]) {
+                changed.push_back(i);
+            }
+        }
+        for (size_t i = changed.size(); i > 1; i--) {
+            size_t j = next_random() % i;
+            size_t tmp = changed[i - 1];
+            changed[i - 1] = changed[j];
+            changed[j] = tmp;
+        }
+        snapshot_store_t torn = old_store;
+        size_t written = changed.empty() ? 0 : next_random() % (changed.size() + 1);
+        for (size_t i = 0; i < written; i++) {
+            ((uint8_t*)&torn)[changed[i]] = new_bytes[changed[i]];
+        }
+
+        if (!SwitchSnapshot::latest(&torn, &snapshot)) {
+            return fail("a torn capture lost both snapshots");
+        }
+        if (matches(&snapshot, &switches, CHECK_SWITCHES)) {
+            kept_new++;
+        } else if (matches(&snapshot, &before, CHECK_SWITCHES)) {
+            kept_old++;
+        } else {
+            return fail("a torn capture restored states never captured");
+        }
+        if (written == changed.size() && !matches(&snapshot, &switches, CHECK_SWITCHES)) {
+            return fail("a complete capture was not the latest");
+        }
+    }
+    printf("Torn captures: %d restored the new states, %d the previous, none mixed\n", kept_new, kept_old);
+    return 0;
+}
+
+static int check_brown_out() {
+    // Switches change, NVS is flushed now and then, and the supply dips
+    // at a random moment; the boot after must find the last change
+    for (int trial = 0; trial < 1000; trial++) {
+        snapshot_store_t store;
+        SwitchSnapshot::reset(&store);
+        switches_t switches = {};
+        switches_t nvs = {};
+        int changes = 1 + next_random() % 50;
+        for (int i = 0; i < changes; i++) {
+            change_randomly(&switches, CHECK_SWITCHES);
+            SwitchSnapshot::capture(&store, switches.states, switches.values, CHECK_SWITCHES);
+            if (next_random() % 8 == 0) {
+                nvs = switches;
+            }
+        }
+
+        // The next boot: the snapshot goes over NVS if NVS missed it
+        bool missed = memcmp(&nvs, &switches, sizeof(nvs)) != 0;
+        if (SwitchSnapshot::restore(&store, nvs.states, nvs.values, CHECK_SWITCHES, true) != missed) {
+            return fail("a snapshot was restored over the same states, or not over older ones");
+        }
+        if (memcmp(&nvs, &switches, sizeof(nvs)) != 0) {
+            return fail("switch states lost in a brown-out");
+        }
+    }
+    printf("Brown-outs: last commanded states restored in 1000 of 1000\n");
+    return 0;
+}
+
+static int check_restore() {
+    snapshot_store_t store;
+    switches_t switches = {};
+    switches_t nvs = {};
+    for (int i = 0; i < CHECK_SWITCHES; i += 2) {
+        switches.states[i] = true;
+        switches.values[i] = 1.0 + i;
+    }
+
+    // Nothing to restore from power-on memory or an empty store
+    uint8_t* bytes = (uint8_t*)&store;
+    for (size_t i = 0; i < sizeof(store); i++) {
+        bytes[i] = (uint8_t)next_random();
+    }
+    if (SwitchSnapshot::restore(&store, nvs.states, nvs.values, CHECK_SWITCHES, true)) {
+        return fail("power-on memory was restored");
+    }
+    SwitchSnapshot::reset(&store);
+    if (SwitchSnapshot::restore(&store, nvs.states, nvs.values, CHECK_SWITCHES, true)) {
+        return fail("an empty store was restored");
+    }
+
+    // A snapshot for another number of switches, as after a firmware
+    // update that added some, is left alone
+    SwitchSnapshot::capture(&store, switches.states, switches.values, CHECK_SWITCHES - 1);
+    if (SwitchSnapshot::restore(&store, nvs.states, nvs.values, CHECK_SWITCHES, true)) {
+        return fail("a snapshot of another switch count was restored");
+    }
+
+    // Newer than NVS, or NVS never written
+    SwitchSnapshot::capture(&store, switches.states, switches.values, CHECK_SWITCHES);
+    if (!SwitchSnapshot::restore(&store, nvs.states, nvs.values, CHECK_SWITCHES, true) ||
+        memcmp(&nvs, &switches, sizeof(nvs)) != 0) {
+        return fail("a newer snapshot was not restored");
+    }
+    // Without NVS states the buffers hold nothing meaningful, even when
+    // they happen to match
+    switches_t empty = switches;
+    if (!SwitchSnapshot::restore(&store, empty.states, empty.values, CHECK_SWITCHES, false) ||
+        !matches_switches(&empty, &switches, CHECK_SWITCHES)) {
+        return fail("a snapshot was not restored without NVS states");
+    }
+    if (SwitchSnapshot::restore(&store, nvs.states, nvs.values, CHECK_SWITCHES, true)) {
+        return fail("a snapshot was restored twice");
+    }
+
+    // More switches than the snapshot holds: the ones it covers come back,
+    // the rest keep NVS; without NVS there is nothing whole to start from
+    switches_t many = {};
+    switches_t many_nvs = {};
+    for (int i = 0; i < POWER_FAIL_MAX_SWITCHES; i += 3) {
+        many.states[i] = true;
+        many.values[i] = 1.0 + i;
+    }
+    SwitchSnapshot::capture(&store, many.states, many.values, POWER_FAIL_MAX_SWITCHES + 1);
+    bool states[POWER_FAIL_MAX_SWITCHES + 1] = {};
+    double values[POWER_FAIL_MAX_SWITCHES + 1] = {};
+    states[POWER_FAIL_MAX_SWITCHES] = true;
+    values[POWER_FAIL_MAX_SWITCHES] = 42.0;
+    if (SwitchSnapshot::restore(&store, states, values, POWER_FAIL_MAX_SWITCHES + 1, false)) {
+        return fail("a partial snapshot was restored without NVS states");
+    }
+    if (!SwitchSnapshot::restore(&store, states, values, POWER_FAIL_MAX_SWITCHES + 1, true)) {
+        return fail("a partial snapshot was not restored over NVS");
+    }
+    memcpy(many_nvs.states, states, sizeof(many_nvs.states));
+    memcpy(many_nvs.values, values, sizeof(many_nvs.values));
+    if (!matches_switches(&many_nvs, &many, POWER_FAIL_MAX_SWITCHES) || !states[POWER_FAIL_MAX_SWITCHES] ||
+        values[POWER_FAIL_MAX_SWITCHES] != 42.0) {
+        return fail("a partial snapshot restored the wrong switches");
+    }
+    printf("Restore: newer snapshots restored, empty, foreign and repeated ones left alone\n");
+    return 0;
+}
+
+static void measure(int count) {
+    snapshot_store_t store;
+    SwitchSnapshot::reset(&store);
+    switches_t switches = {};
+    const int rounds = 1000000;
+    auto start = std::chrono::steady_clock::now();
+    for (int i = 0; i < rounds; i++) {
+        switches.values[i % count] = i;
+        SwitchSnapshot::capture(&store, switches.states, switches.values, count);
+    }
+    double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    printf("Capture of %d switches: %.1f ns on this host\n", count, elapsed / rounds * 1e9);
+}
+
+int main() {
+    if (check_power_on() != 0 || check_torn() != 0 || check_brown_out() != 0 || check_restore() != 0) {
+        return 1;
+    }
+    measure(DEFAULT_NUM_SWITCHES);
+    measure(POWER_FAIL_MAX_SWITCHES);
+    return 0;
+}
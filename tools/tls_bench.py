@@ -0,0 +1,172 @@
+#!/usr/bin/env python3
+"""Compare HTTPS handshake and request latency on the switch device.
+
+Four cases are measured, each over a number of samples:
+
+    full      new TCP connection and a full TLS handshake per request
+    resumed   new TCP connection, TLS session resumed from a ticket
+    reused    one kept-alive TLS connection for every request
+    plain     one kept-alive plain HTTP connection, for reference
+
+The request is GET getswitch on the Alpaca API. Handshake and request
+times are reported separately, so the cost of the handshake itself is
+visible. With session tickets enabled on the device, "resumed" handshakes
+should take a fraction of "full" ones, and "reused" requests should be
+close to "plain".
+
+The device certificate is usually self-signed, so it is not verified
+unless --cafile is given.
+
+Usage:
+    tls_bench.py 192.168.1.50
+    tls_bench.py 192.168.1.50 --samples 50 --cafile device.pem --user admin --password admin
+"""
+
+import argparse
+import base64
+import socket
+import ssl
+import statistics
+import sys
+import time
+
+PATH = "/api/v1/switch/0/getswitch?Id=0&ClientID=1&ClientTransactionID=1"
+
+
+def make_context(cafile):
+    # TLS 1.2 tickets are issued during the handshake, so the session can
+    # be resumed straight away
+    context = ssl.SSLContext(ssl.PROTOCOL_TLS_CLIENT)
+    context.maximum_version = ssl.TLSVersion.TLSv1_2
+    if cafile:
+        context.load_verify_locations(cafile)
+        context.check_hostname = False
+    else:
+        context.check_hostname = False
+        context.verify_mode = ssl.CERT_NONE
+    return context
+
+
+def build_request(host, auth):
+    lines = [f"GET {PATH} HTTP/1.1", f"Host: {host}", "Connection: keep-alive"]
+    if auth:
+        lines.append("Authorization: Basic " + auth)
+    return ("\r\n".join(lines) + "\r\n\r\n").encode()
+
+
+def read_response(sock):
+    """Read one response with a Content-Length body."""
+    data = b""
+    while b"\r\n\r\n" not in data:
+        chunk = sock.recv(4096)
+        if not chunk:
+            raise ConnectionError("connection closed")
+        data += chunk
+    head, _, body = data.partition(b"\r\n\r\n")
+    length = 0
+    for line in head.split(b"\r\n")[1:]:
+        name, _, value = line.partition(b":")
+        if name.strip().lower() == b"content-length":
+            length = int(value)
+    while len(body) < length:
+        chunk = sock.recv(4096)
+        if not chunk:
+            raise ConnectionError("connection closed")
+        body += chunk
+    if not head.startswith(b"HTTP/1.1 200"):
+        raise ConnectionError(head.split(b"\r\n")[0].decode())
+
+
+def timed_request(sock, request):
+    start = time.perf_counter()
+    sock.sendall(request)
+    read_response(sock)
+    return (time.perf_counter() - start) * 1000.0
+
+
+def connect_tls(args, context, session=None):
+    """Open a TLS connection; returns the socket and handshake time in ms."""
+    raw = socket.create_connection((args.host, args.port), timeout=10)
+    raw.setsockopt(socket.IPPROTO_TCP, socket.TCP_NODELAY, 1)
+    start = time.perf_counter()
+    sock = context.wrap_socket(raw, server_hostname=args.host, session=session)
+    return sock, (time.perf_counter() - start) * 1000.0
+
+
+def bench_new_connections(args, context, request, resume):
+    handshakes = []
+    requests = []
+    resumed = 0
+    session = None
+    for _ in range(args.samples):
+        sock, handshake = connect_tls(args, context, session if resume else None)
+        if sock.session_reused:
+            resumed += 1
+        handshakes.append(handshake)
+        requests.append(timed_request(sock, request))
+        if resume:
+            session = sock.session
+        sock.close()
+    if resume:
+        # The first connection has no session to resume
+        handshakes = handshakes[1:]
+        requests = requests[1:]
+        if resumed < args.samples - 1:
+            print(f"warning: only {resumed} of {args.samples - 1} sessions were resumed",
+                  file=sys.stderr)
+    return handshakes, requests
+
+
+def bench_reused(sock, request, samples):
+    timed_request(sock, request)    # Warm up
+    return [timed_request(sock, request) for _ in range(samples)]
+
+
+def summary(values):
+    if not values:
+        return "-"
+    ordered = sorted(values)
+    p90 = ordered[min(len(ordered) - 1, int(0.9 * len(ordered)))]
+    return f"{statistics.median(ordered):8.1f} {p90:8.1f} {ordered[-1]:8.1f}"
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.split("\n\n")[0])
+    parser.add_argument("host", help="device address")
+    parser.add_argument("--port", type=int, default=443, help="HTTPS port")
+    parser.add_argument("--http-port", type=int, default=80, help="plain HTTP port")
+    parser.add_argument("--samples", type=int, default=20, help="samples per case")
+    parser.add_argument("--cafile", help="verify the device certificate against this file")
+    parser.add_argument("--user", help="Alpaca username when authentication is enabled")
+    parser.add_argument("--password", help="Alpaca password")
+    args = parser.parse_args()
+
+    auth = None
+    if args.user:
+        auth = base64.b64encode(f"{args.user}:{args.password or ''}".encode()).decode()
+    request = build_request(args.host, auth)
+    context = make_context(args.cafile)
+
+    results = []
+    handshakes, requests = bench_new_connections(args, context, request, resume=False)
+    results.append(("full", handshakes, requests))
+
+    handshakes, requests = bench_new_connections(args, context, request, resume=True)
+    results.append(("resumed", handshakes, requests))
+
+    sock, _ = connect_tls(args, context)
+    results.append(("reused", [], bench_reused(sock, request, args.samples)))
+    sock.close()
+
+    sock = socket.create_connection((args.host, args.http_port), timeout=10)
+    sock.setsockopt(socket.IPPROTO_TCP, socket.TCP_NODELAY, 1)
+    results.append(("plain", [], bench_reused(sock, request, args.samples)))
+    sock.close()
+
+    print(f"{'case':<9}{'handshake ms (p50 p90 max)':>28}{'request ms (p50 p90 max)':>28}")
+    for name, handshakes, requests in results:
+        print(f"{name:<9}{summary(handshakes):>28}{summary(requests):>28}")
+
+
+if __name__ == "__main__":
+    main()
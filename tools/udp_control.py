@@ -0,0 +1,243 @@
+#!/usr/bin/env python3
+"""Switch the device over the authenticated UDP control protocol, and
+compare its latency with the Alpaca HTTP API.
+
+Commands:
+
+    get ID            print one switch
+    set ID on|off     set a switch state
+    value ID VALUE    set a switch value
+    snapshot          print every switch, over several replies when needed
+    bench             time UDP set/get against Alpaca PUT/GET
+
+The key is the 32-byte secret stored on the device, as 64 hex digits,
+given with --key or the UDP_CONTROL_KEY environment variable. Create and
+store one with:
+
+    key=$(openssl rand -hex 32)
+    curl -u admin:admin -d "key=$key" http://[ESP32-IP-ADDRESS]/ui/api/udp
+
+Each datagram carries a sequence number that must increase per client id;
+the time in microseconds is used, so restarting the tool needs no state.
+Tools running at the same time must use different --client ids.
+
+Usage:
+    udp_control.py 192.168.1.50 set 0 on
+    udp_control.py 192.168.1.50 snapshot
+    udp_control.py 192.168.1.50 bench --samples 500 --user admin --password admin
+"""
+
+import argparse
+import base64
+import hashlib
+import hmac
+import os
+import socket
+import statistics
+import struct
+import sys
+import time
+import urllib.parse
+import urllib.request
+
+PORT = 32230
+VERSION = 1
+TAG_SIZE = 16
+
+OP_GET = 1
+OP_SET_STATE = 2
+OP_SET_VALUE = 3
+OP_SNAPSHOT = 4
+
+STATUS_STALE_BOOT = 0xFF01
+STATUS_REPLAYED = 0xFF02
+STATUS_BAD_REQUEST = 0xFF03
+STATUS_PARTIAL = 0xFF04
+
+STATUS_NAMES = {
+    0x400: "not implemented",
+    0x401: "invalid value",
+    0x407: "not connected",
+    0x40B: "invalid operation (read-only switch)",
+    STATUS_REPLAYED: "replayed sequence",
+    STATUS_BAD_REQUEST: "bad request",
+}
+
+# magic, version, op, client, switch, reserved, boot id, sequence
+HEADER = struct.Struct(">2sBBBBHIQ")
+REPLY_HEADER = struct.Struct(">2sBBBBHIQ")
+ENTRY = struct.Struct(">BBd")
+
+
+class ProtocolError(Exception):
+    pass
+
+
+class UdpControl:
+    def __init__(self, host, key, client=0, port=PORT, timeout=1.0):
+        self.address = (host, port)
+        self.key = key
+        self.client = client
+        self.boot_id = 0
+        self.last_sequence = 0
+        self.sock = socket.socket(socket.AF_INET, socket.SOCK_DGRAM)
+        self.sock.settimeout(timeout)
+        self.sock.connect(self.address)
+
+    def _tag(self, data):
+        return hmac.new(self.key, data, hashlib.sha256).digest()[:TAG_SIZE]
+
+    def _sequence(self):
+        self.last_sequence = max(self.last_sequence + 1, time.time_ns() // 1000)
+        return self.last_sequence
+
+    def request(self, op, switch=0, value=0.0):
+        """Send one request and return the switches in the reply as
+        (id, state, value) tuples."""
+        status, switches = self._exchange(op, switch, value)
+        if status != 0:
+            raise ProtocolError(STATUS_NAMES.get(status, f"error 0x{status:x}"))
+        return switches
+
+    def snapshot(self):
+        """Return every switch. A device with more switches than fit one
+        reply answers PARTIAL, and is asked again after the last one."""
+        switches = []
+        while True:
+            status, entries = self._exchange(OP_SNAPSHOT, switches[-1][0] + 1 if switches else 0)
+            if status not in (0, STATUS_PARTIAL):
+                raise ProtocolError(STATUS_NAMES.get(status, f"error 0x{status:x}"))
+            switches += entries
+            if status == 0 or not entries:
+                return switches
+
+    def _exchange(self, op, switch, value=0.0):
+        """Send one request and return the reply status and switches."""
+        # The first request, and the first after a device restart, learns
+        # the boot id from the STALE_BOOT reply and is sent again
+        for _ in range(2):
+            sequence = self._sequence()
+            body = HEADER.pack(b"AS", VERSION, op, self.client, switch, 0, self.boot_id, sequence)
+            body += struct.pack(">d", value)
+            self.sock.send(body + self._tag(body))
+
+            while True:
+                try:
+                    reply = self.sock.recv(512)
+                except socket.timeout:
+                    raise ProtocolError("no reply (wrong key or address?)")
+                if len(reply) < REPLY_HEADER.size + TAG_SIZE:
+                    continue
+                data, tag = reply[:-TAG_SIZE], reply[-TAG_SIZE:]
+                if not hmac.compare_digest(tag, self._tag(data)):
+                    continue
+                magic, _, reply_op, _, count, status, boot_id, reply_sequence = \
+                    REPLY_HEADER.unpack_from(data)
+                # Skip late replies to earlier requests
+                if magic == b"AS" and reply_op == op | 0x80 and reply_sequence == sequence:
+                    break
+
+            if status == STATUS_STALE_BOOT:
+                self.boot_id = boot_id
+                continue
+            return status, [ENTRY.unpack_from(data, REPLY_HEADER.size + i * ENTRY.size)
+                            for i in range(count)]
+        raise ProtocolError("device keeps reporting a new boot id")
+
+
+def alpaca_request(host, auth, method, verb, **params):
+    params.update(ClientID=1, ClientTransactionID=1)
+    url = f"http://{host}/api/v1/switch/0/{method}"
+    headers = {"Authorization": "Basic " + auth} if auth else {}
+    if verb == "GET":
+        req = urllib.request.Request(url + "?" + urllib.parse.urlencode(params), headers=headers)
+    else:
+        req = urllib.request.Request(url, urllib.parse.urlencode(params).encode(), headers,
+                                     method="PUT")
+    with urllib.request.urlopen(req, timeout=5) as response:
+        response.read()
+
+
+def timed(samples, call):
+    """Run call samples times, alternating the state, and return the
+    latencies in ms."""
+    latencies = []
+    for i in range(samples):
+        start = time.perf_counter()
+        call(i % 2 == 0)
+        latencies.append((time.perf_counter() - start) * 1000.0)
+    return latencies
+
+
+def summary(values):
+    ordered = sorted(values)
+    p = lambda q: ordered[min(len(ordered) - 1, int(q * len(ordered)))]
+    return (f"{statistics.median(ordered):8.2f} {p(0.9):8.2f} {p(0.99):8.2f} "
+            f"{ordered[-1]:8.2f}")
+
+
+def bench(args, control):
+    auth = None
+    if args.user:
+        auth = base64.b64encode(f"{args.user}:{args.password or ''}".encode()).decode()
+    switch = args.switch
+
+    control.request(OP_GET, switch)     # Learn the boot id
+    results = [
+        ("udp set", timed(args.samples, lambda on: control.request(OP_SET_STATE, switch, float(on)))),
+        ("udp get", timed(args.samples, lambda on: control.request(OP_GET, switch))),
+        ("http set", timed(args.samples, lambda on: alpaca_request(
+            args.host, auth, "setswitch", "PUT", Id=switch, State="true" if on else "false"))),
+        ("http get", timed(args.samples, lambda on: alpaca_request(
+            args.host, auth, "getswitch", "GET", Id=switch))),
+    ]
+    print(f"{'case':<10}{'p50':>9}{'p90':>9}{'p99':>9}{'max':>9}  (ms)")
+    for name, latencies in results:
+        print(f"{name:<10}{summary(latencies)}")
+
+
+def print_switches(switches):
+    for switch, state, value in switches:
+        print(f"{switch}: {'on' if state else 'off'} {value:g}")
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.split("\n\n")[0])
+    parser.add_argument("host", help="device address")
+    parser.add_argument("command", choices=("get", "set", "value", "snapshot", "bench"))
+    parser.add_argument("args", nargs="*")
+    parser.add_argument("--key", default=os.environ.get("UDP_CONTROL_KEY"),
+                        help="shared key as 64 hex digits")
+    parser.add_argument("--port", type=int, default=PORT, help="UDP control port")
+    parser.add_argument("--client", type=int, default=0, help="client id, 0-7")
+    parser.add_argument("--switch", type=int, default=0, help="switch used by bench")
+    parser.add_argument("--samples", type=int, default=200, help="requests per bench case")
+    parser.add_argument("--user", help="Alpaca username for the HTTP side of bench")
+    parser.add_argument("--password", help="Alpaca password")
+    args = parser.parse_args()
+
+    if not args.key or len(args.key) != 64:
+        parser.error("a 64 hex digit --key (or UDP_CONTROL_KEY) is required")
+    control = UdpControl(args.host, bytes.fromhex(args.key), args.client, args.port)
+
+    try:
+        if args.command == "get":
+            print_switches(control.request(OP_GET, int(args.args[0])))
+        elif args.command == "set":
+            state = args.args[1].lower() in ("on", "true", "1")
+            print_switches(control.request(OP_SET_STATE, int(args.args[0]), float(state)))
+        elif args.command == "value":
+            print_switches(control.request(OP_SET_VALUE, int(args.args[0]), float(args.args[1])))
+        elif args.command == "snapshot":
+            print_switches(control.snapshot())
+        else:
+            bench(args, control)
+    except (IndexError, ValueError):
+        parser.error(f"missing or invalid arguments for {args.command}")
+    except ProtocolError as error:
+        print(f"error: {error}", file=sys.stderr)
+        sys.exit(1)
+
+
+if __name__ == "__main__":
+    main()